@@ -3,6 +3,10 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 using namespace std;
 
 #define STB_IMAGE_IMPLEMENTATION /* compile it here */
@@ -28,6 +32,14 @@ using namespace std;
     #include <sys/time.h>
 #endif
 
+#ifndef _WIN32
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 
 //------------------------------------------------------------------------------
 // Timing
@@ -93,144 +105,546 @@ std::ifstream::pos_type filesize(const char* filename)
 
 
 
-int main(int argc, char** argv)
+//------------------------------------------------------------------------------
+// Memory-mapped files
+
+// Maps a whole file, so the codec reads and writes the page cache directly
+// instead of copying through a stream
+class MappedFile
 {
-    bool compress = false;
-    bool decompress = false;
-    const char* sourceFile = nullptr;
-    const char* destFile = nullptr;
+public:
+    uint8_t* Data = nullptr;
+    size_t Bytes = 0;
 
-    if (argc >= 4)
+    ~MappedFile()
     {
-        if (0 == strcmp(argv[1], "-c")) {
-            compress = true;
+        Close();
+    }
+
+    // Map an existing file for reading
+    bool OpenRead(const char* path)
+    {
+#ifdef _WIN32
+        File = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (File == INVALID_HANDLE_VALUE) {
+            return false;
         }
-        else if (0 == strcmp(argv[1], "-d")) {
-            decompress = true;
+        LARGE_INTEGER size = {};
+        if (!::GetFileSizeEx(File, &size) || size.QuadPart == 0) {
+            return false;
+        }
+        Bytes = (size_t)size.QuadPart;
+        return MapView(PAGE_READONLY, FILE_MAP_READ);
+#else
+        File = ::open(path, O_RDONLY);
+        if (File < 0) {
+            return false;
+        }
+        struct stat st;
+        if (::fstat(File, &st) != 0 || st.st_size == 0) {
+            return false;
         }
-        sourceFile = argv[2];
-        destFile = argv[3];
+        Bytes = (size_t)st.st_size;
+        return MapView(PROT_READ);
+#endif
     }
 
-    if (compress)
+    // Create or truncate a file of `bytes` bytes and map it for writing.
+    // Close() trims it to the bytes actually written
+    bool OpenWrite(const char* path, size_t bytes)
     {
-        cout << "Compressing " << sourceFile << " to " << destFile << endl;
-
-        uint64_t t0 = GetTimeUsec();
+        Writable = true;
+        Bytes = bytes;
+#ifdef _WIN32
+        File = ::CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (File == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        return MapView(PAGE_READWRITE, FILE_MAP_WRITE);
+#else
+        File = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (File < 0 || ::ftruncate(File, (off_t)bytes) != 0) {
+            return false;
+        }
+        return MapView(PROT_READ | PROT_WRITE);
+#endif
+    }
 
-        int x, y, comp;
-        stbi_uc* data = stbi_load(sourceFile, &x, &y, &comp, 0);
-        if (!data)
+    // Unmap, keeping the first `bytes` bytes of a file opened for writing.
+    // Returns false if the file could not be trimmed
+    bool Close(size_t bytes = 0)
+    {
+        bool success = true;
+#ifdef _WIN32
+        if (Data) {
+            ::UnmapViewOfFile(Data);
+        }
+        if (Mapping) {
+            ::CloseHandle(Mapping);
+        }
+        if (File != INVALID_HANDLE_VALUE)
+        {
+            if (Writable)
+            {
+                LARGE_INTEGER size = {};
+                size.QuadPart = (LONGLONG)bytes;
+                success = ::SetFilePointerEx(File, size, nullptr, FILE_BEGIN) && ::SetEndOfFile(File);
+            }
+            ::CloseHandle(File);
+        }
+        Mapping = nullptr;
+        File = INVALID_HANDLE_VALUE;
+#else
+        if (Data) {
+            ::munmap(Data, Bytes);
+        }
+        if (File >= 0)
         {
-            cout << "Unable to load file: " << sourceFile << endl;
-            return -1;
+            if (Writable) {
+                success = ::ftruncate(File, (off_t)bytes) == 0;
+            }
+            ::close(File);
         }
+        File = -1;
+#endif
+        Data = nullptr;
+        Bytes = 0;
+        Writable = false;
+        return success;
+    }
+
+private:
+    bool Writable = false;
+
+#ifdef _WIN32
+    HANDLE File = INVALID_HANDLE_VALUE;
+    HANDLE Mapping = nullptr;
 
-        uint64_t t1 = GetTimeUsec();
+    bool MapView(DWORD protect, DWORD access)
+    {
+        const uint64_t size = Bytes;
+        Mapping = ::CreateFileMappingA(File, nullptr, protect,
+            (DWORD)(size >> 32), (DWORD)size, nullptr);
+        if (!Mapping) {
+            return false;
+        }
+        Data = (uint8_t*)::MapViewOfFile(Mapping, access, 0, 0, Bytes);
+        return Data != nullptr;
+    }
+#else
+    int File = -1;
 
+    bool MapView(int protect)
+    {
+        void* data = ::mmap(nullptr, Bytes, protect, MAP_SHARED, File, 0);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        Data = (uint8_t*)data;
+        if (!Writable) {
+            ::madvise(data, Bytes, MADV_SEQUENTIAL);
+        }
+        return true;
+    }
+#endif
+};
+
+//------------------------------------------------------------------------------
+// Conversion
+
+// Returns 0 on success, or the process exit code for the failure.
+// Reports progress on cout if verbose.  *outputBytes gets the file size
+static int CompressFile(
+    const char* sourceFile,
+    const char* destFile,
+    ZPNG_Context* context,
+    bool verbose,
+    uint64_t* outputBytes)
+{
+    if (verbose) {
+        cout << "Compressing " << sourceFile << " to " << destFile << endl;
+    }
+
+    uint64_t t0 = GetTimeUsec();
+
+    MappedFile input;
+    if (!input.OpenRead(sourceFile))
+    {
+        cout << "Could not open input file: " << sourceFile << endl;
+        return -4;
+    }
+
+    int x, y, comp;
+    stbi_uc* data = stbi_load_from_memory(input.Data, (int)input.Bytes, &x, &y, &comp, 0);
+    input.Close();
+    if (!data)
+    {
+        cout << "Unable to load file: " << sourceFile << endl;
+        return -1;
+    }
+
+    uint64_t t1 = GetTimeUsec();
+
+    if (verbose) {
         cout << "Loaded " << sourceFile << " in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
 
-        ZPNG_ImageData image;
-        image.Buffer.Data = data;
-        image.Buffer.Bytes = x * y * comp;
-        image.BytesPerChannel = 1;
-        image.Channels = comp;
-        image.HeightPixels = y;
-        image.WidthPixels = x;
-        image.StrideBytes = x * image.Channels;
+    ZPNG_ImageData image;
+    image.Buffer.Data = data;
+    image.Buffer.Bytes = x * y * comp;
+    image.BytesPerChannel = 1;
+    image.Channels = comp;
+    image.HeightPixels = y;
+    image.WidthPixels = x;
+    image.StrideBytes = x * image.Channels;
+    image.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    t0 = GetTimeUsec();
+
+    // Compress straight into the mapped output file
+    MappedFile output;
+    if (!output.OpenWrite(destFile, ZPNG_MaximumBufferSize(&image)))
+    {
+        cout << "Could not open output file: " << destFile << endl;
+        stbi_image_free(data);
+        return -3;
+    }
 
-        t0 = GetTimeUsec();
+    ZPNG_Buffer buffer;
+    buffer.Data = output.Data;
+    buffer.Bytes = output.Bytes;
 
-        ZPNG_Buffer buffer = ZPNG_Compress(&image);
+    const int compressResult = ZPNG_CompressToBuffer(&image, &buffer, context);
+    stbi_image_free(data);
 
-        if (!buffer.Data)
-        {
-            cout << "ZPNG compression failed" << endl;
-            return -2;
-        }
+    if (!compressResult)
+    {
+        cout << "ZPNG compression failed: " << sourceFile << endl;
+        output.Close();
+        return -2;
+    }
 
-        t1 = GetTimeUsec();
+    t1 = GetTimeUsec();
 
+    if (verbose)
+    {
         cout << "Compressed ZPNG in " << (t1 - t0) / 1000.f << " msec" << endl;
 
         cout << "ZPNG compression size: " << buffer.Bytes << " bytes" << endl;
+    }
 
-        std::ofstream output(destFile, std::ios::binary);
-        if (!output)
-        {
-            cout << "Could not open output file" << endl;
-            return -3;
-        }
-        output.write((char*)buffer.Data, buffer.Bytes);
-        output.close();
+    if (!output.Close(buffer.Bytes))
+    {
+        cout << "Could not write output file: " << destFile << endl;
+        return -3;
+    }
 
-        stbi_image_free(data);
+    *outputBytes = buffer.Bytes;
+    return 0;
+}
 
-        ZPNG_Free(&buffer);
+// Returns 0 on success, or the process exit code for the failure.
+// Reports progress on cout if verbose.  *outputBytes gets the pixel bytes
+static int DecompressFile(
+    const char* sourceFile,
+    const char* destFile,
+    ZPNG_DecompressionContext* context,
+    bool verbose,
+    uint64_t* outputBytes)
+{
+    if (verbose) {
+        cout << "Decompressing " << sourceFile << " to " << destFile << " (output will be PNG format)" << endl;
     }
-    else if (decompress)
+
+    MappedFile input;
+    if (!input.OpenRead(sourceFile))
     {
-        cout << "Decompressing " << sourceFile << " to " << destFile << " (output will be PNG format)" << endl;
+        cout << "Could not open input file: " << sourceFile << endl;
+        return -4;
+    }
 
-        std::ifstream input(sourceFile, std::ios::binary);
-        if (!input)
-        {
-            cout << "Could not open input file" << endl;
-            return -4;
-        }
+    // Decompress directly from the mapped file
+    ZPNG_Buffer buffer;
+    buffer.Data = input.Data;
+    buffer.Bytes = input.Bytes;
 
-        // copies all data into buffer
-        std::vector<char> fileData((
-            std::istreambuf_iterator<char>(input)),
-            (std::istreambuf_iterator<char>()));
+    uint64_t t0 = GetTimeUsec();
 
-        ZPNG_Buffer buffer;
-        buffer.Data = (uint8_t*)&fileData[0];
-        buffer.Bytes = (unsigned)fileData.size();
+    ZPNG_ImageData decompressResult = ZPNG_DecompressWithContext(context, nullptr, buffer);
 
-        uint64_t t0 = GetTimeUsec();
+    uint64_t t1 = GetTimeUsec();
 
-        ZPNG_ImageData decompressResult = ZPNG_Decompress(buffer);
+    if (!decompressResult.Buffer.Data)
+    {
+        cout << "Decompression failed: " << sourceFile << endl;
+        return -5;
+    }
 
-        uint64_t t1 = GetTimeUsec();
+    if (verbose) {
+        cout << "Decompressed ZPNG in " << (t1 - t0) / 1000.f << " msec" << endl;
+    }
 
-        if (!decompressResult.Buffer.Data)
-        {
-            cout << "Decompression failed" << endl;
-            return -5;
+    t0 = GetTimeUsec();
+
+    int writeResult = stbi_write_png(
+        destFile,
+        decompressResult.WidthPixels,
+        decompressResult.HeightPixels,
+        decompressResult.Channels,
+        decompressResult.Buffer.Data,
+        decompressResult.StrideBytes);
+
+    t1 = GetTimeUsec();
+
+    *outputBytes = decompressResult.Buffer.Bytes;
+    ZPNG_Free(&decompressResult.Buffer);
+
+    if (!writeResult)
+    {
+        cout << "Failed to compress PNG: " << destFile << endl;
+        return -6;
+    }
+
+    if (verbose)
+    {
+        cout << "Compressed PNG in " << (t1 - t0) / 1000.f << " msec" << endl;
+
+        cout << "Wrote decompressed PNG file: " << destFile << endl;
+    }
+
+    return 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Batch Mode
+
+static bool IsDirectory(const char* path)
+{
+#ifdef _WIN32
+    const DWORD attributes = ::GetFileAttributesA(path);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return ::stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static bool MakeDirectory(const char* path)
+{
+    if (IsDirectory(path)) {
+        return true;
+    }
+#ifdef _WIN32
+    return ::CreateDirectoryA(path, nullptr) != 0;
+#else
+    return ::mkdir(path, 0755) == 0;
+#endif
+}
+
+// Regular files in a directory, sorted by name
+static bool ListDirectory(const string& dir, vector<string>& files)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE find = ::FindFirstFileA((dir + "\\*").c_str(), &found);
+    if (find == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    do {
+        if ((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+            files.push_back(dir + "\\" + found.cFileName);
+        }
+    } while (::FindNextFileA(find, &found));
+    ::FindClose(find);
+#else
+    DIR* d = ::opendir(dir.c_str());
+    if (!d) {
+        return false;
+    }
+    while (struct dirent* entry = ::readdir(d))
+    {
+        const string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            files.push_back(path);
         }
+    }
+    ::closedir(d);
+#endif
+    std::sort(files.begin(), files.end());
+    return true;
+}
 
-        cout << "Decompressed ZPNG in " << (t1 - t0) / 1000.f << " msec" << endl;
+// One path per line, skipping blank lines
+static bool ReadFileList(const char* listFile, vector<string>& files)
+{
+    std::ifstream input(listFile);
+    if (!input) {
+        return false;
+    }
+    string line;
+    while (std::getline(input, line))
+    {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            files.push_back(line);
+        }
+    }
+    return true;
+}
 
-        t0 = GetTimeUsec();
+// outDir/name with the extension of the source file name replaced
+static string GetOutputPath(const string& outDir, const string& sourceFile, const char* extension)
+{
+    const size_t slash = sourceFile.find_last_of("/\\");
+    string name = (slash == string::npos) ? sourceFile : sourceFile.substr(slash + 1);
+    const size_t dot = name.find_last_of('.');
+    if (dot != string::npos && dot != 0) {
+        name.resize(dot);
+    }
+    return outDir + "/" + name + extension;
+}
+
+// Convert every file from a directory or list file into outDir with
+// `jobs` workers.  Each worker owns its codec contexts and takes the
+// next file when it finishes one, so the reads, PNG decodes, compression
+// and writes of different files overlap.  Returns the process exit code
+static int RunBatch(bool compress, const char* source, const char* outDir, unsigned jobs)
+{
+    vector<string> files;
+    if (IsDirectory(source) ? !ListDirectory(source, files) : !ReadFileList(source, files))
+    {
+        cout << "Could not read input list: " << source << endl;
+        return -4;
+    }
+    if (!MakeDirectory(outDir))
+    {
+        cout << "Could not create output directory: " << outDir << endl;
+        return -3;
+    }
+
+    if (jobs == 0)
+    {
+        jobs = std::thread::hardware_concurrency();
+        if (jobs == 0) {
+            jobs = 1;
+        }
+    }
+    if (jobs > files.size()) {
+        jobs = files.size() > 0 ? (unsigned)files.size() : 1;
+    }
+
+    cout << (compress ? "Compressing " : "Decompressing ") << files.size() << " files from "
+        << source << " to " << outDir << " with " << jobs << " jobs" << endl;
+
+    std::atomic<size_t> nextFile(0);
+    std::atomic<unsigned> failures(0);
+    std::atomic<uint64_t> totalBytes(0);
 
-        int writeResult = stbi_write_png(
-            destFile,
-            decompressResult.WidthPixels,
-            decompressResult.HeightPixels,
-            decompressResult.Channels,
-            decompressResult.Buffer.Data,
-            decompressResult.StrideBytes);
+    const uint64_t t0 = GetTimeUsec();
 
-        t1 = GetTimeUsec();
+    auto worker = [&]()
+    {
+        ZPNG_Context* context = compress ? ZPNG_AllocateCompressionContext() : nullptr;
+        ZPNG_DecompressionContext* dcontext = compress ? nullptr : ZPNG_AllocateDecompressionContext();
 
-        if (!writeResult)
+        for (;;)
         {
-            cout << "Failed to compress PNG" << endl;
-            return -6;
+            const size_t i = nextFile++;
+            if (i >= files.size()) {
+                break;
+            }
+
+            const string dest = GetOutputPath(outDir, files[i], compress ? ".zpng" : ".png");
+            uint64_t bytes = 0;
+            const int result = compress ?
+                CompressFile(files[i].c_str(), dest.c_str(), context, false, &bytes) :
+                DecompressFile(files[i].c_str(), dest.c_str(), dcontext, false, &bytes);
+
+            if (result != 0) {
+                ++failures;
+            } else {
+                totalBytes += bytes;
+            }
         }
 
-        cout << "Compressed PNG in " << (t1 - t0) / 1000.f << " msec" << endl;
+        ZPNG_FreeCompressionContext(context);
+        ZPNG_FreeDecompressionContext(dcontext);
+    };
 
-        cout << "Wrote decompressed PNG file: " << destFile << endl;
+    vector<std::thread> threads;
+    for (unsigned i = 1; i < jobs; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const uint64_t t1 = GetTimeUsec();
+
+    cout << "Converted " << files.size() - failures << " of " << files.size() << " files in "
+        << (t1 - t0) / 1000.f << " msec, " << totalBytes << (compress ? " compressed" : " pixel") << " bytes" << endl;
+
+    return failures == 0 ? 0 : -7;
+}
 
-        ZPNG_Free(&decompressResult.Buffer);
+
+int main(int argc, char** argv)
+{
+    bool compress = false;
+    bool decompress = false;
+    unsigned jobs = 0;
+    bool batch = false;
+    int arg = 1;
+
+    if (argc >= 2)
+    {
+        if (0 == strcmp(argv[1], "-c")) {
+            compress = true;
+        }
+        else if (0 == strcmp(argv[1], "-d")) {
+            decompress = true;
+        }
+        ++arg;
     }
-    else
+
+    // -j N: Batch mode with N workers, or one per core for 0
+    if (arg + 1 < argc && 0 == strcmp(argv[arg], "-j"))
     {
-        cout << "Usage: zpng -c Input.PNG Test.ZPNG" << endl;
-        cout << "Usage: zpng -d Test.ZPNG Output.PNG" << endl;
+        jobs = (unsigned)atoi(argv[arg + 1]);
+        batch = true;
+        arg += 2;
+    }
+
+    if (arg + 2 != argc) {
+        compress = decompress = false;
     }
 
+    if (compress || decompress)
+    {
+        const char* source = argv[arg];
+        const char* dest = argv[arg + 1];
+        uint64_t bytes = 0;
+
+        if (batch || IsDirectory(source)) {
+            return RunBatch(compress, source, dest, jobs);
+        }
+        if (compress) {
+            return CompressFile(source, dest, nullptr, true, &bytes);
+        }
+        return DecompressFile(source, dest, nullptr, true, &bytes);
+    }
+
+    cout << "Usage: zpng -c Input.PNG Test.ZPNG" << endl;
+    cout << "Usage: zpng -d Test.ZPNG Output.PNG" << endl;
+    cout << "Usage: zpng -c|-d [-j N] <InputDir|ListFile> <OutputDir>" << endl;
+    cout << "  Batch mode converts every file with N workers, default one per core" << endl;
+
     return 0;
 }
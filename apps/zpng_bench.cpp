@@ -0,0 +1,1021 @@
+#include "../zpng.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+#include <stdlib.h>
+using namespace std;
+
+#define STB_IMAGE_IMPLEMENTATION /* compile it here */
+#include "thirdparty/stb_image.h"
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <dirent.h>
+    #include <sys/stat.h>
+#endif
+
+
+//------------------------------------------------------------------------------
+// Timing
+
+static uint64_t GetTimeNsec()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//------------------------------------------------------------------------------
+// Corpus
+
+// An image loaded into memory, with ZPNG_ImageData pointing at Pixels
+struct BenchImage
+{
+    string Class;
+    string Name;
+    vector<uint8_t> Pixels;
+    ZPNG_ImageData Image;
+
+    // Index of the previous video frame that this one is a delta against,
+    // or -1 for still images and the first frame of a sequence
+    int RefIndex = -1;
+};
+
+static bool IsDirectory(const string& path)
+{
+#ifdef _WIN32
+    const DWORD attributes = ::GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Entries of a directory other than . and .., sorted by name
+static vector<string> ListDirectory(const string& dir)
+{
+    vector<string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE find = ::FindFirstFileA((dir + "\\*").c_str(), &found);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do {
+            names.push_back(found.cFileName);
+        } while (::FindNextFileA(find, &found));
+        ::FindClose(find);
+    }
+#else
+    DIR* d = ::opendir(dir.c_str());
+    if (d)
+    {
+        while (struct dirent* entry = ::readdir(d)) {
+            names.push_back(entry->d_name);
+        }
+        ::closedir(d);
+    }
+#endif
+    names.erase(std::remove_if(names.begin(), names.end(),
+        [](const string& name) { return name == "." || name == ".."; }), names.end());
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// Load any image stb_image can read, as 8 bits per channel
+static bool LoadImage(const string& path, const string& imageClass, BenchImage& bench)
+{
+    int x, y, comp;
+    stbi_uc* data = stbi_load(path.c_str(), &x, &y, &comp, 0);
+    if (!data) {
+        return false;
+    }
+
+    const unsigned bytesPerChannel = 1;
+    const size_t bytes = (size_t)x * y * comp;
+
+    bench.Class = imageClass;
+    bench.Name = path;
+    bench.Pixels.assign((const uint8_t*)data, (const uint8_t*)data + bytes);
+    stbi_image_free(data);
+
+    ZPNG_ImageData& image = bench.Image;
+    memset(&image, 0, sizeof(image));
+    image.Buffer.Data = bench.Pixels.data();
+    image.Buffer.Bytes = bytes;
+    image.BytesPerChannel = bytesPerChannel;
+    image.Channels = comp;
+    image.HeightPixels = y;
+    image.WidthPixels = x;
+    image.StrideBytes = x * comp * bytesPerChannel;
+    image.IsIFrame = 1;
+    image.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+    return true;
+}
+
+// Each subdirectory of the corpus is an image class, including any files
+// below it.  Files at the top level are in a class named after the corpus
+static void LoadDirectory(const string& dir, const string& imageClass, vector<BenchImage>& images)
+{
+    for (const string& name : ListDirectory(dir))
+    {
+        const string path = dir + "/" + name;
+        if (IsDirectory(path))
+        {
+            LoadDirectory(path, imageClass.empty() ? name : imageClass, images);
+            continue;
+        }
+
+        BenchImage bench;
+        if (LoadImage(path, imageClass.empty() ? "corpus" : imageClass, bench)) {
+            images.push_back(std::move(bench));
+        } else {
+            cout << "Skipping " << path << ": " << stbi_failure_reason() << endl;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Synthetic Corpus
+
+// Deterministic generator (SplitMix64) so every run sees the same images
+struct BenchRandom
+{
+    uint64_t State;
+
+    explicit BenchRandom(uint64_t seed) : State(seed) {}
+
+    uint64_t Next()
+    {
+        uint64_t z = (State += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, 1)
+    double Unit()
+    {
+        return (Next() >> 11) * (1. / 9007199254740992.);
+    }
+
+    // Uniform in [lo, hi)
+    double Range(double lo, double hi)
+    {
+        return lo + (hi - lo) * Unit();
+    }
+
+    // Roughly normal with mean 0 and standard deviation 1
+    double Gaussian()
+    {
+        return (Unit() + Unit() + Unit() + Unit() - 2.) * 1.7320508;
+    }
+};
+
+static const unsigned kSceneWaves = 3;
+static const unsigned kSceneDiscs = 6;
+
+// A smooth photographic scene defined over the whole plane, so that video
+// frames can be cut from it at any offset
+struct BenchScene
+{
+    double Base[4], GradX[4], GradY[4];
+    double WaveX[kSceneWaves], WaveY[kSceneWaves], Phase[kSceneWaves];
+    double WaveAmp[kSceneWaves][4];
+    double DiscX[kSceneDiscs], DiscY[kSceneDiscs], DiscRadius[kSceneDiscs];
+    double DiscShift[kSceneDiscs][4];
+
+    void Randomize(BenchRandom& rng, unsigned width, unsigned height)
+    {
+        for (unsigned c = 0; c < 4; ++c)
+        {
+            Base[c] = rng.Range(0.2, 0.6);
+            GradX[c] = rng.Range(-0.3, 0.3) / width;
+            GradY[c] = rng.Range(-0.3, 0.3) / height;
+        }
+        for (unsigned k = 0; k < kSceneWaves; ++k)
+        {
+            WaveX[k] = rng.Range(-12., 12.) / width;
+            WaveY[k] = rng.Range(-12., 12.) / height;
+            Phase[k] = rng.Range(0., 6.2831853);
+            for (unsigned c = 0; c < 4; ++c) {
+                WaveAmp[k][c] = rng.Range(0., 0.08);
+            }
+        }
+        for (unsigned d = 0; d < kSceneDiscs; ++d)
+        {
+            DiscX[d] = rng.Range(0., width);
+            DiscY[d] = rng.Range(0., height);
+            DiscRadius[d] = rng.Range(0.05, 0.2) * height;
+            for (unsigned c = 0; c < 4; ++c) {
+                DiscShift[d][c] = rng.Range(-0.3, 0.3);
+            }
+        }
+    }
+
+    // Intensity of color channel c at (x, y), in [0, 1]
+    double Sample(double x, double y, unsigned c) const
+    {
+        double v = Base[c] + GradX[c] * x + GradY[c] * y;
+        for (unsigned k = 0; k < kSceneWaves; ++k) {
+            v += WaveAmp[k][c] * std::sin(WaveX[k] * x + WaveY[k] * y + Phase[k]);
+        }
+        for (unsigned d = 0; d < kSceneDiscs; ++d)
+        {
+            const double dx = x - DiscX[d], dy = y - DiscY[d];
+            if (dx * dx + dy * dy < DiscRadius[d] * DiscRadius[d]) {
+                v += DiscShift[d][c];
+            }
+        }
+        return v < 0. ? 0. : (v > 1. ? 1. : v);
+    }
+};
+
+static BenchImage& AddSyntheticImage(
+    vector<BenchImage>& images,
+    const string& imageClass,
+    const string& name,
+    unsigned width,
+    unsigned height,
+    unsigned channels,
+    unsigned bytesPerChannel,
+    unsigned pixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT)
+{
+    images.emplace_back();
+    BenchImage& bench = images.back();
+    bench.Class = imageClass;
+    bench.Name = name;
+    bench.Pixels.resize((size_t)width * height * channels * bytesPerChannel);
+
+    ZPNG_ImageData& image = bench.Image;
+    memset(&image, 0, sizeof(image));
+    image.Buffer.Data = bench.Pixels.data();
+    image.Buffer.Bytes = bench.Pixels.size();
+    image.BytesPerChannel = bytesPerChannel;
+    image.Channels = channels;
+    image.HeightPixels = height;
+    image.WidthPixels = width;
+    image.StrideBytes = width * channels * bytesPerChannel;
+    image.IsIFrame = 1;
+    image.PixelFormat = pixelFormat;
+    return bench;
+}
+
+static void SetSample(BenchImage& bench, unsigned x, unsigned y, unsigned c, unsigned value)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    uint8_t* sample = bench.Pixels.data() + (size_t)y * image.StrideBytes +
+        (x * image.Channels + c) * image.BytesPerChannel;
+    if (image.BytesPerChannel == 1) {
+        *sample = (uint8_t)value;
+    } else {
+        const uint16_t value16 = (uint16_t)value;
+        memcpy(sample, &value16, 2);
+    }
+}
+
+// Scale [0, 1] to an integer sample of the given bit depth, plus noise
+static unsigned Quantize(double v, unsigned bits, double noise, BenchRandom& rng)
+{
+    const double maxValue = (double)((1u << bits) - 1);
+    double q = v * maxValue + 0.5;
+    if (noise > 0.) {
+        q += noise * rng.Gaussian();
+    }
+    return q < 0. ? 0u : (q > maxValue ? (unsigned)maxValue : (unsigned)q);
+}
+
+// Color at each 2x2 position of a Bayer format, indexed by y*2+x
+struct BayerLayout
+{
+    unsigned Format;
+    const char* Name;
+    unsigned Colors[4];
+};
+
+static const BayerLayout kBayerLayouts[] = {
+    { ZPNG_PIXEL_FORMAT_BAYER_RGGB, "rggb", { 0, 1, 1, 2 } },
+    { ZPNG_PIXEL_FORMAT_BAYER_BGGR, "bggr", { 2, 1, 1, 0 } },
+    { ZPNG_PIXEL_FORMAT_BAYER_GRBG, "grbg", { 1, 0, 2, 1 } },
+    { ZPNG_PIXEL_FORMAT_BAYER_GBRG, "gbrg", { 1, 2, 0, 1 } },
+};
+
+// Returns null for ZPNG_PIXEL_FORMAT_DEFAULT
+static const BayerLayout* FindBayerLayout(unsigned pixelFormat)
+{
+    for (const BayerLayout& layout : kBayerLayouts)
+    {
+        if (layout.Format == pixelFormat) {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+// Render the scene at offset (ox, oy) into every channel of the image,
+// or through the color filter array for Bayer formats
+static void RenderScene(
+    BenchImage& bench,
+    const BenchScene& scene,
+    int ox,
+    int oy,
+    unsigned bits,
+    double noise,
+    BenchRandom& rng)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    const BayerLayout* layout = FindBayerLayout(image.PixelFormat);
+
+    for (unsigned y = 0; y < image.HeightPixels; ++y)
+    {
+        for (unsigned x = 0; x < image.WidthPixels; ++x)
+        {
+            const double sx = (double)x + ox, sy = (double)y + oy;
+            if (layout)
+            {
+                const unsigned color = layout->Colors[(y & 1) * 2 + (x & 1)];
+                SetSample(bench, x, y, 0, Quantize(scene.Sample(sx, sy, color), bits, noise, rng));
+                continue;
+            }
+            for (unsigned c = 0; c < image.Channels; ++c) {
+                SetSample(bench, x, y, c, Quantize(scene.Sample(sx, sy, c), bits, noise, rng));
+            }
+        }
+    }
+}
+
+// Flat UI: a desktop color, overlapping windows with title bars, and rows
+// of one-pixel glyph strokes standing in for text
+static void RenderScreenshot(BenchImage& bench, BenchRandom& rng)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    const unsigned w = image.WidthPixels, h = image.HeightPixels;
+    const unsigned channels = image.Channels < 3 ? image.Channels : 3;
+
+    vector<uint8_t> rgb((size_t)w * h * 3);
+    auto fill = [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1, const uint8_t* color) {
+        for (unsigned y = y0; y < y1 && y < h; ++y) {
+            for (unsigned x = x0; x < x1 && x < w; ++x) {
+                memcpy(&rgb[((size_t)y * w + x) * 3], color, 3);
+            }
+        }
+    };
+
+    const uint8_t desktop[3] = { 40, 90, 140 };
+    fill(0, 0, w, h, desktop);
+
+    const unsigned windows = 5;
+    for (unsigned i = 0; i < windows; ++i)
+    {
+        const unsigned x0 = (unsigned)rng.Range(0., w * 0.7);
+        const unsigned y0 = (unsigned)rng.Range(0., h * 0.7);
+        const unsigned x1 = x0 + (unsigned)rng.Range(w * 0.2, w * 0.5);
+        const unsigned y1 = y0 + (unsigned)rng.Range(h * 0.2, h * 0.5);
+        const uint8_t frame[3] = { 200, 200, 205 };
+        const uint8_t title[3] = { (uint8_t)rng.Range(0., 256.), (uint8_t)rng.Range(0., 256.), 180 };
+        const uint8_t client[3] = { 250, 250, 250 };
+        const uint8_t ink[3] = { 20, 20, 30 };
+        fill(x0, y0, x1, y1, frame);
+        fill(x0 + 2, y0 + 2, x1 - 2, y0 + 20, title);
+        fill(x0 + 2, y0 + 22, x1 - 2, y1 - 2, client);
+
+        for (unsigned ty = y0 + 28; ty + 10 < y1; ty += 14)
+        {
+            unsigned tx = x0 + 8;
+            while (tx + 8 < x1 && rng.Unit() < 0.97)
+            {
+                // A glyph is a few random strokes in a 6x9 cell
+                for (unsigned stroke = 0; stroke < 3; ++stroke)
+                {
+                    const unsigned gx = tx + (unsigned)rng.Range(0., 6.);
+                    const unsigned gy = ty + (unsigned)rng.Range(0., 4.);
+                    if (rng.Unit() < 0.5) {
+                        fill(gx, gy, gx + 1, gy + 5, ink);
+                    } else {
+                        fill(tx, gy, tx + 6, gy + 1, ink);
+                    }
+                }
+                tx += rng.Unit() < 0.15 ? 10 : 7;
+            }
+        }
+    }
+
+    for (unsigned y = 0; y < h; ++y)
+    {
+        for (unsigned x = 0; x < w; ++x)
+        {
+            const uint8_t* p = &rgb[((size_t)y * w + x) * 3];
+            if (channels == 1) {
+                SetSample(bench, x, y, 0, (p[0] * 77u + p[1] * 150u + p[2] * 29u) >> 8);
+                continue;
+            }
+            for (unsigned c = 0; c < channels; ++c) {
+                SetSample(bench, x, y, c, p[c]);
+            }
+            if (image.Channels == 4) {
+                SetSample(bench, x, y, 3, 255);
+            }
+        }
+    }
+}
+
+// 16-bit depth map: a tilted floor, a back wall, and boxes in front of them,
+// with zero where the sensor returned no depth
+static void RenderDepth(BenchImage& bench, BenchRandom& rng)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    const unsigned w = image.WidthPixels, h = image.HeightPixels;
+
+    const unsigned boxes = 4;
+    unsigned bx0[boxes], by0[boxes], bx1[boxes], by1[boxes], bz[boxes];
+    for (unsigned i = 0; i < boxes; ++i)
+    {
+        bx0[i] = (unsigned)rng.Range(0., w * 0.8);
+        by0[i] = (unsigned)rng.Range(h * 0.2, h * 0.8);
+        bx1[i] = bx0[i] + (unsigned)rng.Range(w * 0.05, w * 0.2);
+        by1[i] = by0[i] + (unsigned)rng.Range(h * 0.05, h * 0.2);
+        bz[i] = (unsigned)rng.Range(800., 2500.);
+    }
+
+    for (unsigned y = 0; y < h; ++y)
+    {
+        for (unsigned x = 0; x < w; ++x)
+        {
+            // Millimeters
+            double z = y < h / 2 ? 5000. : 5000. - 3500. * (y - h / 2.) / (h / 2.);
+            for (unsigned i = 0; i < boxes; ++i) {
+                if (x >= bx0[i] && x < bx1[i] && y >= by0[i] && y < by1[i]) {
+                    z = bz[i] + 0.5 * (x - bx0[i]);
+                }
+            }
+            unsigned value = (unsigned)(z + 2. * rng.Gaussian());
+            if (rng.Unit() < 0.01) {
+                value = 0;
+            }
+            SetSample(bench, x, y, 0, value);
+        }
+    }
+}
+
+// Replace the last channel with alpha that is opaque except in a few soft
+// circular holes, like a cut-out photo or a UI sprite sheet
+static void RenderSparseAlpha(BenchImage& bench, BenchRandom& rng)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    const unsigned w = image.WidthPixels, h = image.HeightPixels;
+    const unsigned alpha = image.Channels - 1;
+    const unsigned maxValue = image.BytesPerChannel == 1 ? 255 : 65535;
+
+    const unsigned holes = 3;
+    double hx[holes], hy[holes], hr[holes];
+    for (unsigned i = 0; i < holes; ++i)
+    {
+        hx[i] = rng.Range(0., w);
+        hy[i] = rng.Range(0., h);
+        hr[i] = rng.Range(0.05, 0.15) * h;
+    }
+
+    for (unsigned y = 0; y < h; ++y)
+    {
+        for (unsigned x = 0; x < w; ++x)
+        {
+            double a = 1.;
+            for (unsigned i = 0; i < holes; ++i)
+            {
+                const double d = std::sqrt((x - hx[i]) * (x - hx[i]) + (y - hy[i]) * (y - hy[i]));
+                const double edge = (d - hr[i]) / 8.;
+                if (edge < 1.) {
+                    a = std::min(a, edge < 0. ? 0. : edge);
+                }
+            }
+            SetSample(bench, x, y, alpha, (unsigned)(a * maxValue + 0.5));
+        }
+    }
+}
+
+struct SyntheticOptions
+{
+    unsigned Width = 640;
+    unsigned Height = 480;
+    uint64_t Seed = 1;
+
+    // Video sequences: frame count, pan in pixels per frame, and frames
+    // between scene cuts (0 for none)
+    unsigned VideoFrames = 16;
+    int VideoMotion = 2;
+    unsigned VideoCutInterval = 8;
+
+    // Only generate the large class, for memory-bound paths
+    bool Large = false;
+};
+
+// Video frames are cuts of a panning scene with fresh sensor noise each
+// frame, and a new scene every cutInterval frames
+static void AddSyntheticVideo(
+    vector<BenchImage>& images,
+    const SyntheticOptions& options,
+    const string& name,
+    unsigned channels,
+    unsigned pixelFormat,
+    BenchRandom& rng)
+{
+    BenchScene scene;
+    int ox = 0, oy = 0;
+
+    for (unsigned frame = 0; frame < options.VideoFrames; ++frame)
+    {
+        const bool cut = frame == 0 || (options.VideoCutInterval && frame % options.VideoCutInterval == 0);
+        if (cut)
+        {
+            scene.Randomize(rng, options.Width, options.Height);
+            ox = oy = 0;
+        }
+
+        const int refIndex = frame == 0 ? -1 : (int)images.size() - 1;
+        BenchImage& bench = AddSyntheticImage(images, "video", name + "-" + std::to_string(frame),
+            options.Width, options.Height, channels, 1, pixelFormat);
+        bench.RefIndex = refIndex;
+        bench.Image.IsIFrame = refIndex < 0 ? 1 : 0;
+        RenderScene(bench, scene, ox, oy, 8, 0.7, rng);
+
+        ox += options.VideoMotion;
+        oy += options.VideoMotion / 2;
+    }
+}
+
+// Generates the default corpus, covering each pixel layout the library
+// has a filter for
+// Default size of the large class: 50 MP, as from a high-end camera
+static const unsigned kLargeWidth = 8688;
+static const unsigned kLargeHeight = 5792;
+
+// Photos far larger than the CPU caches, in the planar RGB and RGBA formats
+static void GenerateLargeCorpus(const SyntheticOptions& options, vector<BenchImage>& images)
+{
+    const unsigned w = options.Width & ~1u, h = options.Height & ~1u;
+    BenchRandom rng(options.Seed);
+    BenchScene scene;
+
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "large", "large-rgb8", w, h, 3, 1), scene, 0, 0, 8, 1., rng);
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "large", "large-rgba8", w, h, 4, 1), scene, 0, 0, 8, 1., rng);
+}
+
+static void GenerateCorpus(const SyntheticOptions& options, vector<BenchImage>& images)
+{
+    if (options.Large) {
+        GenerateLargeCorpus(options, images);
+        return;
+    }
+
+    const unsigned w = options.Width & ~1u, h = options.Height & ~1u;
+    BenchRandom rng(options.Seed);
+    BenchScene scene;
+
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "photo", "photo-rgb8", w, h, 3, 1), scene, 0, 0, 8, 1., rng);
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "photo", "photo-rgb16", w, h, 3, 2), scene, 0, 0, 16, 200., rng);
+
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "sensor", "sensor-gray8", w, h, 1, 1), scene, 0, 0, 8, 6., rng);
+    scene.Randomize(rng, w, h);
+    RenderScene(AddSyntheticImage(images, "sensor", "sensor-gray12", w, h, 1, 2), scene, 0, 0, 12, 40., rng);
+
+    RenderScreenshot(AddSyntheticImage(images, "screenshot", "ui-gray8", w, h, 1, 1), rng);
+    RenderScreenshot(AddSyntheticImage(images, "screenshot", "ui-rgb8", w, h, 3, 1), rng);
+    RenderScreenshot(AddSyntheticImage(images, "screenshot", "ui-rgba8", w, h, 4, 1), rng);
+
+    for (unsigned i = 0; i < sizeof(kBayerLayouts) / sizeof(kBayerLayouts[0]); ++i)
+    {
+        // Alternate 8-bit and 12-bit sensors
+        const unsigned bytesPerChannel = i % 2 ? 2 : 1;
+        const unsigned bits = bytesPerChannel == 1 ? 8 : 12;
+        scene.Randomize(rng, w, h);
+        BenchImage& bench = AddSyntheticImage(images, "bayer",
+            string("bayer-") + kBayerLayouts[i].Name + std::to_string(bits), w, h, 1, bytesPerChannel, kBayerLayouts[i].Format);
+        RenderScene(bench, scene, 0, 0, bits, bits == 8 ? 2. : 20., rng);
+    }
+
+    RenderDepth(AddSyntheticImage(images, "depth", "depth16", w, h, 1, 2), rng);
+
+    scene.Randomize(rng, w, h);
+    BenchImage& grayAlpha = AddSyntheticImage(images, "alpha", "alpha-ga8", w, h, 2, 1);
+    RenderScene(grayAlpha, scene, 0, 0, 8, 1., rng);
+    RenderSparseAlpha(grayAlpha, rng);
+    scene.Randomize(rng, w, h);
+    BenchImage& rgba = AddSyntheticImage(images, "alpha", "alpha-rgba8", w, h, 4, 1);
+    RenderScene(rgba, scene, 0, 0, 8, 1., rng);
+    RenderSparseAlpha(rgba, rng);
+    scene.Randomize(rng, w, h);
+    BenchImage& rgba16 = AddSyntheticImage(images, "alpha", "alpha-rgba16", w, h, 4, 2);
+    RenderScene(rgba16, scene, 0, 0, 16, 200., rng);
+    RenderSparseAlpha(rgba16, rng);
+
+    SyntheticOptions video = options;
+    video.Width = w;
+    video.Height = h;
+    AddSyntheticVideo(images, video, "video-rgb8", 3, ZPNG_PIXEL_FORMAT_DEFAULT, rng);
+    AddSyntheticVideo(images, video, "video-rggb8", 1, ZPNG_PIXEL_FORMAT_BAYER_RGGB, rng);
+}
+
+
+//------------------------------------------------------------------------------
+// Measurement
+
+struct BenchOptions
+{
+    unsigned Runs = 5;
+    unsigned Warmup = 1;
+    int Level = 0;
+    unsigned Workers = 0;
+    unsigned Backend = ZPNG_BACKEND_ZSTD;
+    bool Palette = false;
+    bool ConstantPlanes = false;
+    bool NonTemporal = false;
+    const char* JsonFile = nullptr;
+};
+
+static const char* GetBackendName(unsigned backend)
+{
+    switch (backend)
+    {
+    case ZPNG_BACKEND_ENTROPY: return "entropy";
+    case ZPNG_BACKEND_AUTO: return "auto";
+    default: return "zstd";
+    }
+}
+
+// Per-run results of one image
+struct ImageResult
+{
+    size_t RawBytes = 0;
+    size_t CompressedBytes = 0;
+    vector<uint64_t> CompressNsec;
+    vector<uint64_t> DecompressNsec;
+
+    // Per run, from ZPNG_Stats
+    vector<uint64_t> CompressFilterNsec, CompressZstdNsec;
+    vector<uint64_t> DecompressFilterNsec, DecompressZstdNsec;
+
+    // Whether the encoder chose an I-frame
+    bool IsIFrame = true;
+};
+
+// Video frames are compressed against ref, and still images on their own.
+// Returns false if the image did not round-trip
+static bool MeasureImage(
+    const BenchImage& bench,
+    const ZPNG_ImageData* ref,
+    const BenchOptions& options,
+    ZPNG_Context* context,
+    ZPNG_DecompressionContext* dcontext,
+    const ZPNG_Stats& compressStats,
+    const ZPNG_Stats& decompressStats,
+    ImageResult& result)
+{
+    const ZPNG_ImageData& image = bench.Image;
+    result.RawBytes = image.Buffer.Bytes;
+
+    for (unsigned run = 0; run < options.Warmup + options.Runs; ++run)
+    {
+        uint64_t t0 = GetTimeNsec();
+        ZPNG_Buffer buffer;
+        if (ref)
+        {
+            buffer.Data = nullptr;
+            buffer.Bytes = 0;
+            if (!ZPNG_CompressVideoToBuffer(ref, &image, &buffer, context)) {
+                return false;
+            }
+        }
+        else
+        {
+            buffer = ZPNG_Compress(&image, context);
+        }
+        uint64_t t1 = GetTimeNsec();
+
+        if (!buffer.Data) {
+            return false;
+        }
+
+        const uint64_t compressNsec = t1 - t0;
+
+        t0 = GetTimeNsec();
+        ZPNG_ImageData decoded = ZPNG_DecompressWithContext(dcontext, ref, buffer);
+        t1 = GetTimeNsec();
+
+        const bool same = decoded.Buffer.Data &&
+            decoded.Buffer.Bytes == image.Buffer.Bytes &&
+            0 == memcmp(decoded.Buffer.Data, image.Buffer.Data, image.Buffer.Bytes);
+
+        result.CompressedBytes = buffer.Bytes;
+        ZPNG_Free(&decoded.Buffer);
+        ZPNG_Free(&buffer);
+
+        if (!same) {
+            return false;
+        }
+
+        if (run >= options.Warmup)
+        {
+            result.CompressNsec.push_back(compressNsec);
+            result.DecompressNsec.push_back(t1 - t0);
+            result.CompressFilterNsec.push_back(compressStats.FilterNsec);
+            result.CompressZstdNsec.push_back(compressStats.ZstdNsec);
+            result.DecompressFilterNsec.push_back(decompressStats.FilterNsec);
+            result.DecompressZstdNsec.push_back(decompressStats.ZstdNsec);
+            result.IsIFrame = compressStats.IsIFrame != 0;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t Percentile(vector<uint64_t> samples, double fraction)
+{
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t)(fraction * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+// Totals for one image class
+struct ClassResult
+{
+    unsigned Images = 0;
+    uint64_t RawBytes = 0;
+    uint64_t CompressedBytes = 0;
+
+    unsigned IFrames = 0;
+
+    // Sum of the median time of each image, and of its stages
+    uint64_t CompressNsec = 0;
+    uint64_t DecompressNsec = 0;
+    uint64_t CompressFilterNsec = 0, CompressZstdNsec = 0;
+    uint64_t DecompressFilterNsec = 0, DecompressZstdNsec = 0;
+
+    // Every timed run of every image
+    vector<uint64_t> CompressSamples;
+    vector<uint64_t> DecompressSamples;
+
+    void Add(const ImageResult& image)
+    {
+        ++Images;
+        RawBytes += image.RawBytes;
+        CompressedBytes += image.CompressedBytes;
+        IFrames += image.IsIFrame ? 1 : 0;
+        CompressNsec += Percentile(image.CompressNsec, 0.5);
+        DecompressNsec += Percentile(image.DecompressNsec, 0.5);
+        CompressFilterNsec += Percentile(image.CompressFilterNsec, 0.5);
+        CompressZstdNsec += Percentile(image.CompressZstdNsec, 0.5);
+        DecompressFilterNsec += Percentile(image.DecompressFilterNsec, 0.5);
+        DecompressZstdNsec += Percentile(image.DecompressZstdNsec, 0.5);
+        CompressSamples.insert(CompressSamples.end(), image.CompressNsec.begin(), image.CompressNsec.end());
+        DecompressSamples.insert(DecompressSamples.end(), image.DecompressNsec.begin(), image.DecompressNsec.end());
+    }
+
+    double Ratio() const
+    {
+        return CompressedBytes ? RawBytes / (double)CompressedBytes : 0.;
+    }
+
+    static double MBps(uint64_t bytes, uint64_t nsec)
+    {
+        return nsec ? bytes * 1000. / nsec : 0.;
+    }
+};
+
+
+//------------------------------------------------------------------------------
+// Reporting
+
+static void PrintClass(const string& name, const ClassResult& r)
+{
+    cout << name << ": " << r.Images << " images, ratio " << r.Ratio()
+        << ", compress " << ClassResult::MBps(r.RawBytes, r.CompressNsec) << " MB/s"
+        << " (median " << Percentile(r.CompressSamples, 0.5) / 1e6 << " ms, p99 " << Percentile(r.CompressSamples, 0.99) / 1e6 << " ms)"
+        << ", decompress " << ClassResult::MBps(r.RawBytes, r.DecompressNsec) << " MB/s"
+        << " (median " << Percentile(r.DecompressSamples, 0.5) / 1e6 << " ms, p99 " << Percentile(r.DecompressSamples, 0.99) / 1e6 << " ms)"
+        << endl;
+    cout << "  filter " << ClassResult::MBps(r.RawBytes, r.CompressFilterNsec) << " / " << ClassResult::MBps(r.RawBytes, r.DecompressFilterNsec)
+        << " MB/s, zstd " << ClassResult::MBps(r.RawBytes, r.CompressZstdNsec) << " / " << ClassResult::MBps(r.RawBytes, r.DecompressZstdNsec)
+        << " MB/s (compress / decompress), " << r.IFrames << " I-frames" << endl;
+}
+
+static void WriteJsonClass(ostream& out, const string& name, const ClassResult& r)
+{
+    out << "    {\"class\": \"" << name << "\""
+        << ", \"images\": " << r.Images
+        << ", \"raw_bytes\": " << r.RawBytes
+        << ", \"compressed_bytes\": " << r.CompressedBytes
+        << ", \"ratio\": " << r.Ratio()
+        << ", \"compress_mbps\": " << ClassResult::MBps(r.RawBytes, r.CompressNsec)
+        << ", \"compress_median_ns\": " << Percentile(r.CompressSamples, 0.5)
+        << ", \"compress_p99_ns\": " << Percentile(r.CompressSamples, 0.99)
+        << ", \"decompress_mbps\": " << ClassResult::MBps(r.RawBytes, r.DecompressNsec)
+        << ", \"decompress_median_ns\": " << Percentile(r.DecompressSamples, 0.5)
+        << ", \"decompress_p99_ns\": " << Percentile(r.DecompressSamples, 0.99)
+        << ", \"compress_filter_ns\": " << r.CompressFilterNsec
+        << ", \"compress_zstd_ns\": " << r.CompressZstdNsec
+        << ", \"decompress_filter_ns\": " << r.DecompressFilterNsec
+        << ", \"decompress_zstd_ns\": " << r.DecompressZstdNsec
+        << ", \"iframes\": " << r.IFrames
+        << "}";
+}
+
+static bool WriteJson(const BenchOptions& options, const map<string, ClassResult>& classes, const ClassResult& total)
+{
+    std::ofstream out(options.JsonFile);
+    if (!out) {
+        return false;
+    }
+
+    out << "{\n  \"runs\": " << options.Runs
+        << ",\n  \"warmup\": " << options.Warmup
+        << ",\n  \"level\": " << options.Level
+        << ",\n  \"workers\": " << options.Workers
+        << ",\n  \"backend\": \"" << GetBackendName(options.Backend) << "\""
+        << ",\n  \"palette\": " << (options.Palette ? "true" : "false")
+        << ",\n  \"constant_planes\": " << (options.ConstantPlanes ? "true" : "false")
+        << ",\n  \"non_temporal\": " << (options.NonTemporal ? "true" : "false")
+        << ",\n  \"classes\": [\n";
+    for (const auto& c : classes)
+    {
+        WriteJsonClass(out, c.first, c.second);
+        out << ",\n";
+    }
+    WriteJsonClass(out, "all", total);
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
+
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    SyntheticOptions synthetic;
+    const char* corpus = nullptr;
+    bool usage = false;
+    bool customSize = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (hasValue && 0 == strcmp(argv[i], "--runs")) {
+            options.Runs = (unsigned)atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--warmup")) {
+            options.Warmup = (unsigned)atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--level")) {
+            options.Level = atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--workers")) {
+            options.Workers = (unsigned)atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--backend")) {
+            ++i;
+            if (0 == strcmp(argv[i], "entropy")) {
+                options.Backend = ZPNG_BACKEND_ENTROPY;
+            } else if (0 == strcmp(argv[i], "auto")) {
+                options.Backend = ZPNG_BACKEND_AUTO;
+            } else if (0 != strcmp(argv[i], "zstd")) {
+                usage = true;
+                break;
+            }
+        } else if (0 == strcmp(argv[i], "--palette")) {
+            options.Palette = true;
+        } else if (0 == strcmp(argv[i], "--constant-planes")) {
+            options.ConstantPlanes = true;
+        } else if (0 == strcmp(argv[i], "--non-temporal")) {
+            options.NonTemporal = true;
+        } else if (hasValue && 0 == strcmp(argv[i], "--json")) {
+            options.JsonFile = argv[++i];
+        } else if (hasValue && 0 == strcmp(argv[i], "--width")) {
+            synthetic.Width = (unsigned)atoi(argv[++i]);
+            customSize = true;
+        } else if (hasValue && 0 == strcmp(argv[i], "--height")) {
+            synthetic.Height = (unsigned)atoi(argv[++i]);
+            customSize = true;
+        } else if (hasValue && 0 == strcmp(argv[i], "--seed")) {
+            synthetic.Seed = (uint64_t)strtoull(argv[++i], nullptr, 10);
+        } else if (hasValue && 0 == strcmp(argv[i], "--frames")) {
+            synthetic.VideoFrames = (unsigned)atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--motion")) {
+            synthetic.VideoMotion = atoi(argv[++i]);
+        } else if (hasValue && 0 == strcmp(argv[i], "--cut")) {
+            synthetic.VideoCutInterval = (unsigned)atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--large")) {
+            synthetic.Large = true;
+        } else if (argv[i][0] != '-' && !corpus) {
+            corpus = argv[i];
+        } else {
+            usage = true;
+            break;
+        }
+    }
+
+    if (synthetic.Large && !customSize)
+    {
+        synthetic.Width = kLargeWidth;
+        synthetic.Height = kLargeHeight;
+    }
+
+    if (usage || options.Runs == 0 || synthetic.Width < 2 || synthetic.Height < 2)
+    {
+        cout << "Usage: zpng_bench [--runs N] [--warmup N] [--level L] [--workers W] [--backend zstd|entropy|auto] [--palette] [--constant-planes] [--non-temporal] [--json Results.json] [CorpusDir]" << endl;
+        cout << "  Each subdirectory of the corpus is reported as its own image class" << endl;
+        cout << "  Without a corpus, a synthetic one is generated using:" << endl;
+        cout << "    [--width W] [--height H] [--seed S] [--frames N] [--motion Pixels] [--cut Frames]" << endl;
+        cout << "  or just 50 MP RGB and RGBA photos (or W x H) for the memory-bound paths using: --large" << endl;
+        return -1;
+    }
+
+    vector<BenchImage> images;
+    if (corpus)
+    {
+        LoadDirectory(corpus, string(), images);
+        if (images.empty())
+        {
+            cout << "No images found in " << corpus << endl;
+            return -4;
+        }
+    }
+    else
+    {
+        GenerateCorpus(synthetic, images);
+        corpus = "the synthetic corpus";
+    }
+
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_DecompressionContext* dcontext = ZPNG_AllocateDecompressionContext();
+
+    // Stage times from the library, for the filter/Zstd split
+    ZPNG_Stats compressStats, decompressStats;
+    memset(&compressStats, 0, sizeof(compressStats));
+    memset(&decompressStats, 0, sizeof(decompressStats));
+    ZPNG_SetCompressionStats(context, &compressStats);
+    ZPNG_SetDecompressionStats(dcontext, &decompressStats);
+    if (options.Level != 0)
+    {
+        ZPNG_CompressionParams params;
+        memset(&params, 0, sizeof(params));
+        params.Level = options.Level;
+        ZPNG_SetCompressionParams(context, &params);
+    }
+    if (options.Workers != 0) {
+        ZPNG_SetCompressionWorkers(context, options.Workers);
+    }
+    ZPNG_SetCompressionBackend(context, options.Backend);
+    ZPNG_SetCompressionPalette(context, options.Palette ? 1 : 0);
+    ZPNG_SetCompressionConstantPlanes(context, options.ConstantPlanes ? 1 : 0);
+    ZPNG_SetCompressionNonTemporal(context, options.NonTemporal ? 1 : 0);
+
+    cout << "Benchmarking " << images.size() << " images from " << corpus << " with "
+        << options.Warmup << " warmup and " << options.Runs << " timed runs each" << endl;
+
+    map<string, ClassResult> classes;
+    ClassResult total;
+    int exitCode = 0;
+
+    for (const BenchImage& bench : images)
+    {
+        ImageResult result;
+        const ZPNG_ImageData* ref = bench.RefIndex >= 0 ? &images[bench.RefIndex].Image : nullptr;
+        if (!MeasureImage(bench, ref, options, context, dcontext, compressStats, decompressStats, result))
+        {
+            cout << "Round trip failed: " << bench.Name << endl;
+            exitCode = -5;
+            continue;
+        }
+        classes[bench.Class].Add(result);
+        total.Add(result);
+    }
+
+    for (const auto& c : classes) {
+        PrintClass(c.first, c.second);
+    }
+    PrintClass("all", total);
+
+    if (options.JsonFile && !WriteJson(options, classes, total))
+    {
+        cout << "Could not write " << options.JsonFile << endl;
+        exitCode = -3;
+    }
+
+    ZPNG_FreeCompressionContext(context);
+    ZPNG_FreeDecompressionContext(dcontext);
+    return exitCode;
+}
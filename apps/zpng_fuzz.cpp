@@ -0,0 +1,207 @@
+/*
+    libFuzzer target for the decoder
+
+    Every input is decoded each way an untrusted upload could be: As a whole
+    image, as a delta frame over a reference of its format, into a padded
+    caller buffer with workers, in place, by region, channel, level and rows,
+    as a stream pushed in pieces, and as a video file, also played back on
+    threads.
+
+    Build with cmake -DZPNG_BUILD_FUZZER=ON using clang, then run:
+
+        ./zpng_fuzz -max_len=16384 CorpusDir
+
+    Valid images can compress thousands of times over, so the input limit
+    keeps what they decode to within the fuzzer's memory limit.
+
+    Building with -DZPNG_FUZZ_MAIN instead of -fsanitize=fuzzer gives a
+    program that runs the files named on its command line, to reproduce a
+    crash with any compiler.
+*/
+
+#include "../zpng.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// References and caller buffers are only allocated up to this size, so the
+// fuzzer finds bugs instead of running out of memory in the harness
+static const uint64_t kMaxImageBytes = 64 * 1024 * 1024;
+
+static int IgnoreRows(void* opaque, const ZPNG_ImageData* rows, unsigned firstRow)
+{
+    (void)opaque;
+    (void)firstRow;
+    // Touch the band so the sanitizers see reads of it
+    volatile uint8_t sum = 0;
+    if (rows->Buffer.Bytes > 0) {
+        sum = (uint8_t)(sum + rows->Buffer.Data[0] + rows->Buffer.Data[rows->Buffer.Bytes - 1]);
+    }
+    return 1;
+}
+
+// Reference of the format of the frame, filled with a pattern
+static ZPNG_ImageData MakeReference(const ZPNG_ImageInfo& info, std::vector<uint8_t>& pixels)
+{
+    pixels.resize((size_t)info.ImageBytes);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        pixels[i] = (uint8_t)(i * 7);
+    }
+
+    ZPNG_ImageData ref;
+    memset(&ref, 0, sizeof(ref));
+    ref.Buffer.Data = pixels.empty() ? nullptr : pixels.data();
+    ref.Buffer.Bytes = pixels.size();
+    ref.WidthPixels = info.WidthPixels;
+    ref.HeightPixels = info.HeightPixels;
+    ref.Channels = info.Channels;
+    ref.BytesPerChannel = info.BytesPerChannel;
+    ref.PixelFormat = info.PixelFormat;
+    ref.StrideBytes = 0;
+    ref.IsIFrame = 1;
+    return ref;
+}
+
+static void FuzzImage(ZPNG_Buffer buffer, ZPNG_DecompressionContext* context)
+{
+    // The library checks header sizes before allocating from them, so
+    // every input is decoded by the calls that allocate their own output
+    ZPNG_VerifyChecksum(buffer);
+
+    ZPNG_ImageData image = ZPNG_Decompress(buffer);
+    ZPNG_Free(&image.Buffer);
+    image = ZPNG_DecompressWithContext(context, nullptr, buffer);
+    ZPNG_Free(&image.Buffer);
+    image = ZPNG_DecompressLevel(buffer, 1);
+    ZPNG_Free(&image.Buffer);
+    ZPNG_DecompressRows(context, buffer, IgnoreRows, nullptr);
+
+    ZPNG_ImageInfo info;
+    if (!ZPNG_GetInfo(buffer, &info)) {
+        return;
+    }
+
+    image = ZPNG_DecompressRegion(buffer, info.WidthPixels / 4, info.HeightPixels / 3,
+        info.WidthPixels / 2, info.HeightPixels / 2);
+    ZPNG_Free(&image.Buffer);
+    image = ZPNG_DecompressChannel(buffer, info.Channels - 1);
+    ZPNG_Free(&image.Buffer);
+
+    // References and caller buffers are allocated here from the header,
+    // so only for images the fuzzer has the memory for
+    if (info.ImageBytes > kMaxImageBytes) {
+        return;
+    }
+
+    std::vector<uint8_t> refPixels;
+    const ZPNG_ImageData ref = MakeReference(info, refPixels);
+    image = ZPNG_DecompressWithContext(context, &ref, buffer);
+    ZPNG_Free(&image.Buffer);
+
+    // A reference of the wrong size must be rejected, not read past
+    if (!info.IsIFrame && info.HeightPixels > 1)
+    {
+        ZPNG_ImageData shortRef = ref;
+        shortRef.Buffer.Bytes /= 2;
+        image = ZPNG_DecompressVideo(&shortRef, buffer);
+        ZPNG_Free(&image.Buffer);
+    }
+
+    // Padded rows into a caller buffer, then the next frame over it
+    const unsigned stride = (unsigned)(info.ImageBytes / (info.HeightPixels ? info.HeightPixels : 1)) + 5;
+    std::vector<uint8_t> pixels((size_t)stride * info.HeightPixels + 1);
+    ZPNG_ImageData frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.Buffer.Data = pixels.data();
+    frame.Buffer.Bytes = pixels.size();
+    frame.StrideBytes = stride;
+    ZPNG_DecompressToBuffer(context, &ref, buffer, &frame);
+    ZPNG_DecompressInPlace(context, buffer, &frame);
+}
+
+static void FuzzStream(const uint8_t* data, size_t size, ZPNG_DecompressionContext* context)
+{
+    ZPNG_StreamDecoder* decoder = ZPNG_BeginDecodeStream(nullptr, IgnoreRows, nullptr, context);
+    size_t offset = 0;
+    for (size_t piece = 1; offset < size; piece = piece * 3 + 1)
+    {
+        const size_t bytes = (size - offset < piece) ? size - offset : piece;
+        if (!ZPNG_PushStreamData(decoder, data + offset, bytes)) {
+            break;
+        }
+        offset += bytes;
+    }
+    ZPNG_EndDecodeStream(decoder);
+}
+
+static void FuzzVideoFile(ZPNG_Buffer buffer, ZPNG_DecompressionContext* context)
+{
+    ZPNG_VideoReader* reader = ZPNG_OpenVideoFile(buffer);
+    if (!reader) {
+        return;
+    }
+
+    const unsigned count = ZPNG_GetVideoFrameCount(reader);
+    for (unsigned i = 0; i < count && i < 8; ++i)
+    {
+        ZPNG_ImageData image = ZPNG_DecodeVideoFrame(reader, context, i);
+        ZPNG_Free(&image.Buffer);
+    }
+
+    // Played back on threads
+    ZPNG_VideoDecoder* decoder = ZPNG_CreateVideoDecoder(reader, 0, 2, 3);
+    ZPNG_ImageData frame;
+    while (ZPNG_NextVideoFrame(decoder, &frame, nullptr)) {
+    }
+    ZPNG_FreeVideoDecoder(decoder);
+
+    ZPNG_CloseVideoFile(reader);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    // Copied so reads past the end of the input are caught
+    std::vector<uint8_t> input(data, data + size);
+    ZPNG_Buffer buffer = { input.empty() ? nullptr : input.data(), input.size() };
+
+    ZPNG_DecompressionContext* context = ZPNG_AllocateDecompressionContext();
+    ZPNG_SetDecompressionWorkers(context, 2);
+
+    FuzzImage(buffer, context);
+    FuzzImage(buffer, nullptr);
+    FuzzStream(buffer.Data, buffer.Bytes, context);
+    FuzzVideoFile(buffer, context);
+
+    ZPNG_FreeDecompressionContext(context);
+    return 0;
+}
+
+#ifdef ZPNG_FUZZ_MAIN
+
+int main(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        FILE* file = fopen(argv[i], "rb");
+        if (!file) {
+            fprintf(stderr, "Cannot open %s\n", argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> data;
+        uint8_t chunk[4096];
+        size_t bytes;
+        while ((bytes = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            data.insert(data.end(), chunk, chunk + bytes);
+        }
+        fclose(file);
+
+        LLVMFuzzerTestOneInput(data.empty() ? nullptr : data.data(), data.size());
+        printf("%s: OK\n", argv[i]);
+    }
+    return 0;
+}
+
+#endif // ZPNG_FUZZ_MAIN
@@ -0,0 +1,2421 @@
+/*
+    Round trip regression test
+
+    Synthetic images are compressed with each of the compression options
+    and decoded every way the API allows, and each result is compared with
+    the original pixels.
+
+    Run by ctest.  Prints each failed check and exits nonzero on failure.
+*/
+
+#include "../zpng.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+static unsigned Failures = 0;
+
+// Name of the case being run, for failure messages
+static const char* CaseName = "";
+
+#define EXPECT(cond) \
+    do { if (!(cond)) { ++Failures; printf("FAILED line %d: %s (%s)\n", __LINE__, #cond, CaseName); } } while (0)
+
+
+//------------------------------------------------------------------------------
+// Synthetic Images
+
+struct TestFormat
+{
+    const char* Name;
+    unsigned Width, Height, Channels, BytesPerChannel;
+
+    // ZPNG_PixelFormat
+    unsigned PixelFormat;
+};
+
+struct TestImage
+{
+    std::vector<uint8_t> Pixels;
+    ZPNG_ImageData Image;
+};
+
+// BytesPerChannel > 8 selects 8-bit Bayer data
+static unsigned GetPixelBytes(const ZPNG_ImageData& image)
+{
+    return image.BytesPerChannel > 8 ? image.Channels : image.Channels * image.BytesPerChannel;
+}
+
+static uint32_t NextRandom(uint32_t& state)
+{
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Smooth gradients with noise and a flat box, shifted right by `shift`
+// pixels so frames of a sequence predict from each other
+static void MakeImage(TestImage& test, const TestFormat& format, unsigned shift, uint32_t seed)
+{
+    ZPNG_ImageData& image = test.Image;
+    memset(&image, 0, sizeof(image));
+    image.WidthPixels = format.Width;
+    image.HeightPixels = format.Height;
+    image.Channels = format.Channels;
+    image.BytesPerChannel = format.BytesPerChannel;
+    image.PixelFormat = format.PixelFormat;
+    image.IsIFrame = 1;
+    test.Pixels.resize((size_t)format.Width * format.Height * GetPixelBytes(image));
+
+    const unsigned sampleBytes = format.BytesPerChannel == 2 ? 2 : 1;
+    uint32_t state = seed;
+    uint8_t* sample = test.Pixels.data();
+    for (unsigned y = 0; y < format.Height; ++y)
+    {
+        for (unsigned x = 0; x < format.Width; ++x)
+        {
+            const unsigned sx = x + 1000 - shift;
+            const bool box = (sx % 40) < 12 && (y % 30) < 10;
+            for (unsigned c = 0; c < format.Channels; ++c, sample += sampleBytes)
+            {
+                unsigned value = box ? 200 + c : sx * 3 + y * 2 + ((sx * y) >> 5) + c * 50 + NextRandom(state) % 5;
+                if (format.Channels == 4 && c == 3) {
+                    value = 255;
+                }
+
+                // 16-bit channels hold 12-bit sensor values
+                if (format.BytesPerChannel == 2)
+                {
+                    const uint16_t wide = (uint16_t)((value * 13) & 0x0FFF);
+                    memcpy(sample, &wide, sizeof(wide));
+                }
+                else {
+                    sample[0] = (uint8_t)value;
+                }
+            }
+        }
+    }
+
+    image.Buffer.Data = test.Pixels.data();
+    image.Buffer.Bytes = test.Pixels.size();
+    image.StrideBytes = format.Width * GetPixelBytes(image);
+}
+
+// Returns true if `actual` holds the pixels of the packed image `expected`.
+// Rows of `actual` are StrideBytes apart, or packed if it is 0
+static bool SamePixels(const ZPNG_ImageData& expected, const ZPNG_ImageData& actual)
+{
+    if (!actual.Buffer.Data || actual.WidthPixels != expected.WidthPixels ||
+        actual.HeightPixels != expected.HeightPixels || actual.Channels != expected.Channels ||
+        actual.BytesPerChannel != expected.BytesPerChannel || actual.PixelFormat != expected.PixelFormat) {
+        return false;
+    }
+    const size_t rowBytes = (size_t)expected.WidthPixels * GetPixelBytes(expected);
+    const size_t stride = actual.StrideBytes >= rowBytes ? actual.StrideBytes : rowBytes;
+    for (unsigned y = 0; y < expected.HeightPixels; ++y)
+    {
+        if (memcmp(actual.Buffer.Data + y * stride, expected.Buffer.Data + y * rowBytes, rowBytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Cell of the progressive format: A pixel, or a 2x2 quad of Bayer images
+static unsigned GetCell(const ZPNG_ImageData& image)
+{
+    return (image.PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT || image.BytesPerChannel > 8) ? 2 : 1;
+}
+
+// Returns true if `actual` holds every 2^level-th cell of the packed image `full`
+static bool SameLevel(const ZPNG_ImageData& full, unsigned level, const ZPNG_ImageData& actual)
+{
+    const unsigned cell = GetCell(full);
+    const unsigned cellsX = full.WidthPixels / cell;
+    const unsigned cellsY = full.HeightPixels / cell;
+    const unsigned levelX = ((cellsX + (1u << level) - 1) >> level) * cell;
+    const unsigned levelY = ((cellsY + (1u << level) - 1) >> level) * cell;
+    if (!actual.Buffer.Data || actual.WidthPixels != levelX || actual.HeightPixels != levelY) {
+        return false;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(full);
+    for (unsigned y = 0; y < levelY; ++y)
+    {
+        const unsigned srcY = ((y / cell) << level) * cell + y % cell;
+        for (unsigned x = 0; x < levelX; ++x)
+        {
+            const unsigned srcX = ((x / cell) << level) * cell + x % cell;
+            const uint8_t* expected = full.Buffer.Data + ((size_t)srcY * full.WidthPixels + srcX) * pixelBytes;
+            if (memcmp(actual.Buffer.Data + ((size_t)y * levelX + x) * pixelBytes, expected, pixelBytes) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Copy the rectangle at (x, y) of a packed image
+static void CropImage(TestImage& test, const ZPNG_ImageData& image, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+    const size_t pixelBytes = GetPixelBytes(image);
+    test.Image = image;
+    test.Image.WidthPixels = width;
+    test.Image.HeightPixels = height;
+    test.Pixels.resize((size_t)width * height * pixelBytes);
+    for (unsigned row = 0; row < height; ++row)
+    {
+        memcpy(test.Pixels.data() + row * width * pixelBytes,
+            image.Buffer.Data + ((size_t)(y + row) * image.WidthPixels + x) * pixelBytes,
+            width * pixelBytes);
+    }
+    test.Image.Buffer.Data = test.Pixels.data();
+    test.Image.Buffer.Bytes = test.Pixels.size();
+    test.Image.StrideBytes = (unsigned)(width * pixelBytes);
+}
+
+// Copy a packed image into rows `padding` bytes longer, filled with noise
+static void PadImage(TestImage& test, const ZPNG_ImageData& image, unsigned padding)
+{
+    const size_t rowBytes = (size_t)image.WidthPixels * GetPixelBytes(image);
+    test.Image = image;
+    test.Image.StrideBytes = (unsigned)(rowBytes + padding);
+    test.Pixels.resize(test.Image.StrideBytes * (size_t)image.HeightPixels);
+    uint32_t state = padding;
+    for (uint8_t& byte : test.Pixels) {
+        byte = (uint8_t)NextRandom(state);
+    }
+    for (unsigned y = 0; y < image.HeightPixels; ++y) {
+        memcpy(test.Pixels.data() + y * (size_t)test.Image.StrideBytes, image.Buffer.Data + y * rowBytes, rowBytes);
+    }
+    test.Image.Buffer.Data = test.Pixels.data();
+    test.Image.Buffer.Bytes = test.Pixels.size();
+}
+
+// Compress a frame, a delta frame if refData is given, into `out`
+static bool CompressFrame(const ZPNG_ImageData* refData, const ZPNG_ImageData& image, ZPNG_Context* context, std::vector<uint8_t>& out)
+{
+    out.resize(ZPNG_MaximumBufferSize(&image));
+    ZPNG_Buffer buffer = { out.data(), out.size() };
+    if (!ZPNG_CompressVideoToBuffer(refData, &image, &buffer, context)) {
+        return false;
+    }
+    out.resize(buffer.Bytes);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Sinks
+
+// Collects the bytes of a ZPNG_WriteFunction
+static int WriteToVector(void* opaque, uint64_t offset, const void* data, size_t bytes)
+{
+    std::vector<uint8_t>* out = (std::vector<uint8_t>*)opaque;
+    if (out->size() < offset + bytes) {
+        out->resize((size_t)(offset + bytes));
+    }
+    memcpy(out->data() + offset, data, bytes);
+    return 1;
+}
+
+// Gathers the bands of a ZPNG_RowFunction into packed rows
+struct RowCollector
+{
+    std::vector<uint8_t> Pixels;
+    unsigned NextRow;
+    bool InOrder;
+};
+
+static int CollectRows(void* opaque, const ZPNG_ImageData* rows, unsigned firstRow)
+{
+    RowCollector* collector = (RowCollector*)opaque;
+    const size_t rowBytes = (size_t)rows->WidthPixels * GetPixelBytes(*rows);
+    const size_t stride = rows->StrideBytes >= rowBytes ? rows->StrideBytes : rowBytes;
+    collector->InOrder = collector->InOrder && firstRow == collector->NextRow;
+    if (collector->Pixels.size() < (firstRow + (size_t)rows->HeightPixels) * rowBytes) {
+        collector->Pixels.resize((firstRow + (size_t)rows->HeightPixels) * rowBytes);
+    }
+    for (unsigned y = 0; y < rows->HeightPixels; ++y) {
+        memcpy(collector->Pixels.data() + (firstRow + (size_t)y) * rowBytes, rows->Buffer.Data + y * stride, rowBytes);
+    }
+    collector->NextRow = firstRow + rows->HeightPixels;
+    return 1;
+}
+
+static int StopRows(void* opaque, const ZPNG_ImageData* rows, unsigned firstRow)
+{
+    (void)opaque;
+    (void)rows;
+    (void)firstRow;
+    return 0;
+}
+
+static bool SameRows(const ZPNG_ImageData& expected, const RowCollector& collector)
+{
+    return collector.InOrder && collector.NextRow == expected.HeightPixels &&
+        collector.Pixels.size() == expected.Buffer.Bytes &&
+        memcmp(collector.Pixels.data(), expected.Buffer.Data, expected.Buffer.Bytes) == 0;
+}
+
+
+//------------------------------------------------------------------------------
+// Still Images
+
+static const TestFormat kFormats[] = {
+    { "gray", 101, 69, 1, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "gray alpha", 101, 69, 2, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "RGB", 101, 69, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "RGBA", 101, 69, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "gray 16", 77, 45, 1, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "gray alpha 16", 77, 45, 2, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "RGB 16", 77, 45, 3, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "RGBA 16", 77, 45, 4, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+    { "Bayer RGGB", 96, 64, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_RGGB },
+    { "Bayer BGGR", 96, 64, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_BGGR },
+    { "Bayer GRBG 16", 96, 64, 1, 2, ZPNG_PIXEL_FORMAT_BAYER_GRBG },
+    { "Bayer GBRG 16", 96, 64, 1, 2, ZPNG_PIXEL_FORMAT_BAYER_GBRG },
+    { "legacy Bayer", 98, 66, 1, 9, ZPNG_PIXEL_FORMAT_DEFAULT },
+};
+
+// A compression option, with optional checks on the images it produces
+struct TestOption
+{
+    const char* Name;
+    void (*Set)(ZPNG_Context* context);
+    void (*Check)(const ZPNG_ImageData& original, ZPNG_Buffer compressed);
+};
+
+static void SetDefault(ZPNG_Context* context)
+{
+    (void)context;
+}
+
+static void SetStrips(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionStripRows(context, 16);
+}
+
+static void SetStripWorkers(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionStripRows(context, 16);
+    ZPNG_SetCompressionWorkers(context, 3);
+}
+
+// One strip taller than the image
+static void SetTallStrip(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionStripRows(context, 1000);
+}
+
+static void SetChecksum(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionChecksum(context, 1);
+}
+
+// A flipped bit anywhere must fail the checksum and the decode
+static void CheckChecksum(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    (void)original;
+    EXPECT(ZPNG_VerifyChecksum(compressed));
+
+    std::vector<uint8_t> corrupt(compressed.Data, compressed.Data + compressed.Bytes);
+    corrupt[corrupt.size() / 2] ^= 4;
+    const ZPNG_Buffer buffer = { corrupt.data(), corrupt.size() };
+    EXPECT(!ZPNG_VerifyChecksum(buffer));
+    ZPNG_ImageData image = ZPNG_Decompress(buffer);
+    EXPECT(!image.Buffer.Data);
+    ZPNG_Free(&image.Buffer);
+}
+
+static void SetLevel19(ZPNG_Context* context)
+{
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    params.Level = 19;
+    ZPNG_SetCompressionParams(context, &params);
+}
+
+static void SetNegativeLevel(ZPNG_Context* context)
+{
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    params.Level = -5;
+    ZPNG_SetCompressionParams(context, &params);
+}
+
+static void SetLongDistance(ZPNG_Context* context)
+{
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    params.Level = 3;
+    params.Strategy = 6;
+    params.WindowLog = 20;
+    params.LongDistanceMatching = 1;
+    ZPNG_SetCompressionParams(context, &params);
+}
+
+static void SetFilterUp(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_UP);
+}
+
+static void SetFilterAverage(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_AVERAGE);
+}
+
+static void SetFilterPaeth(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_PAETH);
+}
+
+static void SetFilterGradient(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_GRADIENT);
+}
+
+static void SetFilterAdaptive(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_ADAPTIVE);
+}
+
+static void SetFilterStrips(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_PAETH);
+    ZPNG_SetCompressionStripRows(context, 16);
+}
+
+static void SetPlanes(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionPlanes(context, 1);
+    ZPNG_SetCompressionStripRows(context, 32);
+}
+
+static void SetPlaneLevels(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionPlanes(context, 1);
+    ZPNG_SetCompressionWorkers(context, 2);
+    ZPNG_SetCompressionPlaneLevel(context, 0, 9);
+    ZPNG_SetCompressionPlaneLevel(context, 3, -1);
+}
+
+static void SetProgressive(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionProgressive(context, 3);
+}
+
+static void SetEntropy(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionBackend(context, ZPNG_BACKEND_ENTROPY);
+    ZPNG_SetCompressionStripRows(context, 16);
+}
+
+static void SetEntropyPlanes(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionBackend(context, ZPNG_BACKEND_ENTROPY);
+    ZPNG_SetCompressionPlanes(context, 1);
+}
+
+static void SetEntropyAuto(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionBackend(context, ZPNG_BACKEND_AUTO);
+    ZPNG_SetCompressionPlanes(context, 1);
+    ZPNG_SetCompressionStripRows(context, 16);
+}
+
+static void SetColorNone(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionColorTransform(context, ZPNG_COLOR_NONE);
+}
+
+static void SetColorSubtractGreen(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionColorTransform(context, ZPNG_COLOR_SUBTRACT_GREEN);
+}
+
+static void SetColorYCoCg(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionColorTransform(context, ZPNG_COLOR_YCOCG_R);
+    ZPNG_SetCompressionFilter(context, ZPNG_FILTER_PAETH);
+}
+
+static void SetColorAuto(ZPNG_Context* context)
+{
+    ZPNG_SetCompressionColorTransform(context, ZPNG_COLOR_AUTO);
+    ZPNG_SetCompressionStripRows(context, 16);
+}
+
+// Only 8-bit RGB and RGBA images record a transform
+static void CheckColorTransform(const ZPNG_ImageData& original, ZPNG_Buffer compressed, unsigned transform)
+{
+    const bool color = original.Channels >= 3 && original.BytesPerChannel == 1 &&
+        original.PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT;
+    ZPNG_ImageInfo info;
+    EXPECT(ZPNG_GetInfo(compressed, &info));
+    if (!color) {
+        EXPECT(info.ColorTransform == ZPNG_COLOR_GB_RG);
+    }
+    else if (transform == ZPNG_COLOR_AUTO) {
+        EXPECT(info.ColorTransform < ZPNG_COLOR_AUTO);
+    }
+    else {
+        EXPECT(info.ColorTransform == transform);
+    }
+}
+
+static void CheckColorNone(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    CheckColorTransform(original, compressed, ZPNG_COLOR_NONE);
+}
+
+static void CheckColorSubtractGreen(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    CheckColorTransform(original, compressed, ZPNG_COLOR_SUBTRACT_GREEN);
+}
+
+static void CheckColorYCoCg(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    CheckColorTransform(original, compressed, ZPNG_COLOR_YCOCG_R);
+}
+
+static void CheckColorAuto(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    CheckColorTransform(original, compressed, ZPNG_COLOR_AUTO);
+}
+
+static const TestOption kOptions[] = {
+    { "default", SetDefault, nullptr },
+    { "strips", SetStrips, nullptr },
+    { "strip workers", SetStripWorkers, nullptr },
+    { "tall strip", SetTallStrip, nullptr },
+    { "checksum", SetChecksum, CheckChecksum },
+    { "level 19", SetLevel19, nullptr },
+    { "level -5", SetNegativeLevel, nullptr },
+    { "long distance", SetLongDistance, nullptr },
+    { "filter up", SetFilterUp, nullptr },
+    { "filter average", SetFilterAverage, nullptr },
+    { "filter Paeth", SetFilterPaeth, nullptr },
+    { "filter gradient", SetFilterGradient, nullptr },
+    { "filter adaptive", SetFilterAdaptive, nullptr },
+    { "filter strips", SetFilterStrips, nullptr },
+    { "planes", SetPlanes, nullptr },
+    { "plane levels", SetPlaneLevels, nullptr },
+    { "progressive", SetProgressive, nullptr },
+    { "entropy", SetEntropy, nullptr },
+    { "entropy planes", SetEntropyPlanes, nullptr },
+    { "entropy auto", SetEntropyAuto, nullptr },
+    { "color none", SetColorNone, CheckColorNone },
+    { "subtract green", SetColorSubtractGreen, CheckColorSubtractGreen },
+    { "YCoCg-R", SetColorYCoCg, CheckColorYCoCg },
+    { "color auto", SetColorAuto, CheckColorAuto },
+};
+
+// Decompression context shared by every case, with workers, so its state
+// is reused between images of all formats
+static ZPNG_DecompressionContext* Decoder = nullptr;
+
+// Decode an I-frame each way and compare with the original
+static void CheckDecodes(const ZPNG_ImageData& original, ZPNG_Buffer compressed)
+{
+    // The headers alone describe the image
+    ZPNG_ImageInfo info;
+    EXPECT(ZPNG_GetInfo(compressed, &info));
+    EXPECT(info.WidthPixels == original.WidthPixels && info.HeightPixels == original.HeightPixels &&
+        info.Channels == original.Channels && info.BytesPerChannel == original.BytesPerChannel &&
+        info.PixelFormat == original.PixelFormat && info.IsIFrame == 1 &&
+        info.ImageBytes == (uint64_t)original.WidthPixels * original.HeightPixels * GetPixelBytes(original));
+    const ZPNG_Buffer header = { compressed.Data, 3 };
+    EXPECT(!ZPNG_GetInfo(header, &info));
+
+    ZPNG_ImageData image = ZPNG_Decompress(compressed);
+    EXPECT(SamePixels(original, image));
+    ZPNG_Free(&image.Buffer);
+
+    image = ZPNG_DecompressWithContext(Decoder, nullptr, compressed);
+    EXPECT(SamePixels(original, image));
+    ZPNG_Free(&image.Buffer);
+
+    // Into a caller buffer with padded rows, which must be large enough
+    const unsigned stride = original.WidthPixels * GetPixelBytes(original) + 7;
+    std::vector<uint8_t> padded((size_t)stride * original.HeightPixels);
+    ZPNG_ImageData frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.Buffer.Data = padded.data();
+    frame.Buffer.Bytes = padded.size();
+    frame.StrideBytes = stride;
+    EXPECT(ZPNG_DecompressToBuffer(Decoder, nullptr, compressed, &frame));
+    EXPECT(SamePixels(original, frame));
+
+    frame.Buffer.Bytes = (size_t)stride * (original.HeightPixels - 1);
+    EXPECT(!ZPNG_DecompressToBuffer(nullptr, nullptr, compressed, &frame));
+
+    // Progressive images decode each level, and the row, region and
+    // channel decoders reject them
+    if (info.Levels != 0)
+    {
+        for (unsigned level = 1; level <= info.Levels + 1; ++level)
+        {
+            image = ZPNG_DecompressLevel(compressed, level);
+            EXPECT(SameLevel(original, level, image));
+            ZPNG_Free(&image.Buffer);
+        }
+        EXPECT(!ZPNG_DecompressRows(nullptr, compressed, CollectRows, nullptr));
+        image = ZPNG_DecompressRegion(compressed, 0, 0, 1, 1);
+        EXPECT(!image.Buffer.Data);
+        image = ZPNG_DecompressChannel(compressed, 0);
+        EXPECT(!image.Buffer.Data);
+        return;
+    }
+
+    RowCollector rows;
+    rows.NextRow = 0;
+    rows.InOrder = true;
+    EXPECT(ZPNG_DecompressRows(Decoder, compressed, CollectRows, &rows));
+    EXPECT(SameRows(original, rows));
+    EXPECT(!ZPNG_DecompressRows(nullptr, compressed, StopRows, nullptr));
+
+    // Even corners and sizes of at least 2 keep Bayer quads whole
+    TestImage region;
+    const unsigned x = (original.WidthPixels / 4) & ~1u;
+    const unsigned y = (original.HeightPixels / 3) & ~1u;
+    const unsigned width = original.WidthPixels >= 4 ? (original.WidthPixels / 2) & ~1u : original.WidthPixels;
+    const unsigned height = original.HeightPixels >= 4 ? (original.HeightPixels / 2) & ~1u : original.HeightPixels;
+    CropImage(region, original, x, y, width, height);
+    image = ZPNG_DecompressRegion(compressed, x, y, width, height);
+    EXPECT(SamePixels(region.Image, image));
+    ZPNG_Free(&image.Buffer);
+
+    // Two pixels past the right edge
+    image = ZPNG_DecompressRegion(compressed, original.WidthPixels - width + 2, y, width, height);
+    EXPECT(!image.Buffer.Data);
+
+    const size_t pixelBytes = GetPixelBytes(original);
+    const size_t channelBytes = pixelBytes / original.Channels;
+    const size_t pixelCount = (size_t)original.WidthPixels * original.HeightPixels;
+    for (unsigned channel = 0; channel < original.Channels; ++channel)
+    {
+        image = ZPNG_DecompressChannel(compressed, channel);
+        bool same = image.Buffer.Data && image.Channels == 1 && image.Buffer.Bytes == pixelCount * channelBytes;
+        for (size_t i = 0; same && i < pixelCount; ++i) {
+            same = memcmp(image.Buffer.Data + i * channelBytes, original.Buffer.Data + i * pixelBytes + channel * channelBytes, channelBytes) == 0;
+        }
+        EXPECT(same);
+        ZPNG_Free(&image.Buffer);
+    }
+    image = ZPNG_DecompressChannel(compressed, original.Channels);
+    EXPECT(!image.Buffer.Data);
+}
+
+static void CheckStillImages()
+{
+    char name[128];
+    for (const TestFormat& format : kFormats)
+    {
+        for (const TestOption& option : kOptions)
+        {
+            snprintf(name, sizeof(name), "%s, %s", format.Name, option.Name);
+            CaseName = name;
+
+            TestImage test;
+            MakeImage(test, format, 0, 1);
+
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            option.Set(context);
+            ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+            EXPECT(compressed.Data);
+            if (compressed.Data)
+            {
+                if (option.Check) {
+                    option.Check(test.Image, compressed);
+                }
+                CheckDecodes(test.Image, compressed);
+            }
+            ZPNG_Free(&compressed);
+
+            // The same image with padded rows
+            TestImage padded;
+            PadImage(padded, test.Image, 13);
+            compressed = ZPNG_Compress(&padded.Image, context);
+            ZPNG_ImageData image = ZPNG_Decompress(compressed);
+            EXPECT(SamePixels(test.Image, image));
+            ZPNG_Free(&image.Buffer);
+            ZPNG_Free(&compressed);
+            ZPNG_FreeCompressionContext(context);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Workers
+
+static void CheckWorkers()
+{
+    CaseName = "workers";
+
+    // Over 1 MB, so ZSTDMT splits it between the workers
+    TestImage test;
+    const TestFormat format = { "large RGBA", 640, 480, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    MakeImage(test, format, 0, 2);
+
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    EXPECT(ZPNG_SetCompressionWorkers(context, 4));
+
+    // Out of range counts are rejected and leave the context as it was
+    EXPECT(!ZPNG_SetCompressionWorkers(context, 201));
+    EXPECT(ZPNG_SetCompressionWorkers(context, 200));
+    EXPECT(ZPNG_SetCompressionWorkers(context, 4));
+
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+        EXPECT(compressed.Data);
+        ZPNG_ImageData image = ZPNG_Decompress(compressed);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_Free(&compressed);
+
+        // And back to the calling thread
+        EXPECT(ZPNG_SetCompressionWorkers(context, 0));
+    }
+
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Parameters
+
+static void CheckParams()
+{
+    CaseName = "params";
+
+    // Out of range values are rejected and leave the parameters unchanged
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    params.Level = 23;
+    EXPECT(!ZPNG_SetCompressionParams(context, &params));
+    params.Level = 1;
+    params.WindowLog = 9;
+    EXPECT(!ZPNG_SetCompressionParams(context, &params));
+    params.WindowLog = 0;
+    params.Strategy = 9;
+    EXPECT(!ZPNG_SetCompressionParams(context, &params));
+
+    TestImage test;
+    const TestFormat format = { "RGB", 101, 69, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    MakeImage(test, format, 0, 4);
+    ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+    ZPNG_ImageData image = ZPNG_Decompress(compressed);
+    EXPECT(SamePixels(test.Image, image));
+    ZPNG_Free(&image.Buffer);
+    ZPNG_Free(&compressed);
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Context Reuse
+
+static void CheckContextReuse()
+{
+    CaseName = "context reuse";
+
+    // Growing and shrinking images, so the scratch space left by a larger
+    // image is reused unzeroed for a smaller one
+    static const TestFormat kSequence[] = {
+        { "small RGB", 31, 17, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "large RGBA", 300, 200, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "gray", 64, 48, 1, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "RGB", 200, 100, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "tiny gray alpha", 3, 2, 2, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    };
+
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    for (unsigned pass = 0; pass < 2; ++pass)
+    {
+        // The second pass uses strips
+        ZPNG_SetCompressionStripRows(context, pass * 16);
+
+        for (unsigned i = 0; i < sizeof(kSequence) / sizeof(kSequence[0]); ++i)
+        {
+            TestImage test;
+            MakeImage(test, kSequence[i], 0, 20 + i);
+            ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+            ZPNG_ImageData image = ZPNG_DecompressWithContext(Decoder, nullptr, compressed);
+            EXPECT(SamePixels(test.Image, image));
+            ZPNG_Free(&image.Buffer);
+            ZPNG_Free(&compressed);
+        }
+    }
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Large Images
+
+static void CheckLargeImages()
+{
+    CaseName = "large image";
+
+    // Over 1 MB with row packed kernels, so they are filtered and
+    // compressed a chunk of rows at a time
+    static const TestFormat kLarge[] = {
+        { "large gray", 1100, 1000, 1, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "large gray alpha", 777, 701, 2, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "large gray 16", 800, 700, 1, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+    };
+
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    for (const TestFormat& format : kLarge)
+    {
+        CaseName = format.Name;
+
+        TestImage test;
+        MakeImage(test, format, 0, 5);
+        ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+        EXPECT(compressed.Data);
+        if (compressed.Data) {
+            CheckDecodes(test.Image, compressed);
+        }
+        ZPNG_Free(&compressed);
+    }
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Image Widths
+
+// Every width up to a few SIMD vectors, so the vector loops of the filters,
+// predictors and video kernels and their scalar tails are all covered
+static void CheckWidth(const TestFormat& format)
+{
+    TestImage test;
+    MakeImage(test, format, 0, format.Width);
+    ZPNG_Buffer compressed = ZPNG_Compress(&test.Image);
+    ZPNG_ImageData image = ZPNG_Decompress(compressed);
+    EXPECT(SamePixels(test.Image, image));
+    ZPNG_Free(&image.Buffer);
+    ZPNG_Free(&compressed);
+
+    // With each predictor
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    for (unsigned filter = ZPNG_FILTER_UP; filter <= ZPNG_FILTER_GRADIENT; ++filter)
+    {
+        EXPECT(ZPNG_SetCompressionFilter(context, filter));
+        compressed = ZPNG_Compress(&test.Image, context);
+        image = ZPNG_Decompress(compressed);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_Free(&compressed);
+    }
+    EXPECT(!ZPNG_SetCompressionFilter(context, ZPNG_FILTER_ADAPTIVE + 1));
+    ZPNG_FreeCompressionContext(context);
+
+    // And a delta frame against it
+    TestImage next;
+    MakeImage(next, format, 1, format.Width + 1);
+    std::vector<uint8_t> delta;
+    EXPECT(CompressFrame(&test.Image, next.Image, nullptr, delta));
+    ZPNG_Buffer buffer = { delta.data(), delta.size() };
+    image = ZPNG_DecompressVideo(&test.Image, buffer);
+    EXPECT(SamePixels(next.Image, image));
+    ZPNG_Free(&image.Buffer);
+
+    // With padded rows in both frames
+    TestImage paddedRef, paddedNext;
+    PadImage(paddedRef, test.Image, 5);
+    PadImage(paddedNext, next.Image, 9);
+    EXPECT(CompressFrame(&paddedRef.Image, paddedNext.Image, nullptr, delta));
+    buffer.Data = delta.data();
+    buffer.Bytes = delta.size();
+    image = ZPNG_DecompressVideo(&paddedRef.Image, buffer);
+    EXPECT(SamePixels(next.Image, image));
+    ZPNG_Free(&image.Buffer);
+}
+
+static void CheckWidths()
+{
+    char name[64];
+    for (unsigned bytes = 1; bytes <= 2; ++bytes)
+    {
+        for (unsigned channels = 1; channels <= 4; ++channels)
+        {
+            for (unsigned width = 1; width <= 40; ++width)
+            {
+                snprintf(name, sizeof(name), "%u channels of %u bytes, width %u", channels, bytes, width);
+                CaseName = name;
+                const TestFormat format = { name, width, 6, channels, bytes, ZPNG_PIXEL_FORMAT_DEFAULT };
+                CheckWidth(format);
+            }
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Pixel Formats
+
+static void CheckPixelFormats()
+{
+    CaseName = "pixel format";
+
+    // Values that are not a ZPNG_PixelFormat, as from an uninitialized field
+    static const unsigned kInvalidFormats[] = { 1, 4, 5, 0xCCCCCCCC, ZPNG_PIXEL_FORMAT_BAYER_GBRG + 1 };
+    TestImage test;
+    const TestFormat gray = { "gray", 64, 48, 1, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    MakeImage(test, gray, 0, 1);
+    for (unsigned format : kInvalidFormats)
+    {
+        test.Image.PixelFormat = format;
+        ZPNG_Buffer compressed = ZPNG_Compress(&test.Image);
+        EXPECT(!compressed.Data);
+        ZPNG_Free(&compressed);
+    }
+
+    // Bayer data must be one channel with an even width and height
+    static const TestFormat kInvalidBayer[] = {
+        { "odd width", 63, 48, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_RGGB },
+        { "odd height", 64, 47, 1, 2, ZPNG_PIXEL_FORMAT_BAYER_BGGR },
+        { "RGB", 64, 48, 3, 1, ZPNG_PIXEL_FORMAT_BAYER_GRBG },
+        { "legacy odd width", 63, 48, 1, 9, ZPNG_PIXEL_FORMAT_DEFAULT },
+    };
+    for (const TestFormat& format : kInvalidBayer)
+    {
+        MakeImage(test, format, 0, 1);
+        ZPNG_Buffer compressed = ZPNG_Compress(&test.Image);
+        EXPECT(!compressed.Data);
+        ZPNG_Free(&compressed);
+    }
+
+    // Bayer delta frames keep their layout
+    const TestFormat bayer = { "Bayer GBRG", 96, 64, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_GBRG };
+    TestImage next;
+    MakeImage(test, bayer, 0, 1);
+    MakeImage(next, bayer, 2, 2);
+    std::vector<uint8_t> delta;
+    EXPECT(CompressFrame(&test.Image, next.Image, nullptr, delta));
+    const ZPNG_Buffer buffer = { delta.data(), delta.size() };
+    ZPNG_ImageData image = ZPNG_DecompressVideo(&test.Image, buffer);
+    EXPECT(SamePixels(next.Image, image));
+    ZPNG_Free(&image.Buffer);
+}
+
+
+//------------------------------------------------------------------------------
+// Wide Images
+
+static void CheckWideImages()
+{
+    // Wider and taller than the 16-bit sizes of the original header
+    static const TestFormat kWide[] = {
+        { "wide gray", 70000, 3, 1, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "wide RGB", 66000, 2, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "tall gray 16", 2, 66000, 1, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "wide Bayer", 65538, 2, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_RGGB },
+    };
+
+    for (const TestFormat& format : kWide)
+    {
+        CaseName = format.Name;
+
+        TestImage test;
+        MakeImage(test, format, 0, 3);
+        for (unsigned stripRows = 0; stripRows <= 16; stripRows += 16)
+        {
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            ZPNG_SetCompressionStripRows(context, stripRows);
+            ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+            EXPECT(compressed.Data);
+            if (compressed.Data) {
+                CheckDecodes(test.Image, compressed);
+            }
+            ZPNG_Free(&compressed);
+            ZPNG_FreeCompressionContext(context);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Row Encoder
+
+static void CheckRowEncoder()
+{
+    static const TestFormat kEncoded[] = {
+        { "encoder gray 16", 90, 77, 1, 2, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "encoder RGB", 90, 77, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "encoder RGBA", 90, 77, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "encoder Bayer", 90, 78, 1, 1, ZPNG_PIXEL_FORMAT_BAYER_GRBG },
+    };
+
+    for (const TestFormat& format : kEncoded)
+    {
+        CaseName = format.Name;
+
+        TestImage test, padded;
+        MakeImage(test, format, 0, 3);
+        PadImage(padded, test.Image, 11);
+
+        for (unsigned pass = 0; pass < 3; ++pass)
+        {
+            // Default strips, 16-row strips, and adaptive filtering
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            ZPNG_SetCompressionStripRows(context, pass ? 16 : 0);
+            if (pass == 2) {
+                ZPNG_SetCompressionFilter(context, ZPNG_FILTER_ADAPTIVE);
+            }
+
+            std::vector<uint8_t> out;
+            ZPNG_Encoder* encoder = ZPNG_BeginEncode(&test.Image, context, WriteToVector, &out);
+            EXPECT(encoder);
+
+            // A few padded rows at a time, as from a line-scan camera
+            const unsigned stride = padded.Image.StrideBytes;
+            for (unsigned row = 0; row < format.Height; row += 5)
+            {
+                const unsigned count = format.Height - row < 5 ? format.Height - row : 5;
+                EXPECT(ZPNG_PushRows(encoder, padded.Image.Buffer.Data + row * (size_t)stride, count, stride));
+            }
+            uint64_t bytes = 0;
+            EXPECT(ZPNG_EndEncode(encoder, &bytes));
+            EXPECT(bytes == out.size());
+
+            const ZPNG_Buffer buffer = { out.data(), out.size() };
+            CheckDecodes(test.Image, buffer);
+            ZPNG_FreeCompressionContext(context);
+        }
+
+        // Rows past the bottom fail, and so does ending early
+        std::vector<uint8_t> out;
+        ZPNG_Encoder* encoder = ZPNG_BeginEncode(&test.Image, nullptr, WriteToVector, &out);
+        EXPECT(!ZPNG_PushRows(encoder, test.Image.Buffer.Data, format.Height + 1, 0));
+        EXPECT(!ZPNG_EndEncode(encoder, nullptr));
+
+        encoder = ZPNG_BeginEncode(&test.Image, nullptr, WriteToVector, &out);
+        EXPECT(ZPNG_PushRows(encoder, test.Image.Buffer.Data, format.Height - 2, 0));
+        EXPECT(!ZPNG_EndEncode(encoder, nullptr));
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Dictionaries
+
+// Sample images to train on, and a similar image to compress in `test`
+static const TestFormat kSample = { "sample", 120, 80, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+
+static void MakeSamples(std::vector<TestImage>& samples, std::vector<ZPNG_ImageData>& images, TestImage& test)
+{
+    samples.resize(4);
+    for (unsigned i = 0; i < samples.size(); ++i)
+    {
+        MakeImage(samples[i], kSample, i * 5, 10 + i);
+        images.push_back(samples[i].Image);
+    }
+    MakeImage(test, kSample, 3, 99);
+}
+
+static void CheckDictionaries()
+{
+    CaseName = "dictionary";
+
+    std::vector<TestImage> samples;
+    std::vector<ZPNG_ImageData> images;
+    TestImage test;
+    MakeSamples(samples, images, test);
+
+    ZPNG_Dictionary* dict = ZPNG_TrainDictionary(images.data(), (unsigned)images.size(), 16 * 1024, nullptr);
+    EXPECT(dict);
+    if (!dict) {
+        return;
+    }
+    ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, nullptr, &dict);
+    EXPECT(compressed.Data);
+    EXPECT(ZPNG_GetImageDictionaryID(compressed) == ZPNG_GetDictionaryID(dict));
+
+    // It needs the dictionary to decode, including one loaded from its data
+    ZPNG_ImageData image = ZPNG_Decompress(compressed);
+    EXPECT(!image.Buffer.Data || ZPNG_GetDictionaryID(dict) == 0);
+    ZPNG_Free(&image.Buffer);
+
+    ZPNG_Buffer serialized = ZPNG_SerializeDictionary(dict);
+    ZPNG_Dictionary* loaded = ZPNG_LoadDictionary(serialized, 0);
+    EXPECT(loaded);
+    EXPECT(ZPNG_GetDictionaryID(loaded) == ZPNG_GetDictionaryID(dict));
+    ZPNG_Dictionary* dicts[2] = { dict, loaded };
+    for (ZPNG_Dictionary* d : dicts)
+    {
+        ZPNG_DecompressionContext* context = ZPNG_AllocateDecompressionContext();
+        EXPECT(ZPNG_SetDecompressionDictionary(context, d));
+        image = ZPNG_DecompressWithContext(context, nullptr, compressed);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_FreeDecompressionContext(context);
+    }
+
+    // A null dictionary is trained on the first frame
+    ZPNG_Dictionary* firstDict = nullptr;
+    ZPNG_Buffer first = ZPNG_Compress(&test.Image, nullptr, &firstDict);
+    EXPECT(first.Data && firstDict);
+    if (firstDict)
+    {
+        ZPNG_DecompressionContext* context = ZPNG_AllocateDecompressionContext();
+        ZPNG_SetDecompressionDictionary(context, firstDict);
+        image = ZPNG_DecompressWithContext(context, nullptr, first);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_FreeDecompressionContext(context);
+        ZPNG_FreeDictionary(firstDict);
+    }
+
+    ZPNG_Free(&first);
+    ZPNG_FreeDictionary(loaded);
+    ZPNG_Free(&serialized);
+    ZPNG_Free(&compressed);
+    ZPNG_FreeDictionary(dict);
+}
+
+
+//------------------------------------------------------------------------------
+// Delta Frames
+
+// Replace the pixels with noise that no predictor can follow
+static void FillNoise(TestImage& test, uint32_t seed)
+{
+    for (uint8_t& byte : test.Pixels) {
+        byte = (uint8_t)NextRandom(seed);
+    }
+}
+
+// Compress a delta frame against refData and decode it.  Returns the
+// IsIFrame of the result, or -1 if it fails to round-trip
+static int CompressDelta(const ZPNG_ImageData& refData, const ZPNG_ImageData& image, ZPNG_Context* context, uint64_t* escapes)
+{
+    std::vector<uint8_t> out;
+    if (!CompressFrame(&refData, image, context, out)) {
+        return -1;
+    }
+    const ZPNG_Buffer buffer = { out.data(), out.size() };
+    ZPNG_ImageInfo info;
+    ZPNG_ImageData decoded = ZPNG_DecompressVideo(&refData, buffer);
+    const bool same = SamePixels(image, decoded) && ZPNG_GetInfo(buffer, &info);
+    ZPNG_Free(&decoded.Buffer);
+    if (!same) {
+        return -1;
+    }
+    if (escapes) {
+        *escapes = info.ContentBytes - info.ImageBytes;
+    }
+    return (int)info.IsIFrame;
+}
+
+static void CheckDeltaFrames()
+{
+    static const TestFormat kFrame = { "frame", 256, 128, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+
+    ZPNG_Context* strips = ZPNG_AllocateCompressionContext();
+    ZPNG_SetCompressionStripRows(strips, 16);
+    ZPNG_Context* contexts[2] = { nullptr, strips };
+
+    for (ZPNG_Context* context : contexts)
+    {
+        // A static scene with fresh sensor noise stays a delta frame
+        CaseName = context ? "static scene, strips" : "static scene";
+        TestImage test, next;
+        MakeImage(test, kFrame, 0, 1);
+        MakeImage(next, kFrame, 0, 2);
+        EXPECT(CompressDelta(test.Image, next.Image, context, nullptr) == 0);
+
+        // A cut to noise, and back, is cheaper as an I-frame
+        CaseName = context ? "scene cut, strips" : "scene cut";
+        TestImage noise;
+        MakeImage(noise, kFrame, 0, 3);
+        FillNoise(noise, 4);
+        EXPECT(CompressDelta(noise.Image, next.Image, context, nullptr) == 1);
+
+        // A fifth of the bytes off by 128, many more escapes than the 1000 a
+        // frame used to be allowed, and still cheaper than the noise
+        CaseName = context ? "escapes, strips" : "escapes";
+        TestImage escaped = noise;
+        escaped.Image.Buffer.Data = escaped.Pixels.data();
+        uint64_t expected = 0;
+        for (size_t i = 0; i < escaped.Pixels.size(); i += 5, ++expected) {
+            escaped.Pixels[i] ^= 0x80;
+        }
+        uint64_t escapes = 0;
+        EXPECT(expected > 1000);
+        EXPECT(CompressDelta(noise.Image, escaped.Image, context, &escapes) == 0);
+        EXPECT(escapes == expected);
+
+        // Escaping every byte costs more than the noise
+        for (uint8_t& byte : escaped.Pixels) {
+            byte = (uint8_t)(byte + 0x80);
+        }
+        EXPECT(CompressDelta(noise.Image, escaped.Image, context, nullptr) == 1);
+    }
+
+    ZPNG_FreeCompressionContext(strips);
+}
+
+
+//------------------------------------------------------------------------------
+// Video Files
+
+static const unsigned kFrameCount = 12;
+
+// A slow pan, or a still scene with fresh noise in each frame, so each
+// frame predicts from the one before it
+static void MakeSequence(std::vector<TestImage>& frames, unsigned pan)
+{
+    static const TestFormat kFrame = { "frame", 128, 80, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    frames.resize(kFrameCount);
+    for (unsigned i = 0; i < kFrameCount; ++i) {
+        MakeImage(frames[i], kFrame, i * pan, pan ? 7 : 7 + i);
+    }
+}
+
+// Decode every frame of a video file by seeking and by playback on threads,
+// with timestamps 10 apart
+static void CheckVideoFile(const std::vector<uint8_t>& file, const std::vector<TestImage>& frames)
+{
+    const ZPNG_Buffer buffer = { (uint8_t*)file.data(), file.size() };
+    ZPNG_VideoReader* reader = ZPNG_OpenVideoFile(buffer);
+    EXPECT(reader);
+    if (!reader) {
+        return;
+    }
+    EXPECT(ZPNG_GetVideoFrameCount(reader) == frames.size());
+
+    for (unsigned i = 0; i < frames.size(); ++i)
+    {
+        ZPNG_VideoFrameInfo info;
+        EXPECT(ZPNG_GetVideoFrameInfo(reader, i, &info));
+        EXPECT(info.Timestamp == (int64_t)i * 10 && info.KeyFrame <= info.RefFrame && info.RefFrame <= i);
+        EXPECT(info.IsKeyFrame == (info.RefFrame == i ? 1u : 0u));
+
+        ZPNG_ImageData image = ZPNG_DecodeVideoFrame(reader, nullptr, i);
+        EXPECT(SamePixels(frames[i].Image, image));
+        ZPNG_Free(&image.Buffer);
+    }
+    EXPECT(ZPNG_FindVideoFrame(reader, 55) == 5);
+    EXPECT(ZPNG_FindVideoFrame(reader, -1) == 0);
+    EXPECT(ZPNG_FindVideoFrame(reader, 1000) == frames.size() - 1);
+
+    // Played back on threads from the start and from the middle, with the
+    // default ring and with the smallest
+    const unsigned firstFrames[] = { 0, 5 };
+    const unsigned ringFrames[] = { 0, 2 };
+    for (unsigned first : firstFrames)
+    {
+        for (unsigned ring : ringFrames)
+        {
+            ZPNG_VideoDecoder* decoder = ZPNG_CreateVideoDecoder(reader, first, 3, ring);
+            EXPECT(decoder);
+            if (!decoder) {
+                continue;
+            }
+            ZPNG_ImageData image;
+            unsigned index = 0, count = 0;
+            while (ZPNG_NextVideoFrame(decoder, &image, &index))
+            {
+                EXPECT(index == first + count && SamePixels(frames[index].Image, image));
+                ++count;
+            }
+            EXPECT(count == frames.size() - first);
+            ZPNG_FreeVideoDecoder(decoder);
+        }
+    }
+
+    ZPNG_CloseVideoFile(reader);
+}
+
+static void CheckVideoFiles()
+{
+    std::vector<TestImage> frames;
+    MakeSequence(frames, 2);
+
+    // Written a frame at a time, with an I-frame every 4 frames
+    CaseName = "video file";
+    std::vector<uint8_t> file;
+    ZPNG_VideoWriter* writer = ZPNG_BeginVideoFile(WriteToVector, &file);
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_SetCompressionStripRows(context, 16);
+    for (unsigned i = 0; i < kFrameCount; ++i)
+    {
+        const bool key = (i % 4) == 0;
+        std::vector<uint8_t> out;
+        EXPECT(CompressFrame(key ? nullptr : &frames[i - 1].Image, frames[i].Image, context, out));
+        const ZPNG_Buffer buffer = { out.data(), out.size() };
+        EXPECT(ZPNG_AddVideoFrame(writer, buffer, (int64_t)i * 10, key ? i : i - 1));
+    }
+    EXPECT(ZPNG_EndVideoFile(writer, nullptr));
+    ZPNG_FreeCompressionContext(context);
+    CheckVideoFile(file, frames);
+
+    // Cut short, the frame table is gone
+    const ZPNG_Buffer truncated = { file.data(), file.size() - 1 };
+    EXPECT(!ZPNG_OpenVideoFile(truncated));
+
+    // Timestamps must not go back
+    CaseName = "video file timestamps";
+    std::vector<uint8_t> out, rejected;
+    EXPECT(CompressFrame(nullptr, frames[0].Image, nullptr, out));
+    const ZPNG_Buffer buffer = { out.data(), out.size() };
+    writer = ZPNG_BeginVideoFile(WriteToVector, &rejected);
+    EXPECT(ZPNG_AddVideoFrame(writer, buffer, 10, 0));
+    EXPECT(!ZPNG_AddVideoFrame(writer, buffer, 9, 1));
+    EXPECT(!ZPNG_EndVideoFile(writer, nullptr));
+}
+
+static int AddToVideoFile(void* opaque, unsigned frame, const ZPNG_VideoFrameInfo* info)
+{
+    (void)frame;
+    return ZPNG_AddVideoFrame((ZPNG_VideoWriter*)opaque, info->Frame, info->Timestamp, info->RefFrame);
+}
+
+static void CheckVideoEncoder()
+{
+    // Two still cameras cut back and forth, so each frame predicts best from
+    // the one before last
+    std::vector<TestImage> frames;
+    MakeSequence(frames, 0);
+    for (unsigned i = 1; i < kFrameCount; i += 2) {
+        FillNoise(frames[i], 99);
+        memcpy(frames[i].Pixels.data(), frames[i - 1].Pixels.data(), frames[i].Pixels.size() / 2);
+    }
+
+    ZPNG_Context* strips = ZPNG_AllocateCompressionContext();
+    ZPNG_SetCompressionStripRows(strips, 16);
+    ZPNG_Context* contexts[2] = { nullptr, strips };
+    for (ZPNG_Context* context : contexts)
+    {
+        // Pipelined unless the context needs the strip format
+        CaseName = context ? "video encoder, strips" : "video encoder";
+        std::vector<uint8_t> file;
+        ZPNG_VideoWriter* writer = ZPNG_BeginVideoFile(WriteToVector, &file);
+        ZPNG_VideoEncoder* encoder = ZPNG_CreateVideoEncoder(&frames[0].Image, context, 3, 0, AddToVideoFile, writer);
+        EXPECT(encoder);
+        if (!encoder) {
+            continue;
+        }
+
+        ZPNG_ImageData other = frames[0].Image;
+        other.WidthPixels /= 2;
+        EXPECT(!ZPNG_PushVideoFrame(encoder, &other, 0));
+        for (unsigned i = 0; i < kFrameCount; ++i)
+        {
+            while (!ZPNG_PushVideoFrame(encoder, &frames[i].Image, (int64_t)i * 10)) {
+                std::this_thread::yield();
+            }
+        }
+        EXPECT(ZPNG_FlushVideoEncoder(encoder));
+        EXPECT(ZPNG_FreeVideoEncoder(encoder));
+        EXPECT(ZPNG_EndVideoFile(writer, nullptr));
+        CheckVideoFile(file, frames);
+
+        const ZPNG_Buffer buffer = { file.data(), file.size() };
+        ZPNG_VideoReader* reader = ZPNG_OpenVideoFile(buffer);
+        ZPNG_VideoFrameInfo info;
+        for (unsigned i = 2; reader && i < kFrameCount; ++i) {
+            EXPECT(ZPNG_GetVideoFrameInfo(reader, i, &info) && info.RefFrame == i - 2);
+        }
+        ZPNG_CloseVideoFile(reader);
+    }
+    ZPNG_FreeCompressionContext(strips);
+}
+
+
+//------------------------------------------------------------------------------
+// Stats
+
+static void CheckStats()
+{
+    CaseName = "stats";
+
+    static const TestFormat kFrame = { "frame", 256, 128, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    TestImage ref, next;
+    MakeImage(ref, kFrame, 0, 1);
+    FillNoise(ref, 2);
+    next = ref;
+    next.Image.Buffer.Data = next.Pixels.data();
+    uint64_t escapes = 0;
+    for (size_t i = 0; i < next.Pixels.size(); i += 7, ++escapes) {
+        next.Pixels[i] ^= 0x80;
+    }
+
+    ZPNG_Stats stats;
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    EXPECT(ZPNG_SetCompressionStats(context, &stats));
+    ZPNG_DecompressionContext* decoder = ZPNG_AllocateDecompressionContext();
+    ZPNG_Stats decodeStats;
+    EXPECT(ZPNG_SetDecompressionStats(decoder, &decodeStats));
+
+    const ZPNG_ImageData* refs[2] = { nullptr, &ref.Image };
+    for (const ZPNG_ImageData* refData : refs)
+    {
+        std::vector<uint8_t> out;
+        EXPECT(CompressFrame(refData, next.Image, context, out));
+        EXPECT(stats.BytesIn == next.Pixels.size() && stats.BytesOut == out.size());
+        EXPECT(stats.IsIFrame == (refData ? 0u : 1u) && stats.OverflowCount == (refData ? escapes : 0));
+        EXPECT(stats.TotalNsec > 0);
+
+        // The context scratch space is already large enough
+        EXPECT(CompressFrame(refData, next.Image, context, out));
+        EXPECT(stats.Allocations == 0);
+
+        const ZPNG_Buffer buffer = { out.data(), out.size() };
+        ZPNG_ImageData image = ZPNG_DecompressWithContext(decoder, refData, buffer);
+        EXPECT(SamePixels(next.Image, image));
+        ZPNG_Free(&image.Buffer);
+        EXPECT(decodeStats.BytesIn == out.size() && decodeStats.BytesOut == next.Pixels.size());
+        EXPECT(decodeStats.IsIFrame == stats.IsIFrame && decodeStats.OverflowCount == stats.OverflowCount);
+    }
+
+    // Stats can be turned off again
+    EXPECT(ZPNG_SetCompressionStats(context, nullptr));
+    stats.BytesIn = 0;
+    std::vector<uint8_t> out;
+    EXPECT(CompressFrame(nullptr, next.Image, context, out));
+    EXPECT(stats.BytesIn == 0);
+
+    ZPNG_FreeDecompressionContext(decoder);
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Small Frames
+
+static void CheckSmallFrames()
+{
+    CaseName = "small frames";
+
+    // Thumbnails on one context, whose Zstd parameters must follow each change
+    static const TestFormat kThumbnail = { "thumbnail", 64, 64, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    size_t fastBytes = 0;
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        params.Level = (i % 3 == 2) ? 19 : 1;
+        EXPECT(ZPNG_SetCompressionParams(context, &params));
+
+        TestImage test;
+        MakeImage(test, kThumbnail, i, 30);
+        std::vector<uint8_t> out;
+        EXPECT(CompressFrame(nullptr, test.Image, context, out));
+        const ZPNG_Buffer buffer = { out.data(), out.size() };
+        ZPNG_ImageInfo info;
+        EXPECT(ZPNG_GetInfo(buffer, &info) && info.ContentBytes == info.ImageBytes);
+        CheckDecodes(test.Image, buffer);
+
+        // The shape shifts by a pixel per frame, so sizes stay comparable
+        if (params.Level == 1) {
+            fastBytes = out.size();
+        } else {
+            EXPECT(out.size() < fastBytes);
+        }
+    }
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Batches
+
+static void CheckBatch()
+{
+    CaseName = "batch";
+
+    // Images of every size and channel count, one of them large enough to
+    // be split across the threads
+    std::vector<TestImage> tests(7);
+    std::vector<ZPNG_ImageData> images;
+    for (unsigned i = 0; i < tests.size(); ++i)
+    {
+        const unsigned scale = i == 6 ? 10 : 1;
+        const TestFormat format = { "batch", (40 + i * 30) * scale, (30 + i * 9) * scale, 1 + i % 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+        MakeImage(tests[i], format, 0, i);
+        images.push_back(tests[i].Image);
+    }
+
+    // The second image goes to a preallocated buffer
+    std::vector<ZPNG_Buffer> outputs(images.size());
+    memset(outputs.data(), 0, outputs.size() * sizeof(ZPNG_Buffer));
+    std::vector<uint8_t> preallocated(ZPNG_MaximumBufferSize(&images[1]));
+    outputs[1].Data = preallocated.data();
+    outputs[1].Bytes = preallocated.size();
+
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+    params.Level = 3;
+    EXPECT(ZPNG_CompressBatch(images.data(), (unsigned)images.size(), outputs.data(), 3, &params) == images.size());
+    for (unsigned i = 0; i < images.size(); ++i)
+    {
+        ZPNG_ImageData image = ZPNG_Decompress(outputs[i]);
+        EXPECT(SamePixels(images[i], image));
+        ZPNG_Free(&image.Buffer);
+        if (i != 1) {
+            ZPNG_Free(&outputs[i]);
+        }
+    }
+    EXPECT(outputs[1].Data == preallocated.data());
+
+    // An image that cannot be compressed leaves its output alone
+    images[2].PixelFormat = 77;
+    memset(outputs.data(), 0, outputs.size() * sizeof(ZPNG_Buffer));
+    EXPECT(ZPNG_CompressBatch(images.data(), (unsigned)images.size(), outputs.data(), 0) == images.size() - 1);
+    EXPECT(!outputs[2].Data);
+    for (ZPNG_Buffer& output : outputs) {
+        ZPNG_Free(&output);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Palettes
+
+// 8-bit images of 4 levels per channel use a palette, and other formats or
+// images with too many colors fall back to the filters
+static void CheckPalettes()
+{
+    char name[128];
+    for (const TestFormat& format : kFormats)
+    {
+        for (unsigned fewColors = 0; fewColors < 2; ++fewColors)
+        {
+            snprintf(name, sizeof(name), "%s, palette%s", format.Name, fewColors ? ", few colors" : "");
+            CaseName = name;
+
+            TestImage test;
+            MakeImage(test, format, 0, 6);
+            if (fewColors)
+            {
+                for (uint8_t& byte : test.Pixels) {
+                    byte &= 0xC0;
+                }
+            }
+
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            EXPECT(ZPNG_SetCompressionPalette(context, 1));
+            ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+            EXPECT(compressed.Data);
+            if (compressed.Data)
+            {
+                const bool eightBit = format.BytesPerChannel == 1 && format.PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT;
+                ZPNG_ImageInfo info;
+                EXPECT(ZPNG_GetInfo(compressed, &info));
+                EXPECT((info.PaletteColors != 0) == (fewColors && eightBit));
+                CheckDecodes(test.Image, compressed);
+            }
+            ZPNG_Free(&compressed);
+            ZPNG_FreeCompressionContext(context);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Constant Planes
+
+// Opaque alpha is left out of 8-bit images, and so are red and blue when
+// they match green, as for gray stored as RGB
+static void CheckConstantPlanes()
+{
+    char name[128];
+    for (const TestFormat& format : kFormats)
+    {
+        const bool eightBit = format.BytesPerChannel == 1 && format.PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT;
+        for (unsigned gray = 0; gray < 2; ++gray)
+        {
+            if (gray && (!eightBit || format.Channels < 3)) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s, constant planes%s", format.Name, gray ? ", gray" : "");
+            CaseName = name;
+
+            TestImage test;
+            MakeImage(test, format, 0, 7);
+            if (gray)
+            {
+                for (size_t i = 0; i < test.Pixels.size(); i += format.Channels) {
+                    test.Pixels[i] = test.Pixels[i + 2] = test.Pixels[i + 1];
+                }
+            }
+            unsigned elided = 0;
+            if (eightBit && format.Channels >= 2) {
+                elided = (format.Channels == 4 ? 1 : 0) + gray * 2;
+            }
+
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            EXPECT(ZPNG_SetCompressionConstantPlanes(context, 1));
+            ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+            EXPECT(compressed.Data);
+            if (compressed.Data)
+            {
+                ZPNG_ImageInfo info;
+                EXPECT(ZPNG_GetInfo(compressed, &info));
+                EXPECT(info.ElidedChannels == elided);
+                CheckDecodes(test.Image, compressed);
+            }
+            ZPNG_Free(&compressed);
+            ZPNG_FreeCompressionContext(context);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Pack Functions
+
+// Packs from the image in `opaque`, as a device kernel would from memory the
+// library cannot read
+static int PackFromOpaque(void* opaque, const ZPNG_ImageData* imageData, unsigned firstRow, unsigned rows, void* packing)
+{
+    ZPNG_ImageData image = *(const ZPNG_ImageData*)opaque;
+    EXPECT(imageData->WidthPixels == image.WidthPixels && imageData->HeightPixels == image.HeightPixels);
+    return ZPNG_PackRows(&image, firstRow, rows, packing);
+}
+
+static int UnpackWithLibrary(void* opaque, const void* packing, unsigned firstRow, unsigned rows, const ZPNG_ImageData* imageData)
+{
+    (void)opaque;
+    return ZPNG_UnpackRows(packing, firstRow, rows, imageData);
+}
+
+static int FailPack(void* opaque, const ZPNG_ImageData* imageData, unsigned firstRow, unsigned rows, void* packing)
+{
+    (void)opaque;
+    (void)packing;
+    return firstRow + rows < imageData->HeightPixels;
+}
+
+static void CheckPackFunctions()
+{
+    ZPNG_DecompressionContext* unpackContext = ZPNG_AllocateDecompressionContext();
+    EXPECT(ZPNG_SetDecompressionUnpackFunction(unpackContext, UnpackWithLibrary, nullptr));
+
+    char name[128];
+    for (const TestFormat& format : kFormats)
+    {
+        snprintf(name, sizeof(name), "%s, pack function", format.Name);
+        CaseName = name;
+
+        TestImage test;
+        MakeImage(test, format, 0, 8);
+
+        // The library is given an image it must not read
+        ZPNG_ImageData device = test.Image;
+        device.Buffer.Data = (uint8_t*)(uintptr_t)16;
+
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, 16);
+        ZPNG_Buffer builtIn = ZPNG_Compress(&test.Image, context);
+        EXPECT(ZPNG_SetCompressionPackFunction(context, PackFromOpaque, &test.Image));
+        ZPNG_Buffer compressed = ZPNG_Compress(&device, context);
+        EXPECT(compressed.Data);
+        if (compressed.Data)
+        {
+            // With the same strip rows the reference matches the built-in filter
+            EXPECT(builtIn.Bytes == compressed.Bytes && memcmp(builtIn.Data, compressed.Data, builtIn.Bytes) == 0);
+            CheckDecodes(test.Image, compressed);
+
+            std::vector<uint8_t> pixels(test.Pixels.size());
+            ZPNG_ImageData frame;
+            memset(&frame, 0, sizeof(frame));
+            frame.Buffer.Data = pixels.data();
+            frame.Buffer.Bytes = pixels.size();
+            EXPECT(ZPNG_DecompressToBuffer(unpackContext, nullptr, compressed, &frame));
+            EXPECT(SamePixels(test.Image, frame));
+        }
+        ZPNG_Free(&compressed);
+
+        // A failing pack function fails the compression
+        EXPECT(ZPNG_SetCompressionPackFunction(context, FailPack, nullptr));
+        compressed = ZPNG_Compress(&device, context);
+        EXPECT(!compressed.Data);
+
+        // The unpack function rejects images with other filters
+        if (format.BytesPerChannel == 1 && format.PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT)
+        {
+            EXPECT(ZPNG_SetCompressionPackFunction(context, nullptr, nullptr));
+            ZPNG_SetCompressionFilter(context, ZPNG_FILTER_PAETH);
+            compressed = ZPNG_Compress(&test.Image, context);
+            std::vector<uint8_t> pixels(test.Pixels.size());
+            ZPNG_ImageData frame;
+            memset(&frame, 0, sizeof(frame));
+            frame.Buffer.Data = pixels.data();
+            frame.Buffer.Bytes = pixels.size();
+            EXPECT(!ZPNG_DecompressToBuffer(unpackContext, nullptr, compressed, &frame));
+            ZPNG_Free(&compressed);
+        }
+        ZPNG_Free(&builtIn);
+        ZPNG_FreeCompressionContext(context);
+    }
+    ZPNG_FreeDecompressionContext(unpackContext);
+}
+
+
+//------------------------------------------------------------------------------
+// Async Queues
+
+// Counts the successful completions of callback jobs, and frees their results
+static void CountDone(void* opaque, const ZPNG_AsyncResult* result)
+{
+    std::atomic<unsigned>* done = (std::atomic<unsigned>*)opaque;
+    if (result->Success && result->Compressed.Data) {
+        ++*done;
+    }
+    ZPNG_Buffer compressed = result->Compressed;
+    ZPNG_Free(&compressed);
+}
+
+static void CheckAsync()
+{
+    CaseName = "async";
+
+    std::vector<TestImage> tests(6);
+    std::vector<ZPNG_ImageData> images;
+    for (unsigned i = 0; i < tests.size(); ++i)
+    {
+        const TestFormat format = { "async", 40 + i * 30, 30 + i * 9, 1 + i % 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+        MakeImage(tests[i], format, 0, i);
+        images.push_back(tests[i].Image);
+    }
+
+    ZPNG_AsyncQueue* queue = ZPNG_CreateAsyncQueue(2, 3);
+    EXPECT(queue);
+    if (!queue) {
+        return;
+    }
+
+    // Submit each image once there is room, polling for the results
+    std::vector<ZPNG_Buffer> compressed(images.size());
+    unsigned polled = 0;
+    for (unsigned i = 0; i < images.size() || polled < images.size(); )
+    {
+        if (i < images.size() && ZPNG_CompressAsync(queue, &images[i], nullptr, (void*)(uintptr_t)i) != 0)
+        {
+            ++i;
+            continue;
+        }
+        ZPNG_AsyncResult result;
+        if (!ZPNG_PollAsync(queue, &result))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        EXPECT(result.Success);
+        compressed[(uintptr_t)result.Opaque] = result.Compressed;
+        ++polled;
+    }
+
+    // Results waiting to be polled hold their places, so poll to make room
+    polled = 0;
+    for (unsigned i = 0; i < images.size() || polled < images.size(); )
+    {
+        if (i < images.size() && ZPNG_DecompressAsync(queue, compressed[i], nullptr, (void*)(uintptr_t)i) != 0)
+        {
+            ++i;
+            continue;
+        }
+        ZPNG_AsyncResult result;
+        if (!ZPNG_PollAsync(queue, &result))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        EXPECT(result.Success && SamePixels(images[(uintptr_t)result.Opaque], result.Image));
+        ZPNG_Free(&result.Image.Buffer);
+        ++polled;
+    }
+    EXPECT(ZPNG_FlushAsyncQueue(queue));
+
+    // Callback jobs give back their places as they finish
+    std::atomic<unsigned> done(0);
+    for (unsigned i = 0; i < images.size(); )
+    {
+        if (ZPNG_CompressAsync(queue, &images[i], CountDone, &done) != 0) {
+            ++i;
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+    EXPECT(ZPNG_FlushAsyncQueue(queue));
+    EXPECT(done == images.size());
+
+    // A full queue refuses jobs without blocking, and freeing it frees the
+    // results that were never polled
+    unsigned queued = 0;
+    while (queued < 4 && ZPNG_CompressAsync(queue, &images[0], nullptr, nullptr) != 0) {
+        ++queued;
+    }
+    EXPECT(queued == 3);
+    EXPECT(ZPNG_FlushAsyncQueue(queue));
+    EXPECT(ZPNG_CompressAsync(queue, &images[0], nullptr, nullptr) == 0);
+
+    ZPNG_FreeAsyncQueue(queue);
+    for (ZPNG_Buffer& buffer : compressed) {
+        ZPNG_Free(&buffer);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Streams
+
+static void CheckStreams()
+{
+    std::vector<TestImage> frames;
+    MakeSequence(frames, 1);
+
+    const unsigned stripRows[] = { 0, 16 };
+    for (unsigned rows : stripRows)
+    {
+        for (unsigned delta = 0; delta < 2; ++delta)
+        {
+            CaseName = delta ? "delta stream" : "stream";
+
+            ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+            ZPNG_SetCompressionStripRows(context, rows);
+            ZPNG_SetCompressionWorkers(context, 2);
+            const ZPNG_ImageData* ref = delta ? &frames[0].Image : nullptr;
+
+            std::vector<uint8_t> stream;
+            EXPECT(ZPNG_CompressStream(ref, &frames[1].Image, WriteToVector, &stream, context));
+
+            // Pushed in pieces of growing size, with the top strips decoded
+            // before the last byte arrives
+            RowCollector collector;
+            collector.NextRow = 0;
+            collector.InOrder = true;
+            ZPNG_StreamDecoder* decoder = ZPNG_BeginDecodeStream(ref, CollectRows, &collector);
+            size_t offset = 0;
+            for (size_t piece = 1; offset < stream.size() - 1; piece = piece * 2 + 3)
+            {
+                const size_t bytes = stream.size() - 1 - offset < piece ? stream.size() - 1 - offset : piece;
+                EXPECT(ZPNG_PushStreamData(decoder, stream.data() + offset, bytes));
+                offset += bytes;
+            }
+            EXPECT(rows == 0 || collector.NextRow != 0);
+            EXPECT(ZPNG_PushStreamData(decoder, stream.data() + offset, 1));
+            EXPECT(ZPNG_EndDecodeStream(decoder));
+            EXPECT(SameRows(frames[1].Image, collector));
+
+            // A stream cut short fails at the end, bytes past the image fail
+            // the push, and so does a sink that stops
+            decoder = ZPNG_BeginDecodeStream(ref, CollectRows, &collector);
+            collector.NextRow = 0;
+            EXPECT(ZPNG_PushStreamData(decoder, stream.data(), stream.size() - 1));
+            EXPECT(!ZPNG_EndDecodeStream(decoder));
+            stream.push_back(0);
+            decoder = ZPNG_BeginDecodeStream(ref, CollectRows, &collector);
+            collector.NextRow = 0;
+            EXPECT(!ZPNG_PushStreamData(decoder, stream.data(), stream.size()));
+            EXPECT(!ZPNG_EndDecodeStream(decoder));
+            stream.pop_back();
+            decoder = ZPNG_BeginDecodeStream(ref, StopRows, nullptr);
+            EXPECT(!ZPNG_PushStreamData(decoder, stream.data(), stream.size()));
+            EXPECT(!ZPNG_EndDecodeStream(decoder));
+
+            ZPNG_FreeCompressionContext(context);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Non-Temporal Stores
+
+// Planes past the 32 MB threshold, with widths off the vector size, come
+// out the same with streaming stores as without
+static void CheckNonTemporal()
+{
+    static const TestFormat kHuge[] = {
+        { "huge RGB", 3401, 3300, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+        { "huge RGBA", 2901, 2900, 4, 1, ZPNG_PIXEL_FORMAT_DEFAULT },
+    };
+
+    for (const TestFormat& format : kHuge)
+    {
+        CaseName = format.Name;
+
+        TestImage test;
+        MakeImage(test, format, 0, 9);
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_Buffer cached = ZPNG_Compress(&test.Image, context);
+        EXPECT(ZPNG_SetCompressionNonTemporal(context, 1));
+        ZPNG_Buffer streamed = ZPNG_Compress(&test.Image, context);
+        EXPECT(streamed.Data && cached.Bytes == streamed.Bytes && memcmp(cached.Data, streamed.Data, cached.Bytes) == 0);
+
+        ZPNG_ImageData image = ZPNG_Decompress(streamed);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_Free(&streamed);
+        ZPNG_Free(&cached);
+        ZPNG_FreeCompressionContext(context);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Allocator
+
+static void* AllocateWithMalloc(void* opaque, size_t bytes)
+{
+    (void)opaque;
+    return malloc(bytes);
+}
+
+static void FreeWithMalloc(void* opaque, void* data)
+{
+    (void)opaque;
+    free(data);
+}
+
+// Buffers over 2 MB are mapped, and are freed from other threads while more
+// are allocated.  The allocator cannot change once buffers are out
+static void CheckAllocator()
+{
+    CaseName = "allocator";
+
+    const TestFormat format = { "allocator", 1024, 800, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    TestImage test;
+    MakeImage(test, format, 0, 10);
+
+    // Many buffers live at once, so they share slots
+    std::vector<ZPNG_Buffer> held(24);
+    for (ZPNG_Buffer& buffer : held)
+    {
+        buffer = ZPNG_Compress(&test.Image);
+        EXPECT(buffer.Data);
+    }
+
+    std::atomic<unsigned> passed(0);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([&test, &held, &passed, i]() {
+            for (unsigned j = i; j < held.size(); j += 4)
+            {
+                ZPNG_ImageData image = ZPNG_Decompress(held[j]);
+                const bool same = SamePixels(test.Image, image);
+                ZPNG_Free(&image.Buffer);
+                ZPNG_Free(&held[j]);
+                held[j] = ZPNG_Compress(&test.Image);
+                if (same && held[j].Data) {
+                    ++passed;
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT(passed == held.size());
+    for (ZPNG_Buffer& buffer : held) {
+        ZPNG_Free(&buffer);
+    }
+
+    EXPECT(!ZPNG_SetAllocator(AllocateWithMalloc, nullptr, nullptr));
+    EXPECT(!ZPNG_SetAllocator(AllocateWithMalloc, FreeWithMalloc, nullptr));
+    EXPECT(!ZPNG_SetAllocator(nullptr, nullptr, nullptr));
+}
+
+
+//------------------------------------------------------------------------------
+// Context Dictionaries
+
+// Decompress with `dict` and compare
+static bool DecodesWith(const ZPNG_Dictionary* dict, ZPNG_Buffer compressed, const ZPNG_ImageData& original)
+{
+    ZPNG_DecompressionContext* context = ZPNG_AllocateDecompressionContext();
+    ZPNG_SetDecompressionDictionary(context, dict);
+    ZPNG_ImageData image = ZPNG_DecompressWithContext(context, nullptr, compressed);
+    const bool same = SamePixels(original, image);
+    ZPNG_Free(&image.Buffer);
+    ZPNG_FreeDecompressionContext(context);
+    return same;
+}
+
+// A dictionary trained on a background thread is used once it is ready,
+// and images compressed before then need none
+static void CheckContextDictionaries()
+{
+    CaseName = "context dictionary";
+
+    std::vector<TestImage> samples;
+    std::vector<ZPNG_ImageData> images;
+    TestImage test;
+    MakeSamples(samples, images, test);
+
+    for (int background = 1; background >= 0; --background)
+    {
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, 16);
+        EXPECT(ZPNG_TrainCompressionDictionary(context, images.data(), (unsigned)images.size(), 16 * 1024, background));
+
+        // Whichever dictionary the image started with is recorded in it
+        ZPNG_Buffer during = ZPNG_Compress(&test.Image, context);
+        EXPECT(during.Data);
+        ZPNG_Dictionary* trained = nullptr;
+        if (ZPNG_GetImageDictionaryID(during) != 0)
+        {
+            trained = ZPNG_GetCompressionDictionary(context);
+            EXPECT(DecodesWith(trained, during, test.Image));
+            ZPNG_FreeDictionary(trained);
+        }
+        else {
+            EXPECT(DecodesWith(nullptr, during, test.Image));
+        }
+        ZPNG_Free(&during);
+
+        EXPECT(ZPNG_WaitCompressionDictionary(context));
+        trained = ZPNG_GetCompressionDictionary(context);
+        EXPECT(trained);
+        ZPNG_Buffer compressed = ZPNG_Compress(&test.Image, context);
+        EXPECT(ZPNG_GetImageDictionaryID(compressed) == ZPNG_GetDictionaryID(trained));
+        EXPECT(DecodesWith(trained, compressed, test.Image));
+        ZPNG_Free(&compressed);
+
+        // Removing it goes back to compressing without one
+        EXPECT(ZPNG_SetCompressionDictionary(context, nullptr));
+        EXPECT(!ZPNG_GetCompressionDictionary(context));
+        compressed = ZPNG_Compress(&test.Image, context);
+        EXPECT(ZPNG_GetImageDictionaryID(compressed) == 0);
+        EXPECT(DecodesWith(nullptr, compressed, test.Image));
+        ZPNG_Free(&compressed);
+
+        ZPNG_FreeDictionary(trained);
+        ZPNG_FreeCompressionContext(context);
+    }
+
+    // Freeing the context waits for training to finish
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    EXPECT(ZPNG_TrainCompressionDictionary(context, images.data(), (unsigned)images.size(), 16 * 1024, 1));
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Shared Dictionaries
+
+// Contexts keep their own references, so a dictionary outlives the caller's
+// reference and is shared by threads compressing at once
+static void CheckSharedDictionaries()
+{
+    CaseName = "shared dictionary";
+
+    std::vector<TestImage> samples;
+    std::vector<ZPNG_ImageData> images;
+    TestImage test;
+    MakeSamples(samples, images, test);
+
+    ZPNG_Dictionary* dict = ZPNG_TrainDictionary(images.data(), (unsigned)images.size(), 16 * 1024, nullptr);
+    EXPECT(dict);
+    if (!dict) {
+        return;
+    }
+    const unsigned id = ZPNG_GetDictionaryID(dict);
+    EXPECT(ZPNG_RetainDictionary(dict) == dict);
+    ZPNG_FreeDictionary(dict);
+
+    ZPNG_Context* contexts[3];
+    for (ZPNG_Context*& context : contexts)
+    {
+        context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, 16);
+        EXPECT(ZPNG_SetCompressionDictionary(context, dict));
+    }
+    ZPNG_DecompressionContext* decoder = ZPNG_AllocateDecompressionContext();
+    EXPECT(ZPNG_SetDecompressionDictionary(decoder, dict));
+    ZPNG_FreeDictionary(dict);
+
+    ZPNG_Buffer compressed[3];
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        threads.emplace_back([&test, &contexts, &compressed, i]() {
+            compressed[i] = ZPNG_Compress(&test.Image, contexts[i]);
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // Each context's reference is its own to release
+    ZPNG_FreeCompressionContext(contexts[0]);
+    ZPNG_FreeCompressionContext(contexts[1]);
+    for (ZPNG_Buffer& buffer : compressed)
+    {
+        EXPECT(ZPNG_GetImageDictionaryID(buffer) == id);
+        ZPNG_ImageData image = ZPNG_DecompressWithContext(decoder, nullptr, buffer);
+        EXPECT(SamePixels(test.Image, image));
+        ZPNG_Free(&image.Buffer);
+        ZPNG_Free(&buffer);
+    }
+
+    // The last context hands out a reference of its own
+    ZPNG_Dictionary* held = ZPNG_GetCompressionDictionary(contexts[2]);
+    EXPECT(held == dict);
+    ZPNG_FreeCompressionContext(contexts[2]);
+    ZPNG_FreeDecompressionContext(decoder);
+    EXPECT(ZPNG_GetDictionaryID(held) == id);
+    ZPNG_FreeDictionary(held);
+}
+
+
+//------------------------------------------------------------------------------
+// Motion Search
+
+// Compress each frame of a sequence against the one before it, and decode
+// it.  Returns the total bytes, or 0 if a frame fails to round-trip
+static size_t CompressSequence(const std::vector<TestImage>& frames, ZPNG_Context* context, std::vector<ZPNG_ImageInfo>& infos)
+{
+    size_t total = 0;
+    infos.resize(frames.size());
+    for (unsigned i = 1; i < frames.size(); ++i)
+    {
+        std::vector<uint8_t> out;
+        if (!CompressFrame(&frames[i - 1].Image, frames[i].Image, context, out)) {
+            return 0;
+        }
+        const ZPNG_Buffer buffer = { out.data(), out.size() };
+        ZPNG_ImageData image = ZPNG_DecompressVideo(&frames[i - 1].Image, buffer);
+        const bool same = SamePixels(frames[i].Image, image) && ZPNG_GetInfo(buffer, &infos[i]);
+        ZPNG_Free(&image.Buffer);
+        if (!same) {
+            return 0;
+        }
+        total += out.size();
+    }
+    return total;
+}
+
+// A pan keeps 16 pixel vectors on every delta frame and shrinks them, and
+// 16-bit images ignore the setting
+static void CheckMotionSearch()
+{
+    std::vector<TestImage> frames;
+    MakeSequence(frames, 3);
+
+    const unsigned stripRows[] = { 0, 16 };
+    for (unsigned rows : stripRows)
+    {
+        CaseName = rows ? "motion search, strips" : "motion search";
+
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, rows);
+        std::vector<ZPNG_ImageInfo> infos;
+        const size_t plain = CompressSequence(frames, context, infos);
+        EXPECT(ZPNG_SetCompressionMotionSearch(context, 1));
+        const size_t moved = CompressSequence(frames, context, infos);
+        EXPECT(plain != 0 && moved != 0 && moved < plain);
+        for (unsigned i = 1; i < infos.size(); ++i) {
+            EXPECT(!infos[i].IsIFrame && infos[i].MotionBlockPixels == 16);
+        }
+        ZPNG_FreeCompressionContext(context);
+    }
+
+    CaseName = "motion search, gray 16";
+    static const TestFormat kWide = { "gray 16", 128, 80, 1, 2, ZPNG_PIXEL_FORMAT_DEFAULT };
+    std::vector<TestImage> wide(2);
+    MakeImage(wide[0], kWide, 0, 7);
+    MakeImage(wide[1], kWide, 3, 7);
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_SetCompressionMotionSearch(context, 1);
+    std::vector<ZPNG_ImageInfo> infos;
+    EXPECT(CompressSequence(wide, context, infos) != 0);
+    EXPECT(infos[1].MotionBlockPixels == 0);
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// Skip Blocks
+
+// A still scene with a small square moving over it
+static void MakeMovingSquare(std::vector<TestImage>& frames)
+{
+    static const TestFormat kFrame = { "frame", 128, 80, 3, 1, ZPNG_PIXEL_FORMAT_DEFAULT };
+    frames.resize(6);
+    for (unsigned i = 0; i < frames.size(); ++i)
+    {
+        MakeImage(frames[i], kFrame, 0, 7);
+        for (unsigned y = 30; y < 50; ++y) {
+            memset(frames[i].Pixels.data() + ((size_t)y * kFrame.Width + 10 + i * 7) * 3, 250, 20 * 3);
+        }
+    }
+}
+
+// Unchanged blocks are left out of delta frames, with or without motion
+// vectors, and frames with too few of them keep the plain format
+static void CheckSkipBlocks()
+{
+    std::vector<TestImage> frames;
+    MakeMovingSquare(frames);
+
+    for (int motion = 0; motion < 2; ++motion)
+    {
+        CaseName = motion ? "skip blocks, motion" : "skip blocks";
+
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, 16);
+        ZPNG_SetCompressionMotionSearch(context, motion);
+        std::vector<ZPNG_ImageInfo> infos;
+        EXPECT(CompressSequence(frames, context, infos) != 0);
+        for (unsigned i = 1; i < infos.size(); ++i) {
+            EXPECT(infos[i].SkippedBlocks == 0);
+        }
+        EXPECT(ZPNG_SetCompressionSkipBlocks(context, 1));
+        EXPECT(CompressSequence(frames, context, infos) != 0);
+        for (unsigned i = 1; i < infos.size(); ++i) {
+            EXPECT(!infos[i].IsIFrame && infos[i].SkippedBlocks != 0);
+        }
+        ZPNG_FreeCompressionContext(context);
+    }
+
+    CaseName = "skip blocks, fresh noise";
+    std::vector<TestImage> noisy;
+    MakeSequence(noisy, 0);
+    ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+    ZPNG_SetCompressionSkipBlocks(context, 1);
+    std::vector<ZPNG_ImageInfo> infos;
+    EXPECT(CompressSequence(noisy, context, infos) != 0);
+    EXPECT(infos[1].SkippedBlocks == 0);
+    ZPNG_FreeCompressionContext(context);
+}
+
+
+//------------------------------------------------------------------------------
+// In-Place Decoding
+
+// Play sequences back over one frame buffer, with each kind of delta frame
+static void CheckInPlace()
+{
+    struct Mode
+    {
+        unsigned StripRows;
+        int Motion, Skip;
+        const char* Name;
+    };
+    static const Mode kModes[] = {
+        { 0, 0, 0, "in place" },
+        { 16, 0, 0, "in place, strips" },
+        { 16, 1, 0, "in place, motion" },
+        { 16, 0, 1, "in place, skip" },
+        { 32, 1, 1, "in place, motion skip" },
+    };
+
+    std::vector<TestImage> sequences[2];
+    MakeSequence(sequences[0], 3);
+    MakeMovingSquare(sequences[1]);
+
+    ZPNG_DecompressionContext* decompressor = ZPNG_AllocateDecompressionContext();
+    ZPNG_SetDecompressionWorkers(decompressor, 2);
+    for (const Mode& mode : kModes)
+    {
+        CaseName = mode.Name;
+
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        ZPNG_SetCompressionStripRows(context, mode.StripRows);
+        ZPNG_SetCompressionMotionSearch(context, mode.Motion);
+        ZPNG_SetCompressionSkipBlocks(context, mode.Skip);
+        for (const std::vector<TestImage>& frames : sequences)
+        {
+            std::vector<uint8_t> pixels(frames[0].Pixels.size());
+            ZPNG_ImageData playback;
+            memset(&playback, 0, sizeof(playback));
+            playback.Buffer.Data = pixels.data();
+            playback.Buffer.Bytes = pixels.size();
+
+            for (unsigned i = 0; i < frames.size(); ++i)
+            {
+                std::vector<uint8_t> out;
+                EXPECT(CompressFrame(i ? &frames[i - 1].Image : nullptr, frames[i].Image, context, out));
+                const ZPNG_Buffer buffer = { out.data(), out.size() };
+                EXPECT(ZPNG_DecompressInPlace(decompressor, buffer, &playback));
+                EXPECT(SamePixels(frames[i].Image, playback));
+            }
+        }
+        ZPNG_FreeCompressionContext(context);
+    }
+    ZPNG_FreeDecompressionContext(decompressor);
+
+    // An I-frame needs a buffer large enough for it, and a delta frame a
+    // reference of its own format
+    CaseName = "in place, mismatch";
+    const std::vector<TestImage>& frames = sequences[1];
+    std::vector<uint8_t> out;
+    EXPECT(CompressFrame(nullptr, frames[0].Image, nullptr, out));
+    ZPNG_Buffer buffer = { out.data(), out.size() };
+    std::vector<uint8_t> pixels(frames[0].Pixels.size());
+    ZPNG_ImageData playback;
+    memset(&playback, 0, sizeof(playback));
+    playback.Buffer.Data = pixels.data();
+    playback.Buffer.Bytes = pixels.size() - 1;
+    EXPECT(!ZPNG_DecompressInPlace(nullptr, buffer, &playback));
+
+    EXPECT(CompressFrame(&frames[0].Image, frames[1].Image, nullptr, out));
+    buffer.Data = out.data();
+    buffer.Bytes = out.size();
+    ZPNG_ImageInfo info;
+    EXPECT(ZPNG_GetInfo(buffer, &info) && !info.IsIFrame);
+    playback = frames[0].Image;
+    std::vector<uint8_t> copy(frames[0].Pixels);
+    playback.Buffer.Data = copy.data();
+    playback.Channels = 4;
+    playback.WidthPixels = frames[0].Image.WidthPixels * 3 / 4;
+    playback.StrideBytes = 0;
+    EXPECT(!ZPNG_DecompressInPlace(nullptr, buffer, &playback));
+}
+
+
+//------------------------------------------------------------------------------
+// Corrupt Input
+
+// Decode a damaged image every way, over `ref` for delta frames.  Returns
+// true if the whole-image decode succeeded
+static bool DecodeCorrupt(const ZPNG_ImageData& ref, ZPNG_Buffer buffer)
+{
+    ZPNG_ImageData image = ZPNG_DecompressVideo(&ref, buffer);
+    const bool decoded = image.Buffer.Data != nullptr;
+    ZPNG_Free(&image.Buffer);
+
+    ZPNG_ImageInfo info;
+    ZPNG_GetInfo(buffer, &info);
+    ZPNG_VerifyChecksum(buffer);
+    RowCollector rows;
+    rows.NextRow = 0;
+    rows.InOrder = true;
+    ZPNG_DecompressRows(Decoder, buffer, CollectRows, &rows);
+    image = ZPNG_DecompressRegion(buffer, 3, 2, 20, 10);
+    ZPNG_Free(&image.Buffer);
+    image = ZPNG_DecompressChannel(buffer, 1);
+    ZPNG_Free(&image.Buffer);
+    image = ZPNG_DecompressLevel(buffer, 1);
+    ZPNG_Free(&image.Buffer);
+
+    std::vector<uint8_t> pixels(ref.Buffer.Data, ref.Buffer.Data + ref.Buffer.Bytes);
+    ZPNG_ImageData frame = ref;
+    frame.Buffer.Data = pixels.data();
+    ZPNG_DecompressInPlace(Decoder, buffer, &frame);
+    return decoded;
+}
+
+// Truncated images never decode, and flipped bits anywhere must not crash
+// any of the decoders
+static void CheckCorruptInput()
+{
+    struct Mode
+    {
+        void (*Set)(ZPNG_Context* context);
+        bool Delta;
+        const char* Name;
+    };
+    static const Mode kModes[] = {
+        { SetDefault, false, "corrupt" },
+        { SetChecksum, false, "corrupt checksum" },
+        { SetPlaneLevels, false, "corrupt plane levels" },
+        { SetProgressive, false, "corrupt progressive" },
+        { SetEntropy, false, "corrupt entropy" },
+        { SetDefault, true, "corrupt delta" },
+        { SetStrips, true, "corrupt delta strips" },
+    };
+
+    std::vector<TestImage> frames;
+    MakeMovingSquare(frames);
+    const ZPNG_ImageData& ref = frames[0].Image;
+    const ZPNG_ImageData& image = frames[1].Image;
+
+    for (const Mode& mode : kModes)
+    {
+        CaseName = mode.Name;
+
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        mode.Set(context);
+        ZPNG_SetCompressionMotionSearch(context, 1);
+        ZPNG_SetCompressionSkipBlocks(context, 1);
+        std::vector<uint8_t> out;
+        EXPECT(CompressFrame(mode.Delta ? &ref : nullptr, image, context, out));
+        ZPNG_FreeCompressionContext(context);
+        std::vector<uint8_t> corrupt(out);
+        const ZPNG_Buffer buffer = { corrupt.data(), corrupt.size() };
+        EXPECT(DecodeCorrupt(ref, buffer));
+
+        for (size_t bytes = 0; bytes < out.size(); bytes += out.size() / 29 + 1)
+        {
+            const ZPNG_Buffer truncated = { corrupt.data(), bytes };
+            EXPECT(!DecodeCorrupt(ref, truncated));
+        }
+        const ZPNG_Buffer truncated = { corrupt.data(), out.size() - 1 };
+        EXPECT(!DecodeCorrupt(ref, truncated));
+
+        for (size_t i = 0; i < out.size(); i += out.size() / 97 + 1)
+        {
+            corrupt[i] ^= (uint8_t)(1 << (i % 8));
+            DecodeCorrupt(ref, buffer);
+            corrupt[i] = out[i];
+        }
+    }
+}
+
+
+int main()
+{
+    // Until the first buffer is allocated the allocator can be set
+    EXPECT(ZPNG_SetAllocator(nullptr, nullptr, nullptr));
+
+    Decoder = ZPNG_AllocateDecompressionContext();
+    ZPNG_SetDecompressionWorkers(Decoder, 3);
+
+    CheckStillImages();
+    CheckWorkers();
+    CheckParams();
+    CheckContextReuse();
+    CheckLargeImages();
+    CheckWidths();
+    CheckPixelFormats();
+    CheckWideImages();
+    CheckRowEncoder();
+    CheckDictionaries();
+    CheckDeltaFrames();
+    CheckVideoFiles();
+    CheckVideoEncoder();
+    CheckStats();
+    CheckSmallFrames();
+    CheckBatch();
+    CheckPalettes();
+    CheckConstantPlanes();
+    CheckPackFunctions();
+    CheckAsync();
+    CheckStreams();
+    CheckNonTemporal();
+    CheckAllocator();
+    CheckContextDictionaries();
+    CheckSharedDictionaries();
+    CheckMotionSearch();
+    CheckSkipBlocks();
+    CheckInPlace();
+    CheckCorruptInput();
+
+    ZPNG_FreeDecompressionContext(Decoder);
+
+    if (Failures != 0) {
+        printf("%u checks failed\n", Failures);
+        return 1;
+    }
+    printf("All round trips passed\n");
+    return 0;
+}
@@ -244,6 +244,7 @@ int main(/*int argc, char** argv*/)
         image.HeightPixels = y;
         image.WidthPixels = x;
         image.StrideBytes = x * image.Channels;
+        image.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
 
         t0 = GetTimeUsec();
 
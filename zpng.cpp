@@ -28,21 +28,160 @@
 */
 
 #define ZDICT_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY /* ZSTD_p_nbWorkers */
 
 #include "zpng.h"
 #include "zstd/zdict.h"
 #include "zstd/zstd.h"
+#include "zstd/zstd_errors.h"
+#include "zstd/huf.h"
+#include "zstd/pool.h"
+#include "zstd/threading.h"
+#include "zstd/cpu.h" // ZSTD_cpuid
+#define XXH_STATIC_LINKING_ONLY /* XXH64_state_t */
+#include "zstd/xxhash.h"
 
 #include <stdlib.h> // calloc
 #include <string.h> // memset
 #include <stdio.h>
+#include <limits.h> // UINT_MAX
+#include <math.h> // log2
+#include <thread> // hardware_concurrency
+#include <atomic>
+#include <chrono> // steady_clock
+
+#if defined(_WIN32)
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h> // VirtualAlloc
+#elif defined(__linux__)
+    #include <sys/mman.h> // mmap
+#endif
+
+// SSSE3 kernels are built on x86 unless ZPNG_DISABLE_SIMD is defined,
+// and only used if the CPU supports them
+#if !defined(ZPNG_DISABLE_SIMD) && \
+    (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+    #define ZPNG_ENABLE_SSSE3
+    #if defined(_MSC_VER)
+        #define ZPNG_TARGET_SSSE3
+    #else
+        #define ZPNG_TARGET_SSSE3 __attribute__((target("ssse3")))
+    #endif
+    #include <tmmintrin.h> // SSSE3
+#endif
 
 //------------------------------------------------------------------------------
 // Constants
 
-// Higher compression levels do not gain much but hurt speed
+// Default level: Higher compression levels do not gain much but hurt speed
 static const int kCompressionLevel = 1;
 
+// Default window for long-distance matching, as chosen by Zstd
+static const unsigned kLongDistanceWindowLog = 27;
+
+// Space kept after the packed bytes of every strip or frame, which also
+// covers the extra bytes that ZSTD_compressBound() allows per plane
+static const unsigned kMinOverflowBytes = 1000;
+
+// Video frames sample every this many rows to choose between delta and intra
+static const unsigned kVideoSampleRowStep = 16;
+
+// Sampled cost of an escaped delta on top of its residual: The byte is
+// stored again after the deltas, about as costly as the largest residual
+static const unsigned kVideoEscapeCost = 128;
+
+// Motion search for delta frames: Block size and the largest vector
+// component in pixels.  A vector other than zero must lower the luma SAD of
+// its block by more than 1/kMotionBias per pixel to be used
+static const unsigned kMotionBlockPixels = 16;
+static const int kMotionRange = 16;
+static const unsigned kMotionBias = 8;
+
+// Delta frames get a skip map if at least 1/kSkipMinShare of their blocks
+// are the same as the reference
+static const unsigned kSkipMinShare = 8;
+
+// ZPNG_CreateVideoEncoder() defaults and limits
+static const unsigned kVideoReferences = 3;
+static const unsigned kMaxVideoReferences = 16;
+static const unsigned kVideoQueueFrames = 4;
+
+// ZPNG_CreateVideoDecoder() default ring, which holds a GOP per thread up
+// to this many frames each
+static const unsigned kVideoDecodeFramesPerThread = 32;
+
+// ZPNG_CreateAsyncQueue() default jobs per thread
+static const unsigned kAsyncJobsPerThread = 2;
+
+// ZPNG_FILTER_ADAPTIVE compresses up to this many bands of rows spread
+// across the image with each predictor
+static const unsigned kFilterSampleBands = 8;
+static const unsigned kFilterBandRows = 16;
+
+// ZPNG_COLOR_AUTO measures the transforms on every 16th row, and needs one
+// to save this much log2 mean square summed over the planes to move off
+// GB-RG
+static const unsigned kColorSampleRowStep = 16;
+static const double kColorTransformMargin = 0.15;
+
+// Smallest strip height for the strip format, keeps the offset table small
+static const unsigned kMinStripRows = 16;
+
+// ZPNG_BACKEND_AUTO splits larger images into strips of about this many
+// packed bytes unless strip rows were set, so the backend can follow the
+// content.  Zstd is much slower per byte on smaller frames of some content
+static const size_t kAutoBackendStripBytes = 1024 * 1024;
+
+// ZPNG_BACKEND_AUTO samples this many bands of bytes spread across each
+// strip or plane, and counts bytes in runs of at least kBackendMinRun
+static const unsigned kBackendProbeBands = 16;
+static const unsigned kBackendProbeBandBytes = 256;
+static const unsigned kBackendMinRun = 4;
+
+// Plane frames: One Zstd frame per color plane of a strip, for RGBA at most
+static const unsigned kMaxFramesPerStrip = 4;
+
+// Palette images have at most this many colors, found with a hash table of
+// 2^kPaletteHashBits slots
+static const unsigned kMaxPaletteColors = 256;
+static const unsigned kPaletteHashBits = 10;
+
+// Packed bytes per chunk for the streaming paths, sized to stay in L2 cache
+static const size_t kStreamChunkBytes = 128 * 1024;
+
+// Smaller images are filtered and compressed in one pass each
+static const size_t kStreamMinBytes = 1024 * 1024;
+
+// Most compression workers, as ZSTDMT caps its workers here
+static const unsigned kMaxWorkers = 200;
+
+// Frames up to this size, such as 256x256 RGBA thumbnails, are compressed
+// on a context that keeps its parameters between calls
+static const size_t kSmallFrameBytes = 256 * 1024;
+
+// Default strip size for ZPNG_BeginEncode()
+static const size_t kEncoderStripBytes = 1024 * 1024;
+
+// Size of dictionaries trained from the first frame
+static const size_t kDictionaryBytes = 100000;
+
+// Most reduced levels of a progressive image, down to 1/256 scale
+static const unsigned kMaxProgressiveLevels = 8;
+
+// Planar images with at least this many bytes can be packed with streaming
+// stores (see ZPNG_SetCompressionNonTemporal()), as their planes would be
+// out of the last level cache by the time Zstd reads them anyway
+static const size_t kNonTemporalMinBytes = 32 * 1024 * 1024;
+
+// The default allocator maps buffers of at least this many bytes from the OS
+// with huge pages, which are 2 MB on x86
+static const size_t kLargePageBytes = 2 * 1024 * 1024;
+
 // This enabled some specialized versions for RGB and RGBA
 #define ENABLE_RGB_COLOR_FILTER
 #define ENABLE_BAYER_FILTER
@@ -62,912 +201,12427 @@ struct ZPNG_Header
     uint8_t BytesPerChannel;
 };
 
-#pragma clang optimize off
+// Strip format: The image is split into horizontal strips that are each
+// filtered and compressed as an independent Zstd frame.
+#define ZPNG_STRIP_HEADER_MAGIC 0xFBF9
+#define ZPNG_STRIP_HEADER_VERSION 2
+
+// Strip header flags
+#define ZPNG_STRIP_FLAG_VIDEO 1 /* Strips are delta encoded against refData */
+#define ZPNG_STRIP_FLAG_PLANES16 2 /* Intra strips use the 16-bit filter */
+#define ZPNG_STRIP_FLAG_CHECKSUM 4 /* XXH64 follows the offset table */
+#define ZPNG_STRIP_FLAG_PLANE_FRAMES 8 /* Each color plane of a strip is its own frame */
+#define ZPNG_STRIP_FLAG_DICTIONARY 16 /* Frames use the dictionary named after the offsets */
+#define ZPNG_STRIP_FLAG_ENTROPY 32 /* Some frames are entropy frames instead of Zstd */
+#define ZPNG_STRIP_FLAG_PALETTE 64 /* Strips hold indices into the palette after the offsets */
+#define ZPNG_STRIP_FLAG_CONSTANT_PLANES 128 /* Strips leave out the channels the plane map fills in */
+#define ZPNG_STRIP_FLAGS_KNOWN (ZPNG_STRIP_FLAG_VIDEO | ZPNG_STRIP_FLAG_PLANES16 | \
+    ZPNG_STRIP_FLAG_CHECKSUM | ZPNG_STRIP_FLAG_PLANE_FRAMES | ZPNG_STRIP_FLAG_DICTIONARY | \
+    ZPNG_STRIP_FLAG_ENTROPY | ZPNG_STRIP_FLAG_PALETTE | ZPNG_STRIP_FLAG_CONSTANT_PLANES)
+
+// Strip format header.
+// Followed by StripCount + 1 uint64_t offsets from the start of the buffer:
+// Strip i occupies bytes [Offset[i], Offset[i + 1]).
+// With ZPNG_STRIP_FLAG_PLANE_FRAMES there are StripCount * Channels + 1
+// offsets instead, and frame i * Channels + p holds plane p of strip i.
+// With ZPNG_STRIP_FLAG_PALETTE the offsets are followed by a uint32_t color
+// count and the colors of Channels bytes each, and the strips hold the
+// index of each pixel's color in 1, 2, 4 or 8 bits, first pixel in the high
+// bits, with each row starting on a new byte.
+// With ZPNG_STRIP_FLAG_CONSTANT_PLANES they are then followed by a plane
+// map of 2 bytes per channel: 0 if the channel is stored, or 1 and its
+// value if it is constant, or 2 and the stored channel it is a copy of.
+// The strips then hold an image of just the stored channels.
+// With ZPNG_STRIP_FLAG_DICTIONARY these are followed by a uint64_t
+// holding the Zstd dictionary ID (see ZPNG_GetDictionaryID()).
+// With motion, delta frames then have a ZPNG_BlockMapHeader and its stored
+// vectors, and with skipped blocks another one and the stored skip map.
+// With ZPNG_STRIP_FLAG_CHECKSUM these are then followed by a uint64_t XXH64
+// of all that precedes it and the strips, with seed 0.
+// The high 4 bits of Filter hold the ZPNG_ColorTransform of the planes of
+// 8-bit RGB and RGBA I-frames, or of three or four stored channels.  For
+// delta frames they hold kVideoMotion if the frame has motion vectors and
+// kVideoSkip if it has skipped blocks.
+// Decoders from before it reject these as an unknown filter.
+// This is also the header for images that do not fit ZPNG_Header.
+struct ZPNG_StripHeader
+{
+    uint16_t Magic;
+    uint8_t Version;
+    uint8_t Flags;
+    uint32_t Width;
+    uint32_t Height;
+    uint8_t Channels;
+    uint8_t BytesPerChannel;
+    uint8_t PixelFormat; // ZPNG_PixelFormat code, see GetPixelFormatCode()
+    uint8_t Filter; // ZPNG_Filter of the intra strips | ZPNG_ColorTransform << 4
+    uint32_t StripRows;
+    uint32_t StripCount;
+};
 
-ZPNG_Context* ZPNG_AllocateCompressionContext()
+// Motion and skip sections of a delta frame, over square blocks of
+// BlockPixels in raster order.  Each is followed by StoredBytes holding its
+// map as a Zstd frame, or raw if StoredBytes is the raw size.
+// The motion map holds a signed byte dx and dy for each block.  Rows of the
+// block at (bx, by) are predicted from the reference at (x + dx, y + dy),
+// clamped to the image.
+// The skip map holds a bit per block, low bit first, set if the block is
+// the same as its prediction.  The strips leave out the pixels of skipped
+// blocks, and hold those of the other blocks of their rows in order.
+struct ZPNG_BlockMapHeader
 {
-    return (ZPNG_Context*)ZSTD_createCCtx();
-}
+    uint32_t BlockPixels;
+    uint32_t StoredBytes;
+};
 
-void ZPNG_FreeCompressionContext(ZPNG_Context* context)
+// Stream format, from ZPNG_CompressStream(): A ZPNG_StripHeader with this
+// magic and no checksum, then the palette, plane map and dictionary ID as in
+// the strip format, but no offset table.  Each frame follows in order as a
+// uint64_t size and that many bytes, so a strip can be decoded as soon as
+// its frames have arrived.
+#define ZPNG_STREAM_HEADER_MAGIC 0xFBFB
+
+// Entropy frame: Filtered bytes Huffman coded without match search, for
+// ZPNG_BACKEND_ENTROPY.  A ZPNG_EntropyFrameHeader, then blocks of up to
+// HUF_BLOCKSIZE_MAX bytes, which restart at each plane so every plane gets
+// its own tables.  Each block is a uint32_t stored size followed by that
+// many bytes of HUF_compress() output: raw bytes if it equals the block
+// size, and one repeated byte if it is 1.
+#define ZPNG_ENTROPY_FRAME_MAGIC 0x4E45505A /* "ZPEN" */
+
+struct ZPNG_EntropyFrameHeader
 {
-    ZSTD_freeCCtx((ZSTD_CCtx*)context);
-}
+    uint32_t Magic;
+    uint32_t Reserved;
+    uint64_t ContentBytes;
 
-void ZPNG_FreeDictionary(ZPNG_Dictionary* dict)
+    // Bytes per plane: ContentBytes for interleaved data
+    uint64_t PlaneBytes;
+};
+
+// Progressive format: The image is split into parts that each hold a
+// subsampled grid of cells, where a cell is a pixel, or a 2x2 quad of Bayer
+// images so the mosaic is kept.  Level n of the image has every 2^n-th cell
+// in each direction.  Part 0 holds level Levels, then each level down to
+// full resolution adds three parts with the cells the level above lacks:
+// those in odd columns, odd rows, and both.
+#define ZPNG_PROGRESSIVE_HEADER_MAGIC 0xFBFA
+#define ZPNG_PROGRESSIVE_HEADER_VERSION 1
+
+// Progressive format header.
+// Followed by 3 * Levels + 2 uint64_t offsets from the start of the buffer:
+// Part i occupies bytes [Offset[i], Offset[i + 1]).  Each part is an I-frame
+// in one of the formats above, or empty if it holds no cells.
+struct ZPNG_ProgressiveHeader
 {
-    ZSTD_freeCDict((ZSTD_CDict*)dict);
-}
+    uint16_t Magic;
+    uint8_t Version;
+    uint8_t Levels;
+    uint32_t Width;
+    uint32_t Height;
+    uint8_t Channels;
+    uint8_t BytesPerChannel;
+    uint8_t PixelFormat; // ZPNG_PixelFormat code, see GetPixelFormatCode()
+    uint8_t Reserved;
+};
 
-//------------------------------------------------------------------------------
-// Image Processing
+// Video file format (.zpngv): A ZPNG_VideoFileHeader, the compressed frames
+// back to back, then FrameCount ZPNG_VideoFrameEntry records at TableOffset.
+// The table is written after the frames so they can be streamed out, and
+// the header is written last so an unfinished file never opens.
+#define ZPNG_VIDEO_FILE_MAGIC 0x564E505A /* "ZPNV" */
+#define ZPNG_VIDEO_FILE_VERSION 1
 
-// Interleaving is a 1% compression win, and a 0.3% performance win: Not used.
-// Splitting the data into blocks of 4 at a time actually reduces compression.
+// Frame entry flags
+#define ZPNG_VIDEO_FRAME_KEY 1 /* I-frame, decodes without a reference */
 
-template<int kChannels>
-static void PackAndFilter(
-    const ZPNG_ImageData* imageData,
-    uint8_t* output
-)
+struct ZPNG_VideoFileHeader
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t Flags;
+    uint32_t FrameCount;
 
-    const uint8_t* input = imageData->Buffer.Data;
+    // Size of each frame entry, so later versions can append fields
+    uint32_t EntryBytes;
 
-    for (unsigned y = 0; y < height; ++y)
-    {
-        uint8_t prev[kChannels] = { 0 };
+    uint64_t TableOffset;
+};
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            // For each channel:
-            for (unsigned i = 0; i < kChannels; ++i)
-            {
-                uint8_t a = input[i];
-                uint8_t d = a - prev[i];
-                output[i] = d;
-                prev[i] = a;
-            }
+struct ZPNG_VideoFrameEntry
+{
+    // Location of the compressed frame in the file
+    uint64_t Offset;
+    uint64_t Bytes;
 
-            input += kChannels;
-            output += kChannels;
-        }
-    }
-}
+    // Caller-defined presentation time, non-decreasing
+    int64_t Timestamp;
 
-template<int kChannels>
-static void UnpackAndUnfilter(
-    const uint8_t* input,
-    ZPNG_ImageData* imageData
-)
+    // Frame this one is delta encoded against, and the I-frame that starts
+    // its chain of references.  Both are the frame itself for I-frames
+    uint32_t RefFrame;
+    uint32_t KeyFrame;
+
+    uint32_t Flags;
+    uint32_t Reserved;
+};
+
+// Stages timed for ZPNG_Stats
+enum ZPNG_StatsStage
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    ZPNG_STAGE_DECIDE,
+    ZPNG_STAGE_FILTER,
+    ZPNG_STAGE_ZSTD,
+    ZPNG_STAGE_DICTIONARY,
 
-    uint8_t* output = imageData->Buffer.Data;
+    ZPNG_STAGE_COUNT
+};
 
-    for (unsigned y = 0; y < height; ++y)
-    {
-        uint8_t prev[kChannels] = { 0 };
+// Collects ZPNG_Stats during one call.  Strip workers add to it concurrently
+struct ZPNG_StatsCollector
+{
+    ZPNG_Stats* Stats;
+    uint64_t StartNsec;
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            // For each channel:
-            for (unsigned i = 0; i < kChannels; ++i)
-            {
-                uint8_t d = input[i];
-                uint8_t a = d + prev[i];
-                output[i] = a;
-                prev[i] = a;
-            }
+    std::atomic<uint64_t> StageNsec[ZPNG_STAGE_COUNT];
+    std::atomic<uint64_t> OverflowCount;
+    std::atomic<unsigned> Allocations;
+};
 
-            input += kChannels;
-            output += kChannels;
-        }
-    }
-}
+// Destination of ZPNG_CompressStream(), which gets each frame as soon as it
+// and all the frames before it are compressed
+struct ZPNG_StreamWriter
+{
+    ZPNG_WriteFunction Write;
+    void* Opaque;
 
-#ifdef ENABLE_BAYER_FILTER
+    // Bytes written so far
+    uint64_t Offset;
 
-// This should work well for RGGB and BGGR
-static void PackAndFilterXGGY(
-    const ZPNG_ImageData* imageData,
-    uint8_t* output
-)
+    // Held while writing, so frames go out one at a time and in order
+    ZSTD_pthread_mutex_t Lock;
+
+    // Per frame: Set once it is compressed.  Frames before Next are written
+    bool* Done;
+    unsigned Next;
+
+    bool Failed;
+};
+
+// Dictionary behind the opaque ZPNG_Dictionary pointer.
+// It is read-only once created, with both directions prepared up front,
+// so any number of threads can use it.  It is freed with its last reference
+struct ZPNG_DictionaryState
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    // Serialized Zstd dictionary, which the CDict and DDict reference
+    uint8_t* Data;
+    size_t Bytes;
 
-    const uint8_t* input = imageData->Buffer.Data;
+    // Callers and contexts holding the dictionary
+    std::atomic<unsigned> References;
 
-    // Color plane split
-    const unsigned planeBytes = width * height / 4;
-    uint8_t* output_r = output;
-    uint8_t* output_b = output + planeBytes;
-    uint8_t* output_g = output + planeBytes * 2;
+    // ZDICT_getDictID() of the data, 0 for raw content
+    unsigned Id;
 
-    for (unsigned row = 0; row < height; row += 2)
-    {
-        uint8_t prev[2] = { 0, 0 };
+    ZSTD_CDict* CDict;
+    ZSTD_DDict* DDict;
+};
 
-        // even
-        for (unsigned x = 0; x < width; x += 2)
-        {
-            uint8_t r = input[0];
-            uint8_t g = input[1];
+// Compression context behind the opaque ZPNG_Context pointer
+struct ZPNG_CompressionContext
+{
+    ZSTD_CCtx* CCtx;
 
-            r -= prev[0];
-            g -= prev[1];
+    // Number of worker threads.  0 or 1 compresses on the calling thread
+    unsigned Workers;
 
-            prev[0] = input[0];
-            prev[1] = input[1];
+    // Rows per strip for the strip format.  0 selects the single-frame format
+    unsigned StripRows;
 
-            *output_r++ = r;
-            *output_g++ = g;
+    // Append an XXH64 of the compressed data
+    bool Checksum;
 
-            input += 2;
-        }
+    // Zstd settings, all zero for the defaults
+    ZPNG_CompressionParams Params;
 
-        prev[0] = prev[1] = 0;
+    // ZPNG_Filter for I-frames
+    unsigned Filter;
 
-        // odd
-        for (unsigned x = 0; x < width; x += 2)
-        {
-            uint8_t g = input[0];
-            uint8_t b = input[1];
+    // ZPNG_ColorTransform for the color planes of I-frames
+    unsigned ColorTransform;
 
-            g -= prev[0];
-            b -= prev[1];
+    // Compress each color plane of RGB/RGBA I-frames as its own Zstd frame
+    bool PlaneFrames;
 
-            prev[0] = input[0];
-            prev[1] = input[1];
+    // Per Y, U, V, A plane: Level for plane frames, 0 for the Params level
+    int PlaneLevels[kMaxFramesPerStrip];
 
-            *output_b++ = b;
-            *output_g++ = g;
+    // Reduced levels of the progressive format for I-frames, 0 for none
+    unsigned ProgressiveLevels;
 
-            input += 2;
-        }
-    }
-}
+    // ZPNG_Backend for I-frames
+    unsigned Backend;
 
-static void UnpackAndUnfilterXGGY(
-    const uint8_t* input,
-    ZPNG_ImageData* imageData
-)
+    // Store I-frames with few enough colors as palette indices
+    bool Palette;
+
+    // Leave constant and duplicate channels of I-frames out of the frames
+    bool ConstantPlanes;
+
+    // Pack large planar single-frame images with streaming stores
+    bool NonTemporal;
+
+    // Search block motion against the reference of delta frames
+    bool MotionSearch;
+
+    // Leave blocks that match the reference out of delta frames
+    bool SkipBlocks;
+
+    // Filters I-frame strips in place of PackImage() if set, so the pixels
+    // are never read here
+    ZPNG_PackFunction PackFunction;
+    void* PackOpaque;
+
+    // Thread pool with Workers - 1 threads, created on first use
+    POOL_ctx* Pool;
+
+    // Extra Zstd contexts for strip workers 1..Workers-1, created on first use
+    ZSTD_CCtx** WorkerCCtx;
+
+    // Zstd context for small frames, created on first use.  Its parameters
+    // are set once and kept until SmallParamsSet is cleared
+    ZSTD_CCtx* SmallCCtx;
+    bool SmallParamsSet;
+
+    // Packing space reused between frames, grown as needed
+    uint8_t* Scratch;
+    size_t ScratchBytes;
+
+    // Luma planes and motion vectors of the frame being compressed, kept
+    // apart from Scratch so the strip encoder can use that
+    uint8_t* MotionScratch;
+    size_t MotionScratchBytes;
+
+    // Skip map of the frame being compressed
+    uint8_t* SkipScratch;
+    size_t SkipScratchBytes;
+
+    // Filled in by each call if set
+    ZPNG_Stats* Stats;
+
+    // Collector for the call in progress, or null if stats are disabled
+    ZPNG_StatsCollector* Collector;
+
+    // Stream for the ZPNG_CompressStream() call in progress, or null
+    ZPNG_StreamWriter* Stream;
+
+    // Reference to the dictionary for calls that pass none, or null.
+    // Each call takes its own reference under DictionaryLock, so the
+    // dictionary can be swapped from another thread between images
+    ZPNG_DictionaryState* Dictionary;
+    ZSTD_pthread_mutex_t DictionaryLock;
+
+    // Single thread for background training, created on first use.
+    // Training is set under DictionaryLock while a job is queued or running
+    POOL_ctx* TrainPool;
+    ZSTD_pthread_cond_t TrainDone;
+    bool Training;
+};
+
+// Decompression state behind the opaque ZPNG_DecompressionContext pointer.
+// ZPNG_Decompress() uses a temporary one for each call.
+struct ZPNG_DecompressionState
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    // Dictionary for frames compressed with one, or null.  The state holds
+    // a reference to it, which is released when it is replaced or freed
+    const ZPNG_DictionaryState* Dictionary;
 
-    uint8_t* output = imageData->Buffer.Data;
+    // Number of worker threads for the strip format
+    unsigned Workers;
 
-    // Color plane split
-    const unsigned planeBytes = width * height / 4;
-    const uint8_t* input_r = input;
-    const uint8_t* input_b = input + planeBytes;
-    const uint8_t* input_g = input + planeBytes * 2;
+    // Thread pool with Workers - 1 threads, created on first use
+    POOL_ctx* Pool;
 
-    for (unsigned y = 0; y < height; y += 2)
-    {
-        uint8_t prev[2] = { 0, 0 };
+    // One Zstd context per worker, created on first use
+    ZSTD_DCtx** DCtx;
 
-        // even
-        for (unsigned x = 0; x < width; x += 2)
-        {
-            uint8_t r = *input_r++;
-            uint8_t g = *input_g++;
+    // Packing space reused between frames, grown as needed
+    uint8_t* Scratch;
+    size_t ScratchBytes;
 
-            // GB-RG filter from BCIF
-            //r += g;
+    // Unfilters strips in place of UnpackImage() if set, so the output is
+    // never written here
+    ZPNG_UnpackFunction UnpackFunction;
+    void* UnpackOpaque;
 
-            r += prev[0];
-            g += prev[1];
+    // Filled in by each call if set
+    ZPNG_Stats* Stats;
 
-            output[0] = r;
-            output[1] = g;
+    // Collector for the call in progress, or null if stats are disabled
+    ZPNG_StatsCollector* Collector;
+};
 
-            prev[0] = r;
-            prev[1] = g;
+//------------------------------------------------------------------------------
+// Allocator
 
-            output += 2;
-        }
+// Buffers DefaultAllocate() mapped from the OS, each in one of a few slots
+// picked by its address.  Anything else it frees came from malloc(),
+// including buffers callers preallocated and gave to ZPNG_Free()
+struct ZPNG_MappedSlot
+{
+    std::atomic<void*> Data;
+    size_t Bytes;
+};
 
-        prev[0] = prev[1] = 0;
+// Mapped buffers are at least 2 MB, so this holds 1 GB or more of them, and
+// buffers with no free slot come from malloc() instead
+static const unsigned kMappedSlots = 512;
+static const unsigned kMappedProbes = 8;
 
-        // odd
-        for (unsigned x = 0; x < width; x += 2)
-        {
-            uint8_t g = *input_g++;
-            uint8_t b = *input_b++;
+// Mapped buffers start on this boundary, and few malloc() buffers do
+#if defined(_WIN32)
+static const uintptr_t kMappedAlignBytes = 64 * 1024;
+#else
+static const uintptr_t kMappedAlignBytes = kLargePageBytes;
+#endif
 
-            // GB-RG filter from BCIF
-            //b += g;
+// Data of a slot being filled in, which no mapped buffer matches
+static void* const kMappedReserved = (void*)(uintptr_t)1;
 
-            g += prev[0];
-            b += prev[1];
+static ZPNG_MappedSlot m_MappedSlots[kMappedSlots];
 
-            output[0] = g;
-            output[1] = b;
+// First of the kMappedProbes slots a buffer can be in
+static inline unsigned GetMappedSlot(const void* data)
+{
+    const uint64_t page = (uint64_t)((uintptr_t)data / kMappedAlignBytes);
+    return (unsigned)((page * 0x9E3779B97F4A7C15ull) >> 32) % kMappedSlots;
+}
 
-            prev[0] = g;
-            prev[1] = b;
+#if defined(_WIN32)
+// Cleared once large pages fail, as they need the lock memory privilege
+static std::atomic<bool> m_LargePages(true);
+#endif
 
-            output += 2;
+// Returns `bytes` mapped from the OS, or null if it is not supported
+static void* MapBuffer(size_t bytes, size_t& mapped)
+{
+    void* data = nullptr;
+#if defined(_WIN32)
+    const size_t largePage = GetLargePageMinimum();
+    if (largePage > 0 && m_LargePages)
+    {
+        mapped = (bytes + largePage - 1) / largePage * largePage;
+        data = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (!data) {
+            m_LargePages = false;
         }
     }
-}
+    if (!data)
+    {
+        mapped = bytes;
+        data = VirtualAlloc(nullptr, mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+#elif defined(__linux__)
+    // Map an extra huge page and trim the ends, so the buffer starts on a
+    // huge page boundary and every 2 MB of it can use one
+    static const size_t kPageBytes = 4096;
+    mapped = (bytes + kPageBytes - 1) & ~(kPageBytes - 1);
+    void* map = mmap(nullptr, mapped + kLargePageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED)
+    {
+        uint8_t* start = (uint8_t*)map;
+        uint8_t* aligned = (uint8_t*)(((uintptr_t)start + kLargePageBytes - 1) & ~(uintptr_t)(kLargePageBytes - 1));
+        if (aligned != start) {
+            munmap(start, (size_t)(aligned - start));
+        }
+        munmap(aligned + mapped, (size_t)(start + kLargePageBytes - aligned));
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, mapped, MADV_HUGEPAGE);
+#endif
+        data = aligned;
+    }
+#else
+    (void)bytes;
+    (void)mapped;
 #endif
+    return data;
+}
 
-// returns the number of overflow bytes
-template<int kChannels>
-static int PackAndFilterVideo(
-    const ZPNG_ImageData* refData,
-    const ZPNG_ImageData* imageData,
-    uint8_t* output
-)
+static void UnmapBuffer(void* data, size_t mapped)
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+#if defined(_WIN32)
+    (void)mapped;
+    VirtualFree(data, 0, MEM_RELEASE);
+#elif defined(__linux__)
+    munmap(data, mapped);
+#else
+    (void)data;
+    (void)mapped;
+#endif
+}
 
-    const uint8_t* input = imageData->Buffer.Data;
-    const uint8_t* ref = refData->Buffer.Data;
+static void* DefaultAllocate(void* opaque, size_t bytes)
+{
+    (void)opaque;
+    if (bytes < kLargePageBytes || bytes > SIZE_MAX - kLargePageBytes) {
+        return malloc(bytes);
+    }
 
-    uint8_t* outStart = output;
-    unsigned overflowCount = 0;
-    uint8_t* overflow = output + height * width * kChannels;
+    // Pages are not touched here, so each is placed on the NUMA node of the
+    // thread that first writes it
+    size_t mapped = 0;
+    void* data = MapBuffer(bytes, mapped);
+    if (!data) {
+        return malloc(bytes);
+    }
 
-    for (unsigned y = 0; y < height; ++y)
+    // Claim a free slot for it, or fall back to malloc() if they are all taken
+    const unsigned first = GetMappedSlot(data);
+    for (unsigned i = 0; i < kMappedProbes; ++i)
     {
-        for (unsigned x = 0; x < width; ++x)
+        ZPNG_MappedSlot& slot = m_MappedSlots[(first + i) % kMappedSlots];
+        void* expected = nullptr;
+        if (slot.Data.compare_exchange_strong(expected, kMappedReserved, std::memory_order_acquire))
         {
-            // For each channel:
-            for (unsigned i = 0; i < kChannels; ++i)
-            {
-                int diff = (int)input[i] - ref[i];
-                if (diff > 127 || diff < -127) {
-                    if (overflowCount == 1000) {
-                        PackAndFilterXGGY(imageData, outStart);
-                        return -1;
-                    }
-                    output[i] = 0x80;
-                    *overflow = input[i];
-                    ++overflow;
-                    ++overflowCount;
-                } else
-                    output[i] = (int8_t)diff;
-            }
-
-            ref += kChannels;
-            input += kChannels;
-            output += kChannels;
+            slot.Bytes = mapped;
+            slot.Data.store(data, std::memory_order_release);
+            return data;
         }
     }
 
-    if (overflowCount != 0)
-        printf("overflow: %d\n", overflowCount);
-
-    return overflowCount;
+    UnmapBuffer(data, mapped);
+    return malloc(bytes);
 }
 
-template<int kChannels>
-static void UnpackAndUnfilterVideo(
-    const ZPNG_ImageData* refData,
-    const uint8_t* input,
-    ZPNG_ImageData* imageData
-)
+static void DefaultFree(void* opaque, void* data)
 {
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
-
-    const uint8_t* ref = refData->Buffer.Data;
-    uint8_t* output = imageData->Buffer.Data;
-    const uint8_t* overflow = input + height * width * kChannels;
+    (void)opaque;
 
-    for (unsigned y = 0; y < height; ++y)
+    // Only the thread freeing a buffer clears its slot
+    if ((uintptr_t)data % kMappedAlignBytes == 0)
     {
-        for (unsigned x = 0; x < width; ++x)
+        const unsigned first = GetMappedSlot(data);
+        for (unsigned i = 0; i < kMappedProbes; ++i)
         {
-            // For each channel:
-            for (unsigned i = 0; i < kChannels; ++i)
+            ZPNG_MappedSlot& slot = m_MappedSlots[(first + i) % kMappedSlots];
+            if (slot.Data.load(std::memory_order_acquire) == data)
             {
-                if (input[i] == 0x80) {
-                    output[i] = *overflow;
-                    ++overflow;
-                } else
-                    output[i] = ref[i] + input[i];
+                const size_t mapped = slot.Bytes;
+                slot.Data.store(nullptr, std::memory_order_release);
+                UnmapBuffer(data, mapped);
+                return;
             }
-
-            ref += kChannels;
-            input += kChannels;
-            output += kChannels;
         }
     }
+
+    free(data);
 }
 
-#ifdef ENABLE_RGB_COLOR_FILTER
+// Allocator set by ZPNG_SetAllocator(), which stays fixed once a buffer
+// has been allocated
+static ZPNG_AllocateFunction m_Allocate = DefaultAllocate;
+static ZPNG_FreeFunction m_Free = DefaultFree;
+static void* m_AllocatorOpaque = nullptr;
+static std::atomic<bool> m_AllocatorUsed(false);
 
-template<>
-void PackAndFilter<3>(
-    const ZPNG_ImageData* imageData,
-    uint8_t* output
-    )
+// Image-sized buffers, including all that are returned to the caller, come
+// from here and are released with FreeBuffer()
+static uint8_t* AllocateBuffer(size_t bytes)
 {
-    static const unsigned kChannels = 3;
+    if (!m_AllocatorUsed.load(std::memory_order_relaxed)) {
+        m_AllocatorUsed.store(true, std::memory_order_relaxed);
+    }
+    return (uint8_t*)m_Allocate(m_AllocatorOpaque, bytes > 0 ? bytes : 1);
+}
 
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+static void FreeBuffer(void* data)
+{
+    if (data) {
+        m_Free(m_AllocatorOpaque, data);
+    }
+}
 
-    const uint8_t* input = imageData->Buffer.Data;
+int ZPNG_SetAllocator(ZPNG_AllocateFunction allocate, ZPNG_FreeFunction release, void* opaque)
+{
+    // Buffers already out must still be released by their allocator
+    if (!allocate != !release || m_AllocatorUsed.load(std::memory_order_relaxed)) {
+        return 0;
+    }
 
-    // Color plane split
-    const unsigned planeBytes = width * height;
-    uint8_t* output_y = output;
-    uint8_t* output_u = output + planeBytes;
-    uint8_t* output_v = output + planeBytes * 2;
+    m_Allocate = allocate ? allocate : DefaultAllocate;
+    m_Free = release ? release : DefaultFree;
+    m_AllocatorOpaque = allocate ? opaque : nullptr;
+    return 1;
+}
 
-    for (unsigned row = 0; row < height; ++row)
-    {
-        uint8_t prev[kChannels] = { 0 };
+//------------------------------------------------------------------------------
+// Stats
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            uint8_t r = input[0];
-            uint8_t g = input[1];
-            uint8_t b = input[2];
+static uint64_t GetTimeNsec()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-            r -= prev[0];
-            g -= prev[1];
-            b -= prev[2];
+// Returns the collector to use for a call, or null if stats are disabled
+static ZPNG_StatsCollector* BeginStats(ZPNG_StatsCollector* collector, ZPNG_Stats* stats)
+{
+    if (!stats) {
+        return nullptr;
+    }
 
-            prev[0] = input[0];
-            prev[1] = input[1];
-            prev[2] = input[2];
+    collector->Stats = stats;
+    collector->StartNsec = GetTimeNsec();
+    for (unsigned i = 0; i < ZPNG_STAGE_COUNT; ++i) {
+        collector->StageNsec[i] = 0;
+    }
+    collector->OverflowCount = 0;
+    collector->Allocations = 0;
+    return collector;
+}
 
-            // GB-RG filter from BCIF
-            uint8_t y = b;
-            uint8_t u = g - b;
-            uint8_t v = g - r;
+static void EndStats(ZPNG_StatsCollector* collector, uint64_t bytesIn, uint64_t bytesOut, unsigned isIFrame)
+{
+    if (!collector) {
+        return;
+    }
 
-            *output_y++ = y;
-            *output_u++ = u;
-            *output_v++ = v;
+    ZPNG_Stats* stats = collector->Stats;
+    stats->TotalNsec = GetTimeNsec() - collector->StartNsec;
+    stats->DecideNsec = collector->StageNsec[ZPNG_STAGE_DECIDE];
+    stats->FilterNsec = collector->StageNsec[ZPNG_STAGE_FILTER];
+    stats->ZstdNsec = collector->StageNsec[ZPNG_STAGE_ZSTD];
+    stats->DictionaryNsec = collector->StageNsec[ZPNG_STAGE_DICTIONARY];
+    stats->BytesIn = bytesIn;
+    stats->BytesOut = bytesOut;
+    stats->OverflowCount = collector->OverflowCount;
+    stats->Allocations = collector->Allocations;
+    stats->IsIFrame = isIFrame;
+}
 
-            input += kChannels;
-        }
-    }
+// Timers cost one branch each when stats are disabled
+static inline uint64_t StartStage(const ZPNG_StatsCollector* collector)
+{
+    return collector ? GetTimeNsec() : 0;
 }
 
-template<>
-void UnpackAndUnfilter<3>(
-    const uint8_t* input,
-    ZPNG_ImageData* imageData
-    )
+static inline void EndStage(ZPNG_StatsCollector* collector, unsigned stage, uint64_t start)
 {
-    static const unsigned kChannels = 3;
+    if (collector) {
+        collector->StageNsec[stage] += GetTimeNsec() - start;
+    }
+}
 
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+static inline void CountAllocation(ZPNG_StatsCollector* collector)
+{
+    if (collector) {
+        ++collector->Allocations;
+    }
+}
 
-    uint8_t* output = imageData->Buffer.Data;
+static inline void CountOverflow(ZPNG_StatsCollector* collector, size_t overflowCount)
+{
+    if (collector) {
+        collector->OverflowCount += overflowCount;
+    }
+}
 
-    // Color plane split
-    const unsigned planeBytes = width * height;
-    const uint8_t* input_y = input;
-    const uint8_t* input_u = input + planeBytes;
-    const uint8_t* input_v = input + planeBytes * 2;
+#pragma clang optimize off
 
-    for (unsigned row = 0; row < height; ++row)
-    {
-        uint8_t prev[kChannels] = { 0 };
+ZPNG_Context* ZPNG_AllocateCompressionContext()
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)calloc(1, sizeof(ZPNG_CompressionContext));
+    if (!ctx) {
+        return nullptr;
+    }
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            uint8_t y = *input_y++;
-            uint8_t u = *input_u++;
-            uint8_t v = *input_v++;
+    ctx->CCtx = ZSTD_createCCtx();
+    if (!ctx->CCtx) {
+        free(ctx);
+        return nullptr;
+    }
+    ZSTD_pthread_mutex_init(&ctx->DictionaryLock, nullptr);
+    ZSTD_pthread_cond_init(&ctx->TrainDone, nullptr);
 
-            // GB-RG filter from BCIF
-            const uint8_t B = y;
-            const uint8_t G = u + B;
-            uint8_t r = G - v;
-            uint8_t g = G;
-            uint8_t b = B;
+    return (ZPNG_Context*)ctx;
+}
 
-            r += prev[0];
-            g += prev[1];
-            b += prev[2];
+// Release the pool and worker contexts, which depend on the worker count
+static void FreeContextWorkers(ZPNG_CompressionContext* ctx)
+{
+    POOL_free(ctx->Pool);
+    ctx->Pool = nullptr;
 
-            output[0] = r;
-            output[1] = g;
-            output[2] = b;
+    if (ctx->WorkerCCtx)
+    {
+        for (unsigned i = 1; i < ctx->Workers; ++i) {
+            ZSTD_freeCCtx(ctx->WorkerCCtx[i]);
+        }
+        free(ctx->WorkerCCtx);
+        ctx->WorkerCCtx = nullptr;
+    }
+}
 
-            prev[0] = r;
-            prev[1] = g;
-            prev[2] = b;
+void ZPNG_FreeCompressionContext(ZPNG_Context* context)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (ctx)
+    {
+        // Waits for background training to finish
+        POOL_free(ctx->TrainPool);
+        ZPNG_FreeDictionary((ZPNG_Dictionary*)ctx->Dictionary);
+        ZSTD_pthread_cond_destroy(&ctx->TrainDone);
+        ZSTD_pthread_mutex_destroy(&ctx->DictionaryLock);
+
+        FreeContextWorkers(ctx);
+        ZSTD_freeCCtx(ctx->CCtx);
+        ZSTD_freeCCtx(ctx->SmallCCtx);
+        FreeBuffer(ctx->Scratch);
+        FreeBuffer(ctx->MotionScratch);
+        FreeBuffer(ctx->SkipScratch);
+        free(ctx);
+    }
+}
 
-            output += kChannels;
-        }
+// Returns at least `bytes` of uninitialized scratch space, reused between frames
+static uint8_t* GetScratch(ZPNG_CompressionContext* ctx, size_t bytes)
+{
+    if (ctx->ScratchBytes < bytes)
+    {
+        FreeBuffer(ctx->Scratch);
+        ctx->Scratch = AllocateBuffer(bytes);
+        CountAllocation(ctx->Collector);
+        ctx->ScratchBytes = ctx->Scratch ? bytes : 0;
     }
+    return ctx->Scratch;
 }
 
+static unsigned GetHardwareThreads()
+{
+    const unsigned threads = std::thread::hardware_concurrency();
+    return threads > 0 ? threads : 1;
+}
 
-// Version for RGBA (with alpha):
+// Returns true if pool tasks run on threads of their own.  Without
+// ZSTD_MULTITHREAD, POOL_add() runs the task on the calling thread, so the
+// queues and pipelines whose tasks wait on the caller are not available
+static bool HasThreadPool()
+{
+#ifdef ZSTD_MULTITHREAD
+    return true;
+#else
+    return false;
+#endif
+}
 
-template<>
-void PackAndFilter<4>(
-    const ZPNG_ImageData* imageData,
-    uint8_t* output
-    )
+int ZPNG_SetCompressionWorkers(ZPNG_Context* context, unsigned workers)
 {
-    static const unsigned kChannels = 4;
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    // The Zstd contexts are only given the count when compressing
+    if (workers > 1 && (!HasThreadPool() || workers > kMaxWorkers)) {
+        return 0;
+    }
 
-    const uint8_t* input = imageData->Buffer.Data;
+    if (ctx->Workers != workers) {
+        FreeContextWorkers(ctx);
+        ctx->Workers = workers;
+    }
+    return 1;
+}
 
-    // Color plane split
-    const unsigned planeBytes = width * height;
-    uint8_t* output_y = output;
-    uint8_t* output_u = output + planeBytes;
-    uint8_t* output_v = output + planeBytes * 2;
-    uint8_t* output_a = output + planeBytes * 3;
+int ZPNG_SetCompressionStripRows(ZPNG_Context* context, unsigned stripRows)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-    for (unsigned row = 0; row < height; ++row)
+    if (stripRows != 0)
     {
-        uint8_t prev[kChannels] = { 0 };
+        if (stripRows < kMinStripRows) {
+            stripRows = kMinStripRows;
+        }
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            uint8_t r = input[0];
-            uint8_t g = input[1];
-            uint8_t b = input[2];
-            uint8_t a = input[3];
+        // Keep 2x2 Bayer blocks within one strip
+        stripRows = (stripRows + 1) & ~1u;
+    }
 
-            r -= prev[0];
-            g -= prev[1];
-            b -= prev[2];
-            a -= prev[3];
+    ctx->StripRows = stripRows;
+    return 1;
+}
 
-            prev[0] = input[0];
-            prev[1] = input[1];
-            prev[2] = input[2];
-            prev[3] = input[3];
+int ZPNG_SetCompressionParams(ZPNG_Context* context, const ZPNG_CompressionParams* params)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || !params) {
+        return 0;
+    }
 
-            // GB-RG filter from BCIF
-            uint8_t y = b;
-            uint8_t u = g - b;
-            uint8_t v = g - r;
+    if (params->Level > ZSTD_maxCLevel() ||
+        params->Strategy > (unsigned)ZSTD_btultra ||
+        (params->WindowLog != 0 && (params->WindowLog < ZSTD_WINDOWLOG_MIN || params->WindowLog > ZSTD_WINDOWLOG_MAX))) {
+        return 0;
+    }
 
-            *output_y++ = y;
-            *output_u++ = u;
-            *output_v++ = v;
-            *output_a++ = a;
+    ctx->Params = *params;
+    ctx->SmallParamsSet = false;
+    return 1;
+}
 
-            input += kChannels;
-        }
+int ZPNG_SetCompressionFilter(ZPNG_Context* context, unsigned filter)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || filter > ZPNG_FILTER_ADAPTIVE) {
+        return 0;
     }
+
+    ctx->Filter = filter;
+    return 1;
 }
 
-template<>
-void UnpackAndUnfilter<4>(
-    const uint8_t* input,
-    ZPNG_ImageData* imageData
-    )
+int ZPNG_SetCompressionColorTransform(ZPNG_Context* context, unsigned transform)
 {
-    static const unsigned kChannels = 4;
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || transform > ZPNG_COLOR_AUTO) {
+        return 0;
+    }
 
-    const unsigned height = imageData->HeightPixels;
-    const unsigned width = imageData->WidthPixels;
+    ctx->ColorTransform = transform;
+    return 1;
+}
 
-    uint8_t* output = imageData->Buffer.Data;
+int ZPNG_SetCompressionChecksum(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-    // Color plane split
-    const unsigned planeBytes = width * height;
-    const uint8_t* input_y = input;
-    const uint8_t* input_u = input + planeBytes;
-    const uint8_t* input_v = input + planeBytes * 2;
-    const uint8_t* input_a = input + planeBytes * 3;
+    ctx->Checksum = (enabled != 0);
+    return 1;
+}
 
-    for (unsigned row = 0; row < height; ++row)
-    {
-        uint8_t prev[kChannels] = { 0 };
+int ZPNG_SetCompressionPlanes(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-        for (unsigned x = 0; x < width; ++x)
-        {
-            uint8_t y = *input_y++;
-            uint8_t u = *input_u++;
-            uint8_t v = *input_v++;
-            uint8_t a = *input_a++;
+    ctx->PlaneFrames = (enabled != 0);
+    return 1;
+}
 
-            // GB-RG filter from BCIF
-            const uint8_t B = y;
-            const uint8_t G = u + B;
-            uint8_t r = G - v;
-            uint8_t g = G;
-            uint8_t b = B;
+int ZPNG_SetCompressionPalette(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-            r += prev[0];
-            g += prev[1];
-            b += prev[2];
-            a += prev[3];
+    ctx->Palette = (enabled != 0);
+    return 1;
+}
 
-            output[0] = r;
-            output[1] = g;
-            output[2] = b;
-            output[3] = a;
+int ZPNG_SetCompressionConstantPlanes(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
-            prev[0] = r;
-            prev[1] = g;
-            prev[2] = b;
-            prev[3] = a;
+    ctx->ConstantPlanes = (enabled != 0);
+    return 1;
+}
 
-            output += kChannels;
-        }
+int ZPNG_SetCompressionNonTemporal(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
     }
+
+    ctx->NonTemporal = (enabled != 0);
+    return 1;
 }
 
-#endif
+int ZPNG_SetCompressionMotionSearch(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
 
+    ctx->MotionSearch = (enabled != 0);
+    return 1;
+}
 
-#ifdef __cplusplus
+int ZPNG_SetCompressionSkipBlocks(ZPNG_Context* context, int enabled)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    ctx->SkipBlocks = (enabled != 0);
+    return 1;
+}
+
+int ZPNG_SetCompressionPlaneLevel(ZPNG_Context* context, unsigned plane, int level)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || plane >= kMaxFramesPerStrip || level > ZSTD_maxCLevel()) {
+        return 0;
+    }
+
+    ctx->PlaneLevels[plane] = level;
+    return 1;
+}
+
+int ZPNG_SetCompressionBackend(ZPNG_Context* context, unsigned backend)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || backend >= ZPNG_BACKEND_COUNT) {
+        return 0;
+    }
+
+    ctx->Backend = backend;
+    return 1;
+}
+
+int ZPNG_SetCompressionProgressive(ZPNG_Context* context, unsigned levels)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx || levels > kMaxProgressiveLevels) {
+        return 0;
+    }
+
+    ctx->ProgressiveLevels = levels;
+    return 1;
+}
+
+int ZPNG_SetCompressionStats(ZPNG_Context* context, ZPNG_Stats* stats)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    ctx->Stats = stats;
+    return 1;
+}
+
+int ZPNG_SetCompressionPackFunction(ZPNG_Context* context, ZPNG_PackFunction pack, void* opaque)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    ctx->PackFunction = pack;
+    ctx->PackOpaque = opaque;
+    return 1;
+}
+
+// Take another reference to a dictionary, which may be null
+static ZPNG_DictionaryState* RetainDictionary(const ZPNG_Dictionary* dict)
+{
+    ZPNG_DictionaryState* state = (ZPNG_DictionaryState*)dict;
+    if (state) {
+        state->References.fetch_add(1, std::memory_order_relaxed);
+    }
+    return state;
+}
+
+ZPNG_Dictionary* ZPNG_RetainDictionary(ZPNG_Dictionary* dict)
+{
+    return (ZPNG_Dictionary*)RetainDictionary(dict);
+}
+
+// Give the context the reference `dict`, and return its old reference for
+// the caller to release
+static ZPNG_DictionaryState* SwapContextDictionary(
+    ZPNG_CompressionContext* ctx,
+    ZPNG_DictionaryState* dict
+)
+{
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    ZPNG_DictionaryState* old = ctx->Dictionary;
+    ctx->Dictionary = dict;
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+    return old;
+}
+
+int ZPNG_SetCompressionDictionary(ZPNG_Context* context, const ZPNG_Dictionary* dict)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    // The old dictionary is released outside the lock, as the last
+    // reference frees it
+    ZPNG_DictionaryState* old = SwapContextDictionary(ctx, RetainDictionary(dict));
+    ZPNG_FreeDictionary((ZPNG_Dictionary*)old);
+    return 1;
+}
+
+static void InitDecompressionState(ZPNG_DecompressionState* state)
+{
+    state->Dictionary = nullptr;
+    state->Workers = GetHardwareThreads();
+    state->Pool = nullptr;
+    state->DCtx = nullptr;
+    state->Scratch = nullptr;
+    state->ScratchBytes = 0;
+    state->UnpackFunction = nullptr;
+    state->UnpackOpaque = nullptr;
+    state->Stats = nullptr;
+    state->Collector = nullptr;
+}
+
+// Release the pool and worker contexts, which depend on the worker count
+static void FreeDecompressionWorkers(ZPNG_DecompressionState* state)
+{
+    POOL_free(state->Pool);
+    state->Pool = nullptr;
+
+    if (state->DCtx)
+    {
+        for (unsigned i = 0; i < state->Workers; ++i) {
+            ZSTD_freeDCtx(state->DCtx[i]);
+        }
+        free(state->DCtx);
+        state->DCtx = nullptr;
+    }
+}
+
+static void FreeDecompressionState(ZPNG_DecompressionState* state)
+{
+    FreeDecompressionWorkers(state);
+
+    ZPNG_FreeDictionary((ZPNG_Dictionary*)state->Dictionary);
+    state->Dictionary = nullptr;
+
+    FreeBuffer(state->Scratch);
+    state->Scratch = nullptr;
+    state->ScratchBytes = 0;
+}
+
+// Returns at least `bytes` of uninitialized scratch space, reused between frames
+static uint8_t* GetScratch(ZPNG_DecompressionState* state, size_t bytes)
+{
+    if (state->ScratchBytes < bytes)
+    {
+        FreeBuffer(state->Scratch);
+        state->Scratch = AllocateBuffer(bytes);
+        CountAllocation(state->Collector);
+        state->ScratchBytes = state->Scratch ? bytes : 0;
+    }
+    return state->Scratch;
+}
+
+// Make sure the first `workers` Zstd contexts exist, and the pool if needed.
+// Returns the number of workers that can be used, or 0 on failure
+static unsigned EnsureDecompressionWorkers(ZPNG_DecompressionState* state, unsigned workers)
+{
+    if (workers > state->Workers) {
+        workers = state->Workers;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    if (!state->DCtx)
+    {
+        CountAllocation(state->Collector);
+        state->DCtx = (ZSTD_DCtx**)calloc(state->Workers > 0 ? state->Workers : 1, sizeof(ZSTD_DCtx*));
+        if (!state->DCtx) {
+            return 0;
+        }
+    }
+
+    for (unsigned i = 0; i < workers; ++i)
+    {
+        if (!state->DCtx[i])
+        {
+            CountAllocation(state->Collector);
+            state->DCtx[i] = ZSTD_createDCtx();
+            if (!state->DCtx[i]) {
+                return 0;
+            }
+        }
+    }
+
+    if (workers > 1 && !state->Pool)
+    {
+        CountAllocation(state->Collector);
+        state->Pool = POOL_create(state->Workers - 1, state->Workers);
+        if (!state->Pool) {
+            return 1;
+        }
+    }
+
+    return workers;
+}
+
+ZPNG_DecompressionContext* ZPNG_AllocateDecompressionContext()
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)calloc(1, sizeof(ZPNG_DecompressionState));
+    if (!state) {
+        return nullptr;
+    }
+
+    InitDecompressionState(state);
+
+    // Create the Zstd context up front so it is reused from the first frame
+    if (!EnsureDecompressionWorkers(state, 1)) {
+        ZPNG_FreeDecompressionContext(state);
+        return nullptr;
+    }
+
+    return (ZPNG_DecompressionContext*)state;
+}
+
+void ZPNG_FreeDecompressionContext(ZPNG_DecompressionContext* context)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (state)
+    {
+        FreeDecompressionState(state);
+        free(state);
+    }
+}
+
+int ZPNG_SetDecompressionWorkers(ZPNG_DecompressionContext* context, unsigned workers)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (!state) {
+        return 0;
+    }
+
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    if (state->Workers != workers) {
+        FreeDecompressionWorkers(state);
+        state->Workers = workers;
+    }
+    return 1;
+}
+
+int ZPNG_SetDecompressionDictionary(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_Dictionary* dict
+)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (!state) {
+        return 0;
+    }
+
+    ZPNG_FreeDictionary((ZPNG_Dictionary*)state->Dictionary);
+    state->Dictionary = RetainDictionary(dict);
+    return 1;
+}
+
+int ZPNG_SetDecompressionStats(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Stats* stats
+)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (!state) {
+        return 0;
+    }
+
+    state->Stats = stats;
+    return 1;
+}
+
+int ZPNG_SetDecompressionUnpackFunction(
+    ZPNG_DecompressionContext* context,
+    ZPNG_UnpackFunction unpack,
+    void* opaque
+)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (!state) {
+        return 0;
+    }
+
+    state->UnpackFunction = unpack;
+    state->UnpackOpaque = opaque;
+    return 1;
+}
+
+void ZPNG_FreeDictionary(ZPNG_Dictionary* dict)
+{
+    ZPNG_DictionaryState* state = (ZPNG_DictionaryState*)dict;
+    if (state && state->References.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        ZSTD_freeCDict(state->CDict);
+        ZSTD_freeDDict(state->DDict);
+        free(state->Data);
+        free(state);
+    }
+}
+
+// Prepare a dictionary from serialized Zstd dictionary data, compressing
+// at the given level.  Returns null on failure
+static ZPNG_DictionaryState* CreateDictionary(
+    const void* data,
+    size_t bytes,
+    int level
+)
+{
+    ZPNG_DictionaryState* dict = (ZPNG_DictionaryState*)calloc(1, sizeof(ZPNG_DictionaryState));
+    if (!dict) {
+        return nullptr;
+    }
+
+    dict->Data = (uint8_t*)malloc(bytes > 0 ? bytes : 1);
+    if (!dict->Data) {
+        free(dict);
+        return nullptr;
+    }
+    memcpy(dict->Data, data, bytes);
+    dict->Bytes = bytes;
+    dict->References = 1;
+    dict->Id = ZDICT_getDictID(data, bytes);
+
+    // Both tables point into the one copy of the dictionary
+    dict->CDict = ZSTD_createCDict_byReference(dict->Data, bytes, level);
+    dict->DDict = ZSTD_createDDict_byReference(dict->Data, bytes);
+    if (!dict->CDict || !dict->DDict) {
+        ZPNG_FreeDictionary((ZPNG_Dictionary*)dict);
+        return nullptr;
+    }
+
+    return dict;
+}
+
+// The dictionary argument if there is one, and otherwise the context's
+// dictionary, through contextDict, or null if it has none.  contextDict
+// holds a reference for the whole image, to release with
+// ZPNG_FreeDictionary(), and is null if none was taken
+static ZPNG_Dictionary** AcquireCallDictionary(
+    ZPNG_CompressionContext* ctx,
+    ZPNG_Dictionary** dictionary,
+    ZPNG_Dictionary** contextDict
+)
+{
+    *contextDict = nullptr;
+    if (dictionary || !ctx) {
+        return dictionary;
+    }
+
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    *contextDict = RetainDictionary((ZPNG_Dictionary*)ctx->Dictionary);
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+
+    return *contextDict ? contextDict : nullptr;
+}
+
+// Compression dictionary of the optional dictionary argument, or null
+static const ZSTD_CDict* GetCDict(ZPNG_Dictionary** dictionary)
+{
+    if (!dictionary || !*dictionary) {
+        return nullptr;
+    }
+    return ((const ZPNG_DictionaryState*)*dictionary)->CDict;
+}
+
+//------------------------------------------------------------------------------
+// Entropy Backend
+
+static inline size_t GetEntropyBlockBytes(size_t planeRemaining)
+{
+    return planeRemaining < HUF_BLOCKSIZE_MAX ? planeRemaining : HUF_BLOCKSIZE_MAX;
+}
+
+// Huffman code srcSize bytes in planes of planeBytes into an entropy frame.
+// Returns the frame size or a Zstd error code
+static size_t CompressEntropyFrame(
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize,
+    size_t planeBytes
+)
+{
+    if (dstCapacity < sizeof(ZPNG_EntropyFrameHeader)) {
+        return (size_t)-ZSTD_error_dstSize_tooSmall;
+    }
+    if (planeBytes == 0 || planeBytes > srcSize) {
+        planeBytes = srcSize;
+    }
+
+    ZPNG_EntropyFrameHeader header;
+    header.Magic = ZPNG_ENTROPY_FRAME_MAGIC;
+    header.Reserved = 0;
+    header.ContentBytes = srcSize;
+    header.PlaneBytes = planeBytes;
+    memcpy(dst, &header, sizeof(header));
+
+    uint8_t* output = (uint8_t*)dst;
+    size_t outputBytes = sizeof(header);
+    const uint8_t* input = (const uint8_t*)src;
+
+    for (size_t planeStart = 0; planeStart < srcSize; planeStart += planeBytes)
+    {
+        const size_t planeEnd = (srcSize - planeStart > planeBytes) ? planeStart + planeBytes : srcSize;
+
+        for (size_t offset = planeStart; offset < planeEnd; )
+        {
+            const size_t blockBytes = GetEntropyBlockBytes(planeEnd - offset);
+            if (dstCapacity - outputBytes < sizeof(uint32_t) + blockBytes) {
+                return (size_t)-ZSTD_error_dstSize_tooSmall;
+            }
+            uint8_t* block = output + outputBytes + sizeof(uint32_t);
+
+            // Blocks that do not shrink are stored raw, as HUF_decompress() expects
+            size_t stored = HUF_compress(block, blockBytes, input + offset, blockBytes);
+            if (HUF_isError(stored) || stored == 0 || stored >= blockBytes)
+            {
+                memcpy(block, input + offset, blockBytes);
+                stored = blockBytes;
+            }
+
+            const uint32_t storedWord = (uint32_t)stored;
+            memcpy(output + outputBytes, &storedWord, sizeof(storedWord));
+            outputBytes += sizeof(uint32_t) + stored;
+            offset += blockBytes;
+        }
+    }
+
+    return outputBytes;
+}
+
+static bool IsEntropyFrame(const void* src, size_t srcSize)
+{
+    uint32_t magic;
+    if (srcSize < sizeof(ZPNG_EntropyFrameHeader)) {
+        return false;
+    }
+    memcpy(&magic, src, sizeof(magic));
+    return magic == ZPNG_ENTROPY_FRAME_MAGIC;
+}
+
+// Returns true if ZPNG_BACKEND_AUTO should code these filtered bytes as an
+// entropy frame.  Both coders are estimated from the order-0 entropy of a
+// sample: Huffman codes cost at least a bit per byte, while Zstd matches make
+// bytes in runs nearly free.  Zstd is slower, so it must save a tenth
+static bool IsNoiseHeavy(const uint8_t* data, size_t bytes)
+{
+    unsigned histogram[256] = { 0 };
+    size_t runBytes = 0;
+
+    unsigned bandCount = kBackendProbeBands;
+    size_t bandBytes = kBackendProbeBandBytes;
+    if (bytes < (size_t)bandCount * bandBytes)
+    {
+        bandCount = 1;
+        bandBytes = bytes;
+    }
+
+    for (unsigned band = 0; band < bandCount; ++band)
+    {
+        const uint8_t* input = data + (bytes - bandBytes) * band / (bandCount > 1 ? bandCount - 1 : 1);
+
+        unsigned run = 1;
+        histogram[input[0]]++;
+        for (size_t i = 1; i < bandBytes; ++i)
+        {
+            histogram[input[i]]++;
+            run = (input[i] == input[i - 1]) ? run + 1 : 1;
+
+            // The first byte of a run is a literal, and the rest are a match
+            if (run == kBackendMinRun) {
+                runBytes += kBackendMinRun - 1;
+            } else if (run > kBackendMinRun) {
+                ++runBytes;
+            }
+        }
+    }
+
+    const size_t sampled = (size_t)bandCount * bandBytes;
+    if (sampled == 0) {
+        return false;
+    }
+
+    double entropyBits = 0.;
+    for (unsigned i = 0; i < 256; ++i) {
+        if (histogram[i] != 0) {
+            entropyBits += histogram[i] * log2((double)sampled / histogram[i]);
+        }
+    }
+
+    const double huffmanBits = entropyBits > sampled ? entropyBits : (double)sampled;
+    const double zstdBits = entropyBits * (double)(sampled - runBytes) / sampled;
+    return zstdBits * 10. >= huffmanBits * 9.;
+}
+
+// Decode an entropy frame.  Returns its content size or a Zstd error code
+static size_t DecompressEntropyFrame(
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize
+)
+{
+    ZPNG_EntropyFrameHeader header;
+    if (!IsEntropyFrame(src, srcSize)) {
+        return (size_t)-ZSTD_error_prefix_unknown;
+    }
+    memcpy(&header, src, sizeof(header));
+    if (header.ContentBytes > dstCapacity) {
+        return (size_t)-ZSTD_error_dstSize_tooSmall;
+    }
+    if (header.ContentBytes != 0 && (header.PlaneBytes == 0 || header.PlaneBytes > header.ContentBytes)) {
+        return (size_t)-ZSTD_error_corruption_detected;
+    }
+
+    const size_t contentBytes = (size_t)header.ContentBytes;
+    const size_t planeBytes = (size_t)header.PlaneBytes;
+    uint8_t* output = (uint8_t*)dst;
+    const uint8_t* input = (const uint8_t*)src;
+    size_t inputBytes = sizeof(header);
+
+    for (size_t planeStart = 0; planeStart < contentBytes; planeStart += planeBytes)
+    {
+        const size_t planeEnd = (contentBytes - planeStart > planeBytes) ? planeStart + planeBytes : contentBytes;
+
+        for (size_t offset = planeStart; offset < planeEnd; )
+        {
+            const size_t blockBytes = GetEntropyBlockBytes(planeEnd - offset);
+
+            uint32_t stored;
+            if (srcSize - inputBytes < sizeof(stored)) {
+                return (size_t)-ZSTD_error_srcSize_wrong;
+            }
+            memcpy(&stored, input + inputBytes, sizeof(stored));
+            inputBytes += sizeof(stored);
+            if (srcSize - inputBytes < stored) {
+                return (size_t)-ZSTD_error_srcSize_wrong;
+            }
+
+            const size_t result = HUF_decompress(output + offset, blockBytes, input + inputBytes, stored);
+            if (HUF_isError(result)) {
+                return (size_t)-ZSTD_error_corruption_detected;
+            }
+            inputBytes += stored;
+            offset += blockBytes;
+        }
+    }
+
+    if (inputBytes != srcSize) {
+        return (size_t)-ZSTD_error_srcSize_wrong;
+    }
+    return contentBytes;
+}
+
+//------------------------------------------------------------------------------
+// Zstd Helpers
+
+static int GetCompressionLevel(const ZPNG_CompressionParams* params)
+{
+    return params->Level != 0 ? params->Level : kCompressionLevel;
+}
+
+static unsigned GetWindowLog(const ZPNG_CompressionParams* params)
+{
+    if (params->WindowLog == 0 && params->LongDistanceMatching) {
+        return kLongDistanceWindowLog;
+    }
+    return params->WindowLog;
+}
+
+// Request the parameters on cctx for ZSTD_compress_generic().
+// The level also selects literal compression, and long-distance matching
+// is read from here by ZSTD_compress_advanced() as well
+static size_t SetZstdParams(
+    ZSTD_CCtx* cctx,
+    const ZPNG_CompressionParams* params,
+    unsigned workers
+)
+{
+    // Parameters cannot change while a dictionary is referenced
+    size_t err = ZSTD_CCtx_refCDict(cctx, nullptr);
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_compressionLevel, (unsigned)GetCompressionLevel(params));
+    }
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_enableLongDistanceMatching, params->LongDistanceMatching ? 1 : 0);
+    }
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_windowLog, GetWindowLog(params));
+    }
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_compressionStrategy, params->Strategy);
+    }
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_nbWorkers, workers > 1 ? workers : 0);
+    }
+    if (!ZSTD_isError(err) && workers > 1) {
+        err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_jobSize, params->TargetBlockBytes);
+    }
+    return err;
+}
+
+// Match parameters for a frame of srcSize bytes, as ZSTD_compress_generic()
+// would pick them from SetZstdParams()
+static ZSTD_parameters GetFrameParams(
+    const ZPNG_CompressionParams* params,
+    size_t srcSize
+)
+{
+    ZSTD_parameters frameParams = ZSTD_getParams(GetCompressionLevel(params), srcSize ? srcSize : 1, 0);
+
+    const unsigned windowLog = GetWindowLog(params);
+    if (windowLog != 0) {
+        frameParams.cParams.windowLog = windowLog;
+    }
+    if (params->Strategy != 0) {
+        frameParams.cParams.strategy = (ZSTD_strategy)params->Strategy;
+    }
+    frameParams.cParams = ZSTD_adjustCParams(frameParams.cParams, srcSize ? srcSize : 1, 0);
+    return frameParams;
+}
+
+// Compress one frame on the calling thread
+static size_t CompressFrame(
+    ZSTD_CCtx* cctx,
+    const ZPNG_CompressionParams* params,
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize,
+    const ZSTD_CDict* cdict
+)
+{
+    if (cdict) {
+        return ZSTD_compress_usingCDict(cctx, dst, dstCapacity, src, srcSize, cdict);
+    }
+
+    const size_t err = SetZstdParams(cctx, params, 0);
+    if (ZSTD_isError(err)) {
+        return err;
+    }
+    return ZSTD_compress_advanced(cctx, dst, dstCapacity, src, srcSize, nullptr, 0, GetFrameParams(params, srcSize));
+}
+
+// Start a ZSTD_compress_generic() frame of srcSize bytes on the context
+static size_t BeginContextFrame(
+    ZPNG_CompressionContext* ctx,
+    size_t srcSize,
+    const ZSTD_CDict* cdict
+)
+{
+    ZSTD_CCtx* cctx = ctx->CCtx;
+    ZSTD_CCtx_reset(cctx);
+
+    size_t err = SetZstdParams(cctx, &ctx->Params, ctx->Workers);
+    if (!ZSTD_isError(err) && cdict) {
+        err = ZSTD_CCtx_refCDict(cctx, cdict);
+    }
+    if (!ZSTD_isError(err)) {
+        err = ZSTD_CCtx_setPledgedSrcSize(cctx, srcSize);
+    }
+    return err;
+}
+
+// Compress using the context, splitting the frame across ZSTDMT workers if enabled
+static size_t CompressWithContext(
+    ZPNG_CompressionContext* ctx,
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize,
+    const ZSTD_CDict* cdict
+)
+{
+    if (ctx->Workers <= 1) {
+        return CompressFrame(ctx->CCtx, &ctx->Params, dst, dstCapacity, src, srcSize, cdict);
+    }
+
+    ZSTD_CCtx* cctx = ctx->CCtx;
+    const size_t err = BeginContextFrame(ctx, srcSize, cdict);
+    if (ZSTD_isError(err)) {
+        return err;
+    }
+
+    ZSTD_outBuffer output = { dst, dstCapacity, 0 };
+    ZSTD_inBuffer input = { src, srcSize, 0 };
+
+    // ZSTDMT is non-blocking: Keep calling until the frame is fully flushed
+    for (;;)
+    {
+        const size_t remaining = ZSTD_compress_generic(cctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(remaining)) {
+            ZSTD_CCtx_reset(cctx);
+            return remaining;
+        }
+        if (remaining == 0) {
+            break;
+        }
+        if (output.pos >= output.size) {
+            ZSTD_CCtx_reset(cctx);
+            return (size_t)-ZSTD_error_dstSize_tooSmall;
+        }
+    }
+
+    return output.pos;
+}
+
+// Compress a frame of at most kSmallFrameBytes without a dictionary.
+// The parameters stay on the small-frame context, so each call only starts
+// a new frame.  Zstd sizes the window and tables to the pledged size, and
+// skips its checksum and dictionary ID since the Zpng header covers them
+static size_t CompressSmallFrame(
+    ZPNG_CompressionContext* ctx,
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize
+)
+{
+    ZSTD_CCtx* cctx = ctx->SmallCCtx;
+    if (!cctx)
+    {
+        CountAllocation(ctx->Collector);
+        cctx = ZSTD_createCCtx();
+        if (!cctx) {
+            return (size_t)-ZSTD_error_memory_allocation;
+        }
+        ctx->SmallCCtx = cctx;
+        ctx->SmallParamsSet = false;
+    }
+
+    // Only the session is reset here, which keeps the parameters
+    ZSTD_CCtx_reset(cctx);
+
+    if (!ctx->SmallParamsSet)
+    {
+        size_t err = SetZstdParams(cctx, &ctx->Params, 0);
+        if (!ZSTD_isError(err)) {
+            err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_checksumFlag, 0);
+        }
+        if (!ZSTD_isError(err)) {
+            err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_dictIDFlag, 0);
+        }
+        if (!ZSTD_isError(err)) {
+            err = ZSTD_CCtx_setParameter(cctx, ZSTD_p_contentSizeFlag, 1);
+        }
+        if (ZSTD_isError(err)) {
+            return err;
+        }
+        ctx->SmallParamsSet = true;
+    }
+
+    const size_t err = ZSTD_CCtx_setPledgedSrcSize(cctx, srcSize);
+    if (ZSTD_isError(err)) {
+        return err;
+    }
+
+    // With room for the compress bound, this is a single one-shot pass
+    ZSTD_outBuffer output = { dst, dstCapacity, 0 };
+    ZSTD_inBuffer input = { src, srcSize, 0 };
+    const size_t remaining = ZSTD_compress_generic(cctx, &output, &input, ZSTD_e_end);
+    if (ZSTD_isError(remaining)) {
+        ZSTD_CCtx_reset(cctx);
+        return remaining;
+    }
+    if (remaining != 0) {
+        ZSTD_CCtx_reset(cctx);
+        return (size_t)-ZSTD_error_dstSize_tooSmall;
+    }
+
+    return output.pos;
+}
+
+// Split each of imageCount packed images into 8 samples per row, and
+// train a dictionary of up to dictBytes on them.  Returns null on failure
+static ZPNG_DictionaryState* TrainDictionary(
+    const uint8_t* packing,
+    const size_t* imageBytes,
+    const unsigned* imageRows,
+    unsigned imageCount,
+    size_t dictBytes,
+    int level
+)
+{
+    unsigned sampleCount = 0;
+    for (unsigned i = 0; i < imageCount; ++i) {
+        sampleCount += imageRows[i] * 8;
+    }
+    if (sampleCount == 0) {
+        return nullptr;
+    }
+
+    char* dictBuf = (char*)malloc(dictBytes);
+    size_t* sampleSizes = (size_t*)malloc(sampleCount * sizeof(size_t));
+    if (!dictBuf || !sampleSizes) {
+        free(dictBuf);
+        free(sampleSizes);
+        return nullptr;
+    }
+
+    // Samples must be contiguous, so each image's remainder goes in its last one
+    size_t* sampleSize = sampleSizes;
+    for (unsigned i = 0; i < imageCount; ++i)
+    {
+        const unsigned count = imageRows[i] * 8;
+        for (unsigned j = 0; j < count; ++j) {
+            sampleSize[j] = imageBytes[i] / count;
+        }
+        if (count > 0) {
+            sampleSize[count - 1] += imageBytes[i] % count;
+        }
+        sampleSize += count;
+    }
+
+    ZDICT_cover_params_t params = {32, 8, 0, 1, {level, 0, 0}};
+    size_t actualSize = ZDICT_trainFromBuffer_cover(dictBuf, dictBytes, packing, sampleSizes, sampleCount, params);
+    free(sampleSizes);
+
+    ZPNG_DictionaryState* dict = nullptr;
+    if (!ZDICT_isError(actualSize)) {
+        dict = CreateDictionary(dictBuf, actualSize, level);
+    }
+    free(dictBuf);
+    return dict;
+}
+
+// Train a dictionary on packed rows from the first frame
+static ZPNG_DictionaryState* TrainFrameDictionary(
+    const uint8_t* packing,
+    size_t bytes,
+    unsigned rows,
+    int level
+)
+{
+    return TrainDictionary(packing, &bytes, &rows, 1, kDictionaryBytes, level);
+}
+
+// Decompress one Zstd or entropy frame, with the dictionary if one is given
+static size_t DecompressFrame(
+    ZSTD_DCtx* dctx,
+    const ZSTD_DDict* ddict,
+    void* dst,
+    size_t dstCapacity,
+    const void* src,
+    size_t srcSize
+)
+{
+    if (IsEntropyFrame(src, srcSize)) {
+        return DecompressEntropyFrame(dst, dstCapacity, src, srcSize);
+    }
+    if (ddict) {
+        return ZSTD_decompress_usingDDict(dctx, dst, dstCapacity, src, srcSize, ddict);
+    }
+    return ZSTD_decompressDCtx(dctx, dst, dstCapacity, src, srcSize);
+}
+
+// Dictionary for a single-frame format image.  Only frames that name a
+// dictionary use one: Zstd would otherwise start from the dictionary's
+// repeat offsets and misread the frame
+static const ZSTD_DDict* GetFrameDDict(
+    const ZPNG_DecompressionState* state,
+    const void* src,
+    size_t srcSize
+)
+{
+    if (!state->Dictionary || ZSTD_getDictID_fromFrame(src, srcSize) == 0) {
+        return nullptr;
+    }
+    return state->Dictionary->DDict;
+}
+
+//------------------------------------------------------------------------------
+// Thread Pool
+
+// Runs task indices [0, TaskCount) on the pool plus the calling thread.
+// Each task also receives a worker index < the number of workers used,
+// so that callers can give each worker its own scratch state.
+typedef void (*ZPNG_TaskFunction)(void* opaque, unsigned task, unsigned worker);
+
+struct ZPNG_ParallelTasks
+{
+    ZPNG_TaskFunction Function;
+    void* Opaque;
+    unsigned TaskCount;
+
+    ZSTD_pthread_mutex_t Lock;
+    ZSTD_pthread_cond_t Done;
+    unsigned NextTask;
+    unsigned NextWorker;
+    unsigned ActiveHelpers;
+};
+
+static void RunTasks(ZPNG_ParallelTasks* tasks, unsigned worker)
+{
+    for (;;)
+    {
+        ZSTD_pthread_mutex_lock(&tasks->Lock);
+        const unsigned task = tasks->NextTask++;
+        ZSTD_pthread_mutex_unlock(&tasks->Lock);
+
+        if (task >= tasks->TaskCount) {
+            break;
+        }
+
+        tasks->Function(tasks->Opaque, task, worker);
+    }
+}
+
+static void PoolHelper(void* opaque)
+{
+    ZPNG_ParallelTasks* tasks = (ZPNG_ParallelTasks*)opaque;
+
+    ZSTD_pthread_mutex_lock(&tasks->Lock);
+    const unsigned worker = tasks->NextWorker++;
+    ZSTD_pthread_mutex_unlock(&tasks->Lock);
+
+    RunTasks(tasks, worker);
+
+    ZSTD_pthread_mutex_lock(&tasks->Lock);
+    if (--tasks->ActiveHelpers == 0) {
+        ZSTD_pthread_cond_signal(&tasks->Done);
+    }
+    ZSTD_pthread_mutex_unlock(&tasks->Lock);
+}
+
+// Blocks until all tasks are complete
+static void ParallelFor(
+    POOL_ctx* pool,
+    unsigned workers,
+    unsigned taskCount,
+    ZPNG_TaskFunction function,
+    void* opaque
+)
+{
+    if (workers > taskCount) {
+        workers = taskCount;
+    }
+
+    if (!pool || workers <= 1)
+    {
+        for (unsigned i = 0; i < taskCount; ++i) {
+            function(opaque, i, 0);
+        }
+        return;
+    }
+
+    ZPNG_ParallelTasks tasks;
+    tasks.Function = function;
+    tasks.Opaque = opaque;
+    tasks.TaskCount = taskCount;
+    tasks.NextTask = 0;
+    tasks.NextWorker = 1;
+    tasks.ActiveHelpers = workers - 1;
+    ZSTD_pthread_mutex_init(&tasks.Lock, nullptr);
+    ZSTD_pthread_cond_init(&tasks.Done, nullptr);
+
+    for (unsigned i = 1; i < workers; ++i) {
+        POOL_add(pool, PoolHelper, &tasks);
+    }
+
+    // The calling thread is worker 0
+    RunTasks(&tasks, 0);
+
+    ZSTD_pthread_mutex_lock(&tasks.Lock);
+    while (tasks.ActiveHelpers > 0) {
+        ZSTD_pthread_cond_wait(&tasks.Done, &tasks.Lock);
+    }
+    ZSTD_pthread_mutex_unlock(&tasks.Lock);
+
+    ZSTD_pthread_cond_destroy(&tasks.Done);
+    ZSTD_pthread_mutex_destroy(&tasks.Lock);
+}
+
+//------------------------------------------------------------------------------
+// Image Processing
+
+// Bytes from the start of one row to the next.  A StrideBytes of 0 or less
+// than a row means the rows are tightly packed.
+static inline size_t GetRowStride(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes
+)
+{
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    return imageData->StrideBytes >= rowBytes ? imageData->StrideBytes : rowBytes;
+}
+
+// View of rows [firstRow, firstRow + rows) of an image
+static ZPNG_ImageData GetStripImage(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    unsigned rows
+)
+{
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+
+    ZPNG_ImageData strip = *imageData;
+    strip.Buffer.Data = imageData->Buffer.Data + firstRow * stride;
+    strip.Buffer.Bytes = rows * stride;
+    strip.HeightPixels = rows;
+    return strip;
+}
+
+// Interleaving is a 1% compression win, and a 0.3% performance win: Not used.
+// Splitting the data into blocks of 4 at a time actually reduces compression.
+
+template<int kChannels>
+static void PackAndFilter(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                uint8_t a = input[i];
+                uint8_t d = a - prev[i];
+                output[i] = d;
+                prev[i] = a;
+            }
+
+            input += kChannels;
+            output += kChannels;
+        }
+    }
+}
+
+template<int kChannels>
+static void UnpackAndUnfilter(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                uint8_t d = input[i];
+                uint8_t a = d + prev[i];
+                output[i] = a;
+                prev[i] = a;
+            }
+
+            input += kChannels;
+            output += kChannels;
+        }
+    }
+}
+
+// 16-bit channels: The delta is taken on the native-endian uint16_t values
+// and zig-zag coded so small steps either way have a zero high byte.
+// The high bytes of every channel are stored first, then the low bytes,
+// each as a plane of the image.
+
+template<int kChannels>
+static void PackAndFilter16(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels * 2);
+
+    // Byte plane split
+    const size_t planeBytes = (size_t)width * height;
+    uint8_t* output_hi = output;
+    uint8_t* output_lo = output + planeBytes * kChannels;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+
+        uint16_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                uint16_t a;
+                memcpy(&a, input + i * 2, 2);
+                const uint16_t d = (uint16_t)(a - prev[i]);
+                const uint16_t z = (uint16_t)((d << 1) ^ ((d & 0x8000) ? 0xffff : 0));
+                output_hi[i * planeBytes] = (uint8_t)(z >> 8);
+                output_lo[i * planeBytes] = (uint8_t)z;
+                prev[i] = a;
+            }
+
+            input += kChannels * 2;
+            ++output_hi;
+            ++output_lo;
+        }
+    }
+}
+
+template<int kChannels>
+static void UnpackAndUnfilter16(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels * 2);
+
+    // Byte plane split
+    const size_t planeBytes = (size_t)width * height;
+    const uint8_t* input_hi = input;
+    const uint8_t* input_lo = input + planeBytes * kChannels;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        uint16_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                const uint16_t z = (uint16_t)((input_hi[i * planeBytes] << 8) | input_lo[i * planeBytes]);
+                const uint16_t d = (uint16_t)((z >> 1) ^ ((z & 1) ? 0xffff : 0));
+                const uint16_t a = (uint16_t)(prev[i] + d);
+                memcpy(output + i * 2, &a, 2);
+                prev[i] = a;
+            }
+
+            output += kChannels * 2;
+            ++input_hi;
+            ++input_lo;
+        }
+    }
+}
+
+#ifdef ENABLE_BAYER_FILTER
+
+// Bayer samples are 1 byte, or native-endian uint16_t like PackAndFilter16().
+// 2-byte deltas are zig-zag coded, with the high bytes of all the samples
+// stored before the low bytes.
+
+template<int kBytes>
+static inline unsigned LoadSample(const uint8_t* input)
+{
+    if (kBytes == 1) {
+        return input[0];
+    }
+    uint16_t v;
+    memcpy(&v, input, 2);
+    return v;
+}
+
+template<int kBytes>
+static inline void StoreSample(uint8_t* output, unsigned v)
+{
+    if (kBytes == 1) {
+        output[0] = (uint8_t)v;
+        return;
+    }
+    const uint16_t w = (uint16_t)v;
+    memcpy(output, &w, 2);
+}
+
+template<int kBytes>
+static inline void StoreDelta(uint8_t* output, size_t index, size_t sampleCount, unsigned d)
+{
+    if (kBytes == 1) {
+        output[index] = (uint8_t)d;
+        return;
+    }
+    const uint16_t z = (uint16_t)((d << 1) ^ ((d & 0x8000) ? 0xffff : 0));
+    output[index] = (uint8_t)(z >> 8);
+    output[index + sampleCount] = (uint8_t)z;
+}
+
+template<int kBytes>
+static inline unsigned LoadDelta(const uint8_t* input, size_t index, size_t sampleCount)
+{
+    if (kBytes == 1) {
+        return input[index];
+    }
+    const unsigned z = ((unsigned)input[index] << 8) | input[index + sampleCount];
+    return (z >> 1) ^ ((z & 1) ? 0xffff : 0);
+}
+
+// Even rows hold X and G samples, odd rows hold G and Y samples.
+// kGreenFirst is set for GRBG and GBRG, where G comes first on even rows
+// and last on odd rows.  This should work well for all four layouts.
+template<bool kGreenFirst, int kBytes>
+static void PackAndFilterBayer(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+    const unsigned kMask = (kBytes == 1) ? 0xff : 0xffff;
+
+    const size_t stride = GetRowStride(imageData, kBytes);
+
+    // Color plane split
+    const size_t sampleCount = (size_t)width * height;
+    const size_t planeSamples = sampleCount / 4;
+    size_t index_x = 0;
+    size_t index_y = planeSamples;
+    size_t index_g = planeSamples * 2;
+
+    for (unsigned row = 0; row < height; row += 2)
+    {
+        const uint8_t* input = imageData->Buffer.Data + row * stride;
+
+        unsigned prev[2] = { 0, 0 };
+
+        // even
+        for (unsigned x = 0; x < width; x += 2)
+        {
+            const unsigned a = LoadSample<kBytes>(input);
+            const unsigned b = LoadSample<kBytes>(input + kBytes);
+            const unsigned s = kGreenFirst ? b : a;
+            const unsigned g = kGreenFirst ? a : b;
+
+            StoreDelta<kBytes>(output, index_x++, sampleCount, (s - prev[0]) & kMask);
+            StoreDelta<kBytes>(output, index_g++, sampleCount, (g - prev[1]) & kMask);
+
+            prev[0] = s;
+            prev[1] = g;
+
+            input += kBytes * 2;
+        }
+
+        prev[0] = prev[1] = 0;
+        input = imageData->Buffer.Data + (row + 1) * stride;
+
+        // odd
+        for (unsigned x = 0; x < width; x += 2)
+        {
+            const unsigned a = LoadSample<kBytes>(input);
+            const unsigned b = LoadSample<kBytes>(input + kBytes);
+            const unsigned g = kGreenFirst ? b : a;
+            const unsigned s = kGreenFirst ? a : b;
+
+            StoreDelta<kBytes>(output, index_g++, sampleCount, (g - prev[0]) & kMask);
+            StoreDelta<kBytes>(output, index_y++, sampleCount, (s - prev[1]) & kMask);
+
+            prev[0] = g;
+            prev[1] = s;
+
+            input += kBytes * 2;
+        }
+    }
+}
+
+template<bool kGreenFirst, int kBytes>
+static void UnpackAndUnfilterBayer(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+    const unsigned kMask = (kBytes == 1) ? 0xff : 0xffff;
+
+    const size_t stride = GetRowStride(imageData, kBytes);
+
+    // Color plane split
+    const size_t sampleCount = (size_t)width * height;
+    const size_t planeSamples = sampleCount / 4;
+    size_t index_x = 0;
+    size_t index_y = planeSamples;
+    size_t index_g = planeSamples * 2;
+
+    for (unsigned y = 0; y < height; y += 2)
+    {
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        unsigned prev[2] = { 0, 0 };
+
+        // even
+        for (unsigned x = 0; x < width; x += 2)
+        {
+            const unsigned s = (LoadDelta<kBytes>(input, index_x++, sampleCount) + prev[0]) & kMask;
+            const unsigned g = (LoadDelta<kBytes>(input, index_g++, sampleCount) + prev[1]) & kMask;
+
+            StoreSample<kBytes>(output, kGreenFirst ? g : s);
+            StoreSample<kBytes>(output + kBytes, kGreenFirst ? s : g);
+
+            prev[0] = s;
+            prev[1] = g;
+
+            output += kBytes * 2;
+        }
+
+        prev[0] = prev[1] = 0;
+        output = imageData->Buffer.Data + (y + 1) * stride;
+
+        // odd
+        for (unsigned x = 0; x < width; x += 2)
+        {
+            const unsigned g = (LoadDelta<kBytes>(input, index_g++, sampleCount) + prev[0]) & kMask;
+            const unsigned s = (LoadDelta<kBytes>(input, index_y++, sampleCount) + prev[1]) & kMask;
+
+            StoreSample<kBytes>(output, kGreenFirst ? s : g);
+            StoreSample<kBytes>(output + kBytes, kGreenFirst ? g : s);
+
+            prev[0] = g;
+            prev[1] = s;
+
+            output += kBytes * 2;
+        }
+    }
+}
+#endif
+
+// Deltas wrap around, so the decoder recovers any byte from ref + delta.
+// 0x80 marks an escape, so only bytes that differ by exactly 128 are
+// appended to the overflow list, which has room for one per byte.
+// Returns the number of overflow bytes
+template<int kChannels>
+static size_t PackAndFilterVideo(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+    const size_t refStride = GetRowStride(refData, kChannels);
+
+    size_t overflowCount = 0;
+    uint8_t* overflow = output + (size_t)height * width * kChannels;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+        const uint8_t* ref = refData->Buffer.Data + y * refStride;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                const uint8_t delta = (uint8_t)(input[i] - ref[i]);
+                if (delta == 0x80) {
+                    *overflow = input[i];
+                    ++overflow;
+                    ++overflowCount;
+                }
+                output[i] = delta;
+            }
+
+            ref += kChannels;
+            input += kChannels;
+            output += kChannels;
+        }
+    }
+
+    return overflowCount;
+}
+
+// Escapes read the overflow list, which holds overflowCount bytes.
+// Returns false if the escapes do not use exactly all of them
+template<int kChannels>
+static bool UnpackAndUnfilterVideo(
+    const ZPNG_ImageData* refData,
+    const uint8_t* input,
+    size_t overflowCount,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t refStride = GetRowStride(refData, kChannels);
+    const size_t stride = GetRowStride(imageData, kChannels);
+    const uint8_t* overflow = input + (size_t)height * width * kChannels;
+    const uint8_t* overflowEnd = overflow + overflowCount;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* ref = refData->Buffer.Data + y * refStride;
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            // For each channel:
+            for (unsigned i = 0; i < kChannels; ++i)
+            {
+                if (input[i] == 0x80) {
+                    if (overflow == overflowEnd) {
+                        return false;
+                    }
+                    output[i] = *overflow;
+                    ++overflow;
+                } else
+                    output[i] = ref[i] + input[i];
+            }
+
+            ref += kChannels;
+            input += kChannels;
+            output += kChannels;
+        }
+    }
+
+    return overflow == overflowEnd;
+}
+
+#ifdef ENABLE_RGB_COLOR_FILTER
+
+template<>
+void PackAndFilter<3>(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+    )
+{
+    static const unsigned kChannels = 3;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    uint8_t* output_y = output;
+    uint8_t* output_u = output + planeBytes;
+    uint8_t* output_v = output + planeBytes * 2;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        const uint8_t* input = imageData->Buffer.Data + row * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t r = input[0];
+            uint8_t g = input[1];
+            uint8_t b = input[2];
+
+            r -= prev[0];
+            g -= prev[1];
+            b -= prev[2];
+
+            prev[0] = input[0];
+            prev[1] = input[1];
+            prev[2] = input[2];
+
+            // GB-RG filter from BCIF
+            uint8_t y = b;
+            uint8_t u = g - b;
+            uint8_t v = g - r;
+
+            *output_y++ = y;
+            *output_u++ = u;
+            *output_v++ = v;
+
+            input += kChannels;
+        }
+    }
+}
+
+template<>
+void UnpackAndUnfilter<3>(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+    )
+{
+    static const unsigned kChannels = 3;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    const uint8_t* input_y = input;
+    const uint8_t* input_u = input + planeBytes;
+    const uint8_t* input_v = input + planeBytes * 2;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        uint8_t* output = imageData->Buffer.Data + row * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t y = *input_y++;
+            uint8_t u = *input_u++;
+            uint8_t v = *input_v++;
+
+            // GB-RG filter from BCIF
+            const uint8_t B = y;
+            const uint8_t G = u + B;
+            uint8_t r = G - v;
+            uint8_t g = G;
+            uint8_t b = B;
+
+            r += prev[0];
+            g += prev[1];
+            b += prev[2];
+
+            output[0] = r;
+            output[1] = g;
+            output[2] = b;
+
+            prev[0] = r;
+            prev[1] = g;
+            prev[2] = b;
+
+            output += kChannels;
+        }
+    }
+}
+
+
+// Version for RGBA (with alpha):
+
+template<>
+void PackAndFilter<4>(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+    )
+{
+    static const unsigned kChannels = 4;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    uint8_t* output_y = output;
+    uint8_t* output_u = output + planeBytes;
+    uint8_t* output_v = output + planeBytes * 2;
+    uint8_t* output_a = output + planeBytes * 3;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        const uint8_t* input = imageData->Buffer.Data + row * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t r = input[0];
+            uint8_t g = input[1];
+            uint8_t b = input[2];
+            uint8_t a = input[3];
+
+            r -= prev[0];
+            g -= prev[1];
+            b -= prev[2];
+            a -= prev[3];
+
+            prev[0] = input[0];
+            prev[1] = input[1];
+            prev[2] = input[2];
+            prev[3] = input[3];
+
+            // GB-RG filter from BCIF
+            uint8_t y = b;
+            uint8_t u = g - b;
+            uint8_t v = g - r;
+
+            *output_y++ = y;
+            *output_u++ = u;
+            *output_v++ = v;
+            *output_a++ = a;
+
+            input += kChannels;
+        }
+    }
+}
+
+template<>
+void UnpackAndUnfilter<4>(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+    )
+{
+    static const unsigned kChannels = 4;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    const uint8_t* input_y = input;
+    const uint8_t* input_u = input + planeBytes;
+    const uint8_t* input_v = input + planeBytes * 2;
+    const uint8_t* input_a = input + planeBytes * 3;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        uint8_t* output = imageData->Buffer.Data + row * stride;
+
+        uint8_t prev[kChannels] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t y = *input_y++;
+            uint8_t u = *input_u++;
+            uint8_t v = *input_v++;
+            uint8_t a = *input_a++;
+
+            // GB-RG filter from BCIF
+            const uint8_t B = y;
+            const uint8_t G = u + B;
+            uint8_t r = G - v;
+            uint8_t g = G;
+            uint8_t b = B;
+
+            r += prev[0];
+            g += prev[1];
+            b += prev[2];
+            a += prev[3];
+
+            output[0] = r;
+            output[1] = g;
+            output[2] = b;
+            output[3] = a;
+
+            prev[0] = r;
+            prev[1] = g;
+            prev[2] = b;
+            prev[3] = a;
+
+            output += kChannels;
+        }
+    }
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Spatial Predictors
+
+// Versions of PackAndFilter() and UnpackAndUnfilter() for 1-4 channels that
+// predict from the row above as well.  Like the left filter, each channel is
+// predicted first and the color transform is applied to the residuals.
+
+// Number of ZPNG_Filter predictors usable in an image
+static const unsigned kFilterCount = ZPNG_FILTER_GRADIENT + 1;
+
+// Number of ZPNG_ColorTransform values recorded in an image, and where they
+// go in the strip header Filter byte
+static const unsigned kColorTransformCount = ZPNG_COLOR_YCOCG_R + 1;
+static const unsigned kColorTransformShift = 4;
+
+// Filter byte transform bits of delta frames with a motion section and a
+// skip section
+static const unsigned kVideoMotion = 1;
+static const unsigned kVideoSkip = 2;
+
+template<int kFilter>
+static inline uint8_t Predict(int a, int b, int c)
+{
+    switch (kFilter)
+    {
+    case ZPNG_FILTER_UP:
+        return (uint8_t)b;
+    case ZPNG_FILTER_AVERAGE:
+        return (uint8_t)((a + b) >> 1);
+    case ZPNG_FILTER_PAETH:
+        {
+            const int p = a + b - c;
+            const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            if (pa <= pb && pa <= pc) {
+                return (uint8_t)a;
+            }
+            return (uint8_t)(pb <= pc ? b : c);
+        }
+    case ZPNG_FILTER_GRADIENT:
+        {
+            const int g = a + b - c;
+            return (uint8_t)(g < 0 ? 0 : (g > 255 ? 255 : g));
+        }
+    default:
+        return (uint8_t)a;
+    }
+}
+
+// RGB and RGBA residuals get the color transform and are split into planes
+// as in PackAndFilter<3>, while 1-2 channels stay interleaved
+template<int kChannels>
+struct ResidualLayout
+{
+#ifdef ENABLE_RGB_COLOR_FILTER
+    static const bool kPlanar = (kChannels >= 3);
+#else
+    static const bool kPlanar = false;
+#endif
+};
+
+// Arithmetic shift right by one of a residual taken as signed, for the
+// lifting steps of YCoCg-R
+static inline uint8_t HalfResidual(uint8_t x)
+{
+    return (uint8_t)((x >> 1) | (x & 0x80));
+}
+
+// ZPNG_ColorTransform of the R, G, B residuals in d[0..2], in place
+template<int kChannels, int kTransform = ZPNG_COLOR_GB_RG>
+static inline void ForwardColor(uint8_t* d)
+{
+    if (!ResidualLayout<kChannels>::kPlanar) {
+        return;
+    }
+
+    const uint8_t r = d[0], g = d[1], b = d[2];
+    switch (kTransform)
+    {
+    case ZPNG_COLOR_NONE:
+        break;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        d[0] = g;
+        d[1] = r - g;
+        d[2] = b - g;
+        break;
+    case ZPNG_COLOR_YCOCG_R:
+        {
+            const uint8_t co = r - b;
+            const uint8_t t = b + HalfResidual(co);
+            const uint8_t cg = g - t;
+            d[0] = t + HalfResidual(cg);
+            d[1] = co;
+            d[2] = cg;
+        }
+        break;
+    default:
+        // GB-RG filter from BCIF
+        d[0] = b;
+        d[1] = g - b;
+        d[2] = g - r;
+        break;
+    }
+}
+
+template<int kChannels, int kTransform = ZPNG_COLOR_GB_RG>
+static inline void InverseColor(uint8_t* d)
+{
+    if (!ResidualLayout<kChannels>::kPlanar) {
+        return;
+    }
+
+    switch (kTransform)
+    {
+    case ZPNG_COLOR_NONE:
+        break;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        {
+            const uint8_t G = d[0];
+            d[0] = d[1] + G;
+            d[1] = G;
+            d[2] = d[2] + G;
+        }
+        break;
+    case ZPNG_COLOR_YCOCG_R:
+        {
+            const uint8_t co = d[1], cg = d[2];
+            const uint8_t t = d[0] - HalfResidual(cg);
+            const uint8_t B = t - HalfResidual(co);
+            d[0] = B + co;
+            d[1] = cg + t;
+            d[2] = B;
+        }
+        break;
+    default:
+        {
+            const uint8_t B = d[0];
+            const uint8_t G = d[1] + B;
+            d[0] = G - d[2];
+            d[1] = G;
+            d[2] = B;
+        }
+        break;
+    }
+}
+
+// Residuals of pixel x in a row, before the color transform
+template<int kChannels, int kFilter>
+static inline void PredictPixel(
+    const uint8_t* row,
+    const uint8_t* up,
+    unsigned x,
+    uint8_t* d
+)
+{
+    for (int i = 0; i < kChannels; ++i)
+    {
+        const unsigned index = x * kChannels + i;
+        const int a = (x > 0) ? row[index - kChannels] : 0;
+        const int b = up ? up[index] : 0;
+        const int c = (up && x > 0) ? up[index - kChannels] : 0;
+        d[i] = row[index] - Predict<kFilter>(a, b, c);
+    }
+}
+
+template<int kChannels, int kFilter, int kTransform = ZPNG_COLOR_GB_RG>
+static void PackAndPredict(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    const bool planar = ResidualLayout<kChannels>::kPlanar;
+    const size_t channelStep = planar ? (size_t)width * height : 1;
+    const size_t pixelStep = planar ? 1 : kChannels;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* row = imageData->Buffer.Data + y * stride;
+        const uint8_t* up = (y > 0) ? row - stride : nullptr;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t d[kChannels];
+            PredictPixel<kChannels, kFilter>(row, up, x, d);
+            ForwardColor<kChannels, kTransform>(d);
+
+            for (int i = 0; i < kChannels; ++i) {
+                output[i * channelStep] = d[i];
+            }
+            output += pixelStep;
+        }
+    }
+}
+
+template<int kChannels, int kFilter, int kTransform = ZPNG_COLOR_GB_RG>
+static void UnpackAndUnpredict(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    const bool planar = ResidualLayout<kChannels>::kPlanar;
+    const size_t channelStep = planar ? (size_t)width * height : 1;
+    const size_t pixelStep = planar ? 1 : kChannels;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        uint8_t* row = imageData->Buffer.Data + y * stride;
+        const uint8_t* up = (y > 0) ? row - stride : nullptr;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint8_t d[kChannels];
+            for (int i = 0; i < kChannels; ++i) {
+                d[i] = input[i * channelStep];
+            }
+            input += pixelStep;
+            InverseColor<kChannels, kTransform>(d);
+
+            for (int i = 0; i < kChannels; ++i)
+            {
+                const unsigned index = x * kChannels + i;
+                const int a = (x > 0) ? row[index - kChannels] : 0;
+                const int b = up ? up[index] : 0;
+                const int c = (up && x > 0) ? up[index - kChannels] : 0;
+                row[index] = d[i] + Predict<kFilter>(a, b, c);
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// SIMD Kernels
+
+// SSSE3 versions of the kernels, selected at runtime when the CPU supports
+// them.  They write exactly the same packed data as the scalar versions
+// above, which remain the fallback and handle the ends of rows and images.
+
+#ifdef ZPNG_ENABLE_SSSE3
+
+static bool HasSSSE3()
+{
+    static const bool kHasSSSE3 = ZSTD_cpuid_ssse3(ZSTD_cpuid()) != 0;
+    return kHasSSSE3;
+}
+
+// The video delta codes every byte on its own, so these versions treat each
+// row as one run of bytes whatever the pixel size.  They use just SSE2
+// but share the SSSE3 dispatch.  Escapes are rare, so only blocks that
+// contain one are handled a byte at a time.
+
+// Returns the number of overflow bytes
+ZPNG_TARGET_SSSE3 static size_t PackAndFilterVideoSIMD(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    uint8_t* output
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+    const size_t refStride = GetRowStride(refData, pixelBytes);
+
+    size_t overflowCount = 0;
+    uint8_t* overflow = output + rowBytes * height;
+
+    const __m128i escape = _mm_set1_epi8((char)0x80);
+
+    for (unsigned y = 0; y < height; ++y, output += rowBytes)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+        const uint8_t* ref = refData->Buffer.Data + y * refStride;
+
+        size_t i = 0;
+        for (; i + 16 <= rowBytes; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i*)(input + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(ref + i));
+            const __m128i delta = _mm_sub_epi8(a, b);
+            _mm_storeu_si128((__m128i*)(output + i), delta);
+
+            const unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(delta, escape));
+            if (mask == 0) {
+                continue;
+            }
+
+            // Append the escaped bytes in order
+            for (unsigned j = 0; j < 16; ++j)
+            {
+                if (mask & (1u << j))
+                {
+                    *overflow = input[i + j];
+                    ++overflow;
+                    ++overflowCount;
+                }
+            }
+        }
+
+        for (; i < rowBytes; ++i)
+        {
+            const uint8_t delta = (uint8_t)(input[i] - ref[i]);
+            if (delta == 0x80) {
+                *overflow = input[i];
+                ++overflow;
+                ++overflowCount;
+            }
+            output[i] = delta;
+        }
+    }
+
+    return overflowCount;
+}
+
+ZPNG_TARGET_SSSE3 static bool UnpackAndUnfilterVideoSIMD(
+    const ZPNG_ImageData* refData,
+    const uint8_t* input,
+    unsigned pixelBytes,
+    size_t overflowCount,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+    const size_t refStride = GetRowStride(refData, pixelBytes);
+
+    const uint8_t* overflow = input + rowBytes * height;
+    const uint8_t* overflowEnd = overflow + overflowCount;
+
+    const __m128i escape = _mm_set1_epi8((char)0x80);
+
+    for (unsigned y = 0; y < height; ++y, input += rowBytes)
+    {
+        const uint8_t* ref = refData->Buffer.Data + y * refStride;
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        size_t i = 0;
+        for (; i + 16 <= rowBytes; i += 16)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i*)(input + i));
+            const __m128i b = _mm_loadu_si128((const __m128i*)(ref + i));
+            _mm_storeu_si128((__m128i*)(output + i), _mm_add_epi8(a, b));
+
+            // Replace escaped bytes from the overflow list
+            const unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, escape));
+            if (mask != 0)
+            {
+                for (unsigned j = 0; j < 16; ++j)
+                {
+                    if (mask & (1u << j)) {
+                        if (overflow == overflowEnd) {
+                            return false;
+                        }
+                        output[i + j] = *overflow;
+                        ++overflow;
+                    }
+                }
+            }
+        }
+
+        for (; i < rowBytes; ++i)
+        {
+            if (input[i] == 0x80) {
+                if (overflow == overflowEnd) {
+                    return false;
+                }
+                output[i] = *overflow;
+                ++overflow;
+            } else
+                output[i] = ref[i] + input[i];
+        }
+    }
+
+    return overflow == overflowEnd;
+}
+
+#ifdef ENABLE_RGB_COLOR_FILTER
+
+// Each byte minus the byte before it, using the last byte of prev for the first
+ZPNG_TARGET_SSSE3 static inline __m128i DeltaBytes(__m128i x, __m128i prev)
+{
+    return _mm_sub_epi8(x, _mm_alignr_epi8(x, prev, 15));
+}
+
+// Running sum of the bytes, continuing from the last byte of prev
+ZPNG_TARGET_SSSE3 static inline __m128i PrefixSumBytes(__m128i x, __m128i prev)
+{
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    return _mm_add_epi8(x, _mm_shuffle_epi8(prev, _mm_set1_epi8(15)));
+}
+
+// Split 16 RGB pixels into one register per channel
+// HalfResidual() of each byte
+ZPNG_TARGET_SSSE3 static inline __m128i HalfBytes(__m128i x)
+{
+    const __m128i low = _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi8(0x7F));
+    return _mm_or_si128(low, _mm_and_si128(x, _mm_set1_epi8((char)0x80)));
+}
+
+// ForwardColor() of 16 residuals per channel into the Y, U, V planes
+template<int kTransform>
+ZPNG_TARGET_SSSE3 static inline void ForwardColorBytes(
+    __m128i r, __m128i g, __m128i b,
+    __m128i& y, __m128i& u, __m128i& v
+)
+{
+    switch (kTransform)
+    {
+    case ZPNG_COLOR_NONE:
+        y = r;
+        u = g;
+        v = b;
+        break;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        y = g;
+        u = _mm_sub_epi8(r, g);
+        v = _mm_sub_epi8(b, g);
+        break;
+    case ZPNG_COLOR_YCOCG_R:
+        {
+            u = _mm_sub_epi8(r, b);
+            const __m128i t = _mm_add_epi8(b, HalfBytes(u));
+            v = _mm_sub_epi8(g, t);
+            y = _mm_add_epi8(t, HalfBytes(v));
+        }
+        break;
+    default:
+        // GB-RG filter from BCIF
+        y = b;
+        u = _mm_sub_epi8(g, b);
+        v = _mm_sub_epi8(g, r);
+        break;
+    }
+}
+
+// InverseColor() of 16 bytes per plane into the R, G, B residuals
+template<int kTransform>
+ZPNG_TARGET_SSSE3 static inline void InverseColorBytes(
+    __m128i y, __m128i u, __m128i v,
+    __m128i& r, __m128i& g, __m128i& b
+)
+{
+    switch (kTransform)
+    {
+    case ZPNG_COLOR_NONE:
+        r = y;
+        g = u;
+        b = v;
+        break;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        r = _mm_add_epi8(u, y);
+        g = y;
+        b = _mm_add_epi8(v, y);
+        break;
+    case ZPNG_COLOR_YCOCG_R:
+        {
+            const __m128i t = _mm_sub_epi8(y, HalfBytes(v));
+            g = _mm_add_epi8(v, t);
+            b = _mm_sub_epi8(t, HalfBytes(u));
+            r = _mm_add_epi8(b, u);
+        }
+        break;
+    default:
+        g = _mm_add_epi8(u, y);
+        r = _mm_sub_epi8(g, v);
+        b = y;
+        break;
+    }
+}
+
+ZPNG_TARGET_SSSE3 static inline void LoadPixelsRGB(
+    const uint8_t* input,
+    __m128i& r,
+    __m128i& g,
+    __m128i& b
+)
+{
+    const __m128i a0 = _mm_loadu_si128((const __m128i*)input);
+    const __m128i a1 = _mm_loadu_si128((const __m128i*)(input + 16));
+    const __m128i a2 = _mm_loadu_si128((const __m128i*)(input + 32));
+
+    r = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(a0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    g = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(a0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    b = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(a0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+        _mm_shuffle_epi8(a1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+        _mm_shuffle_epi8(a2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Interleave one register per channel into 16 RGB pixels
+ZPNG_TARGET_SSSE3 static inline void StorePixelsRGB(
+    uint8_t* output,
+    __m128i r,
+    __m128i g,
+    __m128i b
+)
+{
+    const __m128i a0 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+    const __m128i a1 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+    const __m128i a2 = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+        _mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+        _mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+    _mm_storeu_si128((__m128i*)output, a0);
+    _mm_storeu_si128((__m128i*)(output + 16), a1);
+    _mm_storeu_si128((__m128i*)(output + 32), a2);
+}
+
+// Split 16 RGBA pixels into one register per channel
+ZPNG_TARGET_SSSE3 static inline void LoadPixelsRGBA(
+    const uint8_t* input,
+    __m128i& r,
+    __m128i& g,
+    __m128i& b,
+    __m128i& a
+)
+{
+    // Gather each block of 4 pixels into 32-bit words of one channel each
+    const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input), gather);
+    const __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(input + 16)), gather);
+    const __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(input + 32)), gather);
+    const __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(input + 48)), gather);
+
+    // Transpose the 4x4 words
+    const __m128i t0 = _mm_unpacklo_epi32(s0, s1);
+    const __m128i t1 = _mm_unpackhi_epi32(s0, s1);
+    const __m128i t2 = _mm_unpacklo_epi32(s2, s3);
+    const __m128i t3 = _mm_unpackhi_epi32(s2, s3);
+    r = _mm_unpacklo_epi64(t0, t2);
+    g = _mm_unpackhi_epi64(t0, t2);
+    b = _mm_unpacklo_epi64(t1, t3);
+    a = _mm_unpackhi_epi64(t1, t3);
+}
+
+// Interleave one register per channel into 16 RGBA pixels
+ZPNG_TARGET_SSSE3 static inline void StorePixelsRGBA(
+    uint8_t* output,
+    __m128i r,
+    __m128i g,
+    __m128i b,
+    __m128i a
+)
+{
+    // Transpose the 4x4 words, then the bytes within each block of 4 pixels
+    const __m128i t0 = _mm_unpacklo_epi32(r, g);
+    const __m128i t1 = _mm_unpacklo_epi32(b, a);
+    const __m128i t2 = _mm_unpackhi_epi32(r, g);
+    const __m128i t3 = _mm_unpackhi_epi32(b, a);
+    const __m128i scatter = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    _mm_storeu_si128((__m128i*)output, _mm_shuffle_epi8(_mm_unpacklo_epi64(t0, t1), scatter));
+    _mm_storeu_si128((__m128i*)(output + 16), _mm_shuffle_epi8(_mm_unpackhi_epi64(t0, t1), scatter));
+    _mm_storeu_si128((__m128i*)(output + 32), _mm_shuffle_epi8(_mm_unpacklo_epi64(t2, t3), scatter));
+    _mm_storeu_si128((__m128i*)(output + 48), _mm_shuffle_epi8(_mm_unpackhi_epi64(t2, t3), scatter));
+}
+
+// With kStream the store bypasses the cache where `output` is aligned
+template<bool kStream>
+ZPNG_TARGET_SSSE3 static inline void StorePlaneBytes(uint8_t* output, __m128i bytes)
+{
+    if (kStream && ((uintptr_t)output & 15) == 0) {
+        _mm_stream_si128((__m128i*)output, bytes);
+    } else {
+        _mm_storeu_si128((__m128i*)output, bytes);
+    }
+}
+
+template<bool kStream, int kTransform = ZPNG_COLOR_GB_RG>
+ZPNG_TARGET_SSSE3 static void PackAndFilterSSSE3_RGB(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    static const unsigned kChannels = 3;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    uint8_t* output_y = output;
+    uint8_t* output_u = output + planeBytes;
+    uint8_t* output_v = output + planeBytes * 2;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        const uint8_t* input = imageData->Buffer.Data + row * stride;
+
+        __m128i prevR = _mm_setzero_si128();
+        __m128i prevG = _mm_setzero_si128();
+        __m128i prevB = _mm_setzero_si128();
+
+        unsigned x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i r, g, b;
+            LoadPixelsRGB(input, r, g, b);
+
+            const __m128i dr = DeltaBytes(r, prevR);
+            const __m128i dg = DeltaBytes(g, prevG);
+            const __m128i db = DeltaBytes(b, prevB);
+            prevR = r;
+            prevG = g;
+            prevB = b;
+
+            __m128i y, u, v;
+            ForwardColorBytes<kTransform>(dr, dg, db, y, u, v);
+            StorePlaneBytes<kStream>(output_y, y);
+            StorePlaneBytes<kStream>(output_u, u);
+            StorePlaneBytes<kStream>(output_v, v);
+
+            input += 16 * kChannels;
+            output_y += 16;
+            output_u += 16;
+            output_v += 16;
+        }
+
+        uint8_t prev[kChannels] = { 0 };
+        if (x > 0) {
+            memcpy(prev, input - kChannels, kChannels);
+        }
+
+        for (; x < width; ++x)
+        {
+            uint8_t d[kChannels];
+            for (unsigned i = 0; i < kChannels; ++i) {
+                d[i] = input[i] - prev[i];
+            }
+            memcpy(prev, input, kChannels);
+            ForwardColor<kChannels, kTransform>(d);
+
+            *output_y++ = d[0];
+            *output_u++ = d[1];
+            *output_v++ = d[2];
+
+            input += kChannels;
+        }
+    }
+}
+
+template<int kTransform = ZPNG_COLOR_GB_RG>
+ZPNG_TARGET_SSSE3 static void UnpackAndUnfilterSSSE3_RGB(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData
+)
+{
+    static const unsigned kChannels = 3;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    const uint8_t* input_y = input;
+    const uint8_t* input_u = input + planeBytes;
+    const uint8_t* input_v = input + planeBytes * 2;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        uint8_t* output = imageData->Buffer.Data + row * stride;
+
+        __m128i prevR = _mm_setzero_si128();
+        __m128i prevG = _mm_setzero_si128();
+        __m128i prevB = _mm_setzero_si128();
+
+        unsigned x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i y = _mm_loadu_si128((const __m128i*)input_y);
+            const __m128i u = _mm_loadu_si128((const __m128i*)input_u);
+            const __m128i v = _mm_loadu_si128((const __m128i*)input_v);
+
+            __m128i dr, dg, db;
+            InverseColorBytes<kTransform>(y, u, v, dr, dg, db);
+            prevR = PrefixSumBytes(dr, prevR);
+            prevG = PrefixSumBytes(dg, prevG);
+            prevB = PrefixSumBytes(db, prevB);
+
+            StorePixelsRGB(output, prevR, prevG, prevB);
+
+            input_y += 16;
+            input_u += 16;
+            input_v += 16;
+            output += 16 * kChannels;
+        }
+
+        uint8_t prev[kChannels] = { 0 };
+        if (x > 0) {
+            memcpy(prev, output - kChannels, kChannels);
+        }
+
+        for (; x < width; ++x)
+        {
+            uint8_t d[kChannels] = { *input_y++, *input_u++, *input_v++ };
+            InverseColor<kChannels, kTransform>(d);
+
+            prev[0] += d[0];
+            prev[1] += d[1];
+            prev[2] += d[2];
+
+            output[0] = prev[0];
+            output[1] = prev[1];
+            output[2] = prev[2];
+
+            output += kChannels;
+        }
+    }
+}
+
+// Without kAlpha the alpha plane is left out, as for a constant alpha
+template<bool kAlpha, bool kStream = false, int kTransform = ZPNG_COLOR_GB_RG>
+ZPNG_TARGET_SSSE3 static void PackAndFilterSSSE3_RGBA(
+    const ZPNG_ImageData* imageData,
+    uint8_t* output
+)
+{
+    static const unsigned kChannels = 4;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    uint8_t* output_y = output;
+    uint8_t* output_u = output + planeBytes;
+    uint8_t* output_v = output + planeBytes * 2;
+    uint8_t* output_a = output + planeBytes * 3;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        const uint8_t* input = imageData->Buffer.Data + row * stride;
+
+        __m128i prevR = _mm_setzero_si128();
+        __m128i prevG = _mm_setzero_si128();
+        __m128i prevB = _mm_setzero_si128();
+        __m128i prevA = _mm_setzero_si128();
+
+        unsigned x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i r, g, b, a;
+            LoadPixelsRGBA(input, r, g, b, a);
+
+            const __m128i dr = DeltaBytes(r, prevR);
+            const __m128i dg = DeltaBytes(g, prevG);
+            const __m128i db = DeltaBytes(b, prevB);
+            const __m128i da = DeltaBytes(a, prevA);
+            prevR = r;
+            prevG = g;
+            prevB = b;
+            prevA = a;
+
+            __m128i y, u, v;
+            ForwardColorBytes<kTransform>(dr, dg, db, y, u, v);
+            StorePlaneBytes<kStream>(output_y, y);
+            StorePlaneBytes<kStream>(output_u, u);
+            StorePlaneBytes<kStream>(output_v, v);
+            if (kAlpha)
+            {
+                StorePlaneBytes<kStream>(output_a, da);
+                output_a += 16;
+            }
+
+            input += 16 * kChannels;
+            output_y += 16;
+            output_u += 16;
+            output_v += 16;
+        }
+
+        uint8_t prev[kChannels] = { 0 };
+        if (x > 0) {
+            memcpy(prev, input - kChannels, kChannels);
+        }
+
+        for (; x < width; ++x)
+        {
+            uint8_t d[kChannels];
+            for (unsigned i = 0; i < kChannels; ++i) {
+                d[i] = input[i] - prev[i];
+            }
+            memcpy(prev, input, kChannels);
+            ForwardColor<kChannels, kTransform>(d);
+
+            *output_y++ = d[0];
+            *output_u++ = d[1];
+            *output_v++ = d[2];
+            if (kAlpha) {
+                *output_a++ = d[3];
+            }
+
+            input += kChannels;
+        }
+    }
+}
+
+// Without kAlpha there is no alpha plane, and every pixel gets `alpha`
+template<bool kAlpha, int kTransform = ZPNG_COLOR_GB_RG>
+ZPNG_TARGET_SSSE3 static void UnpackAndUnfilterSSSE3_RGBA(
+    const uint8_t* input,
+    ZPNG_ImageData* imageData,
+    uint8_t alpha = 0
+)
+{
+    static const unsigned kChannels = 4;
+
+    const unsigned height = imageData->HeightPixels;
+    const unsigned width = imageData->WidthPixels;
+
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    // Color plane split
+    const size_t planeBytes = (size_t)width * height;
+    const uint8_t* input_y = input;
+    const uint8_t* input_u = input + planeBytes;
+    const uint8_t* input_v = input + planeBytes * 2;
+    const uint8_t* input_a = input + planeBytes * 3;
+
+    for (unsigned row = 0; row < height; ++row)
+    {
+        uint8_t* output = imageData->Buffer.Data + row * stride;
+
+        __m128i prevR = _mm_setzero_si128();
+        __m128i prevG = _mm_setzero_si128();
+        __m128i prevB = _mm_setzero_si128();
+        __m128i prevA = _mm_set1_epi8((char)alpha);
+
+        unsigned x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i y = _mm_loadu_si128((const __m128i*)input_y);
+            const __m128i u = _mm_loadu_si128((const __m128i*)input_u);
+            const __m128i v = _mm_loadu_si128((const __m128i*)input_v);
+
+            __m128i dr, dg, db;
+            InverseColorBytes<kTransform>(y, u, v, dr, dg, db);
+            prevR = PrefixSumBytes(dr, prevR);
+            prevG = PrefixSumBytes(dg, prevG);
+            prevB = PrefixSumBytes(db, prevB);
+            if (kAlpha)
+            {
+                prevA = PrefixSumBytes(_mm_loadu_si128((const __m128i*)input_a), prevA);
+                input_a += 16;
+            }
+
+            StorePixelsRGBA(output, prevR, prevG, prevB, prevA);
+
+            input_y += 16;
+            input_u += 16;
+            input_v += 16;
+            output += 16 * kChannels;
+        }
+
+        uint8_t prev[kChannels] = { 0, 0, 0, alpha };
+        if (x > 0) {
+            memcpy(prev, output - kChannels, kChannels);
+        }
+
+        for (; x < width; ++x)
+        {
+            uint8_t d[3] = { *input_y++, *input_u++, *input_v++ };
+            InverseColor<3, kTransform>(d);
+
+            prev[0] += d[0];
+            prev[1] += d[1];
+            prev[2] += d[2];
+            if (kAlpha) {
+                prev[3] += *input_a++;
+            }
+
+            memcpy(output, prev, kChannels);
+
+            output += kChannels;
+        }
+    }
+}
+
+#endif // ENABLE_RGB_COLOR_FILTER
+
+#endif // ZPNG_ENABLE_SSSE3
+
+//------------------------------------------------------------------------------
+// Kernel Dispatch
+
+// Bytes per pixel in the packed representation
+static unsigned GetPixelBytes(const ZPNG_ImageData* imageData)
+{
+    return (imageData->BytesPerChannel > 8) ? imageData->Channels : imageData->BytesPerChannel * imageData->Channels;
+}
+
+// Bytes of tightly packed pixels in the image.
+// Returns false if the image is too large to address, leaving headroom
+// for the compression bounds
+static bool GetImageBytes(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    size_t* byteCount
+)
+{
+    const uint64_t pixelCount = (uint64_t)imageData->WidthPixels * imageData->HeightPixels;
+    if (pixelBytes != 0 && pixelCount > (uint64_t)((size_t)-1 / 2) / pixelBytes) {
+        return false;
+    }
+    *byteCount = (size_t)(pixelCount * pixelBytes);
+    return true;
+}
+
+// Space for the escapes after `bytes` of packed deltas.  Only deltas of
+// exactly +/-128 are escaped, each with one byte, so a delta frame never
+// has more escapes than bytes.  I-frames have none
+static inline size_t GetOverflowBytes(size_t bytes, bool delta)
+{
+    return (delta && bytes > kMinOverflowBytes) ? bytes : kMinOverflowBytes;
+}
+
+static bool IsBayerFormat(unsigned pixelFormat)
+{
+    return pixelFormat >= ZPNG_PIXEL_FORMAT_BAYER_RGGB && pixelFormat <= ZPNG_PIXEL_FORMAT_BAYER_GBRG;
+}
+
+// Returns the Bayer layout of the image, or ZPNG_PIXEL_FORMAT_DEFAULT
+static unsigned GetBayerFormat(const ZPNG_ImageData* imageData)
+{
+    // Older callers select 8-bit RGGB/BGGR with BytesPerChannel > 8
+    if (imageData->BytesPerChannel > 8) {
+        return ZPNG_PIXEL_FORMAT_BAYER_RGGB;
+    }
+    return IsBayerFormat(imageData->PixelFormat) ? imageData->PixelFormat : (unsigned)ZPNG_PIXEL_FORMAT_DEFAULT;
+}
+
+// Headers store the pixel format as 0 or the Bayer layouts as 1-4
+static uint8_t GetPixelFormatCode(unsigned pixelFormat)
+{
+    return IsBayerFormat(pixelFormat) ? (uint8_t)(pixelFormat - ZPNG_PIXEL_FORMAT_BAYER_RGGB + 1) : 0;
+}
+
+// Unknown codes give a format that IsValidPixelFormat() rejects
+static unsigned GetPixelFormatFromCode(uint8_t code)
+{
+    if (code == 0) {
+        return ZPNG_PIXEL_FORMAT_DEFAULT;
+    }
+    return code <= 4 ? ZPNG_PIXEL_FORMAT_BAYER_RGGB + code - 1u : ~0u;
+}
+
+// Returns true if the pixel format matches the other image fields
+static bool IsValidPixelFormat(const ZPNG_ImageData* imageData)
+{
+    if (imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT && !IsBayerFormat(imageData->PixelFormat)) {
+        return false;
+    }
+    if (IsBayerFormat(imageData->PixelFormat))
+    {
+        return imageData->Channels == 1 &&
+            (imageData->BytesPerChannel == 1 || imageData->BytesPerChannel == 2) &&
+            (imageData->WidthPixels % 2) == 0 &&
+            (imageData->HeightPixels % 2) == 0;
+    }
+    // The Bayer kernels work on whole 2x2 quads, also for older callers
+    if (imageData->BytesPerChannel > 8) {
+        return (imageData->WidthPixels % 2) == 0 && (imageData->HeightPixels % 2) == 0;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Kernel Table
+
+typedef void (*ZPNG_PackKernel)(const ZPNG_ImageData* imageData, uint8_t* packing);
+typedef void (*ZPNG_UnpackKernel)(const uint8_t* packing, ZPNG_ImageData* imageData);
+
+// Intra kernels for one pixel layout, indexed by ZPNG_Filter, or null where
+// the layout does not support the filter.  GetKernels() finds the set for
+// an image once instead of switching on its pixel size for every strip
+struct ZPNG_Kernels
+{
+    ZPNG_PackKernel Pack[kFilterCount];
+    ZPNG_UnpackKernel Unpack[kFilterCount];
+};
+
+// Delta against a reference frame, which works on bytes whatever the pixel
+// format, found with GetVideoKernels()
+struct ZPNG_VideoKernels
+{
+    size_t (*Pack)(const ZPNG_ImageData* refData, const ZPNG_ImageData* imageData, uint8_t* packing);
+    bool (*Unpack)(const ZPNG_ImageData* refData, const uint8_t* packing, size_t overflowCount, ZPNG_ImageData* imageData);
+};
+
+// Kernel sets for each CPU: Scalar, then SSSE3 if it is built
+#ifdef ZPNG_ENABLE_SSSE3
+static const unsigned kSimdLevels = 2;
+#else
+static const unsigned kSimdLevels = 1;
+#endif
+
+// Index of the kernel sets for this CPU
+static unsigned GetSimdLevel()
+{
+#ifdef ZPNG_ENABLE_SSSE3
+    if (HasSSSE3()) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// Spatial predictors of kChannels, which exist for 1-4 channels
+template<int kChannels, int kFilter, int kTransform = ZPNG_COLOR_GB_RG, bool kPredictable = (kChannels <= 4)>
+struct ZPNG_PredictorKernels
+{
+    static constexpr ZPNG_PackKernel Pack() { return PackAndPredict<kChannels, kFilter, kTransform>; }
+    static constexpr ZPNG_UnpackKernel Unpack() { return UnpackAndUnpredict<kChannels, kFilter, kTransform>; }
+};
+
+template<int kChannels, int kFilter, int kTransform>
+struct ZPNG_PredictorKernels<kChannels, kFilter, kTransform, false>
+{
+    static constexpr ZPNG_PackKernel Pack() { return nullptr; }
+    static constexpr ZPNG_UnpackKernel Unpack() { return nullptr; }
+};
+
+// Left filter kernels of kPixelBytes, and the predictors for that many
+// channels with the color transform of the left filter
+template<int kPixelBytes, int kTransform = ZPNG_COLOR_GB_RG>
+static constexpr ZPNG_Kernels MakeByteKernels(ZPNG_PackKernel pack, ZPNG_UnpackKernel unpack)
+{
+    return {
+        {
+            pack,
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_UP, kTransform>::Pack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_AVERAGE, kTransform>::Pack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_PAETH, kTransform>::Pack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_GRADIENT, kTransform>::Pack()
+        },
+        {
+            unpack,
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_UP, kTransform>::Unpack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_AVERAGE, kTransform>::Unpack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_PAETH, kTransform>::Unpack(),
+            ZPNG_PredictorKernels<kPixelBytes, ZPNG_FILTER_GRADIENT, kTransform>::Unpack()
+        }
+    };
+}
+
+template<int kPixelBytes>
+static constexpr ZPNG_Kernels MakeByteKernels()
+{
+    return MakeByteKernels<kPixelBytes>(PackAndFilter<kPixelBytes>, UnpackAndUnfilter<kPixelBytes>);
+}
+
+// Kernels with only the left filter, as for 16-bit and Bayer images
+static constexpr ZPNG_Kernels MakeLeftKernels(ZPNG_PackKernel pack, ZPNG_UnpackKernel unpack)
+{
+    return { { pack }, { unpack } };
+}
+
+#ifdef ENABLE_RGB_COLOR_FILTER
+// Kernels of RGB or RGBA for a color transform other than GB-RG.  The left
+// filter is the scalar predictor unless SSSE3 versions are given
+template<int kPixelBytes, int kTransform>
+static constexpr ZPNG_Kernels MakeColorKernels()
+{
+    return MakeByteKernels<kPixelBytes, kTransform>(
+        PackAndPredict<kPixelBytes, ZPNG_FILTER_LEFT, kTransform>,
+        UnpackAndUnpredict<kPixelBytes, ZPNG_FILTER_LEFT, kTransform>);
+}
+
+#ifdef ZPNG_ENABLE_SSSE3
+template<int kTransform>
+ZPNG_TARGET_SSSE3 static void UnpackAndUnfilterSSSE3_RGBAPlanes(const uint8_t* packing, ZPNG_ImageData* imageData)
+{
+    UnpackAndUnfilterSSSE3_RGBA<true, kTransform>(packing, imageData);
+}
+
+#endif
+#endif // ENABLE_RGB_COLOR_FILTER
+
+#ifdef ZPNG_ENABLE_SSSE3
+template<int kPixelBytes>
+ZPNG_TARGET_SSSE3 static size_t PackAndFilterVideoSIMD(const ZPNG_ImageData* refData, const ZPNG_ImageData* imageData, uint8_t* packing)
+{
+    return PackAndFilterVideoSIMD(refData, imageData, kPixelBytes, packing);
+}
+
+template<int kPixelBytes>
+ZPNG_TARGET_SSSE3 static bool UnpackAndUnfilterVideoSIMD(const ZPNG_ImageData* refData, const uint8_t* packing, size_t overflowCount, ZPNG_ImageData* imageData)
+{
+    return UnpackAndUnfilterVideoSIMD(refData, packing, kPixelBytes, overflowCount, imageData);
+}
+#endif
+
+// Byte kernels by CPU and pixel bytes 1-8.  With ENABLE_RGB_COLOR_FILTER
+// 3 and 4 bytes split into color planes, with SSSE3 versions
+static const ZPNG_Kernels kByteKernels[kSimdLevels][8] = {
+    {
+        MakeByteKernels<1>(),
+        MakeByteKernels<2>(),
+        MakeByteKernels<3>(),
+        MakeByteKernels<4>(),
+        MakeByteKernels<5>(),
+        MakeByteKernels<6>(),
+        MakeByteKernels<7>(),
+        MakeByteKernels<8>()
+    },
+#ifdef ZPNG_ENABLE_SSSE3
+    {
+        MakeByteKernels<1>(),
+        MakeByteKernels<2>(),
+#ifdef ENABLE_RGB_COLOR_FILTER
+        MakeByteKernels<3>(PackAndFilterSSSE3_RGB<false>, UnpackAndUnfilterSSSE3_RGB),
+        MakeByteKernels<4>(PackAndFilterSSSE3_RGBA<true>, UnpackAndUnfilterSSSE3_RGBAPlanes<ZPNG_COLOR_GB_RG>),
+#else
+        MakeByteKernels<3>(),
+        MakeByteKernels<4>(),
+#endif
+        MakeByteKernels<5>(),
+        MakeByteKernels<6>(),
+        MakeByteKernels<7>(),
+        MakeByteKernels<8>()
+    },
+#endif
+};
+
+#ifdef ENABLE_RGB_COLOR_FILTER
+// RGB and RGBA kernels by CPU, then ZPNG_ColorTransform after the GB-RG
+// one of kByteKernels
+static const ZPNG_Kernels kColorKernels[kSimdLevels][kColorTransformCount - 1][2] = {
+    {
+        { MakeColorKernels<3, ZPNG_COLOR_NONE>(), MakeColorKernels<4, ZPNG_COLOR_NONE>() },
+        { MakeColorKernels<3, ZPNG_COLOR_SUBTRACT_GREEN>(), MakeColorKernels<4, ZPNG_COLOR_SUBTRACT_GREEN>() },
+        { MakeColorKernels<3, ZPNG_COLOR_YCOCG_R>(), MakeColorKernels<4, ZPNG_COLOR_YCOCG_R>() }
+    },
+#ifdef ZPNG_ENABLE_SSSE3
+    {
+        {
+            MakeByteKernels<3, ZPNG_COLOR_NONE>(PackAndFilterSSSE3_RGB<false, ZPNG_COLOR_NONE>, UnpackAndUnfilterSSSE3_RGB<ZPNG_COLOR_NONE>),
+            MakeByteKernels<4, ZPNG_COLOR_NONE>(PackAndFilterSSSE3_RGBA<true, false, ZPNG_COLOR_NONE>, UnpackAndUnfilterSSSE3_RGBAPlanes<ZPNG_COLOR_NONE>)
+        },
+        {
+            MakeByteKernels<3, ZPNG_COLOR_SUBTRACT_GREEN>(PackAndFilterSSSE3_RGB<false, ZPNG_COLOR_SUBTRACT_GREEN>, UnpackAndUnfilterSSSE3_RGB<ZPNG_COLOR_SUBTRACT_GREEN>),
+            MakeByteKernels<4, ZPNG_COLOR_SUBTRACT_GREEN>(PackAndFilterSSSE3_RGBA<true, false, ZPNG_COLOR_SUBTRACT_GREEN>, UnpackAndUnfilterSSSE3_RGBAPlanes<ZPNG_COLOR_SUBTRACT_GREEN>)
+        },
+        {
+            MakeByteKernels<3, ZPNG_COLOR_YCOCG_R>(PackAndFilterSSSE3_RGB<false, ZPNG_COLOR_YCOCG_R>, UnpackAndUnfilterSSSE3_RGB<ZPNG_COLOR_YCOCG_R>),
+            MakeByteKernels<4, ZPNG_COLOR_YCOCG_R>(PackAndFilterSSSE3_RGBA<true, false, ZPNG_COLOR_YCOCG_R>, UnpackAndUnfilterSSSE3_RGBAPlanes<ZPNG_COLOR_YCOCG_R>)
+        }
+    },
+#endif
+};
+#endif // ENABLE_RGB_COLOR_FILTER
+
+// 16-bit kernels of ZPNG_STRIP_FLAG_PLANES16 by channels 1-4
+static const ZPNG_Kernels kWideKernels[4] = {
+    MakeLeftKernels(PackAndFilter16<1>, UnpackAndUnfilter16<1>),
+    MakeLeftKernels(PackAndFilter16<2>, UnpackAndUnfilter16<2>),
+    MakeLeftKernels(PackAndFilter16<3>, UnpackAndUnfilter16<3>),
+    MakeLeftKernels(PackAndFilter16<4>, UnpackAndUnfilter16<4>)
+};
+
+// Bayer kernels by 8 or 16 bits, then for red or blue first (RGGB, BGGR)
+// or green first (GRBG, GBRG)
+static const ZPNG_Kernels kBayerKernels[2][2] = {
+    {
+        MakeLeftKernels(PackAndFilterBayer<false, 1>, UnpackAndUnfilterBayer<false, 1>),
+        MakeLeftKernels(PackAndFilterBayer<true, 1>, UnpackAndUnfilterBayer<true, 1>)
+    },
+    {
+        MakeLeftKernels(PackAndFilterBayer<false, 2>, UnpackAndUnfilterBayer<false, 2>),
+        MakeLeftKernels(PackAndFilterBayer<true, 2>, UnpackAndUnfilterBayer<true, 2>)
+    }
+};
+
+// Video kernels by CPU and pixel bytes 1-8
+static const ZPNG_VideoKernels kVideoKernels[kSimdLevels][8] = {
+    {
+        { PackAndFilterVideo<1>, UnpackAndUnfilterVideo<1> },
+        { PackAndFilterVideo<2>, UnpackAndUnfilterVideo<2> },
+        { PackAndFilterVideo<3>, UnpackAndUnfilterVideo<3> },
+        { PackAndFilterVideo<4>, UnpackAndUnfilterVideo<4> },
+        { PackAndFilterVideo<5>, UnpackAndUnfilterVideo<5> },
+        { PackAndFilterVideo<6>, UnpackAndUnfilterVideo<6> },
+        { PackAndFilterVideo<7>, UnpackAndUnfilterVideo<7> },
+        { PackAndFilterVideo<8>, UnpackAndUnfilterVideo<8> }
+    },
+#ifdef ZPNG_ENABLE_SSSE3
+    {
+        { PackAndFilterVideoSIMD<1>, UnpackAndUnfilterVideoSIMD<1> },
+        { PackAndFilterVideoSIMD<2>, UnpackAndUnfilterVideoSIMD<2> },
+        { PackAndFilterVideoSIMD<3>, UnpackAndUnfilterVideoSIMD<3> },
+        { PackAndFilterVideoSIMD<4>, UnpackAndUnfilterVideoSIMD<4> },
+        { PackAndFilterVideoSIMD<5>, UnpackAndUnfilterVideoSIMD<5> },
+        { PackAndFilterVideoSIMD<6>, UnpackAndUnfilterVideoSIMD<6> },
+        { PackAndFilterVideoSIMD<7>, UnpackAndUnfilterVideoSIMD<7> },
+        { PackAndFilterVideoSIMD<8>, UnpackAndUnfilterVideoSIMD<8> }
+    },
+#endif
+};
+
+// Images whose I-frame residuals are split into one plane per channel
+static bool IsPlanarImage(const ZPNG_ImageData* imageData)
+{
+#ifdef ENABLE_RGB_COLOR_FILTER
+    return imageData->BytesPerChannel == 1 &&
+        (imageData->Channels == 3 || imageData->Channels == 4) &&
+        imageData->PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT;
+#else
+    (void)imageData;
+    return false;
+#endif
+}
+
+// Intra kernels for imageData with pixelBytes per pixel.  Bayer images use
+// the Bayer kernels, and wide selects the 16-bit filters of
+// ZPNG_STRIP_FLAG_PLANES16.  The ZPNG_ColorTransform applies to planar
+// images only.  Returns null if there are none
+static const ZPNG_Kernels* GetKernels(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    bool wide,
+    unsigned transform = ZPNG_COLOR_GB_RG
+)
+{
+    const unsigned bayerFormat = GetBayerFormat(imageData);
+    if (bayerFormat != ZPNG_PIXEL_FORMAT_DEFAULT)
+    {
+        const bool greenFirst = bayerFormat == ZPNG_PIXEL_FORMAT_BAYER_GRBG || bayerFormat == ZPNG_PIXEL_FORMAT_BAYER_GBRG;
+        return &kBayerKernels[wide ? 1 : 0][greenFirst ? 1 : 0];
+    }
+    if (wide) {
+        const unsigned channels = imageData->Channels;
+        return (channels >= 1 && channels <= 4) ? &kWideKernels[channels - 1] : nullptr;
+    }
+    if (pixelBytes < 1 || pixelBytes > 8) {
+        return nullptr;
+    }
+#ifdef ENABLE_RGB_COLOR_FILTER
+    if (transform != ZPNG_COLOR_GB_RG && IsPlanarImage(imageData)) {
+        return (transform < kColorTransformCount) ? &kColorKernels[GetSimdLevel()][transform - 1][pixelBytes - 3] : nullptr;
+    }
+#else
+    (void)transform;
+#endif
+    return &kByteKernels[GetSimdLevel()][pixelBytes - 1];
+}
+
+// Returns null if pixelBytes is not 1-8
+static const ZPNG_VideoKernels* GetVideoKernels(unsigned pixelBytes)
+{
+    if (pixelBytes < 1 || pixelBytes > 8) {
+        return nullptr;
+    }
+    return &kVideoKernels[GetSimdLevel()][pixelBytes - 1];
+}
+
+static void PackImage(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    uint8_t* packing
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, pixelBytes, false);
+    if (kernels) {
+        kernels->Pack[ZPNG_FILTER_LEFT](imageData, packing);
+    }
+}
+
+static void UnpackImage(
+    const uint8_t* packing,
+    unsigned pixelBytes,
+    ZPNG_ImageData* imageData
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, pixelBytes, false);
+    if (kernels) {
+        kernels->Unpack[ZPNG_FILTER_LEFT](packing, imageData);
+    }
+}
+
+// Images that can use predictors other than ZPNG_FILTER_LEFT
+static bool IsPredictable(const ZPNG_ImageData* imageData)
+{
+    return imageData->BytesPerChannel == 1 &&
+        imageData->Channels >= 1 && imageData->Channels <= 4 &&
+        imageData->PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT;
+}
+
+// PackImage() of a whole image.  With `nonTemporal` the planes of large
+// planar images are written with streaming stores, so they do not evict
+// the pixels and turn into reads for ownership of lines Zstd reads later
+static void PackWholeImage(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    uint8_t* packing,
+    bool nonTemporal
+)
+{
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+    const size_t planeBytes = (size_t)imageData->WidthPixels * imageData->HeightPixels;
+    if (nonTemporal && IsPlanarImage(imageData) && planeBytes * pixelBytes >= kNonTemporalMinBytes &&
+        GetBayerFormat(imageData) == ZPNG_PIXEL_FORMAT_DEFAULT && HasSSSE3())
+    {
+        if (pixelBytes == 3) {
+            PackAndFilterSSSE3_RGB<true>(imageData, packing);
+        } else {
+            PackAndFilterSSSE3_RGBA<true, true>(imageData, packing);
+        }
+
+        // Streaming stores are weakly ordered, so finish them before Zstd reads
+        _mm_sfence();
+        return;
+    }
+#else
+    (void)nonTemporal;
+#endif
+    PackImage(imageData, pixelBytes, packing);
+}
+
+// Whether RGBA channel `channel` of a planar image depends on plane `plane`
+// under a ZPNG_ColorTransform.  GB-RG puts blue in Y, green in Y + U and
+// red in Y + U - V, while YCoCg-R needs all three.  A negative channel
+// decodes the whole image, which needs every plane
+static bool IsPlaneNeeded(int channel, unsigned plane, unsigned transform)
+{
+    if (channel < 0) {
+        return true;
+    }
+    if (channel == 3) {
+        return plane == 3;
+    }
+    switch (transform)
+    {
+    case ZPNG_COLOR_NONE:
+        return plane == (unsigned)channel;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        return plane == 0 || (channel == 0 && plane == 1) || (channel == 2 && plane == 2);
+    case ZPNG_COLOR_YCOCG_R:
+        return plane < 3;
+    }
+    return plane < 3 && plane + channel <= 2;
+}
+
+// Residuals of RGBA channel `channel` from the planes of a planar image,
+// undoing the color transform for that channel alone.  Overwrites the Y plane
+static const uint8_t* GetChannelResiduals(
+    uint8_t* planes,
+    size_t planeBytes,
+    unsigned channel,
+    unsigned transform
+)
+{
+    uint8_t* y = planes;
+    const uint8_t* u = planes + planeBytes;
+    const uint8_t* v = planes + planeBytes * 2;
+
+    if (channel == 3) {
+        return planes + planeBytes * 3;
+    }
+
+    switch (transform)
+    {
+    case ZPNG_COLOR_NONE:
+        return planes + planeBytes * channel;
+    case ZPNG_COLOR_SUBTRACT_GREEN:
+        if (channel != 1) {
+            const uint8_t* diff = (channel == 0) ? u : v;
+            for (size_t i = 0; i < planeBytes; ++i) {
+                y[i] = (uint8_t)(y[i] + diff[i]);
+            }
+        }
+        return y;
+    case ZPNG_COLOR_YCOCG_R:
+        for (size_t i = 0; i < planeBytes; ++i)
+        {
+            uint8_t d[3] = { y[i], u[i], v[i] };
+            InverseColor<3, ZPNG_COLOR_YCOCG_R>(d);
+            y[i] = d[channel];
+        }
+        return y;
+    }
+
+    switch (channel)
+    {
+    case 0:
+        for (size_t i = 0; i < planeBytes; ++i) {
+            y[i] = (uint8_t)(y[i] + u[i] - v[i]);
+        }
+        return y;
+    case 1:
+        for (size_t i = 0; i < planeBytes; ++i) {
+            y[i] = (uint8_t)(y[i] + u[i]);
+        }
+        return y;
+    }
+    return y;
+}
+
+// PackImage() with a predictor.  Requires IsPredictable() unless the
+// filter is ZPNG_FILTER_LEFT
+static void PackImageFiltered(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    unsigned filter,
+    unsigned transform,
+    uint8_t* packing
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, pixelBytes, false, transform);
+    if (kernels && filter < kFilterCount && kernels->Pack[filter]) {
+        kernels->Pack[filter](imageData, packing);
+    }
+}
+
+static void UnpackImageFiltered(
+    const uint8_t* packing,
+    unsigned pixelBytes,
+    unsigned filter,
+    ZPNG_ImageData* imageData
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, pixelBytes, false);
+    if (kernels && filter < kFilterCount && kernels->Unpack[filter]) {
+        kernels->Unpack[filter](packing, imageData);
+    }
+}
+
+// Pick the predictor that compresses bands of rows sampled across the image
+// the best with the ZPNG_ColorTransform.  Requires IsPredictable().
+// The packing scratch space is reused
+static unsigned SelectImageFilter(
+    ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    unsigned transform
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const unsigned bandRows = (height < kFilterBandRows) ? height : kFilterBandRows;
+    const unsigned bandCount = (height / kFilterBandRows < kFilterSampleBands) ?
+        (height / kFilterBandRows > 0 ? height / kFilterBandRows : 1) : kFilterSampleBands;
+
+    const size_t bandBytes = (size_t)imageData->WidthPixels * bandRows * pixelBytes;
+    const size_t bound = ZSTD_compressBound(bandBytes);
+    uint8_t* packing = GetScratch(ctx, bandBytes + bound);
+    if (!packing || bandBytes == 0) {
+        return ZPNG_FILTER_LEFT;
+    }
+
+    // The estimate uses the fast default level whatever the context uses
+    ZPNG_CompressionParams params;
+    memset(&params, 0, sizeof(params));
+
+    size_t sizes[kFilterCount] = { 0 };
+    for (unsigned band = 0; band < bandCount; ++band)
+    {
+        const unsigned firstRow = (unsigned)(((uint64_t)height - bandRows) * band / (bandCount > 1 ? bandCount - 1 : 1));
+        const ZPNG_ImageData bandImage = GetStripImage(imageData, pixelBytes, firstRow, bandRows);
+
+        for (unsigned filter = 0; filter < kFilterCount; ++filter)
+        {
+            PackImageFiltered(&bandImage, pixelBytes, filter, transform, packing);
+            const size_t result = CompressFrame(ctx->CCtx, &params, packing + bandBytes, bound, packing, bandBytes, nullptr);
+            sizes[filter] += ZSTD_isError(result) ? bandBytes : result;
+        }
+    }
+
+    // The left filter has SIMD versions and fits the original header,
+    // so another predictor has to be clearly better to be picked
+    unsigned best = ZPNG_FILTER_LEFT;
+    size_t bestSize = sizes[ZPNG_FILTER_LEFT] - sizes[ZPNG_FILTER_LEFT] / 32;
+    for (unsigned filter = ZPNG_FILTER_LEFT + 1; filter < kFilterCount; ++filter)
+    {
+        if (sizes[filter] < bestSize) {
+            best = filter;
+            bestSize = sizes[filter];
+        }
+    }
+    return best;
+}
+
+// Add the squares of the signed Y, U, V values that ForwardColor() makes
+// from the R, G, B residuals in d to energy[0..2]
+template<int kTransform>
+static inline void AddColorEnergy(const uint8_t* d, uint64_t* energy)
+{
+    uint8_t p[3] = { d[0], d[1], d[2] };
+    ForwardColor<3, kTransform>(p);
+    for (int i = 0; i < 3; ++i)
+    {
+        const int v = (int8_t)p[i];
+        energy[i] += (uint64_t)(v * v);
+    }
+}
+
+// Pick the ZPNG_ColorTransform that best decorrelates the channels, from
+// the left filter residuals of every kColorSampleRowStep-th row.  A plane
+// costs the log of its mean square, as for a Laplacian or Gaussian source,
+// so a transform wins by moving the shared signal out of two planes.
+// Requires IsPlanarImage()
+static unsigned SelectColorTransform(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+
+    uint64_t energy[kColorTransformCount][3] = {};
+    uint64_t count = 1;
+    for (unsigned y = 0; y < height; y += kColorSampleRowStep)
+    {
+        const uint8_t* row = imageData->Buffer.Data + y * stride;
+        for (unsigned x = 1; x < width; ++x)
+        {
+            const uint8_t* pixel = row + (size_t)x * pixelBytes;
+            const uint8_t d[3] = {
+                (uint8_t)(pixel[0] - pixel[0 - (int)pixelBytes]),
+                (uint8_t)(pixel[1] - pixel[1 - (int)pixelBytes]),
+                (uint8_t)(pixel[2] - pixel[2 - (int)pixelBytes])
+            };
+            AddColorEnergy<ZPNG_COLOR_GB_RG>(d, energy[ZPNG_COLOR_GB_RG]);
+            AddColorEnergy<ZPNG_COLOR_NONE>(d, energy[ZPNG_COLOR_NONE]);
+            AddColorEnergy<ZPNG_COLOR_SUBTRACT_GREEN>(d, energy[ZPNG_COLOR_SUBTRACT_GREEN]);
+            AddColorEnergy<ZPNG_COLOR_YCOCG_R>(d, energy[ZPNG_COLOR_YCOCG_R]);
+        }
+        count += width;
+    }
+
+    double costs[kColorTransformCount];
+    for (unsigned t = 0; t < kColorTransformCount; ++t)
+    {
+        costs[t] = 0.0;
+        for (unsigned plane = 0; plane < 3; ++plane) {
+            costs[t] += log2((double)energy[t][plane] / count + 1.0);
+        }
+    }
+
+    // GB-RG is kept unless another transform is clearly better, since
+    // it fits the original header
+    unsigned best = ZPNG_COLOR_GB_RG;
+    double bestCost = costs[ZPNG_COLOR_GB_RG] - kColorTransformMargin;
+    for (unsigned t = ZPNG_COLOR_GB_RG + 1; t < kColorTransformCount; ++t)
+    {
+        if (costs[t] < bestCost) {
+            best = t;
+            bestCost = costs[t];
+        }
+    }
+    return best;
+}
+
+// ZPNG_ColorTransform of an I-frame with the context, which is GB-RG for
+// images that are not planar
+static unsigned GetColorTransform(
+    const ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes
+)
+{
+    if (!ctx || !IsPlanarImage(imageData)) {
+        return ZPNG_COLOR_GB_RG;
+    }
+    if (ctx->ColorTransform == ZPNG_COLOR_AUTO) {
+        return SelectColorTransform(imageData, pixelBytes);
+    }
+    return ctx->ColorTransform;
+}
+
+// 16-bit channels are filtered as uint16_t in formats that record it,
+// which is the strip format with ZPNG_STRIP_FLAG_PLANES16 set
+static bool IsWideImage(const ZPNG_ImageData* imageData)
+{
+    return imageData->BytesPerChannel == 2 && imageData->Channels >= 1 && imageData->Channels <= 4;
+}
+
+// Requires IsWideImage()
+static void PackImageWide(
+    const ZPNG_ImageData* imageData,
+    uint8_t* packing
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, GetPixelBytes(imageData), true);
+    if (kernels) {
+        kernels->Pack[ZPNG_FILTER_LEFT](imageData, packing);
+    }
+}
+
+// Requires IsWideImage()
+static void UnpackImageWide(
+    const uint8_t* packing,
+    ZPNG_ImageData* imageData
+)
+{
+    const ZPNG_Kernels* kernels = GetKernels(imageData, GetPixelBytes(imageData), true);
+    if (kernels) {
+        kernels->Unpack[ZPNG_FILTER_LEFT](packing, imageData);
+    }
+}
+
+// Returns the number of overflow bytes
+static size_t PackImageVideo(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    uint8_t* packing
+)
+{
+    const ZPNG_VideoKernels* kernels = GetVideoKernels(pixelBytes);
+    return kernels ? kernels->Pack(refData, imageData, packing) : 0;
+}
+
+//------------------------------------------------------------------------------
+// Motion Search
+
+// Motion vectors of a delta frame, one per kMotionBlockPixels square block
+// of pixels.  Blocks at the right and bottom edges are cut short
+struct ZPNG_MotionField
+{
+    // Frame dimensions in pixels and blocks
+    unsigned Width, Height;
+    unsigned BlocksX, BlocksY;
+
+    // dx and dy of each block in raster order
+    int8_t* Vectors;
+
+    // Vectors as written to the motion section
+    uint8_t* Stored;
+    size_t StoredBytes;
+
+    // One compensated row, for estimating costs
+    uint8_t* RowScratch;
+};
+
+static inline unsigned GetMotionBlocks(unsigned pixels)
+{
+    return (unsigned)(((uint64_t)pixels + kMotionBlockPixels - 1) / kMotionBlockPixels);
+}
+
+// Whether the motion search handles images of this format
+static bool IsMotionSearchable(const ZPNG_ImageData* imageData)
+{
+    return imageData->BytesPerChannel == 1 && imageData->Channels >= 1 && imageData->Channels <= 4 &&
+        imageData->PixelFormat == ZPNG_PIXEL_FORMAT_DEFAULT &&
+        imageData->WidthPixels >= kMotionBlockPixels * 2 && imageData->HeightPixels >= kMotionBlockPixels * 2;
+}
+
+// Predict rows [firstRow, firstRow + rows) of a delta frame from refData
+// moved by the motion vectors, into rows of Width * pixelBytes.  Source
+// pixels are clamped to the image, so any vectors are safe to apply
+static void CompensateRows(
+    const ZPNG_ImageData* refData,
+    const ZPNG_MotionField* motion,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    unsigned rows,
+    uint8_t* output
+)
+{
+    const unsigned width = motion->Width;
+    const int height = (int)motion->Height;
+    const size_t stride = GetRowStride(refData, pixelBytes);
+    const size_t rowBytes = (size_t)width * pixelBytes;
+
+    for (unsigned y = firstRow; y < firstRow + rows; ++y)
+    {
+        const int8_t* vectors = motion->Vectors + (size_t)(y / kMotionBlockPixels) * motion->BlocksX * 2;
+        uint8_t* out = output + (size_t)(y - firstRow) * rowBytes;
+
+        for (unsigned bx = 0; bx < motion->BlocksX; ++bx)
+        {
+            int sy = (int)y + vectors[bx * 2 + 1];
+            sy = sy < 0 ? 0 : (sy >= height ? height - 1 : sy);
+            const uint8_t* src = refData->Buffer.Data + sy * stride;
+
+            const unsigned x0 = bx * kMotionBlockPixels;
+            const unsigned blockWidth = width - x0 < kMotionBlockPixels ? width - x0 : kMotionBlockPixels;
+            const int sx = (int)x0 + vectors[bx * 2];
+
+            if (sx >= 0 && sx + blockWidth <= width) {
+                memcpy(out + (size_t)x0 * pixelBytes, src + (size_t)sx * pixelBytes, (size_t)blockWidth * pixelBytes);
+                continue;
+            }
+            for (unsigned i = 0; i < blockWidth; ++i)
+            {
+                int x = sx + (int)i;
+                x = x < 0 ? 0 : (x >= (int)width ? (int)width - 1 : x);
+                memcpy(out + (size_t)(x0 + i) * pixelBytes, src + (size_t)x * pixelBytes, pixelBytes);
+            }
+        }
+    }
+}
+
+// Reference rows for a delta strip: A view of refData, or its motion
+// compensated prediction written to `compensated`
+static ZPNG_ImageData GetStripReference(
+    const ZPNG_ImageData* refData,
+    const ZPNG_MotionField* motion,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    unsigned rows,
+    uint8_t* compensated
+)
+{
+    if (!motion) {
+        return GetStripImage(refData, pixelBytes, firstRow, rows);
+    }
+
+    CompensateRows(refData, motion, pixelBytes, firstRow, rows, compensated);
+
+    ZPNG_ImageData strip = *refData;
+    strip.Buffer.Data = compensated;
+    strip.Buffer.Bytes = (size_t)rows * motion->Width * pixelBytes;
+    strip.WidthPixels = motion->Width;
+    strip.StrideBytes = motion->Width * pixelBytes;
+    strip.HeightPixels = rows;
+    return strip;
+}
+
+// Luma of 8-bit pixels for the motion search: (R + 2G + B) / 4 with three
+// or more channels, or else the first channel
+template<int kPixelBytes>
+static void GetMotionLuma(
+    const ZPNG_ImageData* imageData,
+    uint8_t* luma
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const size_t stride = GetRowStride(imageData, kPixelBytes);
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        const uint8_t* row = imageData->Buffer.Data + y * stride;
+        uint8_t* out = luma + (size_t)y * width;
+
+        for (unsigned x = 0; x < width; ++x, row += kPixelBytes)
+        {
+            if (kPixelBytes >= 3) {
+                out[x] = (uint8_t)((row[0] + 2 * row[1] + row[2] + 2) >> 2);
+            } else {
+                out[x] = row[0];
+            }
+        }
+    }
+}
+
+// GetMotionLuma() by bytes per pixel, 1-4
+static void (* const kMotionLuma[4])(const ZPNG_ImageData* imageData, uint8_t* luma) = {
+    GetMotionLuma<1>, GetMotionLuma<2>, GetMotionLuma<3>, GetMotionLuma<4>
+};
+
+// 2x2 box average of a luma plane, dropping an odd last row or column
+static void HalveLuma(
+    const uint8_t* luma,
+    unsigned width,
+    unsigned height,
+    uint8_t* half
+)
+{
+    const unsigned halfWidth = width / 2;
+    for (unsigned y = 0; y < height / 2; ++y)
+    {
+        const uint8_t* row0 = luma + (size_t)y * 2 * width;
+        const uint8_t* row1 = row0 + width;
+        uint8_t* out = half + (size_t)y * halfWidth;
+        for (unsigned x = 0; x < halfWidth; ++x) {
+            out[x] = (uint8_t)((row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2);
+        }
+    }
+}
+
+// Image and reference luma at one resolution
+struct ZPNG_MotionPlane
+{
+    const uint8_t* Image;
+    const uint8_t* Ref;
+    unsigned Width, Height;
+};
+
+#ifdef ZPNG_ENABLE_SSSE3
+
+// Sum of absolute differences of 8 or 16 pixel wide blocks
+template<int kWidth>
+ZPNG_TARGET_SSSE3 static unsigned GetBlockSadSSSE3(
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t stride,
+    unsigned rows
+)
+{
+    __m128i sum = _mm_setzero_si128();
+    for (unsigned row = 0; row < rows; ++row, a += stride, b += stride)
+    {
+        if (kWidth == 16) {
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+        } else {
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)a), _mm_loadl_epi64((const __m128i*)b)));
+        }
+    }
+    return (unsigned)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)));
+}
+
+#endif // ZPNG_ENABLE_SSSE3
+
+// Sum of absolute differences between the block at (x, y) of the image and
+// the reference block moved by (dx, dy).  Stops early once it reaches
+// `limit`, and returns UINT_MAX if the moved block leaves the plane
+static unsigned GetMotionSad(
+    const ZPNG_MotionPlane* plane,
+    unsigned x,
+    unsigned y,
+    unsigned blockWidth,
+    unsigned blockHeight,
+    int dx,
+    int dy,
+    unsigned limit
+)
+{
+    const int sx = (int)x + dx, sy = (int)y + dy;
+    if (sx < 0 || sy < 0 || sx + blockWidth > plane->Width || sy + blockHeight > plane->Height) {
+        return UINT_MAX;
+    }
+
+    const uint8_t* a = plane->Image + (size_t)y * plane->Width + x;
+    const uint8_t* b = plane->Ref + (size_t)sy * plane->Width + sx;
+#ifdef ZPNG_ENABLE_SSSE3
+    if ((blockWidth == 16 || blockWidth == 8) && HasSSSE3()) {
+        return blockWidth == 16 ?
+            GetBlockSadSSSE3<16>(a, b, plane->Width, blockHeight) :
+            GetBlockSadSSSE3<8>(a, b, plane->Width, blockHeight);
+    }
+#endif
+    unsigned sad = 0;
+    for (unsigned row = 0; row < blockHeight && sad < limit; ++row, a += plane->Width, b += plane->Width) {
+        for (unsigned i = 0; i < blockWidth; ++i) {
+            sad += (unsigned)abs(a[i] - b[i]);
+        }
+    }
+    return sad;
+}
+
+// Best vector found so far for a block
+struct ZPNG_MotionCandidate
+{
+    int Dx, Dy;
+    unsigned Sad;
+};
+
+// Replace the best vector with (dx, dy) if it is in range and better
+static void TryMotion(
+    const ZPNG_MotionPlane* plane,
+    unsigned x,
+    unsigned y,
+    unsigned blockWidth,
+    unsigned blockHeight,
+    int dx,
+    int dy,
+    int range,
+    ZPNG_MotionCandidate* best
+)
+{
+    if (dx < -range || dx > range || dy < -range || dy > range) {
+        return;
+    }
+    const unsigned sad = GetMotionSad(plane, x, y, blockWidth, blockHeight, dx, dy, best->Sad);
+    if (sad < best->Sad)
+    {
+        best->Dx = dx;
+        best->Dy = dy;
+        best->Sad = sad;
+    }
+}
+
+// Find a vector for each block of imageData against refData, in scratch
+// space on the context.  Each block starts from the zero vector and those
+// of the blocks to its left, above and above right, descends a small
+// diamond on the half resolution luma, and is refined at full resolution.
+// Returns 1 if any block moves, 0 if none does or there was no memory
+static int SearchMotion(
+    ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    ZPNG_MotionField* motion
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+    const size_t planeBytes = (size_t)width * height;
+    const size_t halfBytes = (size_t)(width / 2) * (height / 2);
+
+    motion->Width = width;
+    motion->Height = height;
+    motion->BlocksX = GetMotionBlocks(width);
+    motion->BlocksY = GetMotionBlocks(height);
+    const size_t vectorBytes = (size_t)motion->BlocksX * motion->BlocksY * 2;
+    const size_t storedBytes = ZSTD_compressBound(vectorBytes);
+    const size_t rowBytes = (size_t)width * pixelBytes;
+
+    const size_t bytes = planeBytes * 2 + halfBytes * 2 + vectorBytes + storedBytes + rowBytes;
+    if (ctx->MotionScratchBytes < bytes)
+    {
+        FreeBuffer(ctx->MotionScratch);
+        ctx->MotionScratch = AllocateBuffer(bytes);
+        CountAllocation(ctx->Collector);
+        ctx->MotionScratchBytes = ctx->MotionScratch ? bytes : 0;
+    }
+    if (!ctx->MotionScratch) {
+        return 0;
+    }
+
+    uint8_t* imageLuma = ctx->MotionScratch;
+    uint8_t* refLuma = imageLuma + planeBytes;
+    uint8_t* imageHalf = refLuma + planeBytes;
+    uint8_t* refHalf = imageHalf + halfBytes;
+    motion->Vectors = (int8_t*)(refHalf + halfBytes);
+    motion->Stored = (uint8_t*)motion->Vectors + vectorBytes;
+    motion->StoredBytes = 0;
+    motion->RowScratch = motion->Stored + storedBytes;
+
+    kMotionLuma[pixelBytes - 1](imageData, imageLuma);
+    kMotionLuma[pixelBytes - 1](refData, refLuma);
+    HalveLuma(imageLuma, width, height, imageHalf);
+    HalveLuma(refLuma, width, height, refHalf);
+
+    const ZPNG_MotionPlane full = { imageLuma, refLuma, width, height };
+    const ZPNG_MotionPlane half = { imageHalf, refHalf, width / 2, height / 2 };
+    const unsigned halfBlock = kMotionBlockPixels / 2;
+    const int halfRange = kMotionRange / 2;
+    bool moved = false;
+
+    for (unsigned by = 0; by < motion->BlocksY; ++by)
+    {
+        for (unsigned bx = 0; bx < motion->BlocksX; ++bx)
+        {
+            int8_t* vector = motion->Vectors + ((size_t)by * motion->BlocksX + bx) * 2;
+            vector[0] = vector[1] = 0;
+
+            // Blocks that already match closely cannot gain enough to move
+            const unsigned x = bx * kMotionBlockPixels, y = by * kMotionBlockPixels;
+            const unsigned w = width - x < kMotionBlockPixels ? width - x : kMotionBlockPixels;
+            const unsigned h = height - y < kMotionBlockPixels ? height - y : kMotionBlockPixels;
+            const unsigned bias = w * h / kMotionBias;
+            const unsigned zeroSad = GetMotionSad(&full, x, y, w, h, 0, 0, UINT_MAX);
+            if (zeroSad <= bias) {
+                continue;
+            }
+
+            ZPNG_MotionCandidate best = { 0, 0, UINT_MAX };
+
+            // An odd last row or column can leave an edge block empty at
+            // half resolution, and then only the refinement runs
+            const unsigned hx = bx * halfBlock, hy = by * halfBlock;
+            if (hx < half.Width && hy < half.Height)
+            {
+                const unsigned hw = half.Width - hx < halfBlock ? half.Width - hx : halfBlock;
+                const unsigned hh = half.Height - hy < halfBlock ? half.Height - hy : halfBlock;
+
+                TryMotion(&half, hx, hy, hw, hh, 0, 0, halfRange, &best);
+                if (bx > 0) {
+                    TryMotion(&half, hx, hy, hw, hh, vector[-2] / 2, vector[-1] / 2, halfRange, &best);
+                }
+                if (by > 0)
+                {
+                    const int8_t* above = vector - (size_t)motion->BlocksX * 2;
+                    TryMotion(&half, hx, hy, hw, hh, above[0] / 2, above[1] / 2, halfRange, &best);
+                    if (bx + 1 < motion->BlocksX) {
+                        TryMotion(&half, hx, hy, hw, hh, above[2] / 2, above[3] / 2, halfRange, &best);
+                    }
+                }
+
+                // Step to the best of the 8 neighbors until none is better
+                for (int step = 0; step < halfRange * 2; ++step)
+                {
+                    const int cx = best.Dx, cy = best.Dy;
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            if (dx != 0 || dy != 0) {
+                                TryMotion(&half, hx, hy, hw, hh, cx + dx, cy + dy, halfRange, &best);
+                            }
+                        }
+                    }
+                    if (best.Dx == cx && best.Dy == cy) {
+                        break;
+                    }
+                }
+            }
+
+            // The neighbors' own vectors are tried again at full resolution,
+            // where halving them cannot lose a pixel
+            ZPNG_MotionCandidate refined = { 0, 0, zeroSad };
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    TryMotion(&full, x, y, w, h, best.Dx * 2 + dx, best.Dy * 2 + dy, kMotionRange, &refined);
+                }
+            }
+            if (bx > 0) {
+                TryMotion(&full, x, y, w, h, vector[-2], vector[-1], kMotionRange, &refined);
+            }
+            if (by > 0) {
+                const int8_t* above = vector - (size_t)motion->BlocksX * 2;
+                TryMotion(&full, x, y, w, h, above[0], above[1], kMotionRange, &refined);
+            }
+
+            // Still blocks stay still unless moving them clearly pays
+            if (refined.Sad + bias < zeroSad)
+            {
+                vector[0] = (int8_t)refined.Dx;
+                vector[1] = (int8_t)refined.Dy;
+                moved = true;
+            }
+        }
+    }
+
+    return moved ? 1 : 0;
+}
+
+// Estimate the cost of delta coding against refData, and of intra coding,
+// from a sample of rows.  Both are the sum of absolute byte residuals, with
+// the intra residual taken from the previous sample of the same color, and
+// each escaped delta adds kVideoEscapeCost.
+// With motion the deltas are against the compensated reference
+static void GetVideoCosts(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    const ZPNG_MotionField* motion,
+    uint64_t* deltaCostOut,
+    uint64_t* intraCostOut
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+    const size_t refStride = GetRowStride(refData, pixelBytes);
+
+    // Bayer samples repeat their color every other pixel
+    size_t intraBytes = pixelBytes;
+    if (GetBayerFormat(imageData) != ZPNG_PIXEL_FORMAT_DEFAULT) {
+        intraBytes = (size_t)imageData->BytesPerChannel * 2;
+    }
+
+    uint64_t deltaCost = 0, intraCost = 0;
+
+    for (unsigned y = height / kVideoSampleRowStep / 2; y < height; y += kVideoSampleRowStep)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+        const uint8_t* ref = refData->Buffer.Data + y * refStride;
+        if (motion)
+        {
+            CompensateRows(refData, motion, pixelBytes, y, 1, motion->RowScratch);
+            ref = motion->RowScratch;
+        }
+
+        for (size_t i = intraBytes; i < rowBytes; ++i)
+        {
+            const int delta = (int8_t)(uint8_t)(input[i] - ref[i]);
+            const int intra = (int8_t)(uint8_t)(input[i] - input[i - intraBytes]);
+            deltaCost += delta < 0 ? -delta : delta;
+            intraCost += intra < 0 ? -intra : intra;
+            if (delta == -128) {
+                deltaCost += kVideoEscapeCost;
+            }
+        }
+    }
+
+    *deltaCostOut = deltaCost;
+    *intraCostOut = intraCost;
+}
+
+// Returns true if delta coding against refData is estimated to be cheaper
+// than intra coding, so scene cuts and flashes become I-frames
+static bool IsDeltaCheaper(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    const ZPNG_MotionField* motion
+)
+{
+    uint64_t deltaCost, intraCost;
+    GetVideoCosts(refData, imageData, pixelBytes, motion, &deltaCost, &intraCost);
+    return deltaCost <= intraCost;
+}
+
+// Returns true if the motion vectors are estimated to shrink the residuals
+// of delta coding against refData
+static bool IsMotionCheaper(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    const ZPNG_MotionField* motion
+)
+{
+    uint64_t stillCost, movedCost, intraCost;
+    GetVideoCosts(refData, imageData, pixelBytes, nullptr, &stillCost, &intraCost);
+    GetVideoCosts(refData, imageData, pixelBytes, motion, &movedCost, &intraCost);
+    return movedCost < stillCost;
+}
+
+// Returns false if the escapes do not match the overflowCount bytes after the deltas
+static bool UnpackImageVideo(
+    const ZPNG_ImageData* refData,
+    const uint8_t* packing,
+    unsigned pixelBytes,
+    size_t overflowCount,
+    ZPNG_ImageData* imageData
+)
+{
+    const ZPNG_VideoKernels* kernels = GetVideoKernels(pixelBytes);
+    return kernels && kernels->Unpack(refData, packing, overflowCount, imageData);
+}
+
+// The generic kernels filter each row on its own, so any range of rows can
+// be packed or unpacked separately.  The RGB(A) and Bayer kernels write planes
+// that each span the whole image.
+static bool IsRowPacked(
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes
+)
+{
+    if (GetBayerFormat(imageData) != ZPNG_PIXEL_FORMAT_DEFAULT) {
+        return false;
+    }
+#ifdef ENABLE_RGB_COLOR_FILTER
+    if (pixelBytes == 3 || pixelBytes == 4) {
+        return false;
+    }
+#else
+    (void)pixelBytes;
+#endif
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Skip Blocks
+
+// Blocks of a delta frame that are the same as their prediction from the
+// reference, on the grid of the motion blocks
+struct ZPNG_SkipMap
+{
+    // Frame width in pixels, and dimensions in blocks
+    unsigned Width;
+    unsigned BlocksX, BlocksY;
+
+    // A bit per block in raster order, low bit first, set if it is skipped
+    uint8_t* Bits;
+
+    // Bits as written to the skip section
+    uint8_t* Stored;
+    size_t StoredBytes;
+};
+
+static inline size_t GetSkipMapBytes(const ZPNG_SkipMap* skip)
+{
+    return ((size_t)skip->BlocksX * skip->BlocksY + 7) / 8;
+}
+
+static inline bool IsBlockSkipped(const ZPNG_SkipMap* skip, unsigned bx, unsigned by)
+{
+    const size_t block = (size_t)by * skip->BlocksX + bx;
+    return ((skip->Bits[block / 8] >> (block % 8)) & 1) != 0;
+}
+
+static unsigned CountSkippedBlocks(const ZPNG_SkipMap* skip)
+{
+    unsigned count = 0;
+    for (unsigned by = 0; by < skip->BlocksY; ++by) {
+        for (unsigned bx = 0; bx < skip->BlocksX; ++bx) {
+            count += IsBlockSkipped(skip, bx, by) ? 1 : 0;
+        }
+    }
+    return count;
+}
+
+// Whether a frame is large enough for a skip map to pay for the strip
+// header, and small enough that the pixels a strip keeps, which are packed
+// as one row, fit its width
+static bool IsSkippable(const ZPNG_ImageData* imageData)
+{
+    return imageData->WidthPixels >= kMotionBlockPixels * 2 && imageData->HeightPixels >= kMotionBlockPixels * 2 &&
+        (uint64_t)imageData->WidthPixels * imageData->HeightPixels <= UINT_MAX;
+}
+
+// Find the next run of blocks at or after *bx in block row `by` that are
+// skipped, or not, as pixel columns [*x0, *x1).  Returns false if none is left
+static bool GetBlockRun(
+    const ZPNG_SkipMap* skip,
+    unsigned by,
+    bool skipped,
+    unsigned* bx,
+    unsigned* x0,
+    unsigned* x1
+)
+{
+    while (*bx < skip->BlocksX && IsBlockSkipped(skip, *bx, by) != skipped) {
+        ++*bx;
+    }
+    if (*bx >= skip->BlocksX) {
+        return false;
+    }
+    *x0 = *bx * kMotionBlockPixels;
+    while (*bx < skip->BlocksX && IsBlockSkipped(skip, *bx, by) == skipped) {
+        ++*bx;
+    }
+    *x1 = *bx < skip->BlocksX ? *bx * kMotionBlockPixels : skip->Width;
+    return true;
+}
+
+// Pixels of the blocks that are not skipped in rows [firstRow, firstRow + rows)
+static size_t GetChangedPixels(
+    const ZPNG_SkipMap* skip,
+    unsigned firstRow,
+    unsigned rows
+)
+{
+    size_t pixels = 0;
+    for (unsigned y = firstRow; y < firstRow + rows;)
+    {
+        const unsigned by = y / kMotionBlockPixels;
+        const unsigned blockRows = kMotionBlockPixels - y % kMotionBlockPixels;
+        const unsigned spanRows = firstRow + rows - y < blockRows ? firstRow + rows - y : blockRows;
+
+        size_t rowPixels = 0;
+        unsigned bx = 0, x0, x1;
+        while (GetBlockRun(skip, by, false, &bx, &x0, &x1)) {
+            rowPixels += x1 - x0;
+        }
+        pixels += rowPixels * spanRows;
+        y += spanRows;
+    }
+    return pixels;
+}
+
+// Gather the pixels of the blocks that are not skipped from a strip starting
+// at frame row firstRow into `output`, in raster order.  Returns them as an
+// image of one row, since the video kernels only depend on pixel order
+static ZPNG_ImageData GatherChangedPixels(
+    const ZPNG_SkipMap* skip,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    const ZPNG_ImageData* strip,
+    uint8_t* output
+)
+{
+    const size_t stride = GetRowStride(strip, pixelBytes);
+    uint8_t* out = output;
+
+    for (unsigned row = 0; row < strip->HeightPixels; ++row)
+    {
+        const uint8_t* line = strip->Buffer.Data + row * stride;
+        const unsigned by = (firstRow + row) / kMotionBlockPixels;
+        unsigned bx = 0, x0, x1;
+        while (GetBlockRun(skip, by, false, &bx, &x0, &x1))
+        {
+            const size_t bytes = (size_t)(x1 - x0) * pixelBytes;
+            memcpy(out, line + (size_t)x0 * pixelBytes, bytes);
+            out += bytes;
+        }
+    }
+
+    const size_t pixels = (size_t)(out - output) / pixelBytes;
+    ZPNG_ImageData changed = *strip;
+    changed.Buffer.Data = output;
+    changed.Buffer.Bytes = (size_t)(out - output);
+    changed.WidthPixels = (unsigned)pixels;
+    changed.HeightPixels = pixels ? 1 : 0;
+    changed.StrideBytes = 0;
+    return changed;
+}
+
+// Inverse of GatherChangedPixels(): Write the pixels in `changed` back to
+// the blocks of the strip that are not skipped
+static void ScatterChangedPixels(
+    const ZPNG_SkipMap* skip,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    const uint8_t* changed,
+    ZPNG_ImageData* strip
+)
+{
+    const size_t stride = GetRowStride(strip, pixelBytes);
+
+    for (unsigned row = 0; row < strip->HeightPixels; ++row)
+    {
+        uint8_t* line = strip->Buffer.Data + row * stride;
+        const unsigned by = (firstRow + row) / kMotionBlockPixels;
+        unsigned bx = 0, x0, x1;
+        while (GetBlockRun(skip, by, false, &bx, &x0, &x1))
+        {
+            const size_t bytes = (size_t)(x1 - x0) * pixelBytes;
+            memcpy(line + (size_t)x0 * pixelBytes, changed, bytes);
+            changed += bytes;
+        }
+    }
+}
+
+// Copy the skipped blocks of a strip from its reference rows
+static void CopySkippedPixels(
+    const ZPNG_SkipMap* skip,
+    unsigned pixelBytes,
+    unsigned firstRow,
+    const ZPNG_ImageData* stripRef,
+    ZPNG_ImageData* strip
+)
+{
+    const size_t stride = GetRowStride(strip, pixelBytes);
+    const size_t refStride = GetRowStride(stripRef, pixelBytes);
+
+    for (unsigned row = 0; row < strip->HeightPixels; ++row)
+    {
+        uint8_t* line = strip->Buffer.Data + row * stride;
+        const uint8_t* refLine = stripRef->Buffer.Data + row * refStride;
+        const unsigned by = (firstRow + row) / kMotionBlockPixels;
+        unsigned bx = 0, x0, x1;
+        while (GetBlockRun(skip, by, true, &bx, &x0, &x1)) {
+            memcpy(line + (size_t)x0 * pixelBytes, refLine + (size_t)x0 * pixelBytes, (size_t)(x1 - x0) * pixelBytes);
+        }
+    }
+}
+
+// Whether a block of imageData is bit for bit the same as refData at the
+// block moved by (dx, dy).  Blocks moved partly outside the reference are
+// clamped when predicted, so they never count as the same
+static bool IsBlockSame(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    unsigned x,
+    unsigned y,
+    unsigned w,
+    unsigned h,
+    int dx,
+    int dy
+)
+{
+    const int sx = (int)x + dx, sy = (int)y + dy;
+    if (sx < 0 || sy < 0 || sx + w > imageData->WidthPixels || sy + h > imageData->HeightPixels) {
+        return false;
+    }
+
+    const size_t stride = GetRowStride(imageData, pixelBytes);
+    const size_t refStride = GetRowStride(refData, pixelBytes);
+    const uint8_t* input = imageData->Buffer.Data + y * stride + (size_t)x * pixelBytes;
+    const uint8_t* ref = refData->Buffer.Data + sy * refStride + (size_t)sx * pixelBytes;
+    const size_t rowBytes = (size_t)w * pixelBytes;
+
+    // memcmp() is vectorized by the C library, and stops at the first change
+    for (unsigned row = 0; row < h; ++row) {
+        if (memcmp(input + row * stride, ref + row * refStride, rowBytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Mark the blocks of imageData that are the same as their prediction from
+// refData, moved by any motion vectors, in scratch space on the context.
+// Returns 1 if enough blocks are skipped to be worth a map, 0 if not or
+// there was no memory
+static int FindSkipBlocks(
+    ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    const ZPNG_MotionField* motion,
+    ZPNG_SkipMap* skip
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+
+    skip->Width = width;
+    skip->BlocksX = GetMotionBlocks(width);
+    skip->BlocksY = GetMotionBlocks(height);
+    const size_t mapBytes = GetSkipMapBytes(skip);
+    const size_t storedBytes = ZSTD_compressBound(mapBytes);
+
+    const size_t bytes = mapBytes + storedBytes;
+    if (ctx->SkipScratchBytes < bytes)
+    {
+        FreeBuffer(ctx->SkipScratch);
+        ctx->SkipScratch = AllocateBuffer(bytes);
+        CountAllocation(ctx->Collector);
+        ctx->SkipScratchBytes = ctx->SkipScratch ? bytes : 0;
+    }
+    if (!ctx->SkipScratch) {
+        return 0;
+    }
+
+    skip->Bits = ctx->SkipScratch;
+    skip->Stored = skip->Bits + mapBytes;
+    skip->StoredBytes = 0;
+    memset(skip->Bits, 0, mapBytes);
+
+    uint64_t skipped = 0;
+    for (unsigned by = 0; by < skip->BlocksY; ++by)
+    {
+        for (unsigned bx = 0; bx < skip->BlocksX; ++bx)
+        {
+            const size_t block = (size_t)by * skip->BlocksX + bx;
+            const int8_t* vector = motion ? motion->Vectors + block * 2 : nullptr;
+            const unsigned x = bx * kMotionBlockPixels, y = by * kMotionBlockPixels;
+            const unsigned w = width - x < kMotionBlockPixels ? width - x : kMotionBlockPixels;
+            const unsigned h = height - y < kMotionBlockPixels ? height - y : kMotionBlockPixels;
+
+            if (IsBlockSame(refData, imageData, pixelBytes, x, y, w, h, vector ? vector[0] : 0, vector ? vector[1] : 0))
+            {
+                skip->Bits[block / 8] |= (uint8_t)(1 << (block % 8));
+                ++skipped;
+            }
+        }
+    }
+
+    const uint64_t blocks = (uint64_t)skip->BlocksX * skip->BlocksY;
+    return (skipped != 0 && skipped >= blocks / kSkipMinShare) ? 1 : 0;
+}
+
+// Read the skip map of a delta frame from the skip section into skip->Bits,
+// which holds GetSkipMapBytes().  Without a Zstd context one is made for
+// the call.  Returns false if the map is corrupt
+static bool ReadSkipMap(
+    const uint8_t* stored,
+    size_t storedBytes,
+    ZSTD_DCtx* dctx,
+    ZPNG_SkipMap* skip
+)
+{
+    const size_t mapBytes = GetSkipMapBytes(skip);
+    if (storedBytes == mapBytes)
+    {
+        memcpy(skip->Bits, stored, mapBytes);
+        return true;
+    }
+    const size_t result = dctx ?
+        ZSTD_decompressDCtx(dctx, skip->Bits, mapBytes, stored, storedBytes) :
+        ZSTD_decompress(skip->Bits, mapBytes, stored, storedBytes);
+    return result == mapBytes;
+}
+
+//------------------------------------------------------------------------------
+// Palette
+
+static const uint16_t kPaletteEmpty = 0xFFFF;
+
+// Colors of an 8-bit image with at most kMaxPaletteColors of them, and an
+// open addressing hash table from each color to its index
+struct ZPNG_Palette
+{
+    unsigned Channels;
+    unsigned Count;
+
+    // Bits per index: 1, 2, 4 or 8
+    unsigned Bits;
+
+    // Count colors of Channels bytes each
+    uint8_t Colors[kMaxPaletteColors * 4];
+
+    // Slot i holds color Keys[i] at index Indices[i], or kPaletteEmpty
+    uint32_t Keys[1 << kPaletteHashBits];
+    uint16_t Indices[1 << kPaletteHashBits];
+};
+
+// Smallest index size that fits the colors
+static unsigned GetPaletteBits(unsigned colors)
+{
+    return colors <= 2 ? 1 : colors <= 4 ? 2 : colors <= 16 ? 4 : 8;
+}
+
+template<int kChannels>
+static inline uint32_t LoadColor(const uint8_t* pixel)
+{
+    uint32_t key = pixel[0];
+    if (kChannels >= 2) {
+        key |= (uint32_t)pixel[1] << 8;
+    }
+    if (kChannels >= 3) {
+        key |= (uint32_t)pixel[2] << 16;
+    }
+    if (kChannels >= 4) {
+        key |= (uint32_t)pixel[3] << 24;
+    }
+    return key;
+}
+
+static inline unsigned GetColorSlot(uint32_t key)
+{
+    return (key * 0x9E3779B1u) >> (32 - kPaletteHashBits);
+}
+
+// Index of a color, which is added if it is new.
+// Returns -1 if it is new and the palette is full
+static int AddPaletteColor(ZPNG_Palette* palette, uint32_t key)
+{
+    const unsigned mask = (1u << kPaletteHashBits) - 1;
+    unsigned slot = GetColorSlot(key);
+    while (palette->Indices[slot] != kPaletteEmpty)
+    {
+        if (palette->Keys[slot] == key) {
+            return palette->Indices[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    if (palette->Count >= kMaxPaletteColors) {
+        return -1;
+    }
+
+    const unsigned index = palette->Count++;
+    palette->Keys[slot] = key;
+    palette->Indices[slot] = (uint16_t)index;
+    for (unsigned i = 0; i < palette->Channels; ++i) {
+        palette->Colors[index * palette->Channels + i] = (uint8_t)(key >> (i * 8));
+    }
+    return (int)index;
+}
+
+// Index of a color that is in the palette
+static inline unsigned GetPaletteIndex(const ZPNG_Palette* palette, uint32_t key)
+{
+    const unsigned mask = (1u << kPaletteHashBits) - 1;
+    unsigned slot = GetColorSlot(key);
+    while (palette->Keys[slot] != key || palette->Indices[slot] == kPaletteEmpty) {
+        slot = (slot + 1) & mask;
+    }
+    return palette->Indices[slot];
+}
+
+// Runs of one color are common in images with few colors, so only pixels
+// that differ from the one before are looked up
+template<int kChannels>
+static bool ScanPaletteColors(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Palette* palette
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    uint32_t prev = LoadColor<kChannels>(imageData->Buffer.Data);
+    AddPaletteColor(palette, prev);
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* row = imageData->Buffer.Data + y * stride;
+        for (unsigned x = 0; x < width; ++x)
+        {
+            const uint32_t key = LoadColor<kChannels>(row + x * kChannels);
+            if (key == prev) {
+                continue;
+            }
+            prev = key;
+            if (AddPaletteColor(palette, key) < 0) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Find the palette of an image with few enough colors for indices to be
+// smaller than the pixels.  Returns false if the image cannot use one
+static bool GetImagePalette(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Palette* palette
+)
+{
+    const unsigned channels = imageData->Channels;
+    if (imageData->BytesPerChannel != 1 || imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT ||
+        channels < 1 || channels > 4 || imageData->WidthPixels == 0 || imageData->HeightPixels == 0) {
+        return false;
+    }
+
+    palette->Channels = channels;
+    palette->Count = 0;
+    memset(palette->Colors, 0, sizeof(palette->Colors));
+    memset(palette->Indices, 0xFF, sizeof(palette->Indices));
+
+    bool found = false;
+    switch (channels)
+    {
+    case 1: found = ScanPaletteColors<1>(imageData, palette); break;
+    case 2: found = ScanPaletteColors<2>(imageData, palette); break;
+    case 3: found = ScanPaletteColors<3>(imageData, palette); break;
+    case 4: found = ScanPaletteColors<4>(imageData, palette); break;
+    }
+    palette->Bits = GetPaletteBits(palette->Count);
+
+    // 8-bit indices of 1-channel pixels would be no smaller
+    return found && (channels > 1 || palette->Bits < 8);
+}
+
+// Write the index of each pixel in kBits bits, first pixel in the high
+// bits, with each row starting on a new byte
+template<int kChannels, int kBits>
+static void PackPaletteIndices(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_Palette* palette,
+    uint8_t* output
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        const uint8_t* row = imageData->Buffer.Data + y * stride;
+        uint32_t prev = LoadColor<kChannels>(row);
+        unsigned index = GetPaletteIndex(palette, prev);
+        unsigned bits = 0, filled = 0;
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            const uint32_t key = LoadColor<kChannels>(row + x * kChannels);
+            if (key != prev)
+            {
+                prev = key;
+                index = GetPaletteIndex(palette, key);
+            }
+
+            bits = (bits << kBits) | index;
+            filled += kBits;
+            if (filled == 8)
+            {
+                *output++ = (uint8_t)bits;
+                bits = 0;
+                filled = 0;
+            }
+        }
+
+        if (filled != 0) {
+            *output++ = (uint8_t)(bits << (8 - filled));
+        }
+    }
+}
+
+template<int kChannels>
+static void PackPaletteChannels(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_Palette* palette,
+    uint8_t* output
+)
+{
+    switch (palette->Bits)
+    {
+    case 1: PackPaletteIndices<kChannels, 1>(imageData, palette, output); break;
+    case 2: PackPaletteIndices<kChannels, 2>(imageData, palette, output); break;
+    case 4: PackPaletteIndices<kChannels, 4>(imageData, palette, output); break;
+    default: PackPaletteIndices<kChannels, 8>(imageData, palette, output); break;
+    }
+}
+
+static void PackImagePalette(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_Palette* palette,
+    uint8_t* output
+)
+{
+    switch (palette->Channels)
+    {
+    case 1: PackPaletteChannels<1>(imageData, palette, output); break;
+    case 2: PackPaletteChannels<2>(imageData, palette, output); break;
+    case 3: PackPaletteChannels<3>(imageData, palette, output); break;
+    case 4: PackPaletteChannels<4>(imageData, palette, output); break;
+    }
+}
+
+// Colors holds kMaxPaletteColors entries, so any index can be looked up
+template<int kChannels, int kBits>
+static void UnpackPaletteIndices(
+    const uint8_t* input,
+    const uint8_t* colors,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const unsigned height = imageData->HeightPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+    const unsigned perByte = 8 / kBits;
+    const unsigned mask = (1u << kBits) - 1;
+
+    for (unsigned y = 0; y < height; ++y)
+    {
+        uint8_t* row = imageData->Buffer.Data + y * stride;
+        for (unsigned x = 0; x < width; x += perByte)
+        {
+            const unsigned bits = *input++;
+            const unsigned count = width - x < perByte ? width - x : perByte;
+            for (unsigned i = 0; i < count; ++i)
+            {
+                const unsigned index = (bits >> (8 - kBits * (i + 1))) & mask;
+                memcpy(row + (x + i) * kChannels, colors + index * kChannels, kChannels);
+            }
+        }
+    }
+}
+
+template<int kChannels>
+static void UnpackPaletteChannels(
+    const uint8_t* input,
+    const uint8_t* colors,
+    unsigned bits,
+    ZPNG_ImageData* imageData
+)
+{
+    switch (bits)
+    {
+    case 1: UnpackPaletteIndices<kChannels, 1>(input, colors, imageData); break;
+    case 2: UnpackPaletteIndices<kChannels, 2>(input, colors, imageData); break;
+    case 4: UnpackPaletteIndices<kChannels, 4>(input, colors, imageData); break;
+    default: UnpackPaletteIndices<kChannels, 8>(input, colors, imageData); break;
+    }
+}
+
+static void UnpackImagePalette(
+    const uint8_t* input,
+    const uint8_t* colors,
+    unsigned bits,
+    ZPNG_ImageData* imageData
+)
+{
+    switch (imageData->Channels)
+    {
+    case 1: UnpackPaletteChannels<1>(input, colors, bits, imageData); break;
+    case 2: UnpackPaletteChannels<2>(input, colors, bits, imageData); break;
+    case 3: UnpackPaletteChannels<3>(input, colors, bits, imageData); break;
+    case 4: UnpackPaletteChannels<4>(input, colors, bits, imageData); break;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Constant Planes
+
+// Where a channel of a constant planes image comes from
+enum ZPNG_PlaneSource
+{
+    // Stored in the frames
+    kPlaneStored = 0,
+
+    // Every pixel has the same value
+    kPlaneConstant = 1,
+
+    // Equal to another channel, which is stored
+    kPlaneCopy = 2
+};
+
+// Channels of an 8-bit image with 2 to 4 channels that the frames leave out
+struct ZPNG_PlaneMap
+{
+    unsigned Channels;
+
+    // Stored channels in order, which the frames hold as an image of their own
+    unsigned StoredCount;
+    uint8_t Stored[4];
+
+    // Per channel: ZPNG_PlaneSource, and the value or the channel to copy
+    uint8_t Source[4];
+    uint8_t Value[4];
+};
+
+// Bytes of the map in the strip header
+static const unsigned kPlaneMapBytesPerChannel = 2;
+
+// Accumulated differences from the first pixel of each channel, and of red
+// and blue from green
+struct ZPNG_PlaneScan
+{
+    uint8_t Changed[4];
+    uint8_t RedDiffers;
+    uint8_t BlueDiffers;
+};
+
+static inline bool IsPlaneScanDone(const ZPNG_PlaneScan* scan, unsigned channels)
+{
+    for (unsigned i = 0; i < channels; ++i) {
+        if (scan->Changed[i] == 0) {
+            return false;
+        }
+    }
+    return channels < 3 || (scan->RedDiffers != 0 && scan->BlueDiffers != 0);
+}
+
+// Scan pixels [x, width) of a row
+template<int kChannels>
+static inline void ScanPlaneRow(
+    const uint8_t* row,
+    const uint8_t* first,
+    unsigned x,
+    unsigned width,
+    ZPNG_PlaneScan* scan
+)
+{
+    for (; x < width; ++x)
+    {
+        const uint8_t* pixel = row + x * kChannels;
+        for (unsigned i = 0; i < kChannels; ++i) {
+            scan->Changed[i] |= pixel[i] ^ first[i];
+        }
+        if (kChannels >= 3)
+        {
+            scan->RedDiffers |= pixel[0] ^ pixel[1];
+            scan->BlueDiffers |= pixel[2] ^ pixel[1];
+        }
+    }
+}
+
+template<int kChannels>
+static void ScanPlanes(
+    const ZPNG_ImageData* imageData,
+    ZPNG_PlaneScan* scan
+)
+{
+    const size_t stride = GetRowStride(imageData, kChannels);
+    const uint8_t* first = imageData->Buffer.Data;
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        ScanPlaneRow<kChannels>(first + y * stride, first, 0, imageData->WidthPixels, scan);
+
+        // Stop as soon as nothing can be left out
+        if (IsPlaneScanDone(scan, kChannels)) {
+            return;
+        }
+    }
+}
+
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+
+// Nonzero if any byte is
+ZPNG_TARGET_SSSE3 static inline uint8_t AnyBytes(__m128i x)
+{
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF;
+}
+
+// 16 pixels at a time, split into channels as the color filter does
+template<int kChannels>
+ZPNG_TARGET_SSSE3 static void ScanPlanesSSSE3(
+    const ZPNG_ImageData* imageData,
+    ZPNG_PlaneScan* scan
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+    const uint8_t* first = imageData->Buffer.Data;
+
+    const __m128i firstR = _mm_set1_epi8((char)first[0]);
+    const __m128i firstG = _mm_set1_epi8((char)first[1]);
+    const __m128i firstB = _mm_set1_epi8((char)first[2]);
+    const __m128i firstA = _mm_set1_epi8((char)first[kChannels - 1]);
+
+    __m128i changedR = _mm_setzero_si128();
+    __m128i changedG = _mm_setzero_si128();
+    __m128i changedB = _mm_setzero_si128();
+    __m128i changedA = _mm_setzero_si128();
+    __m128i redDiffers = _mm_setzero_si128();
+    __m128i blueDiffers = _mm_setzero_si128();
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        const uint8_t* row = first + y * stride;
+
+        unsigned x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i r, g, b, a;
+            if (kChannels == 4) {
+                LoadPixelsRGBA(row + x * kChannels, r, g, b, a);
+                changedA = _mm_or_si128(changedA, _mm_xor_si128(a, firstA));
+            } else {
+                LoadPixelsRGB(row + x * kChannels, r, g, b);
+            }
+            changedR = _mm_or_si128(changedR, _mm_xor_si128(r, firstR));
+            changedG = _mm_or_si128(changedG, _mm_xor_si128(g, firstG));
+            changedB = _mm_or_si128(changedB, _mm_xor_si128(b, firstB));
+            redDiffers = _mm_or_si128(redDiffers, _mm_xor_si128(r, g));
+            blueDiffers = _mm_or_si128(blueDiffers, _mm_xor_si128(b, g));
+        }
+        ScanPlaneRow<kChannels>(row, first, x, width, scan);
+
+        scan->Changed[0] |= AnyBytes(changedR);
+        scan->Changed[1] |= AnyBytes(changedG);
+        scan->Changed[2] |= AnyBytes(changedB);
+        if (kChannels == 4) {
+            scan->Changed[3] |= AnyBytes(changedA);
+        }
+        scan->RedDiffers |= AnyBytes(redDiffers);
+        scan->BlueDiffers |= AnyBytes(blueDiffers);
+
+        if (IsPlaneScanDone(scan, kChannels)) {
+            return;
+        }
+    }
+}
+
+#endif // ENABLE_RGB_COLOR_FILTER && ZPNG_ENABLE_SSSE3
+
+// Fill in StoredCount and Stored from Source.  Returns false if a copy is
+// not of a stored channel
+static bool PlaceStoredPlanes(ZPNG_PlaneMap* map)
+{
+    map->StoredCount = 0;
+    for (unsigned i = 0; i < map->Channels; ++i)
+    {
+        if (map->Source[i] == kPlaneStored) {
+            map->Stored[map->StoredCount++] = (uint8_t)i;
+        } else if (map->Source[i] == kPlaneCopy) {
+            if (map->Value[i] >= map->Channels || map->Source[map->Value[i]] != kPlaneStored) {
+                return false;
+            }
+        } else if (map->Source[i] != kPlaneConstant) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Find the channels that are constant, and red or blue channels equal to
+// green as in grayscale stored as RGB.  Returns false if every channel
+// must be stored or the image cannot leave any out
+static bool GetPlaneMap(
+    const ZPNG_ImageData* imageData,
+    ZPNG_PlaneMap* map
+)
+{
+    const unsigned channels = imageData->Channels;
+    if (imageData->BytesPerChannel != 1 || imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT ||
+        channels < 2 || channels > 4 || imageData->WidthPixels == 0 || imageData->HeightPixels == 0) {
+        return false;
+    }
+
+    ZPNG_PlaneScan scan;
+    memset(&scan, 0, sizeof(scan));
+    switch (channels)
+    {
+    case 2: ScanPlanes<2>(imageData, &scan); break;
+    case 3:
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+        if (HasSSSE3()) {
+            ScanPlanesSSSE3<3>(imageData, &scan);
+            break;
+        }
+#endif
+        ScanPlanes<3>(imageData, &scan);
+        break;
+    case 4:
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+        if (HasSSSE3()) {
+            ScanPlanesSSSE3<4>(imageData, &scan);
+            break;
+        }
+#endif
+        ScanPlanes<4>(imageData, &scan);
+        break;
+    }
+
+    map->Channels = channels;
+    for (unsigned i = 0; i < channels; ++i)
+    {
+        map->Source[i] = scan.Changed[i] ? kPlaneStored : kPlaneConstant;
+        map->Value[i] = imageData->Buffer.Data[i];
+    }
+
+    // Copies of green only help while green itself is stored
+    if (channels >= 3 && map->Source[1] == kPlaneStored)
+    {
+        if (!scan.RedDiffers && map->Source[0] == kPlaneStored) {
+            map->Source[0] = kPlaneCopy;
+            map->Value[0] = 1;
+        }
+        if (!scan.BlueDiffers && map->Source[2] == kPlaneStored) {
+            map->Source[2] = kPlaneCopy;
+            map->Value[2] = 1;
+        }
+    }
+
+    PlaceStoredPlanes(map);
+    return map->StoredCount < channels;
+}
+
+// Read a map of `channels` channels.  Returns false if it is invalid
+static bool ReadPlaneMap(
+    const uint8_t* data,
+    unsigned channels,
+    ZPNG_PlaneMap* map
+)
+{
+    map->Channels = channels;
+    for (unsigned i = 0; i < channels; ++i)
+    {
+        map->Source[i] = data[i * kPlaneMapBytesPerChannel];
+        map->Value[i] = data[i * kPlaneMapBytesPerChannel + 1];
+    }
+    return PlaceStoredPlanes(map);
+}
+
+static void WritePlaneMap(
+    const ZPNG_PlaneMap* map,
+    uint8_t* data
+)
+{
+    for (unsigned i = 0; i < map->Channels; ++i)
+    {
+        data[i * kPlaneMapBytesPerChannel] = map->Source[i];
+        data[i * kPlaneMapBytesPerChannel + 1] = map->Value[i];
+    }
+}
+
+// Copy the stored channels of each pixel into a tightly packed image
+template<int kChannels, int kStored>
+static void GatherPlanesStored(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_PlaneMap* map,
+    uint8_t* output
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    uint8_t stored[kStored > 0 ? kStored : 1];
+    memcpy(stored, map->Stored, sizeof(stored));
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+        for (unsigned x = 0; x < width; ++x)
+        {
+            for (int i = 0; i < kStored; ++i) {
+                output[i] = input[stored[i]];
+            }
+            input += kChannels;
+            output += kStored;
+        }
+    }
+}
+
+template<int kChannels>
+static void GatherPlanesChannels(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_PlaneMap* map,
+    uint8_t* output
+)
+{
+    switch (map->StoredCount)
+    {
+    case 1: GatherPlanesStored<kChannels, 1>(imageData, map, output); break;
+    case 2: GatherPlanesStored<kChannels, 2>(imageData, map, output); break;
+    case 3: GatherPlanesStored<kChannels, 3>(imageData, map, output); break;
+    }
+}
+
+static void GatherPlanes(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_PlaneMap* map,
+    uint8_t* output
+)
+{
+    switch (map->Channels)
+    {
+    case 2: GatherPlanesChannels<2>(imageData, map, output); break;
+    case 3: GatherPlanesChannels<3>(imageData, map, output); break;
+    case 4: GatherPlanesChannels<4>(imageData, map, output); break;
+    }
+}
+
+// Each pixel is the constants plus each stored value times a word with a 1
+// in the byte of that channel and of each copy of it
+template<int kChannels, int kStored>
+static void GetPlaneSpread(
+    const ZPNG_PlaneMap* map,
+    uint32_t* base,
+    uint32_t* spread
+)
+{
+    uint8_t baseBytes[4] = { 0 };
+    uint8_t spreadBytes[kStored > 0 ? kStored : 1][4];
+    memset(spreadBytes, 0, sizeof(spreadBytes));
+    for (int i = 0; i < kChannels; ++i)
+    {
+        if (map->Source[i] == kPlaneConstant) {
+            baseBytes[i] = map->Value[i];
+        }
+        for (int j = 0; j < kStored; ++j) {
+            const unsigned stored = map->Stored[j];
+            if (i == (int)stored || (map->Source[i] == kPlaneCopy && map->Value[i] == stored)) {
+                spreadBytes[j][i] = 1;
+            }
+        }
+    }
+    memcpy(base, baseBytes, sizeof(*base));
+    memcpy(spread, spreadBytes, sizeof(spreadBytes));
+}
+
+// Rebuild `cols` pixels from column firstCol of each of `rows` rows of the
+// stored channels, which are srcWidth pixels across
+template<int kChannels, int kStored>
+static void ExpandPlanesStored(
+    const ZPNG_PlaneMap* map,
+    const uint8_t* input,
+    unsigned srcWidth,
+    unsigned firstCol,
+    unsigned cols,
+    unsigned rows,
+    uint8_t* output,
+    size_t stride
+)
+{
+    uint32_t base, spread[kStored > 0 ? kStored : 1];
+    GetPlaneSpread<kChannels, kStored>(map, &base, spread);
+
+    for (unsigned y = 0; y < rows; ++y)
+    {
+        const uint8_t* src = input + ((size_t)y * srcWidth + firstCol) * kStored;
+        uint8_t* dst = output + y * stride;
+        for (unsigned x = 0; x < cols; ++x)
+        {
+            uint32_t pixel = base;
+            for (int i = 0; i < kStored; ++i) {
+                pixel |= src[i] * spread[i];
+            }
+            memcpy(dst, &pixel, kChannels);
+            src += kStored;
+            dst += kChannels;
+        }
+    }
+}
+
+template<int kChannels>
+static void ExpandPlanesChannels(
+    const ZPNG_PlaneMap* map,
+    const uint8_t* input,
+    unsigned srcWidth,
+    unsigned firstCol,
+    unsigned cols,
+    unsigned rows,
+    uint8_t* output,
+    size_t stride
+)
+{
+    switch (map->StoredCount)
+    {
+    case 0: ExpandPlanesStored<kChannels, 0>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    case 1: ExpandPlanesStored<kChannels, 1>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    case 2: ExpandPlanesStored<kChannels, 2>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    case 3: ExpandPlanesStored<kChannels, 3>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    }
+}
+
+static void ExpandPlanes(
+    const ZPNG_PlaneMap* map,
+    const uint8_t* input,
+    unsigned srcWidth,
+    unsigned firstCol,
+    unsigned cols,
+    unsigned rows,
+    uint8_t* output,
+    size_t stride
+)
+{
+    switch (map->Channels)
+    {
+    case 2: ExpandPlanesChannels<2>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    case 3: ExpandPlanesChannels<3>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    case 4: ExpandPlanesChannels<4>(map, input, srcWidth, firstCol, cols, rows, output, stride); break;
+    }
+}
+
+// PackAndFilter<kStored>() of the gathered stored channels, read in place
+template<int kChannels, int kStored>
+static void PackAndFilterStored(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_PlaneMap* map,
+    uint8_t* output
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    uint8_t stored[kStored];
+    memcpy(stored, map->Stored, sizeof(stored));
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        const uint8_t* input = imageData->Buffer.Data + y * stride;
+
+        uint8_t prev[kStored] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            for (int i = 0; i < kStored; ++i)
+            {
+                const uint8_t a = input[stored[i]];
+                output[i] = a - prev[i];
+                prev[i] = a;
+            }
+            input += kChannels;
+            output += kStored;
+        }
+    }
+}
+
+// UnpackAndUnfilter<kStored>() followed by ExpandPlanes() in one pass
+template<int kChannels, int kStored>
+static void UnpackAndUnfilterStored(
+    const uint8_t* input,
+    const ZPNG_PlaneMap* map,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned width = imageData->WidthPixels;
+    const size_t stride = GetRowStride(imageData, kChannels);
+
+    uint32_t base, spread[kStored];
+    GetPlaneSpread<kChannels, kStored>(map, &base, spread);
+
+    for (unsigned y = 0; y < imageData->HeightPixels; ++y)
+    {
+        uint8_t* output = imageData->Buffer.Data + y * stride;
+
+        uint8_t prev[kStored] = { 0 };
+
+        for (unsigned x = 0; x < width; ++x)
+        {
+            uint32_t pixel = base;
+            for (int i = 0; i < kStored; ++i)
+            {
+                prev[i] += input[i];
+                pixel |= prev[i] * spread[i];
+            }
+            memcpy(output, &pixel, kChannels);
+            input += kStored;
+            output += kChannels;
+        }
+    }
+}
+
+// Whether the stored channels are RGB followed by a constant alpha
+static bool IsConstantAlpha(const ZPNG_PlaneMap* map)
+{
+    return map->Channels == 4 && map->StoredCount == 3 &&
+        map->Stored[0] == 0 && map->Stored[1] == 1 && map->Stored[2] == 2;
+}
+
+// PackImage() of the gathered stored channels without gathering them.
+// Returns false if there is no kernel for the map
+static bool PackImageStored(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_PlaneMap* map,
+    uint8_t* packing
+)
+{
+    const unsigned key = map->Channels * 4 + map->StoredCount;
+    switch (key)
+    {
+    case 2 * 4 + 1: PackAndFilterStored<2, 1>(imageData, map, packing); return true;
+    case 3 * 4 + 1: PackAndFilterStored<3, 1>(imageData, map, packing); return true;
+    case 3 * 4 + 2: PackAndFilterStored<3, 2>(imageData, map, packing); return true;
+    case 4 * 4 + 1: PackAndFilterStored<4, 1>(imageData, map, packing); return true;
+    case 4 * 4 + 2: PackAndFilterStored<4, 2>(imageData, map, packing); return true;
+    }
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+    if (IsConstantAlpha(map) && HasSSSE3()) {
+        PackAndFilterSSSE3_RGBA<false>(imageData, packing);
+        return true;
+    }
+#endif
+    return map->StoredCount == 0;
+}
+
+// UnpackImage() and ExpandPlanes() of a whole strip in one pass.
+// Returns false if there is no kernel for the map
+static bool UnpackImageStored(
+    const uint8_t* packing,
+    const ZPNG_PlaneMap* map,
+    ZPNG_ImageData* imageData
+)
+{
+    const unsigned key = map->Channels * 4 + map->StoredCount;
+    switch (key)
+    {
+    case 2 * 4 + 1: UnpackAndUnfilterStored<2, 1>(packing, map, imageData); return true;
+    case 3 * 4 + 1: UnpackAndUnfilterStored<3, 1>(packing, map, imageData); return true;
+    case 3 * 4 + 2: UnpackAndUnfilterStored<3, 2>(packing, map, imageData); return true;
+    case 4 * 4 + 1: UnpackAndUnfilterStored<4, 1>(packing, map, imageData); return true;
+    case 4 * 4 + 2: UnpackAndUnfilterStored<4, 2>(packing, map, imageData); return true;
+    }
+#if defined(ENABLE_RGB_COLOR_FILTER) && defined(ZPNG_ENABLE_SSSE3)
+    if (IsConstantAlpha(map) && map->Source[3] == kPlaneConstant && HasSSSE3()) {
+        UnpackAndUnfilterSSSE3_RGBA<false>(packing, imageData, map->Value[3]);
+        return true;
+    }
+#endif
+    if (map->StoredCount == 0) {
+        ExpandPlanes(map, packing, imageData->WidthPixels, 0, imageData->WidthPixels,
+            imageData->HeightPixels, imageData->Buffer.Data,
+            GetRowStride(imageData, map->Channels));
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Strip Format
+
+// Layout shared by the strip encoder and decoder
+struct ZPNG_StripLayout
+{
+    unsigned PixelBytes;
+    unsigned StripRows;
+    unsigned StripCount;
+
+    // Zstd frames per strip: 1, or one per plane with plane frames
+    unsigned FramesPerStrip;
+    unsigned FrameCount;
+
+    // Bytes of packed pixels in a full strip
+    size_t StripBytes;
+
+    // Delta frames leave room for an escape per packed byte
+    bool Delta;
+
+    // Packing space per strip, including video overflow bytes
+    size_t SlotBytes;
+
+    // Palette images only: Colors and bits per index, otherwise 0
+    unsigned PaletteColors;
+    unsigned IndexBits;
+
+    // Bytes per pixel in the frames: PixelBytes, or the stored channels of
+    // a constant planes image
+    unsigned StoredPixelBytes;
+
+    // Offsets of the palette, plane map, dictionary ID, motion section, skip
+    // section and checksum, or 0 if there are none
+    size_t PaletteOffset;
+    size_t PlaneMapOffset;
+    size_t DictionaryOffset;
+    size_t MotionOffset;
+    size_t SkipOffset;
+    size_t ChecksumOffset;
+
+    // Header plus offset table and all of the sections above
+    size_t HeaderBytes;
+};
+
+static void GetStripLayout(
+    unsigned width,
+    unsigned height,
+    unsigned pixelBytes,
+    unsigned stripRows,
+    unsigned framesPerStrip,
+    unsigned paletteColors,
+    const ZPNG_PlaneMap* planeMap,
+    bool delta,
+    bool dictionary,
+    bool checksum,
+    ZPNG_StripLayout* layout
+)
+{
+    layout->PixelBytes = pixelBytes;
+    layout->StripRows = stripRows;
+    layout->StripCount = (unsigned)(((uint64_t)height + stripRows - 1) / stripRows);
+    layout->FramesPerStrip = framesPerStrip;
+    layout->FrameCount = layout->StripCount * framesPerStrip;
+    // Strips may be taller than the image, but are only sized for its rows
+    layout->StripBytes = (size_t)width * (stripRows < height ? stripRows : height) * pixelBytes;
+    layout->Delta = delta;
+    layout->SlotBytes = layout->StripBytes + GetOverflowBytes(layout->StripBytes, delta);
+    layout->HeaderBytes = sizeof(ZPNG_StripHeader) + ((size_t)layout->FrameCount + 1) * sizeof(uint64_t);
+    layout->PaletteColors = paletteColors;
+    layout->IndexBits = paletteColors ? GetPaletteBits(paletteColors) : 0;
+    layout->PaletteOffset = 0;
+    if (paletteColors)
+    {
+        layout->PaletteOffset = layout->HeaderBytes;
+        layout->HeaderBytes += sizeof(uint32_t) + (size_t)paletteColors * pixelBytes;
+    }
+    layout->StoredPixelBytes = pixelBytes;
+    layout->PlaneMapOffset = 0;
+    if (planeMap)
+    {
+        layout->StoredPixelBytes = planeMap->StoredCount;
+        layout->PlaneMapOffset = layout->HeaderBytes;
+        layout->HeaderBytes += planeMap->Channels * kPlaneMapBytesPerChannel;
+    }
+    layout->DictionaryOffset = 0;
+    if (dictionary)
+    {
+        layout->DictionaryOffset = layout->HeaderBytes;
+        layout->HeaderBytes += sizeof(uint64_t);
+    }
+    layout->MotionOffset = 0;
+    layout->SkipOffset = 0;
+    layout->ChecksumOffset = 0;
+    if (checksum)
+    {
+        layout->ChecksumOffset = layout->HeaderBytes;
+        layout->HeaderBytes += sizeof(uint64_t);
+    }
+}
+
+// Add a block map section of `bytes` to a layout, before any checksum.
+// Returns its offset
+static size_t AddBlockMapLayout(
+    ZPNG_StripLayout* layout,
+    size_t bytes
+)
+{
+    const size_t offset = layout->ChecksumOffset ? layout->ChecksumOffset : layout->HeaderBytes;
+    layout->HeaderBytes += bytes;
+    if (layout->ChecksumOffset) {
+        layout->ChecksumOffset += bytes;
+    }
+    return offset;
+}
+
+// Read the header of the block map section that would come next in a
+// layout, and add the section.  Decoders only know the block size they
+// search with.  Returns the section offset, or 0 if it is invalid
+static size_t ReadBlockMapLayout(
+    ZPNG_Buffer buffer,
+    ZPNG_StripLayout* layout
+)
+{
+    const size_t offset = layout->ChecksumOffset ? layout->ChecksumOffset : layout->HeaderBytes;
+    ZPNG_BlockMapHeader section;
+    if (buffer.Bytes < offset + sizeof(section)) {
+        return 0;
+    }
+    memcpy(&section, buffer.Data + offset, sizeof(section));
+    if (section.BlockPixels != kMotionBlockPixels ||
+        (uint64_t)offset + sizeof(section) + section.StoredBytes > buffer.Bytes) {
+        return 0;
+    }
+    return AddBlockMapLayout(layout, sizeof(section) + section.StoredBytes);
+}
+
+// Whether a strip format header is of a delta frame with motion vectors
+static bool HasStripMotion(const ZPNG_StripHeader* header)
+{
+    return (header->Flags & ZPNG_STRIP_FLAG_VIDEO) && ((header->Filter >> kColorTransformShift) & kVideoMotion) != 0;
+}
+
+// Whether a strip format header is of a delta frame with skipped blocks
+static bool HasStripSkip(const ZPNG_StripHeader* header)
+{
+    return (header->Flags & ZPNG_STRIP_FLAG_VIDEO) && ((header->Filter >> kColorTransformShift) & kVideoSkip) != 0;
+}
+
+// Frames per strip in a buffer with this header
+static unsigned GetFramesPerStrip(const ZPNG_StripHeader* header)
+{
+    return (header->Flags & ZPNG_STRIP_FLAG_PLANE_FRAMES) ? header->Channels : 1;
+}
+
+// Layout of a strip format buffer, with the palette size, any plane map and
+// the motion and skip section sizes read from it.  Returns 1 on success, 0 if one of
+// these is invalid or not in the buffer
+static int GetBufferStripLayout(
+    ZPNG_Buffer buffer,
+    unsigned pixelBytes,
+    ZPNG_StripLayout* layout,
+    ZPNG_PlaneMap* planeMap
+)
+{
+    const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+    const bool delta = (header->Flags & ZPNG_STRIP_FLAG_VIDEO) != 0;
+    const bool dictionary = (header->Flags & ZPNG_STRIP_FLAG_DICTIONARY) != 0;
+    const bool checksum = (header->Flags & ZPNG_STRIP_FLAG_CHECKSUM) != 0;
+    GetStripLayout(header->Width, header->Height, pixelBytes, header->StripRows,
+        GetFramesPerStrip(header), 0, nullptr, delta, dictionary, checksum, layout);
+
+    // The palette and then the plane map follow the offset table
+    size_t offset = sizeof(ZPNG_StripHeader) + ((size_t)layout->FrameCount + 1) * sizeof(uint64_t);
+    uint32_t colors = 0;
+    if (header->Flags & ZPNG_STRIP_FLAG_PALETTE)
+    {
+        if (buffer.Bytes < offset + sizeof(colors)) {
+            return 0;
+        }
+        memcpy(&colors, buffer.Data + offset, sizeof(colors));
+        if (colors == 0 || colors > kMaxPaletteColors) {
+            return 0;
+        }
+        offset += sizeof(colors) + (size_t)colors * pixelBytes;
+    }
+
+    ZPNG_PlaneMap map;
+    const bool hasPlaneMap = (header->Flags & ZPNG_STRIP_FLAG_CONSTANT_PLANES) != 0;
+    if (hasPlaneMap)
+    {
+        const unsigned channels = header->Channels;
+        if (header->BytesPerChannel != 1 || channels < 2 || channels > 4 ||
+            buffer.Bytes < offset + channels * kPlaneMapBytesPerChannel ||
+            !ReadPlaneMap(buffer.Data + offset, channels, &map)) {
+            return 0;
+        }
+        if (planeMap) {
+            *planeMap = map;
+        }
+    }
+
+    if (colors != 0 || hasPlaneMap) {
+        GetStripLayout(header->Width, header->Height, pixelBytes, header->StripRows,
+            GetFramesPerStrip(header), colors, hasPlaneMap ? &map : nullptr, delta, dictionary, checksum, layout);
+    }
+
+    if (HasStripMotion(header))
+    {
+        layout->MotionOffset = ReadBlockMapLayout(buffer, layout);
+        if (layout->MotionOffset == 0) {
+            return 0;
+        }
+    }
+    if (HasStripSkip(header))
+    {
+        layout->SkipOffset = ReadBlockMapLayout(buffer, layout);
+        if (layout->SkipOffset == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Bytes in the frames for `rows` rows of a strip: The stored channels of
+// each pixel, or palette indices with each row starting on a new byte
+static size_t GetPackedBytes(
+    const ZPNG_StripLayout* layout,
+    unsigned width,
+    unsigned rows
+)
+{
+    if (layout->IndexBits != 0) {
+        return (size_t)rows * (((size_t)width * layout->IndexBits + 7) / 8);
+    }
+    return (size_t)rows * width * layout->StoredPixelBytes;
+}
+
+// Bytes in the frame of a strip at firstRow: Those of GetPackedBytes(), or
+// of just the blocks that are not skipped in a delta frame with a skip map
+static size_t GetStripPackedBytes(
+    const ZPNG_StripLayout* layout,
+    const ZPNG_SkipMap* skip,
+    unsigned width,
+    unsigned firstRow,
+    unsigned rows
+)
+{
+    if (skip) {
+        return GetChangedPixels(skip, firstRow, rows) * layout->PixelBytes;
+    }
+    return GetPackedBytes(layout, width, rows);
+}
+
+static unsigned GetStripRowCount(
+    const ZPNG_StripLayout* layout,
+    unsigned height,
+    unsigned strip
+)
+{
+    const unsigned firstRow = strip * layout->StripRows;
+    const unsigned remaining = height - firstRow;
+    return remaining < layout->StripRows ? remaining : layout->StripRows;
+}
+
+// Worst-case compressed size of a strip slot
+static size_t GetStripBound(
+    const ZPNG_StripLayout* layout,
+    unsigned width,
+    unsigned rows
+)
+{
+    const size_t packedBytes = (size_t)width * rows * layout->PixelBytes;
+    return ZSTD_compressBound(packedBytes + GetOverflowBytes(packedBytes, layout->Delta));
+}
+
+// Worst-case compressed size of one frame of a strip with `rows` rows
+static size_t GetFrameBound(
+    const ZPNG_StripLayout* layout,
+    unsigned width,
+    unsigned rows
+)
+{
+    if (layout->FramesPerStrip == 1) {
+        return GetStripBound(layout, width, rows);
+    }
+    return ZSTD_compressBound((size_t)width * rows);
+}
+
+// Offset past HeaderBytes where a frame is compressed before compaction.
+// The planes of a strip fit in its slot: The overflow bytes in the strip
+// bound cover the extra 64 bytes that ZSTD_compressBound() allows per plane
+static size_t GetFrameSlot(
+    const ZPNG_StripLayout* layout,
+    unsigned width,
+    unsigned height,
+    unsigned frame
+)
+{
+    const unsigned strip = frame / layout->FramesPerStrip;
+    const unsigned plane = frame % layout->FramesPerStrip;
+    const unsigned rows = GetStripRowCount(layout, height, strip);
+    return strip * GetStripBound(layout, width, layout->StripRows) + plane * GetFrameBound(layout, width, rows);
+}
+
+// Most bytes of stored motion vectors and skip map together for an image.
+// Frames with more are delta coded without them
+static inline size_t GetBlockMapBudget(size_t imageBytes)
+{
+    return imageBytes / 256;
+}
+
+// Worst-case size of a strip format buffer with at most stripCount strips.
+// Strip i is compressed at offset HeaderBytes + i * (bound of a full strip)
+// and the strips are compacted afterwards, which fits within this size.
+// Delta frames may escape every byte once more
+static size_t GetStripMaximumBufferSize(
+    size_t imageBytes,
+    unsigned stripCount,
+    bool delta
+)
+{
+    // ZSTD_compressBound(x) is x + x/256, plus at most 64 bytes for small x,
+    // and each strip has up to kMaxFramesPerStrip frames and offsets
+    const size_t perStripBytes = kMinOverflowBytes + kMinOverflowBytes / 256 +
+        kMaxFramesPerStrip * (1 + 64 + sizeof(uint64_t));
+    const size_t escapeBytes = delta ? imageBytes + imageBytes / 256 : 0;
+    const size_t headerBytes = sizeof(ZPNG_StripHeader) + sizeof(uint64_t) * 3 + // End offset, dictionary ID and checksum
+        sizeof(uint32_t) + kMaxPaletteColors * 4 + // Palette
+        4 * kPlaneMapBytesPerChannel + // Plane map
+        sizeof(ZPNG_BlockMapHeader) * 2; // Motion and skip sections, of at most GetBlockMapBudget() bytes
+    return headerBytes + imageBytes + imageBytes / 256 + escapeBytes + GetBlockMapBudget(imageBytes) + stripCount * perStripBytes;
+}
+
+// XXH64 of a strip format buffer ending at `bytes`, skipping the checksum
+static uint64_t GetStripChecksum(
+    const uint8_t* buffer,
+    size_t bytes,
+    const ZPNG_StripLayout* layout
+)
+{
+    XXH64_state_t state;
+    XXH64_reset(&state, 0);
+    XXH64_update(&state, buffer, layout->ChecksumOffset);
+    XXH64_update(&state, buffer + layout->HeaderBytes, bytes - layout->HeaderBytes);
+    return XXH64_digest(&state);
+}
+
+// Validate the offset table so later stages can trust the offsets.
+// Returns 1 if valid, 0 if not
+static int CheckStripOffsets(
+    ZPNG_Buffer buffer,
+    const ZPNG_StripLayout* layout
+)
+{
+    const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+    const unsigned frameCount = layout->FrameCount;
+    if (header->StripCount != layout->StripCount || buffer.Bytes < layout->HeaderBytes) {
+        return 0;
+    }
+
+    const uint64_t* offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_StripHeader));
+    if (offsets[0] != layout->HeaderBytes || offsets[frameCount] > buffer.Bytes) {
+        return 0;
+    }
+    for (unsigned i = 0; i < frameCount; ++i) {
+        if (offsets[i + 1] < offsets[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Validate the offset table, and the checksum if there is one.
+// Returns 1 if valid, 0 if not
+static int CheckStripTable(
+    ZPNG_Buffer buffer,
+    const ZPNG_StripLayout* layout
+)
+{
+    if (!CheckStripOffsets(buffer, layout)) {
+        return 0;
+    }
+
+    const uint64_t* offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_StripHeader));
+    const unsigned frameCount = layout->FrameCount;
+
+    if (layout->ChecksumOffset != 0)
+    {
+        uint64_t checksum;
+        memcpy(&checksum, buffer.Data + layout->ChecksumOffset, sizeof(checksum));
+        if (checksum != GetStripChecksum(buffer.Data, (size_t)offsets[frameCount], layout)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int EnsureContextWorkers(ZPNG_CompressionContext* ctx)
+{
+    if (ctx->Workers <= 1) {
+        return 1;
+    }
+
+    if (!ctx->Pool)
+    {
+        CountAllocation(ctx->Collector);
+        ctx->Pool = POOL_create(ctx->Workers - 1, ctx->Workers);
+        if (!ctx->Pool) {
+            return 0;
+        }
+    }
+
+    if (!ctx->WorkerCCtx)
+    {
+        CountAllocation(ctx->Collector);
+        ctx->WorkerCCtx = (ZSTD_CCtx**)calloc(ctx->Workers, sizeof(ZSTD_CCtx*));
+        if (!ctx->WorkerCCtx) {
+            return 0;
+        }
+
+        // Worker 0 is the calling thread, which uses the main context
+        ctx->WorkerCCtx[0] = ctx->CCtx;
+    }
+
+    for (unsigned i = 1; i < ctx->Workers; ++i)
+    {
+        if (!ctx->WorkerCCtx[i])
+        {
+            CountAllocation(ctx->Collector);
+            ctx->WorkerCCtx[i] = ZSTD_createCCtx();
+            if (!ctx->WorkerCCtx[i]) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+struct ZPNG_StripEncoder
+{
+    const ZPNG_ImageData* RefData;
+    const ZPNG_ImageData* ImageData;
+    ZPNG_StripLayout Layout;
+
+    // Strip i packs into Packing + i * SlotBytes
+    uint8_t* Packing;
+
+    // Frame i compresses into Output + HeaderBytes + GetFrameSlot(i)
+    uint8_t* Output;
+
+    ZPNG_CompressionContext* Context;
+    const ZSTD_CDict* CDict;
+
+    // Which stages to run for each strip
+    bool Filter;
+    bool Video;
+    bool Compress;
+
+    // ZPNG_Backend of the intra frames
+    unsigned Backend;
+
+    // Intra strips use the 16-bit filter
+    bool Wide;
+
+    // ZPNG_Filter and ZPNG_ColorTransform of the intra strips
+    unsigned Predictor;
+    unsigned Transform;
+
+    // Kernels for the intra strips and their stored channels, found once
+    // with GetKernels(), and for delta strips
+    ZPNG_PackKernel Kernel;
+    ZPNG_PackKernel StoredKernel;
+    const ZPNG_VideoKernels* VideoKernels;
+
+    // Intra strips are packed as indices into this palette, if set
+    const ZPNG_Palette* Palette;
+
+    // Intra strips only hold the stored channels of this map, if set.
+    // StoredFormat describes them as an image, and worker i gathers them
+    // into Gather + i * StripBytes before filtering
+    const ZPNG_PlaneMap* PlaneMap;
+    ZPNG_ImageData StoredFormat;
+    uint8_t* Gather;
+
+    // Set if the context pack function failed on any strip
+    std::atomic<bool> PackFailed;
+
+    // Delta strips are coded against the reference moved by these vectors,
+    // if set.  Worker i compensates into Compensated + i * StripBytes
+    const ZPNG_MotionField* Motion;
+    uint8_t* Compensated;
+
+    // Delta strips only code the blocks that this map does not skip, if
+    // set.  Worker i gathers their pixels and reference pixels into
+    // Changed + i * 2 * StripBytes
+    const ZPNG_SkipMap* Skip;
+    uint8_t* Changed;
+
+    // Per strip: Overflow byte count
+    size_t* OverflowCounts;
+
+    // Per frame: Compressed size or Zstd error code
+    size_t* Results;
+};
+
+// Whether a strip or plane of filtered bytes is coded as an entropy frame
+static bool UseEntropyFrame(const ZPNG_StripEncoder* enc, const uint8_t* src, size_t bytes)
+{
+    if (enc->Video || enc->Backend == ZPNG_BACKEND_ZSTD || bytes == 0) {
+        return false;
+    }
+    return enc->Backend == ZPNG_BACKEND_ENTROPY || IsNoiseHeavy(src, bytes);
+}
+
+// Bytes of each plane of a filtered strip, which get their own Huffman
+// tables.  Bayer samples are split into quarters by color and byte, RGB(A)
+// and 16-bit samples by channel and byte, and the rest are interleaved
+static size_t GetEntropyPlaneBytes(const ZPNG_ImageData* imageData, unsigned rows, size_t packedBytes)
+{
+    const size_t samples = (size_t)rows * imageData->WidthPixels;
+    if (GetBayerFormat(imageData) != ZPNG_PIXEL_FORMAT_DEFAULT) {
+        return samples / 4 > 0 ? samples / 4 : packedBytes;
+    }
+    if (IsWideImage(imageData) || IsPlanarImage(imageData)) {
+        return samples;
+    }
+    return packedBytes;
+}
+
+static bool WriteStreamBytes(ZPNG_StreamWriter* stream, const void* data, size_t bytes)
+{
+    if (!stream->Write(stream->Opaque, stream->Offset, data, bytes)) {
+        return false;
+    }
+    stream->Offset += bytes;
+    return true;
+}
+
+// Mark a frame compressed and write it to the stream along with any later
+// frames that were waiting on it, so frames go out in order whichever
+// worker finishes first
+static void WriteStreamFrames(ZPNG_StripEncoder* enc, unsigned frame)
+{
+    ZPNG_StreamWriter* stream = enc->Context->Stream;
+    const ZPNG_StripLayout* layout = &enc->Layout;
+    const unsigned width = enc->ImageData->WidthPixels;
+    const unsigned height = enc->ImageData->HeightPixels;
+
+    ZSTD_pthread_mutex_lock(&stream->Lock);
+    stream->Done[frame] = true;
+    while (stream->Next < layout->FrameCount && stream->Done[stream->Next])
+    {
+        const unsigned i = stream->Next++;
+        if (stream->Failed) {
+            continue;
+        }
+
+        const size_t result = enc->Results[i];
+        const uint64_t bytes = result;
+        const uint8_t* data = enc->Output + layout->HeaderBytes + GetFrameSlot(layout, width, height, i);
+        if (ZSTD_isError(result) || !WriteStreamBytes(stream, &bytes, sizeof(bytes)) ||
+            !WriteStreamBytes(stream, data, result)) {
+            stream->Failed = true;
+        }
+    }
+    ZSTD_pthread_mutex_unlock(&stream->Lock);
+}
+
+static void EncodeStrip(void* opaque, unsigned strip, unsigned worker)
+{
+    ZPNG_StripEncoder* enc = (ZPNG_StripEncoder*)opaque;
+    const ZPNG_StripLayout* layout = &enc->Layout;
+
+    const unsigned firstRow = strip * layout->StripRows;
+    const unsigned rows = GetStripRowCount(layout, enc->ImageData->HeightPixels, strip);
+    uint8_t* packing = enc->Packing + strip * layout->SlotBytes;
+    ZPNG_StatsCollector* collector = enc->Context->Collector;
+
+    if (enc->Filter)
+    {
+        const uint64_t t0 = StartStage(collector);
+        const ZPNG_ImageData stripImage = GetStripImage(enc->ImageData, layout->PixelBytes, firstRow, rows);
+
+        if (enc->Video)
+        {
+            const ZPNG_ImageData stripRef = GetStripReference(enc->RefData, enc->Motion, layout->PixelBytes, firstRow, rows,
+                enc->Compensated + worker * layout->StripBytes);
+            if (enc->Skip)
+            {
+                uint8_t* changed = enc->Changed + worker * 2 * layout->StripBytes;
+                const ZPNG_ImageData changedImage = GatherChangedPixels(enc->Skip, layout->PixelBytes, firstRow, &stripImage, changed);
+                const ZPNG_ImageData changedRef = GatherChangedPixels(enc->Skip, layout->PixelBytes, firstRow, &stripRef,
+                    changed + layout->StripBytes);
+                enc->OverflowCounts[strip] = enc->VideoKernels->Pack(&changedRef, &changedImage, packing);
+            }
+            else
+            {
+                enc->OverflowCounts[strip] = enc->VideoKernels->Pack(&stripRef, &stripImage, packing);
+            }
+        }
+        else
+        {
+            ZPNG_CompressionContext* ctx = enc->Context;
+            if (ctx->PackFunction) {
+                if (!ctx->PackFunction(ctx->PackOpaque, enc->ImageData, firstRow, rows, packing)) {
+                    enc->PackFailed = true;
+                    EndStage(collector, ZPNG_STAGE_FILTER, t0);
+                    return;
+                }
+            } else if (enc->Palette) {
+                PackImagePalette(&stripImage, enc->Palette, packing);
+            } else if (enc->PlaneMap) {
+                ZPNG_ImageData storedImage = enc->StoredFormat;
+                storedImage.Buffer.Data = enc->Gather + worker * layout->StripBytes;
+                storedImage.Buffer.Bytes = GetPackedBytes(layout, storedImage.WidthPixels, rows);
+                storedImage.HeightPixels = rows;
+                if (enc->Predictor != ZPNG_FILTER_LEFT || enc->Transform != ZPNG_COLOR_GB_RG ||
+                    !PackImageStored(&stripImage, enc->PlaneMap, packing)) {
+                    GatherPlanes(&stripImage, enc->PlaneMap, storedImage.Buffer.Data);
+                    if (enc->StoredKernel) {
+                        enc->StoredKernel(&storedImage, packing);
+                    }
+                }
+            } else {
+                enc->Kernel(&stripImage, packing);
+            }
+            enc->OverflowCounts[strip] = 0;
+        }
+        EndStage(collector, ZPNG_STAGE_FILTER, t0);
+    }
+
+    if (enc->Compress)
+    {
+        const uint64_t t0 = StartStage(collector);
+        const unsigned width = enc->ImageData->WidthPixels;
+        const size_t packedBytes = GetStripPackedBytes(layout, enc->Skip, width, firstRow, rows) + enc->OverflowCounts[strip];
+        uint8_t* dst = enc->Output + layout->HeaderBytes + strip * GetStripBound(layout, width, layout->StripRows);
+
+        if (UseEntropyFrame(enc, packing, packedBytes))
+        {
+            // Color planes are coded separately, like plane frames would be
+            const ZPNG_ImageData* format = enc->PlaneMap ? &enc->StoredFormat : enc->ImageData;
+            const size_t planeBytes = enc->Palette ? packedBytes : GetEntropyPlaneBytes(format, rows, packedBytes);
+            enc->Results[strip] = CompressEntropyFrame(dst, GetStripBound(layout, width, rows), packing, packedBytes, planeBytes);
+        }
+        else if (layout->StripCount == 1)
+        {
+            // A single strip can still be split across ZSTDMT workers
+            enc->Results[strip] = CompressWithContext(enc->Context, dst, GetStripBound(layout, width, rows), packing, packedBytes, enc->CDict);
+        }
+        else
+        {
+            ZSTD_CCtx* cctx = enc->Context->WorkerCCtx ? enc->Context->WorkerCCtx[worker] : enc->Context->CCtx;
+            enc->Results[strip] = CompressFrame(cctx, &enc->Context->Params, dst, GetStripBound(layout, width, rows), packing, packedBytes, enc->CDict);
+        }
+        EndStage(collector, ZPNG_STAGE_ZSTD, t0);
+
+        if (enc->Context->Stream) {
+            WriteStreamFrames(enc, strip);
+        }
+    }
+}
+
+// Compress one plane of a filtered strip, for plane frames
+static void EncodeFrame(void* opaque, unsigned frame, unsigned worker)
+{
+    ZPNG_StripEncoder* enc = (ZPNG_StripEncoder*)opaque;
+    const ZPNG_StripLayout* layout = &enc->Layout;
+    ZPNG_CompressionContext* ctx = enc->Context;
+
+    const unsigned strip = frame / layout->FramesPerStrip;
+    const unsigned plane = frame % layout->FramesPerStrip;
+    const unsigned width = enc->ImageData->WidthPixels;
+    const unsigned height = enc->ImageData->HeightPixels;
+    const unsigned rows = GetStripRowCount(layout, height, strip);
+    const size_t planeBytes = (size_t)width * rows;
+
+    const uint8_t* src = enc->Packing + strip * layout->SlotBytes + plane * planeBytes;
+    uint8_t* dst = enc->Output + layout->HeaderBytes + GetFrameSlot(layout, width, height, frame);
+
+    ZPNG_CompressionParams params = ctx->Params;
+    if (ctx->PlaneLevels[plane] != 0) {
+        params.Level = ctx->PlaneLevels[plane];
+    }
+
+    const uint64_t t0 = StartStage(ctx->Collector);
+    if (UseEntropyFrame(enc, src, planeBytes)) {
+        enc->Results[frame] = CompressEntropyFrame(dst, GetFrameBound(layout, width, rows), src, planeBytes, planeBytes);
+    }
+    else
+    {
+        ZSTD_CCtx* cctx = ctx->WorkerCCtx ? ctx->WorkerCCtx[worker] : ctx->CCtx;
+        enc->Results[frame] = CompressFrame(cctx, &params, dst, GetFrameBound(layout, width, rows), src, planeBytes, enc->CDict);
+    }
+    EndStage(ctx->Collector, ZPNG_STAGE_ZSTD, t0);
+
+    if (ctx->Stream) {
+        WriteStreamFrames(enc, frame);
+    }
+}
+
+// Strip header flags for the encoder's image, apart from the entropy flag
+static unsigned GetStripFlags(
+    const ZPNG_StripEncoder* enc,
+    bool isVideo,
+    bool planeFrames,
+    bool checksum
+)
+{
+    return (isVideo ? ZPNG_STRIP_FLAG_VIDEO : 0) | (enc->Wide ? ZPNG_STRIP_FLAG_PLANES16 : 0) |
+        (checksum ? ZPNG_STRIP_FLAG_CHECKSUM : 0) | (planeFrames ? ZPNG_STRIP_FLAG_PLANE_FRAMES : 0) |
+        (enc->CDict ? ZPNG_STRIP_FLAG_DICTIONARY : 0) | (enc->Palette ? ZPNG_STRIP_FLAG_PALETTE : 0) |
+        (enc->PlaneMap ? ZPNG_STRIP_FLAG_CONSTANT_PLANES : 0);
+}
+
+// Write a block map section holding a stored map
+static void WriteBlockMap(
+    const uint8_t* stored,
+    size_t storedBytes,
+    uint8_t* output
+)
+{
+    ZPNG_BlockMapHeader section;
+    section.BlockPixels = kMotionBlockPixels;
+    section.StoredBytes = (uint32_t)storedBytes;
+    memcpy(output, &section, sizeof(section));
+    memcpy(output + sizeof(section), stored, storedBytes);
+}
+
+// Fill in the strip header, palette, plane map, dictionary ID and block
+// maps at the start of the output.  The offset table and checksum are left
+// alone
+static void WriteStripHeader(
+    const ZPNG_StripEncoder* enc,
+    unsigned flags,
+    ZPNG_Dictionary* const* dictionary
+)
+{
+    uint8_t* output = enc->Output;
+    const ZPNG_ImageData* imageData = enc->ImageData;
+
+    ZPNG_StripHeader* header = (ZPNG_StripHeader*)output;
+    header->Magic = ZPNG_STRIP_HEADER_MAGIC;
+    header->Version = ZPNG_STRIP_HEADER_VERSION;
+    header->Flags = (uint8_t)flags;
+    header->Width = imageData->WidthPixels;
+    header->Height = imageData->HeightPixels;
+    header->Channels = (uint8_t)imageData->Channels;
+    header->BytesPerChannel = (uint8_t)imageData->BytesPerChannel;
+    header->PixelFormat = GetPixelFormatCode(imageData->PixelFormat);
+    // Delta frames flag their sections in place of the transform
+    unsigned transform = enc->Transform;
+    if (enc->Motion || enc->Skip) {
+        transform = (enc->Motion ? kVideoMotion : 0) | (enc->Skip ? kVideoSkip : 0);
+    }
+    header->Filter = (uint8_t)(enc->Predictor | transform << kColorTransformShift);
+    header->StripRows = enc->Layout.StripRows;
+    header->StripCount = enc->Layout.StripCount;
+
+    if (enc->Palette)
+    {
+        const uint32_t colors = enc->Palette->Count;
+        memcpy(output + enc->Layout.PaletteOffset, &colors, sizeof(colors));
+        memcpy(output + enc->Layout.PaletteOffset + sizeof(colors), enc->Palette->Colors, (size_t)colors * enc->Layout.PixelBytes);
+    }
+
+    if (enc->PlaneMap) {
+        WritePlaneMap(enc->PlaneMap, output + enc->Layout.PlaneMapOffset);
+    }
+
+    if (enc->CDict)
+    {
+        const uint64_t id = ((const ZPNG_DictionaryState*)*dictionary)->Id;
+        memcpy(output + enc->Layout.DictionaryOffset, &id, sizeof(id));
+    }
+
+    if (enc->Motion) {
+        WriteBlockMap(enc->Motion->Stored, enc->Motion->StoredBytes, output + enc->Layout.MotionOffset);
+    }
+    if (enc->Skip) {
+        WriteBlockMap(enc->Skip->Stored, enc->Skip->StoredBytes, output + enc->Layout.SkipOffset);
+    }
+}
+
+// Write the stream header: The strip header with the stream magic, then
+// what follows the offset table.  Frames may contain entropy frames unless
+// the backend rules them out, since the header goes before any are made.
+// Returns 1 on success, 0 on failure
+static int WriteStreamHeader(
+    const ZPNG_StripEncoder* enc,
+    unsigned flags,
+    ZPNG_Dictionary* const* dictionary
+)
+{
+    ZPNG_StreamWriter* stream = enc->Context->Stream;
+    if (enc->Backend != ZPNG_BACKEND_ZSTD && !enc->Video) {
+        flags |= ZPNG_STRIP_FLAG_ENTROPY;
+    }
+    WriteStripHeader(enc, flags, dictionary);
+
+    ZPNG_StripHeader header;
+    memcpy(&header, enc->Output, sizeof(header));
+    header.Magic = ZPNG_STREAM_HEADER_MAGIC;
+
+    const size_t tableEnd = sizeof(ZPNG_StripHeader) + ((size_t)enc->Layout.FrameCount + 1) * sizeof(uint64_t);
+    if (!WriteStreamBytes(stream, &header, sizeof(header)) ||
+        !WriteStreamBytes(stream, enc->Output + tableEnd, enc->Layout.HeaderBytes - tableEnd)) {
+        stream->Failed = true;
+        return 0;
+    }
+    return 1;
+}
+
+// Lay out the output of the encoder's image, with its palette, plane map
+// and motion and skip sections
+static void GetEncoderLayout(
+    ZPNG_StripEncoder* enc,
+    unsigned stripRows,
+    unsigned framesPerStrip,
+    bool dictionary,
+    bool checksum
+)
+{
+    const ZPNG_ImageData* imageData = enc->ImageData;
+    GetStripLayout(imageData->WidthPixels, imageData->HeightPixels, GetPixelBytes(imageData), stripRows,
+        framesPerStrip, enc->Palette ? enc->Palette->Count : 0, enc->PlaneMap, enc->RefData != nullptr, dictionary, checksum,
+        &enc->Layout);
+    if (enc->Motion) {
+        enc->Layout.MotionOffset = AddBlockMapLayout(&enc->Layout, sizeof(ZPNG_BlockMapHeader) + enc->Motion->StoredBytes);
+    }
+    if (enc->Skip) {
+        enc->Layout.SkipOffset = AddBlockMapLayout(&enc->Layout, sizeof(ZPNG_BlockMapHeader) + enc->Skip->StoredBytes);
+    }
+}
+
+// Returns the compressed size, or 0 on failure.
+// The output buffer must hold GetStripMaximumBufferSize() bytes for the strip count.
+// The filter and color transform apply to I-frames only, and must be
+// ZPNG_FILTER_LEFT and ZPNG_COLOR_GB_RG for video.
+// A palette replaces the filter, and a plane map leaves channels out of
+// the filtered image.  Both are for I-frames without plane frames.
+// Motion vectors from SearchMotion() and a skip map from FindSkipBlocks()
+// apply to delta frames, and are dropped if the frame becomes an I-frame.
+static size_t CompressStrips(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    uint8_t* output,
+    ZPNG_CompressionContext* ctx,
+    unsigned stripRows,
+    unsigned filter,
+    unsigned transform,
+    bool planeFrames,
+    const ZPNG_Palette* palette,
+    const ZPNG_PlaneMap* planeMap,
+    ZPNG_Dictionary** dictionary,
+    const ZPNG_MotionField* motion,
+    const ZPNG_SkipMap* skip
+)
+{
+    const unsigned height = imageData->HeightPixels;
+
+    // Streams are written before the frames are all known, so they cannot
+    // hold a checksum of them
+    ZPNG_StreamWriter* stream = ctx->Stream;
+    const bool checksum = ctx->Checksum && !stream;
+
+    ZPNG_StripEncoder enc;
+    enc.RefData = refData;
+    enc.ImageData = imageData;
+    enc.Palette = palette;
+    enc.PlaneMap = planeMap;
+    enc.Motion = refData ? motion : nullptr;
+    enc.Compensated = nullptr;
+    enc.Skip = refData ? skip : nullptr;
+    enc.Changed = nullptr;
+    const unsigned framesPerStrip = planeFrames ? imageData->Channels : 1;
+    GetEncoderLayout(&enc, stripRows, framesPerStrip, dictionary != nullptr, checksum);
+    enc.Output = output;
+    enc.Context = ctx;
+    enc.CDict = nullptr;
+    enc.Wide = IsWideImage(imageData);
+    enc.Predictor = filter;
+    enc.Gather = nullptr;
+    enc.PackFailed = false;
+    if (planeMap)
+    {
+        enc.StoredFormat = *imageData;
+        enc.StoredFormat.Channels = planeMap->StoredCount;
+        enc.StoredFormat.StrideBytes = 0;
+    }
+
+    // The transform is of the color planes, so it is dropped for palettes
+    // and plane maps that leave fewer than three channels
+    if (palette || !IsPlanarImage(planeMap ? &enc.StoredFormat : imageData)) {
+        transform = ZPNG_COLOR_GB_RG;
+    }
+    enc.Transform = transform;
+
+    const ZPNG_Kernels* kernels = GetKernels(imageData, enc.Layout.PixelBytes, enc.Wide, transform);
+    enc.Kernel = (kernels && filter < kFilterCount) ? kernels->Pack[filter] : nullptr;
+    enc.StoredKernel = nullptr;
+    if (planeMap && enc.Layout.StoredPixelBytes != 0)
+    {
+        const ZPNG_Kernels* storedKernels = GetKernels(&enc.StoredFormat, enc.Layout.StoredPixelBytes, false, transform);
+        enc.StoredKernel = (storedKernels && filter < kFilterCount) ? storedKernels->Pack[filter] : nullptr;
+    }
+    enc.VideoKernels = GetVideoKernels(enc.Layout.PixelBytes);
+    if (!enc.Kernel || !enc.VideoKernels) {
+        return 0;
+    }
+
+    // Dictionaries are for Zstd, so they keep the Zstd backend
+    enc.Backend = dictionary ? (unsigned)ZPNG_BACKEND_ZSTD : ctx->Backend;
+
+    const unsigned stripCount = enc.Layout.StripCount;
+    const unsigned frameCount = enc.Layout.FrameCount;
+
+    // Carve the per-strip state out of the context scratch space
+    const size_t resultBytes = frameCount * sizeof(size_t);
+    const size_t overflowBytes = stripCount * sizeof(size_t);
+    const size_t packingBytes = stripCount * enc.Layout.SlotBytes;
+    const size_t gatherBytes = planeMap ? (ctx->Workers > 1 ? ctx->Workers : 1) * enc.Layout.StripBytes : 0;
+    const size_t compensatedBytes = enc.Motion ? (ctx->Workers > 1 ? ctx->Workers : 1) * enc.Layout.StripBytes : 0;
+    const size_t changedBytes = enc.Skip ? (ctx->Workers > 1 ? ctx->Workers : 1) * 2 * enc.Layout.StripBytes : 0;
+    const size_t doneBytes = stream ? frameCount * sizeof(bool) : 0;
+    uint8_t* scratch = GetScratch(ctx, resultBytes + overflowBytes + packingBytes + gatherBytes + compensatedBytes +
+        changedBytes + doneBytes);
+    if (!scratch || !EnsureContextWorkers(ctx)) {
+        return 0;
+    }
+
+    enc.Results = (size_t*)scratch;
+    enc.OverflowCounts = (size_t*)(scratch + resultBytes);
+    enc.Packing = scratch + resultBytes + overflowBytes;
+    if (planeMap) {
+        enc.Gather = enc.Packing + packingBytes;
+    }
+    if (enc.Motion) {
+        enc.Compensated = enc.Packing + packingBytes + gatherBytes;
+    }
+    if (enc.Skip) {
+        enc.Changed = enc.Packing + packingBytes + gatherBytes + compensatedBytes;
+    }
+    if (stream)
+    {
+        stream->Done = (bool*)(enc.Packing + packingBytes + gatherBytes + compensatedBytes + changedBytes);
+        memset(stream->Done, 0, doneBytes);
+        stream->Next = 0;
+    }
+
+    const bool isVideo = (refData != nullptr);
+
+    {
+        const bool trainDictionary = dictionary && *dictionary == nullptr;
+        const unsigned workers = ctx->Workers;
+
+        // Filtering and compression run in one pass per strip while the
+        // packed data is still in cache, unless something must be decided
+        // after all the strips are filtered or the planes are compressed
+        // as separate tasks.
+        enc.Filter = true;
+        enc.Video = isVideo;
+        enc.Compress = !trainDictionary && !planeFrames;
+        enc.CDict = GetCDict(dictionary);
+
+        if (stream && enc.Compress && !WriteStreamHeader(&enc, GetStripFlags(&enc, isVideo, false, false), dictionary)) {
+            return 0;
+        }
+
+        ParallelFor(ctx->Pool, workers, stripCount, EncodeStrip, &enc);
+        if (enc.PackFailed) {
+            return 0;
+        }
+
+        if (!enc.Compress)
+        {
+            if (trainDictionary)
+            {
+                const unsigned rows = GetStripRowCount(&enc.Layout, height, 0);
+                const size_t bytes = GetStripPackedBytes(&enc.Layout, enc.Skip, imageData->WidthPixels, 0, rows);
+                const uint64_t t0 = StartStage(ctx->Collector);
+                *dictionary = (ZPNG_Dictionary*)TrainFrameDictionary(enc.Packing, bytes, rows, GetCompressionLevel(&ctx->Params));
+                EndStage(ctx->Collector, ZPNG_STAGE_DICTIONARY, t0);
+                CountAllocation(ctx->Collector);
+                enc.CDict = GetCDict(dictionary);
+
+                // Without a dictionary there is no ID to record.
+                // Nothing has been compressed yet, so the slots can move
+                if (!enc.CDict) {
+                    GetEncoderLayout(&enc, stripRows, framesPerStrip, false, checksum);
+                }
+            }
+
+            if (stream && !WriteStreamHeader(&enc, GetStripFlags(&enc, isVideo, planeFrames, false), dictionary)) {
+                return 0;
+            }
+
+            enc.Filter = false;
+            if (planeFrames) {
+                ParallelFor(ctx->Pool, workers, frameCount, EncodeFrame, &enc);
+            } else {
+                enc.Compress = true;
+                ParallelFor(ctx->Pool, workers, stripCount, EncodeStrip, &enc);
+            }
+        }
+    }
+
+    if (isVideo) {
+        for (unsigned i = 0; i < stripCount; ++i) {
+            CountOverflow(ctx->Collector, enc.OverflowCounts[i]);
+        }
+    }
+
+    {
+        // Compact the frames down to the end of the offset table
+        uint64_t* offsets = (uint64_t*)(output + sizeof(ZPNG_StripHeader));
+        size_t offset = enc.Layout.HeaderBytes;
+        bool entropy = false;
+
+        for (unsigned i = 0; i < frameCount; ++i)
+        {
+            if (ZSTD_isError(enc.Results[i])) {
+                return 0;
+            }
+
+            const size_t slot = GetFrameSlot(&enc.Layout, imageData->WidthPixels, height, i);
+            memmove(output + offset, output + enc.Layout.HeaderBytes + slot, enc.Results[i]);
+            entropy = entropy || IsEntropyFrame(output + offset, enc.Results[i]);
+            offsets[i] = offset;
+            offset += enc.Results[i];
+        }
+        offsets[frameCount] = offset;
+
+        if (stream && (stream->Failed || stream->Next != frameCount)) {
+            return 0;
+        }
+
+        WriteStripHeader(&enc, GetStripFlags(&enc, isVideo, planeFrames, checksum) | (entropy ? ZPNG_STRIP_FLAG_ENTROPY : 0), dictionary);
+
+        if (checksum)
+        {
+            const uint64_t checksum = GetStripChecksum(output, offset, &enc.Layout);
+            memcpy(output + enc.Layout.ChecksumOffset, &checksum, sizeof(checksum));
+        }
+
+        return offset;
+    }
+}
+
+// Rectangle of an image in pixels
+struct ZPNG_Region
+{
+    unsigned X, Y;
+    unsigned Width, Height;
+};
+
+struct ZPNG_StripDecoder
+{
+    const ZPNG_ImageData* RefData;
+    ZPNG_StripLayout Layout;
+    bool Video;
+
+    // Strips use the 16-bit filter
+    bool Wide;
+
+    // ZPNG_Filter and ZPNG_ColorTransform of the intra strips
+    unsigned Predictor;
+    unsigned Transform;
+
+    // Kernels for the intra strips and their stored channels, found once
+    // with GetKernels(), and for delta strips
+    ZPNG_UnpackKernel Kernel;
+    ZPNG_UnpackKernel StoredKernel;
+    const ZPNG_VideoKernels* VideoKernels;
+
+    // Strips hold palette indices.  Colors past the palette are zero, so
+    // any index decodes
+    bool Palette;
+    uint8_t PaletteColors[kMaxPaletteColors * 4];
+
+    // Strips hold the stored channels of the plane map, which are unfiltered
+    // into StripScratch and then expanded
+    bool HasPlaneMap;
+    ZPNG_PlaneMap PlaneMap;
+
+    // Full image dimensions
+    unsigned Width, Height;
+
+    // Output image: The full image, or just the region if Region is set.
+    // With a channel, the buffer receives that channel alone
+    ZPNG_ImageData* ImageData;
+    const ZPNG_Region* Region;
+    int Channel;
+
+    // Row of the full image at the top of ImageData, unless Region is set
+    unsigned FirstRow;
+
+    // Task i decodes strip FirstStrip + i
+    unsigned FirstStrip;
+
+    const uint8_t* Input;
+    const uint64_t* Offsets;
+
+    // Dictionary the frames were compressed with, or null
+    const ZSTD_DDict* DDict;
+
+    // Whether DecodeStrip() decompresses the strip.  Otherwise DecodeFrame()
+    // has already decompressed the planes of task i into its packing
+    bool Decompress;
+
+    // Worker i unpacks strips in Packing + i * SlotBytes, or task i if
+    // the planes were decompressed separately
+    uint8_t* Packing;
+    ZSTD_DCtx** DCtx;
+
+    // Region or plane map only: Worker i unfilters strips into
+    // StripScratch + i * StripBytes
+    uint8_t* StripScratch;
+
+    // Delta frames with motion only: The stored vectors, which are read
+    // into Motion, and worker i compensates into Compensated + i * StripBytes
+    bool HasMotion;
+    const uint8_t* MotionStored;
+    size_t MotionStoredBytes;
+    ZPNG_MotionField Motion;
+    uint8_t* Compensated;
+
+    // Delta frames decode into their reference in place, since each pixel
+    // only reads the pixel under it.  Motion reads the reference around each
+    // block, so then the reference is copied to scratch space and described
+    // here, and RefData points at it
+    ZPNG_ImageData RefCopy;
+
+    // Delta frames with skipped blocks only: The stored map, which is read
+    // into Skip, and worker i gathers the reference pixels of the other
+    // blocks and unpacks them into Changed + i * 2 * StripBytes
+    bool HasSkip;
+    const uint8_t* SkipStored;
+    size_t SkipStoredBytes;
+    ZPNG_SkipMap Skip;
+    uint8_t* Changed;
+
+    // Per task and frame of a strip: Nonzero on failure
+    uint8_t* Failed;
+
+    // Unpack function of the state, which unfilters whole strips of the
+    // full image in place of DecodeStrip(), or null
+    ZPNG_UnpackFunction Unpack;
+    void* UnpackOpaque;
+
+    // Stats for the call, or null
+    ZPNG_StatsCollector* Collector;
+};
+
+// Decompress one plane of a strip, for plane frames
+static void DecodeFrame(void* opaque, unsigned index, unsigned worker)
+{
+    ZPNG_StripDecoder* dec = (ZPNG_StripDecoder*)opaque;
+    const ZPNG_StripLayout* layout = &dec->Layout;
+
+    const unsigned task = index / layout->FramesPerStrip;
+    const unsigned plane = index % layout->FramesPerStrip;
+    if (!IsPlaneNeeded(dec->Channel, plane, dec->Transform)) {
+        return;
+    }
+
+    const unsigned strip = dec->FirstStrip + task;
+    const unsigned frame = strip * layout->FramesPerStrip + plane;
+    const size_t planeBytes = (size_t)GetStripRowCount(layout, dec->Height, strip) * dec->Width;
+
+    const uint64_t t0 = StartStage(dec->Collector);
+    const size_t result = DecompressFrame(
+        dec->DCtx[worker],
+        dec->DDict,
+        dec->Packing + task * layout->SlotBytes + plane * planeBytes,
+        planeBytes,
+        dec->Input + dec->Offsets[frame],
+        (size_t)(dec->Offsets[frame + 1] - dec->Offsets[frame]));
+    EndStage(dec->Collector, ZPNG_STAGE_ZSTD, t0);
+
+    if (ZSTD_isError(result) || result != planeBytes) {
+        dec->Failed[index] = 1;
+    }
+}
+
+static void DecodeStrip(void* opaque, unsigned task, unsigned worker)
+{
+    ZPNG_StripDecoder* dec = (ZPNG_StripDecoder*)opaque;
+    const ZPNG_StripLayout* layout = &dec->Layout;
+    const unsigned pixelBytes = layout->PixelBytes;
+    const unsigned strip = dec->FirstStrip + task;
+
+    const unsigned firstRow = strip * layout->StripRows;
+    const unsigned rows = GetStripRowCount(layout, dec->Height, strip);
+    const size_t stripBytes = (size_t)rows * dec->Width * pixelBytes;
+    const size_t packedBytes = GetStripPackedBytes(layout, dec->HasSkip ? &dec->Skip : nullptr, dec->Width, firstRow, rows);
+    uint8_t* packing = dec->Packing + (dec->Decompress ? worker : task) * layout->SlotBytes;
+
+    // Delta frames always have a frame per strip, with the overflow list after the deltas
+    size_t overflowCount = 0;
+    if (dec->Decompress)
+    {
+        const uint64_t t0 = StartStage(dec->Collector);
+        const size_t result = DecompressFrame(
+            dec->DCtx[worker],
+            dec->DDict,
+            packing,
+            layout->SlotBytes,
+            dec->Input + dec->Offsets[strip],
+            (size_t)(dec->Offsets[strip + 1] - dec->Offsets[strip]));
+        EndStage(dec->Collector, ZPNG_STAGE_ZSTD, t0);
+
+        if (ZSTD_isError(result) || result < packedBytes) {
+            dec->Failed[task] = 1;
+            return;
+        }
+        if (dec->Video) {
+            overflowCount = result - packedBytes;
+            CountOverflow(dec->Collector, overflowCount);
+        }
+    }
+
+    if (dec->Unpack)
+    {
+        const uint64_t t0 = StartStage(dec->Collector);
+        if (!dec->Unpack(dec->UnpackOpaque, packing, firstRow, rows, dec->ImageData)) {
+            dec->Failed[task] = 1;
+        }
+        EndStage(dec->Collector, ZPNG_STAGE_FILTER, t0);
+        return;
+    }
+
+    if (dec->Channel >= 0)
+    {
+        // The channel is unfiltered on its own as a 1-channel image
+        ZPNG_ImageData channelImage = *dec->ImageData;
+        channelImage.Channels = 1;
+        channelImage.StrideBytes = dec->Width;
+
+        ZPNG_ImageData stripImage = GetStripImage(&channelImage, 1, firstRow - dec->FirstRow, rows);
+        const uint8_t* residuals = GetChannelResiduals(packing, (size_t)rows * dec->Width, dec->Channel, dec->Transform);
+        UnpackImageFiltered(residuals, 1, dec->Predictor, &stripImage);
+        return;
+    }
+
+    if (dec->HasPlaneMap)
+    {
+        // Unfilter the stored channels, then fill in the rest of each pixel
+        const uint64_t t0 = StartStage(dec->Collector);
+        if (!dec->Region && dec->Predictor == ZPNG_FILTER_LEFT && dec->Transform == ZPNG_COLOR_GB_RG)
+        {
+            ZPNG_ImageData stripImage = GetStripImage(dec->ImageData, pixelBytes, firstRow - dec->FirstRow, rows);
+            if (UnpackImageStored(packing, &dec->PlaneMap, &stripImage)) {
+                EndStage(dec->Collector, ZPNG_STAGE_FILTER, t0);
+                return;
+            }
+        }
+        ZPNG_ImageData storedImage = *dec->ImageData;
+        storedImage.Buffer.Data = dec->StripScratch + worker * layout->StripBytes;
+        storedImage.Buffer.Bytes = packedBytes;
+        storedImage.Channels = dec->PlaneMap.StoredCount;
+        storedImage.WidthPixels = dec->Width;
+        storedImage.HeightPixels = rows;
+        storedImage.StrideBytes = 0;
+        if (dec->StoredKernel) {
+            dec->StoredKernel(packing, &storedImage);
+        }
+
+        if (dec->Region)
+        {
+            const ZPNG_Region* region = dec->Region;
+            const unsigned startRow = firstRow > region->Y ? firstRow : region->Y;
+            const unsigned endRow = (firstRow + rows < region->Y + region->Height) ? firstRow + rows : region->Y + region->Height;
+            ExpandPlanes(&dec->PlaneMap,
+                storedImage.Buffer.Data + (size_t)(startRow - firstRow) * dec->Width * layout->StoredPixelBytes,
+                dec->Width, region->X, region->Width, endRow - startRow,
+                dec->ImageData->Buffer.Data + (size_t)(startRow - region->Y) * region->Width * pixelBytes,
+                (size_t)region->Width * pixelBytes);
+        }
+        else
+        {
+            ZPNG_ImageData stripImage = GetStripImage(dec->ImageData, pixelBytes, firstRow - dec->FirstRow, rows);
+            ExpandPlanes(&dec->PlaneMap, storedImage.Buffer.Data, dec->Width, 0, dec->Width, rows,
+                stripImage.Buffer.Data, GetRowStride(&stripImage, pixelBytes));
+        }
+        EndStage(dec->Collector, ZPNG_STAGE_FILTER, t0);
+        return;
+    }
+
+    if (dec->Region)
+    {
+        // Unfilter the whole strip, then copy out the overlapping rows
+        ZPNG_ImageData stripImage = *dec->ImageData;
+        stripImage.Buffer.Data = dec->StripScratch + worker * layout->StripBytes;
+        stripImage.Buffer.Bytes = stripBytes;
+        stripImage.WidthPixels = dec->Width;
+        stripImage.HeightPixels = rows;
+        stripImage.StrideBytes = 0;
+        if (dec->Palette) {
+            UnpackImagePalette(packing, dec->PaletteColors, layout->IndexBits, &stripImage);
+        } else {
+            dec->Kernel(packing, &stripImage);
+        }
+
+        const ZPNG_Region* region = dec->Region;
+        const unsigned startRow = firstRow > region->Y ? firstRow : region->Y;
+        const unsigned endRow = (firstRow + rows < region->Y + region->Height) ? firstRow + rows : region->Y + region->Height;
+        const size_t copyBytes = (size_t)region->Width * pixelBytes;
+
+        for (unsigned y = startRow; y < endRow; ++y)
+        {
+            memcpy(
+                dec->ImageData->Buffer.Data + (y - region->Y) * copyBytes,
+                stripImage.Buffer.Data + ((size_t)(y - firstRow) * dec->Width + region->X) * pixelBytes,
+                copyBytes);
+        }
+        return;
+    }
+
+    ZPNG_ImageData stripImage = GetStripImage(dec->ImageData, pixelBytes, firstRow - dec->FirstRow, rows);
+
+    const uint64_t t0 = StartStage(dec->Collector);
+    if (dec->Video)
+    {
+        const ZPNG_ImageData stripRef = GetStripReference(dec->RefData, dec->HasMotion ? &dec->Motion : nullptr, pixelBytes,
+            firstRow, rows, dec->Compensated + worker * layout->StripBytes);
+        if (dec->HasSkip)
+        {
+            // Skipped blocks are already there when decoding into the reference
+            uint8_t* changed = dec->Changed + worker * 2 * layout->StripBytes;
+            const ZPNG_ImageData changedRef = GatherChangedPixels(&dec->Skip, pixelBytes, firstRow, &stripRef, changed);
+            ZPNG_ImageData changedImage = changedRef;
+            changedImage.Buffer.Data = changed + layout->StripBytes;
+            if (!dec->VideoKernels->Unpack(&changedRef, packing, overflowCount, &changedImage)) {
+                dec->Failed[task] = 1;
+                EndStage(dec->Collector, ZPNG_STAGE_FILTER, t0);
+                return;
+            }
+            ScatterChangedPixels(&dec->Skip, pixelBytes, firstRow, changedImage.Buffer.Data, &stripImage);
+            if (stripRef.Buffer.Data != stripImage.Buffer.Data || stripRef.StrideBytes != stripImage.StrideBytes) {
+                CopySkippedPixels(&dec->Skip, pixelBytes, firstRow, &stripRef, &stripImage);
+            }
+        }
+        else
+        {
+            if (!dec->VideoKernels->Unpack(&stripRef, packing, overflowCount, &stripImage)) {
+                dec->Failed[task] = 1;
+            }
+        }
+    }
+    else if (dec->Palette)
+    {
+        UnpackImagePalette(packing, dec->PaletteColors, layout->IndexBits, &stripImage);
+    }
+    else
+    {
+        dec->Kernel(packing, &stripImage);
+    }
+    EndStage(dec->Collector, ZPNG_STAGE_FILTER, t0);
+}
+
+// Set up a decoder for a buffer starting with ZPNG_StripHeader, with the
+// arguments of DecompressStrips().  Returns 1 on success, 0 on failure
+static int InitStripDecoder(
+    ZPNG_StripDecoder* dec,
+    const ZPNG_DecompressionState* state,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    const ZPNG_Region* region,
+    int channel
+)
+{
+    const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+
+    dec->RefData = refData;
+    dec->Width = header->Width;
+    dec->Height = header->Height;
+    const bool hasDictionary = (header->Flags & ZPNG_STRIP_FLAG_DICTIONARY) != 0;
+    if (!GetBufferStripLayout(buffer, GetPixelBytes(imageData), &dec->Layout, &dec->PlaneMap)) {
+        return 0;
+    }
+    dec->Video = (header->Flags & ZPNG_STRIP_FLAG_VIDEO) != 0;
+    dec->Wide = (header->Flags & ZPNG_STRIP_FLAG_PLANES16) != 0;
+    dec->Palette = (header->Flags & ZPNG_STRIP_FLAG_PALETTE) != 0;
+    dec->HasPlaneMap = (header->Flags & ZPNG_STRIP_FLAG_CONSTANT_PLANES) != 0;
+    dec->Predictor = header->Filter & ((1u << kColorTransformShift) - 1);
+    dec->Transform = header->Filter >> kColorTransformShift;
+    // Delta frames are always GB-RG, and flag their sections in its place
+    dec->HasMotion = HasStripMotion(header);
+    dec->HasSkip = HasStripSkip(header);
+    if (dec->Video && (dec->Transform & ~(kVideoMotion | kVideoSkip)) == 0) {
+        dec->Transform = ZPNG_COLOR_GB_RG;
+    }
+    dec->Compensated = nullptr;
+    dec->Changed = nullptr;
+    dec->ImageData = imageData;
+    dec->Region = region;
+    dec->Channel = channel;
+    dec->FirstRow = 0;
+    dec->Input = buffer.Data;
+    dec->Offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_StripHeader));
+    dec->DDict = nullptr;
+    dec->StripScratch = nullptr;
+    dec->Unpack = nullptr;
+    dec->UnpackOpaque = nullptr;
+    dec->Collector = state->Collector;
+
+    // Only 16-bit images use the 16-bit filter, and 16-bit Bayer data always does
+    if ((dec->Wide && !IsWideImage(imageData)) ||
+        (!dec->Wide && IsWideImage(imageData) && IsBayerFormat(imageData->PixelFormat))) {
+        return 0;
+    }
+    if (dec->Video && (region || !refData || !refData->Buffer.Data)) {
+        return 0;
+    }
+    if (dec->Predictor >= kFilterCount ||
+        (dec->Predictor != ZPNG_FILTER_LEFT && (dec->Video || !IsPredictable(imageData)))) {
+        return 0;
+    }
+    if (channel >= 0 && (region || dec->Video || !IsPlanarImage(imageData) || channel >= (int)imageData->Channels)) {
+        return 0;
+    }
+    // Color transforms other than GB-RG are of the planes of I-frames.
+    // With a plane map the planes are of the stored channels
+    if (dec->Transform != ZPNG_COLOR_GB_RG)
+    {
+        ZPNG_ImageData colorFormat = *imageData;
+        if (dec->HasPlaneMap) {
+            colorFormat.Channels = dec->PlaneMap.StoredCount;
+        }
+        if (dec->Transform >= kColorTransformCount || dec->Video || dec->Palette || !IsPlanarImage(&colorFormat)) {
+            return 0;
+        }
+    }
+    // Palettes only hold 8-bit colors of whole I-frame strips
+    if (dec->Palette && (dec->Video || dec->Wide || dec->Layout.FramesPerStrip != 1 || channel >= 0 ||
+        imageData->BytesPerChannel != 1 || imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT || imageData->Channels > 4)) {
+        return 0;
+    }
+    // Plane maps leave channels out of 8-bit I-frames with whole strip frames
+    if (dec->HasPlaneMap && (dec->Video || dec->Wide || dec->Palette || dec->Layout.FramesPerStrip != 1 || channel >= 0 ||
+        imageData->BytesPerChannel != 1 || imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT)) {
+        return 0;
+    }
+
+    const ZPNG_Kernels* kernels = GetKernels(imageData, dec->Layout.PixelBytes, dec->Wide, dec->Transform);
+    dec->Kernel = kernels ? kernels->Unpack[dec->Predictor] : nullptr;
+    dec->StoredKernel = nullptr;
+    if (dec->HasPlaneMap && dec->Layout.StoredPixelBytes != 0)
+    {
+        ZPNG_ImageData storedFormat = *imageData;
+        storedFormat.Channels = dec->PlaneMap.StoredCount;
+        const ZPNG_Kernels* storedKernels = GetKernels(&storedFormat, dec->Layout.StoredPixelBytes, false, dec->Transform);
+        dec->StoredKernel = storedKernels ? storedKernels->Unpack[dec->Predictor] : nullptr;
+    }
+    dec->VideoKernels = GetVideoKernels(dec->Layout.PixelBytes);
+    if (!dec->Kernel || !dec->VideoKernels) {
+        return 0;
+    }
+
+    // Validate the offset table once so the workers can trust it
+    if (!CheckStripTable(buffer, &dec->Layout)) {
+        return 0;
+    }
+
+    if (dec->Palette)
+    {
+        memset(dec->PaletteColors, 0, sizeof(dec->PaletteColors));
+        memcpy(dec->PaletteColors, buffer.Data + dec->Layout.PaletteOffset + sizeof(uint32_t),
+            (size_t)dec->Layout.PaletteColors * dec->Layout.PixelBytes);
+    }
+
+    // The frames can only be decoded with the dictionary they name
+    if (hasDictionary)
+    {
+        uint64_t id;
+        memcpy(&id, buffer.Data + dec->Layout.DictionaryOffset, sizeof(id));
+        if (!state->Dictionary || id != state->Dictionary->Id) {
+            return 0;
+        }
+        dec->DDict = state->Dictionary->DDict;
+    }
+
+    if (dec->HasMotion)
+    {
+        ZPNG_BlockMapHeader motion;
+        memcpy(&motion, buffer.Data + dec->Layout.MotionOffset, sizeof(motion));
+        dec->MotionStored = buffer.Data + dec->Layout.MotionOffset + sizeof(motion);
+        dec->MotionStoredBytes = motion.StoredBytes;
+        dec->Motion.Width = dec->Width;
+        dec->Motion.Height = dec->Height;
+        dec->Motion.BlocksX = GetMotionBlocks(dec->Width);
+        dec->Motion.BlocksY = GetMotionBlocks(dec->Height);
+    }
+
+    if (dec->HasSkip)
+    {
+        if (!IsSkippable(imageData)) {
+            return 0;
+        }
+        ZPNG_BlockMapHeader section;
+        memcpy(&section, buffer.Data + dec->Layout.SkipOffset, sizeof(section));
+        dec->SkipStored = buffer.Data + dec->Layout.SkipOffset + sizeof(section);
+        dec->SkipStoredBytes = section.StoredBytes;
+        dec->Skip.Width = dec->Width;
+        dec->Skip.BlocksX = GetMotionBlocks(dec->Width);
+        dec->Skip.BlocksY = GetMotionBlocks(dec->Height);
+    }
+
+    return 1;
+}
+
+// Decode taskCount strips starting at firstStrip.
+// Returns 1 on success, 0 on failure
+static int RunStripDecoder(
+    ZPNG_DecompressionState* state,
+    ZPNG_StripDecoder* dec,
+    unsigned firstStrip,
+    unsigned taskCount
+)
+{
+    dec->FirstStrip = firstStrip;
+
+    // Plane frames are all decompressed first, as separate tasks
+    const unsigned framesPerStrip = dec->Layout.FramesPerStrip;
+    const unsigned frameTasks = taskCount * framesPerStrip;
+    dec->Decompress = (framesPerStrip == 1);
+
+    const unsigned workers = EnsureDecompressionWorkers(state, frameTasks);
+    if (workers == 0) {
+        return 0;
+    }
+    dec->DCtx = state->DCtx;
+
+    // Carve the per-worker buffers out of the state scratch space
+    const size_t packingBytes = (dec->Decompress ? workers : taskCount) * dec->Layout.SlotBytes;
+    const size_t stripScratchBytes = (dec->Region || dec->HasPlaneMap) ? workers * dec->Layout.StripBytes : 0;
+    const size_t vectorBytes = dec->HasMotion ? (size_t)dec->Motion.BlocksX * dec->Motion.BlocksY * 2 : 0;
+    const size_t compensatedBytes = dec->HasMotion ? workers * dec->Layout.StripBytes : 0;
+    const size_t skipBytes = dec->HasSkip ? GetSkipMapBytes(&dec->Skip) : 0;
+    const size_t changedBytes = dec->HasSkip ? workers * 2 * dec->Layout.StripBytes : 0;
+    const bool copyRef = dec->HasMotion && dec->RefData->Buffer.Data == dec->ImageData->Buffer.Data;
+    const size_t refCopyBytes = copyRef ? (size_t)dec->Height * dec->Width * dec->Layout.PixelBytes : 0;
+    const size_t blockBytes = vectorBytes + compensatedBytes + skipBytes + changedBytes + refCopyBytes;
+    uint8_t* scratch = GetScratch(state, packingBytes + stripScratchBytes + blockBytes + frameTasks);
+    if (!scratch) {
+        return 0;
+    }
+
+    dec->Packing = scratch;
+    if (stripScratchBytes != 0) {
+        dec->StripScratch = scratch + packingBytes;
+    }
+    dec->Failed = scratch + packingBytes + stripScratchBytes + blockBytes;
+    memset(dec->Failed, 0, frameTasks);
+
+    // The vectors are raw if storing them compressed saved nothing
+    if (dec->HasMotion)
+    {
+        dec->Motion.Vectors = (int8_t*)(scratch + packingBytes + stripScratchBytes);
+        dec->Compensated = scratch + packingBytes + stripScratchBytes + vectorBytes;
+        if (dec->MotionStoredBytes == vectorBytes) {
+            memcpy(dec->Motion.Vectors, dec->MotionStored, vectorBytes);
+        } else if (ZSTD_decompressDCtx(dec->DCtx[0], dec->Motion.Vectors, vectorBytes,
+            dec->MotionStored, dec->MotionStoredBytes) != vectorBytes) {
+            return 0;
+        }
+    }
+    if (dec->HasSkip)
+    {
+        dec->Skip.Bits = scratch + packingBytes + stripScratchBytes + vectorBytes + compensatedBytes;
+        dec->Changed = dec->Skip.Bits + skipBytes;
+        if (!ReadSkipMap(dec->SkipStored, dec->SkipStoredBytes, dec->DCtx[0], &dec->Skip)) {
+            return 0;
+        }
+    }
+    if (copyRef)
+    {
+        dec->RefCopy = *dec->RefData;
+        dec->RefCopy.Buffer.Data = scratch + packingBytes + stripScratchBytes + blockBytes - refCopyBytes;
+        dec->RefCopy.Buffer.Bytes = refCopyBytes;
+        dec->RefCopy.StrideBytes = dec->Width * dec->Layout.PixelBytes;
+        const size_t stride = GetRowStride(dec->RefData, dec->Layout.PixelBytes);
+        for (unsigned y = 0; y < dec->Height; ++y) {
+            memcpy(dec->RefCopy.Buffer.Data + (size_t)y * dec->RefCopy.StrideBytes, dec->RefData->Buffer.Data + y * stride,
+                dec->RefCopy.StrideBytes);
+        }
+        dec->RefData = &dec->RefCopy;
+    }
+
+    if (!dec->Decompress)
+    {
+        ParallelFor(state->Pool, workers, frameTasks, DecodeFrame, dec);
+
+        for (unsigned i = 0; i < frameTasks; ++i) {
+            if (dec->Failed[i]) {
+                return 0;
+            }
+        }
+    }
+
+    ParallelFor(state->Pool, workers, taskCount, DecodeStrip, dec);
+
+    for (unsigned i = 0; i < taskCount; ++i) {
+        if (dec->Failed[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Decompress a buffer starting with ZPNG_StripHeader into imageData.
+// Without a region, imageData is the full image with its fields already
+// set from the header.  With a region, imageData receives just the pixels
+// inside it, and only strips that overlap the region are decoded.
+// A channel of a planar image other than -1 decodes into a buffer of
+// Width * Height bytes, and only the planes it depends on are decompressed.
+// Returns 1 on success, 0 on failure
+static int DecompressStrips(
+    ZPNG_DecompressionState* state,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    const ZPNG_Region* region,
+    int channel
+)
+{
+    ZPNG_StripDecoder dec;
+    if (!InitStripDecoder(&dec, state, refData, buffer, imageData, region, channel)) {
+        return 0;
+    }
+
+    // An unpack function takes the left-filtered strips of whole I-frames
+    if (state->UnpackFunction && !region && channel < 0)
+    {
+        if (dec.Video || dec.Palette || dec.HasPlaneMap || dec.Predictor != ZPNG_FILTER_LEFT || dec.Transform != ZPNG_COLOR_GB_RG) {
+            return 0;
+        }
+        dec.Unpack = state->UnpackFunction;
+        dec.UnpackOpaque = state->UnpackOpaque;
+    }
+
+    if (region)
+    {
+        const unsigned firstStrip = region->Y / dec.Layout.StripRows;
+        const unsigned lastStrip = (region->Y + region->Height - 1) / dec.Layout.StripRows;
+        return RunStripDecoder(state, &dec, firstStrip, lastStrip - firstStrip + 1);
+    }
+
+    return RunStripDecoder(state, &dec, 0, dec.Layout.StripCount);
+}
+
+// Read the fields of either header format into imageData.
+// Sets IsIFrame = 0 for delta frames, which need a reference to decode.
+// Returns 1 on success, 0 if the header is invalid
+static int ReadHeader(
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    unsigned* stripRows
+)
+{
+    *stripRows = 0;
+    imageData->IsIFrame = 1;
+
+    if (!buffer.Data || buffer.Bytes < ZPNG_HEADER_OVERHEAD_BYTES) {
+        return 0;
+    }
+
+    const ZPNG_Header* header = (const ZPNG_Header*)buffer.Data;
+    if (header->Magic == ZPNG_STRIP_HEADER_MAGIC)
+    {
+        const ZPNG_StripHeader* stripHeader = (const ZPNG_StripHeader*)buffer.Data;
+        if (buffer.Bytes < sizeof(ZPNG_StripHeader) ||
+            stripHeader->Version != ZPNG_STRIP_HEADER_VERSION ||
+            (stripHeader->Flags & ~ZPNG_STRIP_FLAGS_KNOWN) != 0 ||
+            stripHeader->StripRows == 0) {
+            return 0;
+        }
+
+        imageData->WidthPixels = stripHeader->Width;
+        imageData->HeightPixels = stripHeader->Height;
+        imageData->Channels = stripHeader->Channels;
+        imageData->BytesPerChannel = stripHeader->BytesPerChannel;
+        imageData->PixelFormat = GetPixelFormatFromCode(stripHeader->PixelFormat);
+        imageData->IsIFrame = (stripHeader->Flags & ZPNG_STRIP_FLAG_VIDEO) ? 0 : 1;
+        *stripRows = stripHeader->StripRows;
+    }
+    else
+    {
+        if (header->Magic == ZPNG_VIDEO_HEADER_MAGIC) {
+            imageData->IsIFrame = 0;
+        } else if (header->Magic != ZPNG_HEADER_MAGIC) {
+            return 0;
+        }
+
+        imageData->WidthPixels = header->Width;
+        imageData->HeightPixels = header->Height;
+        imageData->Channels = header->Channels;
+        imageData->BytesPerChannel = header->BytesPerChannel;
+        imageData->PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    if (pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(imageData)) {
+        return 0;
+    }
+
+    // Plane frames are for planar I-frames, and the frame count must fit
+    if (*stripRows != 0 && GetFramesPerStrip((const ZPNG_StripHeader*)buffer.Data) != 1)
+    {
+        const uint64_t stripCount = ((uint64_t)imageData->HeightPixels + *stripRows - 1) / *stripRows;
+        if (!imageData->IsIFrame || !IsPlanarImage(imageData) ||
+            stripCount * imageData->Channels >= UINT32_MAX) {
+            return 0;
+        }
+    }
+
+    // The whole image must be addressable, and a row must fit StrideBytes
+    const uint64_t rowBytes = (uint64_t)imageData->WidthPixels * pixelBytes;
+    size_t byteCount;
+    if (rowBytes > UINT32_MAX || !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+    imageData->StrideBytes = (unsigned)rowBytes;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// Progressive Format
+
+// Layout shared by the progressive encoder and decoder
+struct ZPNG_ProgressiveLayout
+{
+    unsigned Levels;
+    unsigned PartCount;
+    unsigned PixelBytes;
+
+    // Cell size in pixels each way, and full resolution size in cells
+    unsigned Cell;
+    unsigned CellsX;
+    unsigned CellsY;
+
+    // Header plus offset table
+    size_t HeaderBytes;
+};
+
+// Cells of one part, in full resolution cells:
+// CountX x CountY cells, Step apart, starting from (X, Y)
+struct ZPNG_ProgressivePart
+{
+    // Finest level that needs the part
+    unsigned Level;
+
+    unsigned X;
+    unsigned Y;
+    unsigned Step;
+    unsigned CountX;
+    unsigned CountY;
+};
+
+// Bayer images are subsampled in 2x2 quads
+static unsigned GetProgressiveCell(const ZPNG_ImageData* imageData)
+{
+    return GetBayerFormat(imageData) != ZPNG_PIXEL_FORMAT_DEFAULT ? 2 : 1;
+}
+
+// Cells across level `level` of an image `cells` across, rounded up
+static unsigned GetLevelCells(unsigned cells, unsigned level)
+{
+    return (unsigned)(((uint64_t)cells + (1ull << level) - 1) >> level);
+}
+
+static void GetProgressiveLayout(
+    const ZPNG_ImageData* imageData,
+    unsigned levels,
+    ZPNG_ProgressiveLayout* layout
+)
+{
+    layout->Levels = levels;
+    layout->PartCount = 1 + 3 * levels;
+    layout->PixelBytes = GetPixelBytes(imageData);
+    layout->Cell = GetProgressiveCell(imageData);
+    layout->CellsX = imageData->WidthPixels / layout->Cell;
+    layout->CellsY = imageData->HeightPixels / layout->Cell;
+    layout->HeaderBytes = sizeof(ZPNG_ProgressiveHeader) + ((size_t)layout->PartCount + 1) * sizeof(uint64_t);
+}
+
+static void GetProgressivePart(
+    const ZPNG_ProgressiveLayout* layout,
+    unsigned index,
+    ZPNG_ProgressivePart* part
+)
+{
+    if (index == 0)
+    {
+        part->Level = layout->Levels;
+        part->X = 0;
+        part->Y = 0;
+        part->Step = 1u << layout->Levels;
+    }
+    else
+    {
+        // Odd columns, odd rows, then both, of the level the part refines
+        const unsigned phase = (index - 1) % 3;
+        part->Level = layout->Levels - 1 - (index - 1) / 3;
+        const unsigned spacing = 1u << part->Level;
+        part->X = (phase != 1) ? spacing : 0;
+        part->Y = (phase != 0) ? spacing : 0;
+        part->Step = spacing * 2;
+    }
+
+    part->CountX = (layout->CellsX > part->X) ? (layout->CellsX - part->X + part->Step - 1) / part->Step : 0;
+    part->CountY = (layout->CellsY > part->Y) ? (layout->CellsY - part->Y + part->Step - 1) / part->Step : 0;
+}
+
+// Image of the part with the other fields of imageData
+static ZPNG_ImageData GetPartImage(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_ProgressiveLayout* layout,
+    const ZPNG_ProgressivePart* part
+)
+{
+    ZPNG_ImageData partImage = *imageData;
+    partImage.WidthPixels = part->CountX * layout->Cell;
+    partImage.HeightPixels = part->CountY * layout->Cell;
+    partImage.StrideBytes = partImage.WidthPixels * layout->PixelBytes;
+    partImage.Buffer.Data = nullptr;
+    partImage.Buffer.Bytes = (size_t)partImage.StrideBytes * partImage.HeightPixels;
+    partImage.IsIFrame = 1;
+    return partImage;
+}
+
+template<int kBytes>
+static void CopyCellRow(
+    const uint8_t* src,
+    size_t srcStep,
+    uint8_t* dst,
+    size_t dstStep,
+    unsigned count
+)
+{
+    for (unsigned i = 0; i < count; ++i, src += srcStep, dst += dstStep) {
+        memcpy(dst, src, kBytes);
+    }
+}
+
+// Copy countX x countY cells from every srcStep-th cell of src starting at
+// cell (srcX, srcY) to every dstStep-th cell of dst starting at (dstX, dstY)
+static void CopyCells(
+    const uint8_t* src,
+    size_t srcStride,
+    unsigned srcX,
+    unsigned srcY,
+    unsigned srcStep,
+    uint8_t* dst,
+    size_t dstStride,
+    unsigned dstX,
+    unsigned dstY,
+    unsigned dstStep,
+    unsigned countX,
+    unsigned countY,
+    unsigned cell,
+    unsigned pixelBytes
+)
+{
+    const size_t cellBytes = (size_t)cell * pixelBytes;
+    const size_t srcCellStep = srcStep * cellBytes;
+    const size_t dstCellStep = dstStep * cellBytes;
+
+    for (unsigned y = 0; y < countY; ++y)
+    {
+        for (unsigned r = 0; r < cell; ++r)
+        {
+            const uint8_t* s = src + ((size_t)(srcY + y * srcStep) * cell + r) * srcStride + srcX * cellBytes;
+            uint8_t* d = dst + ((size_t)(dstY + y * dstStep) * cell + r) * dstStride + dstX * cellBytes;
+
+            if (srcStep == 1 && dstStep == 1) {
+                memcpy(d, s, countX * cellBytes);
+                continue;
+            }
+
+            switch (cellBytes)
+            {
+            case 1: CopyCellRow<1>(s, srcCellStep, d, dstCellStep, countX); break;
+            case 2: CopyCellRow<2>(s, srcCellStep, d, dstCellStep, countX); break;
+            case 3: CopyCellRow<3>(s, srcCellStep, d, dstCellStep, countX); break;
+            case 4: CopyCellRow<4>(s, srcCellStep, d, dstCellStep, countX); break;
+            case 6: CopyCellRow<6>(s, srcCellStep, d, dstCellStep, countX); break;
+            case 8: CopyCellRow<8>(s, srcCellStep, d, dstCellStep, countX); break;
+            default:
+                for (unsigned i = 0; i < countX; ++i) {
+                    memcpy(d + i * dstCellStep, s + i * srcCellStep, cellBytes);
+                }
+                break;
+            }
+        }
+    }
+}
+
+// Bytes of pixels in the largest part that level `level` needs, at least 1
+static size_t GetLargestPartBytes(
+    const ZPNG_ProgressiveLayout* layout,
+    unsigned level
+)
+{
+    size_t largestBytes = 1;
+    for (unsigned i = 0; i < layout->PartCount; ++i)
+    {
+        ZPNG_ProgressivePart part;
+        GetProgressivePart(layout, i, &part);
+        if (i != 0 && part.Level < level) {
+            break;
+        }
+
+        const size_t bytes = (size_t)part.CountX * part.CountY * layout->Cell * layout->Cell * layout->PixelBytes;
+        if (largestBytes < bytes) {
+            largestBytes = bytes;
+        }
+    }
+    return largestBytes;
+}
+
+// Bytes of part `index`, which may be empty
+static ZPNG_Buffer GetPartBuffer(ZPNG_Buffer buffer, unsigned index)
+{
+    const uint64_t* offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_ProgressiveHeader));
+    ZPNG_Buffer part;
+    part.Data = buffer.Data + offsets[index];
+    part.Bytes = (size_t)(offsets[index + 1] - offsets[index]);
+    return part;
+}
+
+// Read and check the header, offset table and part headers of an image in
+// the progressive format.  Returns 0 for other formats
+static int ReadProgressiveHeader(
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    ZPNG_ProgressiveLayout* layout
+)
+{
+    const ZPNG_ProgressiveHeader* header = (const ZPNG_ProgressiveHeader*)buffer.Data;
+    if (!buffer.Data || buffer.Bytes < sizeof(ZPNG_ProgressiveHeader) ||
+        header->Magic != ZPNG_PROGRESSIVE_HEADER_MAGIC ||
+        header->Version != ZPNG_PROGRESSIVE_HEADER_VERSION ||
+        header->Levels == 0 || header->Levels > kMaxProgressiveLevels ||
+        header->BytesPerChannel > 8) {
+        return 0;
+    }
+
+    imageData->WidthPixels = header->Width;
+    imageData->HeightPixels = header->Height;
+    imageData->Channels = header->Channels;
+    imageData->BytesPerChannel = header->BytesPerChannel;
+    imageData->PixelFormat = GetPixelFormatFromCode(header->PixelFormat);
+    imageData->IsIFrame = 1;
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    const uint64_t rowBytes = (uint64_t)imageData->WidthPixels * pixelBytes;
+    size_t byteCount;
+    if (pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(imageData) ||
+        rowBytes > UINT32_MAX || !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+    imageData->StrideBytes = (unsigned)rowBytes;
+
+    GetProgressiveLayout(imageData, header->Levels, layout);
+    if (buffer.Bytes < layout->HeaderBytes) {
+        return 0;
+    }
+
+    // Parts are back to back after the table
+    const uint64_t* offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_ProgressiveHeader));
+    if (offsets[0] != layout->HeaderBytes) {
+        return 0;
+    }
+    for (unsigned i = 0; i < layout->PartCount; ++i)
+    {
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] > buffer.Bytes) {
+            return 0;
+        }
+
+        ZPNG_ProgressivePart part;
+        GetProgressivePart(layout, i, &part);
+        const ZPNG_Buffer partBuffer = GetPartBuffer(buffer, i);
+        if (part.CountX == 0 || part.CountY == 0)
+        {
+            if (partBuffer.Bytes != 0) {
+                return 0;
+            }
+            continue;
+        }
+
+        unsigned stripRows;
+        ZPNG_ImageData partImage;
+        if (!ReadHeader(partBuffer, &partImage, &stripRows) ||
+            !partImage.IsIFrame ||
+            partImage.WidthPixels != part.CountX * layout->Cell ||
+            partImage.HeightPixels != part.CountY * layout->Cell ||
+            partImage.Channels != imageData->Channels ||
+            partImage.BytesPerChannel != imageData->BytesPerChannel ||
+            partImage.PixelFormat != imageData->PixelFormat) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Worst case size of an image in the single-frame or strip format, as a
+// delta frame if `delta` is set
+static size_t GetImageMaximumBufferSize(
+    const ZPNG_ImageData* imageData,
+    bool delta
+)
+{
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+    if (!GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+
+    const size_t maxOutputBytes = ZSTD_compressBound(byteCount + GetOverflowBytes(byteCount, delta));
+    const size_t frameBytes = ZPNG_HEADER_OVERHEAD_BYTES + maxOutputBytes;
+
+    // Also cover the strip format with the smallest allowed strips
+    const unsigned maxStrips = (unsigned)(((uint64_t)imageData->HeightPixels + kMinStripRows - 1) / kMinStripRows);
+    const size_t stripBytes = GetStripMaximumBufferSize(byteCount, maxStrips, delta);
+
+    return frameBytes > stripBytes ? frameBytes : stripBytes;
+}
+
+// Worst case size of an image in the progressive format
+static size_t GetProgressiveMaximumBufferSize(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_ProgressiveLayout* layout
+)
+{
+    size_t bytes = layout->HeaderBytes;
+    for (unsigned i = 0; i < layout->PartCount; ++i)
+    {
+        ZPNG_ProgressivePart part;
+        GetProgressivePart(layout, i, &part);
+        if (part.CountX != 0 && part.CountY != 0)
+        {
+            const ZPNG_ImageData partImage = GetPartImage(imageData, layout, &part);
+            bytes += GetImageMaximumBufferSize(&partImage, false);
+        }
+    }
+    return bytes;
+}
+
+
+#ifdef __cplusplus
 extern "C" {
 #endif
 
 //------------------------------------------------------------------------------
-// API
+// Streaming
+
+// Rows per chunk for the streaming paths, at least one
+static unsigned GetStreamChunkRows(size_t rowBytes)
+{
+    const size_t rows = kStreamChunkBytes / rowBytes;
+    return rows > 0 ? (unsigned)rows : 1;
+}
+
+// Filter an I-frame a chunk of rows at a time and feed each chunk to Zstd
+// while it is still in cache, instead of packing the whole image first.
+// Requires IsRowPacked().  Returns the compressed size, or a Zstd error code
+static size_t CompressStreaming(
+    ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* imageData,
+    unsigned pixelBytes,
+    uint8_t* dst,
+    size_t dstCapacity,
+    const ZSTD_CDict* cdict
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const unsigned chunkRows = GetStreamChunkRows(rowBytes);
+
+    uint8_t* chunk = GetScratch(ctx, chunkRows * rowBytes);
+    if (!chunk) {
+        return (size_t)-ZSTD_error_memory_allocation;
+    }
+
+    ZSTD_CCtx* cctx = ctx->CCtx;
+    const size_t err = BeginContextFrame(ctx, rowBytes * height, cdict);
+    if (ZSTD_isError(err)) {
+        return err;
+    }
+
+    ZSTD_outBuffer output = { dst, dstCapacity, 0 };
+
+    for (unsigned row = 0; row < height; row += chunkRows)
+    {
+        const unsigned rows = (height - row < chunkRows) ? height - row : chunkRows;
+        const ZPNG_ImageData chunkImage = GetStripImage(imageData, pixelBytes, row, rows);
+        uint64_t t0 = StartStage(ctx->Collector);
+        PackImage(&chunkImage, pixelBytes, chunk);
+        EndStage(ctx->Collector, ZPNG_STAGE_FILTER, t0);
+
+        t0 = StartStage(ctx->Collector);
+        ZSTD_inBuffer input = { chunk, rows * rowBytes, 0 };
+        const ZSTD_EndDirective op = (row + rows >= height) ? ZSTD_e_end : ZSTD_e_continue;
+
+        // The chunk is reused for the next rows, so Zstd must take all of it
+        for (;;)
+        {
+            const size_t remaining = ZSTD_compress_generic(cctx, &output, &input, op);
+            if (ZSTD_isError(remaining)) {
+                ZSTD_CCtx_reset(cctx);
+                return remaining;
+            }
+            if (op == ZSTD_e_end ? (remaining == 0) : (input.pos == input.size)) {
+                break;
+            }
+            if (output.pos >= output.size) {
+                ZSTD_CCtx_reset(cctx);
+                return (size_t)-ZSTD_error_dstSize_tooSmall;
+            }
+        }
+        EndStage(ctx->Collector, ZPNG_STAGE_ZSTD, t0);
+    }
+
+    return output.pos;
+}
+
+// Receiver of decoded rows for ZPNG_DecompressRows()
+struct ZPNG_RowSink
+{
+    ZPNG_RowFunction Function;
+    void* Opaque;
+};
+
+// Decompress an I-frame a chunk of rows at a time and unfilter each chunk
+// while it is still in cache, instead of decompressing the whole image first.
+// With a sink, each chunk is unfiltered into scratch space and passed to it
+// instead, and imageData only describes the image.
+// Requires IsRowPacked().  Returns 1 on success, 0 on failure
+static int DecompressStreaming(
+    ZPNG_DecompressionState* state,
+    const uint8_t* src,
+    size_t srcSize,
+    unsigned pixelBytes,
+    ZPNG_ImageData* imageData,
+    const ZPNG_RowSink* sink
+)
+{
+    const unsigned height = imageData->HeightPixels;
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const unsigned chunkRows = GetStreamChunkRows(rowBytes);
+    const size_t chunkBytes = chunkRows * rowBytes;
+
+    uint8_t* chunk = GetScratch(state, sink ? chunkBytes * 2 : chunkBytes);
+    if (!chunk || !EnsureDecompressionWorkers(state, 1)) {
+        return 0;
+    }
+
+    ZSTD_DStream* dstream = state->DCtx[0];
+    const ZSTD_DDict* ddict = GetFrameDDict(state, src, srcSize);
+    if (ZSTD_isError(ddict ? ZSTD_initDStream_usingDDict(dstream, ddict) : ZSTD_initDStream(dstream))) {
+        return 0;
+    }
+
+    // Accept any window, as ZSTD_decompressDCtx() does for the other paths.
+    // The whole image is allocated anyway, and windows are capped at its size
+    if (ZSTD_isError(ZSTD_DCtx_setMaxWindowSize(dstream, (size_t)1 << ZSTD_WINDOWLOG_MAX))) {
+        return 0;
+    }
+
+    ZSTD_inBuffer input = { src, srcSize, 0 };
+
+    for (unsigned row = 0; row < height; row += chunkRows)
+    {
+        const unsigned rows = (height - row < chunkRows) ? height - row : chunkRows;
+        ZSTD_outBuffer output = { chunk, rows * rowBytes, 0 };
+
+        uint64_t t0 = StartStage(state->Collector);
+        while (output.pos < output.size)
+        {
+            const size_t inputPos = input.pos, outputPos = output.pos;
+            const size_t hint = ZSTD_decompressStream(dstream, &output, &input);
+            if (ZSTD_isError(hint)) {
+                return 0;
+            }
+
+            // Fail if the frame ended early or the input ran out
+            if (output.pos < output.size && (hint == 0 || (input.pos == inputPos && output.pos == outputPos))) {
+                return 0;
+            }
+        }
+        EndStage(state->Collector, ZPNG_STAGE_ZSTD, t0);
+
+        if (!sink)
+        {
+            t0 = StartStage(state->Collector);
+            ZPNG_ImageData chunkImage = GetStripImage(imageData, pixelBytes, row, rows);
+            UnpackImage(chunk, pixelBytes, &chunkImage);
+            EndStage(state->Collector, ZPNG_STAGE_FILTER, t0);
+            continue;
+        }
+
+        ZPNG_ImageData band = *imageData;
+        band.Buffer.Data = chunk + chunkBytes;
+        band.Buffer.Bytes = rows * rowBytes;
+        band.HeightPixels = rows;
+        band.StrideBytes = (unsigned)rowBytes;
+        UnpackImage(chunk, pixelBytes, &band);
+
+        if (!sink->Function(sink->Opaque, &band, row)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+// Row Encoder
+
+// State behind the opaque ZPNG_Encoder pointer
+struct ZPNG_RowEncoder
+{
+    ZPNG_CompressionContext* Context;
+
+    // Context allocated for a null context, freed with the encoder
+    ZPNG_CompressionContext* TempContext;
+
+    // Image format, with no buffer
+    ZPNG_ImageData Format;
+    ZPNG_StripLayout Layout;
+    size_t RowBytes;
+
+    // ZPNG_Filter of the strips, or ZPNG_FILTER_ADAPTIVE until the first one,
+    // and likewise the ZPNG_ColorTransform
+    unsigned Filter;
+    unsigned Transform;
+    bool Wide;
+
+    // Kernels for the image and Transform, indexed by Filter, found with
+    // the first strip
+    const ZPNG_Kernels* Kernels;
+
+    ZPNG_WriteFunction Write;
+    void* Opaque;
+
+    // Rows pushed so far for the current strip, tightly packed
+    uint8_t* Rows;
+    unsigned RowCount;
+
+    // Index of the current strip
+    unsigned Strip;
+
+    // Filtered strip, and compressed bytes waiting to be written
+    uint8_t* Packing;
+    uint8_t* Chunk;
+
+    // Where the next strip starts in the output
+    uint64_t Offset;
+
+    bool Failed;
+};
+
+static void FreeRowEncoder(ZPNG_RowEncoder* enc)
+{
+    ZPNG_FreeCompressionContext(enc->TempContext);
+    FreeBuffer(enc->Rows);
+    free(enc);
+}
+
+// Filter and compress the buffered rows, writing the strip and its end
+// offset.  Returns 1 on success, 0 on failure
+static int EncodeRowStrip(ZPNG_RowEncoder* enc)
+{
+    ZPNG_CompressionContext* ctx = enc->Context;
+    const ZPNG_StripLayout* layout = &enc->Layout;
+
+    ZPNG_ImageData stripImage = enc->Format;
+    stripImage.Buffer.Data = enc->Rows;
+    stripImage.Buffer.Bytes = enc->RowCount * enc->RowBytes;
+    stripImage.HeightPixels = enc->RowCount;
+    stripImage.StrideBytes = (unsigned)enc->RowBytes;
+
+    if (!enc->Kernels)
+    {
+        if (enc->Transform == ZPNG_COLOR_AUTO) {
+            enc->Transform = SelectColorTransform(&stripImage, layout->PixelBytes);
+        }
+        if (enc->Filter == ZPNG_FILTER_ADAPTIVE) {
+            enc->Filter = SelectImageFilter(ctx, &stripImage, layout->PixelBytes, enc->Transform);
+        }
+        enc->Kernels = GetKernels(&enc->Format, layout->PixelBytes, enc->Wide, enc->Transform);
+        if (!enc->Kernels) {
+            return 0;
+        }
+    }
+
+    enc->Kernels->Pack[enc->Filter](&stripImage, enc->Packing);
+
+    const size_t packedBytes = stripImage.Buffer.Bytes;
+    if (ZSTD_isError(BeginContextFrame(ctx, packedBytes, nullptr))) {
+        return 0;
+    }
+
+    // Compressed bytes go out a chunk at a time, whatever the strip size
+    ZSTD_inBuffer input = { enc->Packing, packedBytes, 0 };
+    for (;;)
+    {
+        ZSTD_outBuffer output = { enc->Chunk, kStreamChunkBytes, 0 };
+        const size_t remaining = ZSTD_compress_generic(ctx->CCtx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(remaining)) {
+            ZSTD_CCtx_reset(ctx->CCtx);
+            return 0;
+        }
+
+        if (output.pos > 0)
+        {
+            if (!enc->Write(enc->Opaque, enc->Offset, enc->Chunk, output.pos)) {
+                ZSTD_CCtx_reset(ctx->CCtx);
+                return 0;
+            }
+            enc->Offset += output.pos;
+        }
+
+        if (remaining == 0) {
+            break;
+        }
+    }
+
+    const uint64_t tableOffset = sizeof(ZPNG_StripHeader) + ((uint64_t)enc->Strip + 1) * sizeof(uint64_t);
+    if (!enc->Write(enc->Opaque, tableOffset, &enc->Offset, sizeof(uint64_t))) {
+        return 0;
+    }
+
+    ++enc->Strip;
+    enc->RowCount = 0;
+    return 1;
+}
+
+ZPNG_Encoder* ZPNG_BeginEncode(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context,
+    ZPNG_WriteFunction write,
+    void* opaque
+)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+    if (!write || pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(imageData) ||
+        !GetImageBytes(imageData, pixelBytes, &byteCount) ||
+        (uint64_t)imageData->WidthPixels * pixelBytes > UINT32_MAX) {
+        return nullptr;
+    }
+
+    ZPNG_RowEncoder* enc = (ZPNG_RowEncoder*)calloc(1, sizeof(ZPNG_RowEncoder));
+    if (!enc) {
+        return nullptr;
+    }
+
+    if (!ctx)
+    {
+        enc->TempContext = (ZPNG_CompressionContext*)ZPNG_AllocateCompressionContext();
+        if (!enc->TempContext) {
+            FreeRowEncoder(enc);
+            return nullptr;
+        }
+        ctx = enc->TempContext;
+    }
+
+    enc->Context = ctx;
+    enc->Format = *imageData;
+    enc->Format.Buffer.Data = nullptr;
+    enc->Format.Buffer.Bytes = 0;
+    enc->Format.IsIFrame = 1;
+    enc->RowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    enc->Filter = IsPredictable(imageData) ? ctx->Filter : (unsigned)ZPNG_FILTER_LEFT;
+    enc->Transform = IsPlanarImage(imageData) ? ctx->ColorTransform : (unsigned)ZPNG_COLOR_GB_RG;
+    enc->Wide = IsWideImage(imageData);
+    enc->Write = write;
+    enc->Opaque = opaque;
+
+    // Strips of about kEncoderStripBytes unless the context sets the height,
+    // and no taller than the image
+    const unsigned height = imageData->HeightPixels;
+    uint64_t stripRows = ctx->StripRows;
+    if (stripRows == 0)
+    {
+        stripRows = enc->RowBytes > 0 ? kEncoderStripBytes / enc->RowBytes : kMinStripRows;
+        if (stripRows < kMinStripRows) {
+            stripRows = kMinStripRows;
+        }
+    }
+    if (stripRows > height) {
+        stripRows = height > 0 ? height : 2;
+    }
+    stripRows += stripRows & 1;
+
+    GetStripLayout(imageData->WidthPixels, height, pixelBytes, (unsigned)stripRows, 1, 0, nullptr, false, false, false, &enc->Layout);
+
+    // Buffered rows, packing and the output chunk in one allocation
+    enc->Rows = AllocateBuffer(enc->Layout.StripBytes * 2 + kStreamChunkBytes);
+    if (!enc->Rows) {
+        FreeRowEncoder(enc);
+        return nullptr;
+    }
+    enc->Packing = enc->Rows + enc->Layout.StripBytes;
+    enc->Chunk = enc->Packing + enc->Layout.StripBytes;
+    enc->Offset = enc->Layout.HeaderBytes;
+
+    return (ZPNG_Encoder*)enc;
+}
+
+int ZPNG_PushRows(
+    ZPNG_Encoder* encoder,
+    const void* rows,
+    unsigned rowCount,
+    unsigned strideBytes
+)
+{
+    ZPNG_RowEncoder* enc = (ZPNG_RowEncoder*)encoder;
+    if (!enc || enc->Failed) {
+        return 0;
+    }
+
+    const ZPNG_StripLayout* layout = &enc->Layout;
+    const unsigned height = enc->Format.HeightPixels;
+    const unsigned pushedRows = enc->Strip * layout->StripRows + enc->RowCount;
+    if ((rowCount > 0 && !rows) || rowCount > height - pushedRows) {
+        enc->Failed = true;
+        return 0;
+    }
+
+    const size_t rowBytes = enc->RowBytes;
+    const size_t stride = strideBytes > rowBytes ? strideBytes : rowBytes;
+    const uint8_t* input = (const uint8_t*)rows;
+
+    while (rowCount > 0)
+    {
+        // Copy as many rows as fit in the current strip
+        const unsigned stripRows = GetStripRowCount(layout, height, enc->Strip);
+        const unsigned count = (rowCount < stripRows - enc->RowCount) ? rowCount : stripRows - enc->RowCount;
+        uint8_t* output = enc->Rows + enc->RowCount * rowBytes;
+
+        for (unsigned i = 0; i < count; ++i) {
+            memcpy(output + i * rowBytes, input + i * stride, rowBytes);
+        }
+        input += count * stride;
+        rowCount -= count;
+        enc->RowCount += count;
+
+        if (enc->RowCount == stripRows && !EncodeRowStrip(enc)) {
+            enc->Failed = true;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int ZPNG_EndEncode(
+    ZPNG_Encoder* encoder,
+    uint64_t* bytes
+)
+{
+    ZPNG_RowEncoder* enc = (ZPNG_RowEncoder*)encoder;
+    if (!enc) {
+        return 0;
+    }
+
+    int success = 0;
+    if (!enc->Failed && enc->Strip == enc->Layout.StripCount)
+    {
+        // The first offset and the header go last, once every strip is out
+        ZPNG_StripHeader header;
+        header.Magic = ZPNG_STRIP_HEADER_MAGIC;
+        header.Version = ZPNG_STRIP_HEADER_VERSION;
+        header.Flags = enc->Wide ? ZPNG_STRIP_FLAG_PLANES16 : 0;
+        header.Width = enc->Format.WidthPixels;
+        header.Height = enc->Format.HeightPixels;
+        header.Channels = (uint8_t)enc->Format.Channels;
+        header.BytesPerChannel = (uint8_t)enc->Format.BytesPerChannel;
+        header.PixelFormat = GetPixelFormatCode(enc->Format.PixelFormat);
+        header.Filter = enc->Kernels ? (uint8_t)(enc->Filter | enc->Transform << kColorTransformShift) : (uint8_t)ZPNG_FILTER_LEFT;
+        header.StripRows = enc->Layout.StripRows;
+        header.StripCount = enc->Layout.StripCount;
+
+        const uint64_t firstOffset = enc->Layout.HeaderBytes;
+        success = enc->Write(enc->Opaque, sizeof(ZPNG_StripHeader), &firstOffset, sizeof(firstOffset)) &&
+            enc->Write(enc->Opaque, 0, &header, sizeof(header));
+
+        if (success && bytes) {
+            *bytes = enc->Offset;
+        }
+    }
+
+    FreeRowEncoder(enc);
+    return success;
+}
+
+//------------------------------------------------------------------------------
+// Video File
+
+// State behind the opaque ZPNG_VideoWriter pointer
+struct ZPNG_VideoFileWriter
+{
+    ZPNG_WriteFunction Write;
+    void* Opaque;
+
+    // Frame table, grown as frames are added
+    ZPNG_VideoFrameEntry* Entries;
+    unsigned FrameCount;
+    unsigned EntryCapacity;
+
+    // Where the next frame starts in the output
+    uint64_t Offset;
+
+    bool Failed;
+};
+
+// State behind the opaque ZPNG_VideoReader pointer
+struct ZPNG_VideoFileReader
+{
+    ZPNG_Buffer File;
+
+    // Copy of the frame table, validated on open
+    ZPNG_VideoFrameEntry* Entries;
+    unsigned FrameCount;
+};
+
+ZPNG_VideoWriter* ZPNG_BeginVideoFile(
+    ZPNG_WriteFunction write,
+    void* opaque
+)
+{
+    if (!write) {
+        return nullptr;
+    }
+
+    ZPNG_VideoFileWriter* writer = (ZPNG_VideoFileWriter*)calloc(1, sizeof(ZPNG_VideoFileWriter));
+    if (!writer) {
+        return nullptr;
+    }
+
+    writer->Write = write;
+    writer->Opaque = opaque;
+    writer->Offset = sizeof(ZPNG_VideoFileHeader);
+
+    return (ZPNG_VideoWriter*)writer;
+}
+
+int ZPNG_AddVideoFrame(
+    ZPNG_VideoWriter* videoWriter,
+    ZPNG_Buffer frame,
+    int64_t timestamp,
+    unsigned refFrame
+)
+{
+    ZPNG_VideoFileWriter* writer = (ZPNG_VideoFileWriter*)videoWriter;
+    if (!writer || writer->Failed) {
+        return 0;
+    }
+
+    const unsigned index = writer->FrameCount;
+
+    unsigned stripRows;
+    ZPNG_ImageData header;
+    ZPNG_ProgressiveLayout progressive;
+    if ((!ReadHeader(frame, &header, &stripRows) && !ReadProgressiveHeader(frame, &header, &progressive)) ||
+        index == UINT32_MAX) {
+        goto Fail;
+    }
+
+    // Delta frames need an earlier frame to decode against
+    if (!header.IsIFrame && refFrame >= index) {
+        goto Fail;
+    }
+    if (index > 0 && timestamp < writer->Entries[index - 1].Timestamp) {
+        goto Fail;
+    }
+
+    if (index == writer->EntryCapacity)
+    {
+        const unsigned capacity = writer->EntryCapacity ? writer->EntryCapacity * 2 : 64;
+        ZPNG_VideoFrameEntry* entries = (ZPNG_VideoFrameEntry*)realloc(
+            writer->Entries, (size_t)capacity * sizeof(ZPNG_VideoFrameEntry));
+        if (!entries) {
+            goto Fail;
+        }
+        writer->Entries = entries;
+        writer->EntryCapacity = capacity;
+    }
+
+    if (!writer->Write(writer->Opaque, writer->Offset, frame.Data, frame.Bytes)) {
+        goto Fail;
+    }
+
+    {
+        ZPNG_VideoFrameEntry* entry = writer->Entries + index;
+        entry->Offset = writer->Offset;
+        entry->Bytes = frame.Bytes;
+        entry->Timestamp = timestamp;
+        entry->RefFrame = header.IsIFrame ? index : refFrame;
+        entry->KeyFrame = header.IsIFrame ? index : writer->Entries[refFrame].KeyFrame;
+        entry->Flags = header.IsIFrame ? ZPNG_VIDEO_FRAME_KEY : 0;
+        entry->Reserved = 0;
+    }
+
+    writer->Offset += frame.Bytes;
+    writer->FrameCount = index + 1;
+    return 1;
+
+Fail:
+    writer->Failed = true;
+    return 0;
+}
+
+int ZPNG_EndVideoFile(
+    ZPNG_VideoWriter* videoWriter,
+    uint64_t* bytes
+)
+{
+    ZPNG_VideoFileWriter* writer = (ZPNG_VideoFileWriter*)videoWriter;
+    if (!writer) {
+        return 0;
+    }
+
+    int success = 0;
+
+    if (!writer->Failed)
+    {
+        ZPNG_VideoFileHeader header;
+        header.Magic = ZPNG_VIDEO_FILE_MAGIC;
+        header.Version = ZPNG_VIDEO_FILE_VERSION;
+        header.Flags = 0;
+        header.FrameCount = writer->FrameCount;
+        header.EntryBytes = sizeof(ZPNG_VideoFrameEntry);
+        header.TableOffset = writer->Offset;
+
+        const size_t tableBytes = (size_t)writer->FrameCount * sizeof(ZPNG_VideoFrameEntry);
+        success = (tableBytes == 0 || writer->Write(writer->Opaque, writer->Offset, writer->Entries, tableBytes)) &&
+            writer->Write(writer->Opaque, 0, &header, sizeof(header));
+
+        if (success && bytes) {
+            *bytes = writer->Offset + tableBytes;
+        }
+    }
+
+    free(writer->Entries);
+    free(writer);
+    return success;
+}
+
+ZPNG_VideoReader* ZPNG_OpenVideoFile(
+    ZPNG_Buffer file
+)
+{
+    ZPNG_VideoFileHeader header;
+    if (!file.Data || file.Bytes < sizeof(header)) {
+        return nullptr;
+    }
+    memcpy(&header, file.Data, sizeof(header));
+
+    if (header.Magic != ZPNG_VIDEO_FILE_MAGIC || header.Version != ZPNG_VIDEO_FILE_VERSION ||
+        header.EntryBytes < sizeof(ZPNG_VideoFrameEntry) ||
+        header.TableOffset < sizeof(header) || header.TableOffset > file.Bytes ||
+        (file.Bytes - header.TableOffset) / header.EntryBytes < header.FrameCount) {
+        return nullptr;
+    }
+
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)calloc(1, sizeof(ZPNG_VideoFileReader));
+    if (!reader) {
+        return nullptr;
+    }
+    reader->Entries = (ZPNG_VideoFrameEntry*)malloc((size_t)header.FrameCount * sizeof(ZPNG_VideoFrameEntry) + 1);
+    if (!reader->Entries) {
+        free(reader);
+        return nullptr;
+    }
+    reader->File = file;
+    reader->FrameCount = header.FrameCount;
+
+    // The table may be unaligned, and entries may be longer than this version's
+    const uint8_t* table = file.Data + header.TableOffset;
+    for (unsigned i = 0; i < header.FrameCount; ++i)
+    {
+        ZPNG_VideoFrameEntry* entry = reader->Entries + i;
+        memcpy(entry, table + (size_t)i * header.EntryBytes, sizeof(ZPNG_VideoFrameEntry));
+
+        // Frames lie between the header and the table, and reference chains
+        // only point back to earlier frames, so seeking never loops
+        const bool isKey = (entry->Flags & ZPNG_VIDEO_FRAME_KEY) != 0;
+        if (entry->Offset < sizeof(header) || entry->Offset > header.TableOffset ||
+            entry->Bytes > header.TableOffset - entry->Offset ||
+            (isKey ? (entry->RefFrame != i || entry->KeyFrame != i) :
+                (entry->RefFrame >= i || entry->KeyFrame != reader->Entries[entry->RefFrame].KeyFrame)) ||
+            (i > 0 && entry->Timestamp < entry[-1].Timestamp))
+        {
+            ZPNG_CloseVideoFile(reader);
+            return nullptr;
+        }
+    }
+
+    return (ZPNG_VideoReader*)reader;
+}
+
+unsigned ZPNG_GetVideoFrameCount(
+    ZPNG_VideoReader* videoReader
+)
+{
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)videoReader;
+    return reader ? reader->FrameCount : 0;
+}
+
+int ZPNG_GetVideoFrameInfo(
+    ZPNG_VideoReader* videoReader,
+    unsigned frame,
+    ZPNG_VideoFrameInfo* info
+)
+{
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)videoReader;
+    if (!reader || !info || frame >= reader->FrameCount) {
+        return 0;
+    }
+
+    const ZPNG_VideoFrameEntry* entry = reader->Entries + frame;
+    info->Frame.Data = reader->File.Data + entry->Offset;
+    info->Frame.Bytes = (size_t)entry->Bytes;
+    info->Timestamp = entry->Timestamp;
+    info->IsKeyFrame = (entry->Flags & ZPNG_VIDEO_FRAME_KEY) ? 1 : 0;
+    info->RefFrame = entry->RefFrame;
+    info->KeyFrame = entry->KeyFrame;
+    return 1;
+}
+
+unsigned ZPNG_FindVideoFrame(
+    ZPNG_VideoReader* videoReader,
+    int64_t timestamp
+)
+{
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)videoReader;
+    if (!reader) {
+        return 0;
+    }
+
+    // Binary search for the last frame at or before the timestamp
+    unsigned low = 0, high = reader->FrameCount;
+    while (low < high)
+    {
+        const unsigned mid = low + (high - low) / 2;
+        if (reader->Entries[mid].Timestamp <= timestamp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+// Decode a frame of the file into imageData->Buffer as with
+// ZPNG_DecompressToBuffer().  Only its chain of references back to the
+// nearest I-frame is decoded, each frame over the one before it.
+// Returns 1 on success, 0 on failure
+static int DecodeVideoChain(
+    const ZPNG_VideoFileReader* reader,
+    ZPNG_DecompressionContext* context,
+    unsigned frame,
+    ZPNG_ImageData* imageData
+)
+{
+    unsigned chainLength = 1;
+    for (unsigned i = frame; i != reader->Entries[i].KeyFrame; i = reader->Entries[i].RefFrame) {
+        ++chainLength;
+    }
+    unsigned* chain = (unsigned*)malloc(chainLength * sizeof(unsigned));
+    if (!chain) {
+        return 0;
+    }
+    for (unsigned i = frame, j = chainLength; j > 0; i = reader->Entries[i].RefFrame) {
+        chain[--j] = i;
+    }
+
+    int success = 1;
+    for (unsigned j = 0; j < chainLength && success; ++j)
+    {
+        const ZPNG_VideoFrameEntry* entry = reader->Entries + chain[j];
+
+        ZPNG_Buffer buffer;
+        buffer.Data = reader->File.Data + entry->Offset;
+        buffer.Bytes = (size_t)entry->Bytes;
+
+        success = (j == 0) ?
+            ZPNG_DecompressToBuffer(context, nullptr, buffer, imageData) :
+            ZPNG_DecompressInPlace(context, buffer, imageData);
+    }
+
+    free(chain);
+    return success;
+}
+
+ZPNG_ImageData ZPNG_DecodeVideoFrame(
+    ZPNG_VideoReader* videoReader,
+    ZPNG_DecompressionContext* context,
+    unsigned frame
+)
+{
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)videoReader;
+
+    ZPNG_ImageData imageData;
+    memset(&imageData, 0, sizeof(imageData));
+
+    ZPNG_ImageInfo info;
+    if (!reader || frame >= reader->FrameCount) {
+        return imageData;
+    }
+    const ZPNG_VideoFrameEntry* entry = reader->Entries + frame;
+    const ZPNG_Buffer buffer = { reader->File.Data + entry->Offset, (size_t)entry->Bytes };
+    if (!ZPNG_GetInfo(buffer, &info)) {
+        return imageData;
+    }
+
+    // Every frame of the chain has the format of this one
+    imageData.Buffer.Data = AllocateBuffer((size_t)info.ImageBytes);
+    imageData.Buffer.Bytes = (size_t)info.ImageBytes;
+    if (!imageData.Buffer.Data || !DecodeVideoChain(reader, context, frame, &imageData))
+    {
+        FreeBuffer(imageData.Buffer.Data);
+        memset(&imageData, 0, sizeof(imageData));
+    }
+    return imageData;
+}
+
+void ZPNG_CloseVideoFile(
+    ZPNG_VideoReader* videoReader
+)
+{
+    ZPNG_VideoFileReader* reader = (ZPNG_VideoFileReader*)videoReader;
+    if (reader)
+    {
+        free(reader->Entries);
+        free(reader);
+    }
+}
+
+//------------------------------------------------------------------------------
+// API
+
+
+
+size_t ZPNG_MaximumBufferSize(
+    const ZPNG_ImageData* imageData
+)
+{
+    size_t maxBytes = GetImageMaximumBufferSize(imageData, true);
+
+    // Also cover the progressive format with any number of levels
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    if (maxBytes != 0 && pixelBytes <= 8 && imageData->BytesPerChannel <= 8 && IsValidPixelFormat(imageData))
+    {
+        for (unsigned levels = 1; levels <= kMaxProgressiveLevels; ++levels)
+        {
+            ZPNG_ProgressiveLayout layout;
+            GetProgressiveLayout(imageData, levels, &layout);
+            const size_t progressiveBytes = GetProgressiveMaximumBufferSize(imageData, &layout);
+            if (maxBytes < progressiveBytes) {
+                maxBytes = progressiveBytes;
+            }
+        }
+    }
+
+    return maxBytes;
+}
+
+ZPNG_Buffer ZPNG_Compress(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context,
+    ZPNG_Dictionary** dictionary
+)
+{
+    ZPNG_Buffer buffer;
+    buffer.Bytes = 0;
+    buffer.Data = nullptr;
+    ZPNG_CompressVideoToBuffer(nullptr, imageData, &buffer, context, dictionary);
+
+    return buffer;
+}
+
+int ZPNG_CompressToBuffer(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* bufferOutput,
+    ZPNG_Context* context,
+    ZPNG_Dictionary** dictionary
+)
+{
+    return ZPNG_CompressVideoToBuffer(0, imageData, bufferOutput, context, dictionary);
+}
+
+// 16-bit and Bayer images need the strip header to record their filter,
+// as do other predictors, checksums, plane frames, dictionaries, block maps,
+// entropy frames, palettes, plane maps and dimensions over 65535 pixels.
+// A pack function filters strips, so it needs them too, and streams are
+// written as strips
+static bool NeedsStripHeader(
+    const ZPNG_ImageData* imageData,
+    const ZPNG_CompressionContext* ctx,
+    unsigned filter,
+    unsigned transform,
+    bool planeFrames,
+    bool dictionary,
+    bool blockMaps,
+    bool entropy,
+    bool palette,
+    bool planeMap
+)
+{
+    return IsWideImage(imageData) ||
+        filter != ZPNG_FILTER_LEFT ||
+        transform != ZPNG_COLOR_GB_RG ||
+        planeFrames ||
+        dictionary ||
+        blockMaps ||
+        entropy ||
+        palette ||
+        planeMap ||
+        imageData->PixelFormat != ZPNG_PIXEL_FORMAT_DEFAULT ||
+        imageData->WidthPixels > UINT16_MAX ||
+        imageData->HeightPixels > UINT16_MAX ||
+        (ctx && (ctx->Checksum || ctx->PackFunction || ctx->Stream));
+}
+
+static void WriteHeader(
+    const ZPNG_ImageData* imageData,
+    bool isVideo,
+    uint8_t* output
+)
+{
+    ZPNG_Header* header = (ZPNG_Header*)output;
+    header->Magic = isVideo ? ZPNG_VIDEO_HEADER_MAGIC : ZPNG_HEADER_MAGIC;
+    header->Width = (uint16_t)imageData->WidthPixels;
+    header->Height = (uint16_t)imageData->HeightPixels;
+    header->Channels = (uint8_t)imageData->Channels;
+    header->BytesPerChannel = (uint8_t)imageData->BytesPerChannel;
+}
+
+// Compress a block map for its section into `stored`, which holds
+// ZSTD_compressBound() of it, or keep it raw if that saves nothing.
+// Returns the stored size
+static size_t StoreBlockMap(
+    ZPNG_CompressionContext* ctx,
+    const void* map,
+    size_t mapBytes,
+    uint8_t* stored
+)
+{
+    const size_t result = CompressFrame(ctx->CCtx, &ctx->Params, stored, ZSTD_compressBound(mapBytes), map, mapBytes, nullptr);
+    if (ZSTD_isError(result) || result >= mapBytes)
+    {
+        memcpy(stored, map, mapBytes);
+        return mapBytes;
+    }
+    return result;
+}
+
+// Store the vectors from SearchMotion() for the motion section.
+// Returns false if they are over budget
+static bool StoreMotion(
+    ZPNG_CompressionContext* ctx,
+    ZPNG_MotionField* motion,
+    size_t imageBytes
+)
+{
+    const size_t vectorBytes = (size_t)motion->BlocksX * motion->BlocksY * 2;
+    motion->StoredBytes = StoreBlockMap(ctx, motion->Vectors, vectorBytes, motion->Stored);
+    return motion->StoredBytes <= GetBlockMapBudget(imageBytes);
+}
+
+// Store the map from FindSkipBlocks() for the skip section.  Returns false
+// if it is over what the budget leaves after any motion vectors
+static bool StoreSkip(
+    ZPNG_CompressionContext* ctx,
+    ZPNG_SkipMap* skip,
+    const ZPNG_MotionField* motion,
+    size_t imageBytes
+)
+{
+    skip->StoredBytes = StoreBlockMap(ctx, skip->Bits, GetSkipMapBytes(skip), skip->Stored);
+    return (motion ? motion->StoredBytes : 0) + skip->StoredBytes <= GetBlockMapBudget(imageBytes);
+}
+
+// Compress in the single-frame or strip format.
+// Returns 1 on success, 0 on failure
+static int CompressImage(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* bufferOutput,
+    ZPNG_CompressionContext* ctx,
+    ZPNG_Dictionary** dictionary
+)
+{
+    uint8_t* packing = nullptr;
+    uint8_t* output = nullptr;
+    int success = 0;
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+
+    // FIXME: One day add support for other formats
+    if (pixelBytes > 8 || !IsValidPixelFormat(imageData) || !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+
+    // Parts of a progressive image add to the stats of the whole image
+    ZPNG_StatsCollector statsCollector;
+    ZPNG_StatsCollector* collector = nullptr;
+    const bool ownsStats = ctx && !ctx->Collector;
+    if (ctx)
+    {
+        collector = ownsStats ? BeginStats(&statsCollector, ctx->Stats) : ctx->Collector;
+        ctx->Collector = collector;
+    }
+
+    // A pack function only writes left-filtered I-frames, and nothing that
+    // reads the pixels can run here
+    const bool packFunction = ctx && ctx->PackFunction;
+    if (packFunction) {
+        refData = nullptr;
+    }
+
+    // Motion vectors are kept if they shrink the sampled residuals and fit
+    // their budget.  Streams write the header before the frames, with no
+    // room for them
+    const uint64_t t0 = StartStage(collector);
+    ZPNG_MotionField motionField;
+    const ZPNG_MotionField* motion = nullptr;
+    if (refData && ctx && ctx->MotionSearch && !ctx->Stream && IsMotionSearchable(imageData) &&
+        SearchMotion(ctx, refData, imageData, pixelBytes, &motionField) &&
+        IsMotionCheaper(refData, imageData, pixelBytes, &motionField) &&
+        StoreMotion(ctx, &motionField, byteCount)) {
+        motion = &motionField;
+    }
+
+    // Frames that would cost more as deltas are encoded as I-frames
+    if (refData && !IsDeltaCheaper(refData, imageData, pixelBytes, motion)) {
+        refData = nullptr;
+        motion = nullptr;
+    }
+
+    // Blocks that match their prediction are left out of delta frames if
+    // enough do, under the same budget and for the same reason
+    ZPNG_SkipMap skipMap;
+    const ZPNG_SkipMap* skip = nullptr;
+    if (refData && ctx && ctx->SkipBlocks && !ctx->Stream && IsSkippable(imageData) &&
+        FindSkipBlocks(ctx, refData, imageData, pixelBytes, motion, &skipMap) &&
+        StoreSkip(ctx, &skipMap, motion, byteCount)) {
+        skip = &skipMap;
+    }
+
+    // Images with few colors store palette indices, which are not filtered
+    ZPNG_Palette palette;
+    const bool usePalette = ctx && ctx->Palette && !packFunction && !refData && !dictionary && GetImagePalette(imageData, &palette);
+
+    // Color transforms other than GB-RG and predictors other than the left
+    // filter are for I-frames only
+    const unsigned transform = (!packFunction && !refData && !usePalette) ?
+        GetColorTransform(ctx, imageData, pixelBytes) : (unsigned)ZPNG_COLOR_GB_RG;
+    unsigned filter = ZPNG_FILTER_LEFT;
+    if (ctx && !packFunction && !refData && !usePalette && IsPredictable(imageData))
+    {
+        filter = ctx->Filter;
+        if (filter == ZPNG_FILTER_ADAPTIVE) {
+            filter = SelectImageFilter(ctx, imageData, pixelBytes, transform);
+        }
+    }
+    EndStage(collector, ZPNG_STAGE_DECIDE, t0);
+
+    // Plane frames apply to I-frames with separate color planes
+    const bool planeFrames = ctx && ctx->PlaneFrames && !refData && !usePalette && IsPlanarImage(imageData);
+
+    // Constant and duplicate channels are left out of I-frames, unless plane
+    // frames already give each channel a frame of its own
+    ZPNG_PlaneMap planeMap;
+    bool usePlaneMap = false;
+    if (ctx && ctx->ConstantPlanes && !packFunction && !refData && !usePalette && !planeFrames)
+    {
+        const uint64_t t1 = StartStage(collector);
+        usePlaneMap = GetPlaneMap(imageData, &planeMap);
+        EndStage(collector, ZPNG_STAGE_DECIDE, t1);
+    }
+
+    // Images that the original header cannot describe are written with the
+    // strip header, as a single strip unless strips were requested
+    unsigned stripRows = ctx ? ctx->StripRows : 0;
+    // The entropy backend applies to I-frames without a dictionary
+    const bool entropy = ctx && ctx->Backend != ZPNG_BACKEND_ZSTD && !refData && !dictionary;
+
+    const bool stream = ctx && ctx->Stream;
+    if (stripRows == 0 && ((entropy && ctx->Backend == ZPNG_BACKEND_AUTO) || usePlaneMap || packFunction || stream) && byteCount > kAutoBackendStripBytes * 2)
+    {
+        const size_t rowBytes = (size_t)imageData->WidthPixels * (usePlaneMap ? planeMap.StoredCount : pixelBytes);
+        const size_t rows = (kAutoBackendStripBytes + rowBytes - 1) / rowBytes;
+        stripRows = rows < kMinStripRows ? kMinStripRows : (unsigned)(rows + (rows & 1));
+    }
+    if (stripRows == 0 && NeedsStripHeader(imageData, ctx, filter, transform, planeFrames, dictionary != nullptr,
+        motion != nullptr || skip != nullptr, entropy, usePalette, usePlaneMap)) {
+        stripRows = imageData->HeightPixels + (imageData->HeightPixels & 1);
+        if (stripRows == 0) {
+            stripRows = 2;
+        }
+    }
+
+    const bool useStrips = stripRows != 0;
+    const size_t maxOutputBytes = ZSTD_compressBound(byteCount + GetOverflowBytes(byteCount, refData != nullptr));
+    const size_t maxBufferBytes = useStrips ?
+        GetStripMaximumBufferSize(byteCount, (unsigned)(((uint64_t)imageData->HeightPixels + stripRows - 1) / stripRows),
+            refData != nullptr) :
+        ZPNG_HEADER_OVERHEAD_BYTES + maxOutputBytes;
+    ZPNG_CompressionContext* tempCtx = nullptr;
+
+    // The output is returned to the caller, so it cannot use context scratch
+    if (bufferOutput->Bytes == 0) {
+        output = AllocateBuffer(maxBufferBytes);
+        CountAllocation(collector);
+    } else if (bufferOutput->Bytes >= maxBufferBytes) {
+        output = bufferOutput->Data;
+    }
+
+    if (!output) {
+ReturnResult:
+        if (bufferOutput->Data != output && output) {
+            FreeBuffer(output);
+        }
+        if (!ctx) {
+            FreeBuffer(packing);
+        }
+        ZPNG_FreeCompressionContext(tempCtx);
+
+        if (ownsStats) {
+            ctx->Collector = nullptr;
+        }
+        if (success && ownsStats && collector)
+        {
+            ZPNG_ImageData written;
+            unsigned writtenStripRows;
+            ReadHeader(*bufferOutput, &written, &writtenStripRows);
+            EndStats(collector, byteCount, bufferOutput->Bytes, written.IsIFrame);
+        }
+        return success;
+    }
+
+    if (useStrips)
+    {
+        // The strip encoder keeps its state on a context
+        if (!ctx) {
+            tempCtx = (ZPNG_CompressionContext*)ZPNG_AllocateCompressionContext();
+            if (!tempCtx) {
+                goto ReturnResult;
+            }
+        }
+
+        const size_t result = CompressStrips(refData, imageData, output, ctx ? ctx : tempCtx, stripRows, filter, transform, planeFrames,
+            usePalette ? &palette : nullptr, usePlaneMap ? &planeMap : nullptr, dictionary, motion, skip);
+        if (result == 0) {
+            goto ReturnResult;
+        }
+
+        bufferOutput->Data = output;
+        bufferOutput->Bytes = result;
+        success = 1;
+        goto ReturnResult;
+    }
+
+    // Images with a dictionary use the strip format to record it, so the
+    // single-frame format below is always compressed without one
+
+    // Large I-frames are filtered and compressed in cache-sized chunks
+    if (ctx && !refData && byteCount >= kStreamMinBytes && IsRowPacked(imageData, pixelBytes))
+    {
+        const size_t result = CompressStreaming(
+            ctx,
+            imageData,
+            pixelBytes,
+            output + ZPNG_HEADER_OVERHEAD_BYTES,
+            maxOutputBytes,
+            nullptr);
+
+        if (ZSTD_isError(result)) {
+            goto ReturnResult;
+        }
+
+        WriteHeader(imageData, false, output);
+
+        bufferOutput->Data = output;
+        bufferOutput->Bytes = ZPNG_HEADER_OVERHEAD_BYTES + result;
+        success = 1;
+        goto ReturnResult;
+    }
+
+    // Space for packing: Only the filtered bytes are compressed, so it is not cleared.
+    if (ctx) {
+        packing = GetScratch(ctx, byteCount + GetOverflowBytes(byteCount, refData != nullptr));
+    } else {
+        packing = AllocateBuffer(byteCount + GetOverflowBytes(byteCount, refData != nullptr));
+    }
+
+    if (!packing) {
+        goto ReturnResult;
+    }
+
+    {
+        size_t overflowCount = 0;
+
+        // Pass 1: Pack and filter data.
+        uint64_t t1 = StartStage(collector);
+        if (refData) {
+            overflowCount = PackImageVideo(refData, imageData, pixelBytes, packing);
+        } else {
+            PackWholeImage(imageData, pixelBytes, packing, ctx && ctx->NonTemporal);
+        }
+        EndStage(collector, ZPNG_STAGE_FILTER, t1);
+        if (refData) {
+            CountOverflow(collector, overflowCount);
+        }
+
+        // Pass 2: Compress the packed/filtered data.
+        t1 = StartStage(collector);
+        const size_t packedBytes = byteCount + overflowCount;
+        size_t result;
+        if (ctx && ctx->Workers <= 1 && packedBytes <= kSmallFrameBytes)
+        {
+            result = CompressSmallFrame(
+                ctx,
+                output + ZPNG_HEADER_OVERHEAD_BYTES,
+                maxOutputBytes,
+                packing,
+                packedBytes);
+        }
+        else if (ctx)
+        {
+            result = CompressWithContext(
+                ctx,
+                output + ZPNG_HEADER_OVERHEAD_BYTES,
+                maxOutputBytes,
+                packing,
+                packedBytes,
+                nullptr);
+        } else
+        {
+            result = ZSTD_compress(
+                output + ZPNG_HEADER_OVERHEAD_BYTES,
+                maxOutputBytes,
+                packing,
+                packedBytes,
+                kCompressionLevel);
+        }
+        EndStage(collector, ZPNG_STAGE_ZSTD, t1);
+
+        if (ZSTD_isError(result)) {
+            goto ReturnResult;
+        }
+
+        // Write header
+
+        WriteHeader(imageData, refData != nullptr, output);
+
+        bufferOutput->Data = output;
+        bufferOutput->Bytes = ZPNG_HEADER_OVERHEAD_BYTES + result;
+        success = 1;
+    }
+
+    goto ReturnResult;
+}
+
+// Compress an I-frame in the progressive format, each part as an image of
+// its own with the context settings.  Returns 1 on success, 0 on failure
+static int CompressProgressive(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* bufferOutput,
+    ZPNG_CompressionContext* ctx,
+    ZPNG_Dictionary** dictionary
+)
+{
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+    if (pixelBytes > 8 || !IsValidPixelFormat(imageData) || !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+
+    ZPNG_ProgressiveLayout layout;
+    GetProgressiveLayout(imageData, ctx->ProgressiveLevels, &layout);
+    const size_t maxBufferBytes = GetProgressiveMaximumBufferSize(imageData, &layout);
+
+    uint8_t* output = nullptr;
+    if (bufferOutput->Bytes == 0) {
+        output = AllocateBuffer(maxBufferBytes);
+    } else if (bufferOutput->Bytes >= maxBufferBytes) {
+        output = bufferOutput->Data;
+    }
+
+    // Cells of each part are gathered into space for the largest one
+    uint8_t* cells = AllocateBuffer(GetLargestPartBytes(&layout, 0));
+    ZPNG_ProgressivePart part;
+
+    ZPNG_StatsCollector statsCollector;
+    ZPNG_StatsCollector* collector = BeginStats(&statsCollector, ctx->Stats);
+    ctx->Collector = collector;
+    CountAllocation(collector);
+    if (bufferOutput->Bytes == 0) {
+        CountAllocation(collector);
+    }
+
+    int success = 0;
+    if (output && cells)
+    {
+        // A new dictionary is trained on the whole image rather than the first part
+        if (dictionary && !*dictionary)
+        {
+            const uint64_t t0 = StartStage(collector);
+            *dictionary = ZPNG_TrainDictionary(imageData, 1, 0, ctx);
+            EndStage(collector, ZPNG_STAGE_DICTIONARY, t0);
+            CountAllocation(collector);
+        }
+        ZPNG_Dictionary** partDictionary = (dictionary && *dictionary) ? dictionary : nullptr;
+
+        uint64_t* offsets = (uint64_t*)(output + sizeof(ZPNG_ProgressiveHeader));
+        offsets[0] = layout.HeaderBytes;
+        success = 1;
+
+        for (unsigned i = 0; i < layout.PartCount && success; ++i)
+        {
+            GetProgressivePart(&layout, i, &part);
+            offsets[i + 1] = offsets[i];
+            if (part.CountX == 0 || part.CountY == 0) {
+                continue;
+            }
+
+            ZPNG_ImageData partImage = GetPartImage(imageData, &layout, &part);
+            partImage.Buffer.Data = cells;
+
+            const uint64_t t0 = StartStage(collector);
+            CopyCells(
+                imageData->Buffer.Data, GetRowStride(imageData, pixelBytes), part.X, part.Y, part.Step,
+                cells, partImage.StrideBytes, 0, 0, 1,
+                part.CountX, part.CountY, layout.Cell, pixelBytes);
+            EndStage(collector, ZPNG_STAGE_FILTER, t0);
+
+            ZPNG_Buffer partOutput;
+            partOutput.Data = output + offsets[i];
+            partOutput.Bytes = maxBufferBytes - (size_t)offsets[i];
+            success = CompressImage(nullptr, &partImage, &partOutput, ctx, partDictionary);
+            offsets[i + 1] = offsets[i] + partOutput.Bytes;
+        }
+    }
+
+    if (success)
+    {
+        ZPNG_ProgressiveHeader* header = (ZPNG_ProgressiveHeader*)output;
+        header->Magic = ZPNG_PROGRESSIVE_HEADER_MAGIC;
+        header->Version = ZPNG_PROGRESSIVE_HEADER_VERSION;
+        header->Levels = (uint8_t)layout.Levels;
+        header->Width = imageData->WidthPixels;
+        header->Height = imageData->HeightPixels;
+        header->Channels = (uint8_t)imageData->Channels;
+        header->BytesPerChannel = (uint8_t)imageData->BytesPerChannel;
+        header->PixelFormat = GetPixelFormatCode(imageData->PixelFormat);
+        header->Reserved = 0;
+
+        const uint64_t* offsets = (const uint64_t*)(output + sizeof(ZPNG_ProgressiveHeader));
+        bufferOutput->Data = output;
+        bufferOutput->Bytes = (size_t)offsets[layout.PartCount];
+    }
+    else if (output != bufferOutput->Data) {
+        FreeBuffer(output);
+    }
+    FreeBuffer(cells);
+
+    ctx->Collector = nullptr;
+    if (success) {
+        EndStats(collector, byteCount, bufferOutput->Bytes, 1);
+    }
+    return success;
+}
+
+int ZPNG_CompressVideoToBuffer(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* bufferOutput,
+    ZPNG_Context* context,
+    ZPNG_Dictionary** dictionary
+)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    ZPNG_Dictionary* contextDict;
+    dictionary = AcquireCallDictionary(ctx, dictionary, &contextDict);
+
+    // The progressive format is for I-frames in the current pixel formats
+    int success;
+    if (ctx && ctx->ProgressiveLevels != 0 && !ctx->PackFunction && !refData && imageData->BytesPerChannel <= 8) {
+        success = CompressProgressive(imageData, bufferOutput, ctx, dictionary);
+    } else {
+        success = CompressImage(refData, imageData, bufferOutput, ctx, dictionary);
+    }
+
+    ZPNG_FreeDictionary(contextDict);
+    return success;
+}
+
+// Strip height CompressStrips() uses for an image with a dictionary
+static unsigned GetDictionaryStripRows(
+    const ZPNG_CompressionContext* ctx,
+    const ZPNG_ImageData* imageData
+)
+{
+    if (ctx && ctx->StripRows != 0) {
+        return ctx->StripRows;
+    }
+    const unsigned height = imageData->HeightPixels;
+    return height > 0 ? height + (height & 1) : 2;
+}
+
+// Sample images packed into strips for TrainDictionary()
+struct ZPNG_DictionarySamples
+{
+    uint8_t* Packing;
+    size_t* StripBytes;
+    unsigned* StripHeights;
+    unsigned StripCount;
+
+    size_t DictionaryBytes;
+    int Level;
+};
+
+static void FreeDictionarySamples(ZPNG_DictionarySamples* samples)
+{
+    FreeBuffer(samples->Packing);
+    free(samples->StripBytes);
+    free(samples->StripHeights);
+}
+
+// Filter the images into strips the same way the context compresses them,
+// so training no longer needs the images.  Returns false on failure
+static bool PackDictionarySamples(
+    const ZPNG_ImageData* images,
+    unsigned imageCount,
+    size_t dictionaryBytes,
+    ZPNG_CompressionContext* ctx,
+    ZPNG_DictionarySamples* samples
+)
+{
+    memset(samples, 0, sizeof(ZPNG_DictionarySamples));
+    if (!images || imageCount == 0) {
+        return false;
+    }
+    samples->DictionaryBytes = dictionaryBytes != 0 ? dictionaryBytes : kDictionaryBytes;
+    samples->Level = ctx ? GetCompressionLevel(&ctx->Params) : kCompressionLevel;
+
+    // Count the strips the images will be compressed as
+    size_t totalBytes = 0;
+    unsigned stripTotal = 0;
+    for (unsigned i = 0; i < imageCount; ++i)
+    {
+        const unsigned pixelBytes = GetPixelBytes(&images[i]);
+        size_t byteCount;
+        if (pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(&images[i]) ||
+            !GetImageBytes(&images[i], pixelBytes, &byteCount)) {
+            return false;
+        }
+
+        const unsigned stripRows = GetDictionaryStripRows(ctx, &images[i]);
+        totalBytes += byteCount;
+        stripTotal += (unsigned)(((uint64_t)images[i].HeightPixels + stripRows - 1) / stripRows);
+    }
+
+    samples->Packing = AllocateBuffer(totalBytes > 0 ? totalBytes : 1);
+    samples->StripBytes = (size_t*)malloc((stripTotal > 0 ? stripTotal : 1) * sizeof(size_t));
+    samples->StripHeights = (unsigned*)malloc((stripTotal > 0 ? stripTotal : 1) * sizeof(unsigned));
+    samples->StripCount = stripTotal;
+    if (!samples->Packing || !samples->StripBytes || !samples->StripHeights) {
+        FreeDictionarySamples(samples);
+        return false;
+    }
+
+    uint8_t* output = samples->Packing;
+    unsigned strip = 0;
+    for (unsigned i = 0; i < imageCount; ++i)
+    {
+        const ZPNG_ImageData* imageData = &images[i];
+        const unsigned pixelBytes = GetPixelBytes(imageData);
+        const unsigned stripRows = GetDictionaryStripRows(ctx, imageData);
+
+        const unsigned transform = GetColorTransform(ctx, imageData, pixelBytes);
+        unsigned filter = ZPNG_FILTER_LEFT;
+        if (ctx && IsPredictable(imageData))
+        {
+            filter = ctx->Filter;
+            if (filter == ZPNG_FILTER_ADAPTIVE) {
+                filter = SelectImageFilter(ctx, imageData, pixelBytes, transform);
+            }
+        }
+
+        for (unsigned row = 0; row < imageData->HeightPixels; row += stripRows, ++strip)
+        {
+            const unsigned rows = (imageData->HeightPixels - row < stripRows) ? imageData->HeightPixels - row : stripRows;
+            const ZPNG_ImageData stripImage = GetStripImage(imageData, pixelBytes, row, rows);
+            if (IsWideImage(imageData)) {
+                PackImageWide(&stripImage, output);
+            } else {
+                PackImageFiltered(&stripImage, pixelBytes, filter, transform, output);
+            }
+
+            samples->StripBytes[strip] = (size_t)rows * imageData->WidthPixels * pixelBytes;
+            samples->StripHeights[strip] = rows;
+            output += samples->StripBytes[strip];
+        }
+    }
+
+    return true;
+}
+
+static ZPNG_DictionaryState* TrainSamples(const ZPNG_DictionarySamples* samples)
+{
+    return TrainDictionary(samples->Packing, samples->StripBytes, samples->StripHeights,
+        samples->StripCount, samples->DictionaryBytes, samples->Level);
+}
+
+ZPNG_Dictionary* ZPNG_TrainDictionary(
+    const ZPNG_ImageData* images,
+    unsigned imageCount,
+    size_t dictionaryBytes,
+    ZPNG_Context* context
+)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+
+    ZPNG_DictionarySamples samples;
+    if (!PackDictionarySamples(images, imageCount, dictionaryBytes, ctx, &samples)) {
+        return nullptr;
+    }
+
+    ZPNG_DictionaryState* dict = TrainSamples(&samples);
+    FreeDictionarySamples(&samples);
+    return (ZPNG_Dictionary*)dict;
+}
+
+// Put a trained dictionary in place, and wake ZPNG_WaitCompressionDictionary()
+static void FinishTraining(ZPNG_CompressionContext* ctx, ZPNG_DictionaryState* dict)
+{
+    ZPNG_DictionaryState* old = nullptr;
+
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    if (dict)
+    {
+        old = ctx->Dictionary;
+        ctx->Dictionary = dict;
+    }
+    ctx->Training = false;
+    ZSTD_pthread_cond_broadcast(&ctx->TrainDone);
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+
+    ZPNG_FreeDictionary((ZPNG_Dictionary*)old);
+}
+
+// Background training job, which owns its samples
+struct ZPNG_TrainingJob
+{
+    ZPNG_CompressionContext* Context;
+    ZPNG_DictionarySamples Samples;
+};
+
+static void TrainInBackground(void* opaque)
+{
+    ZPNG_TrainingJob* job = (ZPNG_TrainingJob*)opaque;
+
+    ZPNG_DictionaryState* dict = TrainSamples(&job->Samples);
+    FreeDictionarySamples(&job->Samples);
+    FinishTraining(job->Context, dict);
+    free(job);
+}
+
+int ZPNG_TrainCompressionDictionary(
+    ZPNG_Context* context,
+    const ZPNG_ImageData* images,
+    unsigned imageCount,
+    size_t dictionaryBytes,
+    int background
+)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    // One dictionary trains at a time
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    const bool busy = ctx->Training;
+    ctx->Training = true;
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+    if (busy) {
+        return 0;
+    }
+
+    ZPNG_TrainingJob* job = nullptr;
+    ZPNG_DictionarySamples samples;
+    if (!PackDictionarySamples(images, imageCount, dictionaryBytes, ctx, &samples)) {
+        goto Failed;
+    }
+
+    if (background)
+    {
+        if (!ctx->TrainPool) {
+            ctx->TrainPool = POOL_create(1, 1);
+        }
+        job = (ZPNG_TrainingJob*)malloc(sizeof(ZPNG_TrainingJob));
+        if (!ctx->TrainPool || !job) {
+            free(job);
+            FreeDictionarySamples(&samples);
+            goto Failed;
+        }
+
+        job->Context = ctx;
+        job->Samples = samples;
+        POOL_add(ctx->TrainPool, TrainInBackground, job);
+        return 1;
+    }
+    else
+    {
+        ZPNG_DictionaryState* dict = TrainSamples(&samples);
+        FreeDictionarySamples(&samples);
+        FinishTraining(ctx, dict);
+        return dict ? 1 : 0;
+    }
+
+Failed:
+    FinishTraining(ctx, nullptr);
+    return 0;
+}
+
+int ZPNG_WaitCompressionDictionary(ZPNG_Context* context)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return 0;
+    }
+
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    while (ctx->Training) {
+        ZSTD_pthread_cond_wait(&ctx->TrainDone, &ctx->DictionaryLock);
+    }
+    const bool ready = ctx->Dictionary != nullptr;
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+
+    return ready ? 1 : 0;
+}
+
+ZPNG_Dictionary* ZPNG_GetCompressionDictionary(ZPNG_Context* context)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ZSTD_pthread_mutex_lock(&ctx->DictionaryLock);
+    ZPNG_DictionaryState* dict = RetainDictionary((ZPNG_Dictionary*)ctx->Dictionary);
+    ZSTD_pthread_mutex_unlock(&ctx->DictionaryLock);
+
+    return (ZPNG_Dictionary*)dict;
+}
+
+ZPNG_Dictionary* ZPNG_LoadDictionary(
+    ZPNG_Buffer buffer,
+    int level
+)
+{
+    if (!buffer.Data || buffer.Bytes == 0 || level > ZSTD_maxCLevel()) {
+        return nullptr;
+    }
+
+    return (ZPNG_Dictionary*)CreateDictionary(buffer.Data, buffer.Bytes, level != 0 ? level : kCompressionLevel);
+}
+
+ZPNG_Buffer ZPNG_SerializeDictionary(
+    const ZPNG_Dictionary* dict
+)
+{
+    const ZPNG_DictionaryState* state = (const ZPNG_DictionaryState*)dict;
+
+    ZPNG_Buffer buffer;
+    buffer.Data = nullptr;
+    buffer.Bytes = 0;
+
+    if (state)
+    {
+        buffer.Data = AllocateBuffer(state->Bytes);
+        if (buffer.Data)
+        {
+            memcpy(buffer.Data, state->Data, state->Bytes);
+            buffer.Bytes = state->Bytes;
+        }
+    }
+
+    return buffer;
+}
+
+unsigned ZPNG_GetDictionaryID(
+    const ZPNG_Dictionary* dict
+)
+{
+    const ZPNG_DictionaryState* state = (const ZPNG_DictionaryState*)dict;
+    return state ? state->Id : 0;
+}
+
+unsigned ZPNG_GetImageDictionaryID(
+    ZPNG_Buffer buffer
+)
+{
+    unsigned stripRows = 0;
+    ZPNG_ImageData imageData;
+
+    // Parts of a progressive image share the dictionary
+    ZPNG_ProgressiveLayout progressive;
+    if (ReadProgressiveHeader(buffer, &imageData, &progressive))
+    {
+        for (unsigned i = 0; i < progressive.PartCount; ++i)
+        {
+            const ZPNG_Buffer part = GetPartBuffer(buffer, i);
+            if (part.Bytes != 0) {
+                return ZPNG_GetImageDictionaryID(part);
+            }
+        }
+        return 0;
+    }
+
+    if (!ReadHeader(buffer, &imageData, &stripRows) || stripRows == 0) {
+        return 0;
+    }
+
+    const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+    if ((header->Flags & ZPNG_STRIP_FLAG_DICTIONARY) == 0) {
+        return 0;
+    }
+
+    ZPNG_StripLayout layout;
+    if (!GetBufferStripLayout(buffer, GetPixelBytes(&imageData), &layout, nullptr) || buffer.Bytes < layout.HeaderBytes) {
+        return 0;
+    }
+
+    uint64_t id;
+    memcpy(&id, buffer.Data + layout.DictionaryOffset, sizeof(id));
+    return (unsigned)id;
+}
+
+// Content size of the Zstd frame in [src, src + srcSize), or
+// ZSTD_CONTENTSIZE_ERROR if it is not there
+static uint64_t GetFrameContentBytes(const uint8_t* src, size_t srcSize)
+{
+    if (IsEntropyFrame(src, srcSize))
+    {
+        ZPNG_EntropyFrameHeader header;
+        memcpy(&header, src, sizeof(header));
+        return header.ContentBytes;
+    }
+    const unsigned long long bytes = ZSTD_getFrameContentSize(src, srcSize);
+    return bytes == ZSTD_CONTENTSIZE_UNKNOWN ? ZSTD_CONTENTSIZE_ERROR : (uint64_t)bytes;
+}
+
+int ZPNG_GetInfo(
+    ZPNG_Buffer buffer,
+    ZPNG_ImageInfo* info
+)
+{
+    unsigned stripRows = 0;
+    ZPNG_ImageData imageData;
+    if (!info) {
+        return 0;
+    }
+
+    // A progressive image is described by the sum of its parts
+    ZPNG_ProgressiveLayout progressive;
+    if (ReadProgressiveHeader(buffer, &imageData, &progressive))
+    {
+        ZPNG_ImageInfo total;
+        memset(&total, 0, sizeof(total));
+        for (unsigned i = 0; i < progressive.PartCount; ++i)
+        {
+            const ZPNG_Buffer part = GetPartBuffer(buffer, i);
+            ZPNG_ImageInfo partInfo;
+            if (part.Bytes == 0) {
+                continue;
+            }
+            if (!ZPNG_GetInfo(part, &partInfo)) {
+                return 0;
+            }
+
+            total.ImageBytes += partInfo.ImageBytes;
+            total.ContentBytes += partInfo.ContentBytes;
+            total.StripCount += partInfo.StripCount;
+            total.DictionaryID = partInfo.DictionaryID;
+            if (partInfo.PaletteColors > total.PaletteColors) {
+                total.PaletteColors = partInfo.PaletteColors;
+            }
+            if (partInfo.ElidedChannels > total.ElidedChannels) {
+                total.ElidedChannels = partInfo.ElidedChannels;
+            }
+            if (partInfo.ColorTransform != ZPNG_COLOR_GB_RG) {
+                total.ColorTransform = partInfo.ColorTransform;
+            }
+        }
+
+        info->WidthPixels = imageData.WidthPixels;
+        info->HeightPixels = imageData.HeightPixels;
+        info->Channels = imageData.Channels;
+        info->BytesPerChannel = imageData.BytesPerChannel;
+        info->PixelFormat = imageData.PixelFormat;
+        info->IsIFrame = 1;
+        info->ImageBytes = total.ImageBytes;
+        info->ContentBytes = total.ContentBytes;
+        info->StripCount = total.StripCount;
+        info->DictionaryID = total.DictionaryID;
+        info->Levels = progressive.Levels;
+        info->PaletteColors = total.PaletteColors;
+        info->ElidedChannels = total.ElidedChannels;
+        info->ColorTransform = total.ColorTransform;
+        info->MotionBlockPixels = 0;
+        info->SkippedBlocks = 0;
+        return 1;
+    }
+
+    if (!ReadHeader(buffer, &imageData, &stripRows)) {
+        return 0;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(&imageData);
+    const uint64_t imageBytes = (uint64_t)imageData.WidthPixels * imageData.HeightPixels * pixelBytes;
+    uint64_t contentBytes = 0;
+    uint64_t expectedBytes = imageBytes;
+    unsigned stripCount = 0;
+    unsigned dictionaryId = 0;
+    unsigned paletteColors = 0;
+    unsigned elidedChannels = 0;
+    unsigned colorTransform = ZPNG_COLOR_GB_RG;
+    unsigned motionBlockPixels = 0;
+    unsigned skippedBlocks = 0;
+
+    if (stripRows == 0)
+    {
+        contentBytes = GetFrameContentBytes(
+            buffer.Data + ZPNG_HEADER_OVERHEAD_BYTES,
+            buffer.Bytes - ZPNG_HEADER_OVERHEAD_BYTES);
+        if (contentBytes == ZSTD_CONTENTSIZE_ERROR) {
+            return 0;
+        }
+    }
+    else
+    {
+        const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+        const bool hasDictionary = (header->Flags & ZPNG_STRIP_FLAG_DICTIONARY) != 0;
+
+        ZPNG_StripLayout layout;
+        if (!GetBufferStripLayout(buffer, pixelBytes, &layout, nullptr) || !CheckStripOffsets(buffer, &layout)) {
+            return 0;
+        }
+
+        // Palette images store an index per pixel instead, and constant
+        // planes images only some of the channels
+        paletteColors = layout.PaletteColors;
+        expectedBytes = GetPackedBytes(&layout, imageData.WidthPixels, imageData.HeightPixels);
+        if (layout.PlaneMapOffset != 0) {
+            elidedChannels = imageData.Channels - layout.StoredPixelBytes;
+        }
+        // Delta frames flag their sections in place of the transform
+        colorTransform = header->Filter >> kColorTransformShift;
+        if (HasStripMotion(header))
+        {
+            colorTransform = ZPNG_COLOR_GB_RG;
+            motionBlockPixels = kMotionBlockPixels;
+        }
+
+        // Skipped blocks are left out of the frames
+        if (HasStripSkip(header))
+        {
+            colorTransform = ZPNG_COLOR_GB_RG;
+            ZPNG_BlockMapHeader section;
+            memcpy(&section, buffer.Data + layout.SkipOffset, sizeof(section));
+
+            ZPNG_SkipMap skip;
+            skip.Width = imageData.WidthPixels;
+            skip.BlocksX = GetMotionBlocks(imageData.WidthPixels);
+            skip.BlocksY = GetMotionBlocks(imageData.HeightPixels);
+            skip.Bits = IsSkippable(&imageData) ? AllocateBuffer(GetSkipMapBytes(&skip)) : nullptr;
+            const bool read = skip.Bits &&
+                ReadSkipMap(buffer.Data + layout.SkipOffset + sizeof(section), section.StoredBytes, nullptr, &skip);
+            if (read)
+            {
+                expectedBytes = GetChangedPixels(&skip, 0, imageData.HeightPixels) * pixelBytes;
+                skippedBlocks = CountSkippedBlocks(&skip);
+            }
+            FreeBuffer(skip.Bits);
+            if (!read) {
+                return 0;
+            }
+        }
+
+        const uint64_t* offsets = (const uint64_t*)(buffer.Data + sizeof(ZPNG_StripHeader));
+        for (unsigned i = 0; i < layout.FrameCount; ++i)
+        {
+            const uint64_t bytes = GetFrameContentBytes(buffer.Data + offsets[i], (size_t)(offsets[i + 1] - offsets[i]));
+            if (bytes == ZSTD_CONTENTSIZE_ERROR) {
+                return 0;
+            }
+            contentBytes += bytes;
+        }
+
+        if (hasDictionary)
+        {
+            uint64_t id;
+            memcpy(&id, buffer.Data + layout.DictionaryOffset, sizeof(id));
+            dictionaryId = (unsigned)id;
+        }
+        stripCount = layout.StripCount;
+    }
+
+    // Every pixel is in the frames, and only delta frames add escapes
+    if (contentBytes < expectedBytes || (imageData.IsIFrame && contentBytes != expectedBytes)) {
+        return 0;
+    }
+
+    info->WidthPixels = imageData.WidthPixels;
+    info->HeightPixels = imageData.HeightPixels;
+    info->Channels = imageData.Channels;
+    info->BytesPerChannel = imageData.BytesPerChannel;
+    info->PixelFormat = imageData.PixelFormat;
+    info->IsIFrame = imageData.IsIFrame;
+    info->ImageBytes = imageBytes;
+    info->ContentBytes = contentBytes;
+    info->StripCount = stripCount;
+    info->DictionaryID = dictionaryId;
+    info->Levels = 0;
+    info->PaletteColors = paletteColors;
+    info->ElidedChannels = elidedChannels;
+    info->ColorTransform = colorTransform;
+    info->MotionBlockPixels = motionBlockPixels;
+    info->SkippedBlocks = skippedBlocks;
+    return 1;
+}
+
+ZPNG_ImageData ZPNG_Decompress(
+    ZPNG_Buffer buffer
+)
+{
+    return ZPNG_DecompressVideo(nullptr, buffer);
+}
+
+// Returns true if refData can be read as the reference of a delta frame of
+// the format in imageData: The same size and pixel bytes, with every row in
+// its buffer.  The kernels trust this, so it is checked once per frame
+static bool IsReferenceUsable(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData
+)
+{
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    if (!refData || !refData->Buffer.Data || refData->WidthPixels != imageData->WidthPixels ||
+        refData->HeightPixels != imageData->HeightPixels || GetPixelBytes(refData) != pixelBytes) {
+        return false;
+    }
+    if (imageData->HeightPixels == 0) {
+        return true;
+    }
+
+    // Written as a division so a huge stride cannot wrap around
+    const size_t rowBytes = (size_t)imageData->WidthPixels * pixelBytes;
+    const size_t stride = GetRowStride(refData, pixelBytes);
+    if (refData->Buffer.Bytes < rowBytes) {
+        return false;
+    }
+    return imageData->HeightPixels == 1 ||
+        (refData->Buffer.Bytes - rowBytes) / (imageData->HeightPixels - 1) >= stride;
+}
+
+// Decompress into imageData->Buffer, which must hold the full image.
+// The other imageData fields must already be set by ReadHeader().
+// Returns 1 on success, 0 on failure
+static int DecodeImage(
+    ZPNG_DecompressionState* state,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    unsigned stripRows
+)
+{
+    // Delta frames can only be decoded relative to a reference of their format
+    if (!imageData->IsIFrame && !IsReferenceUsable(refData, imageData)) {
+        return 0;
+    }
+
+    if (stripRows != 0) {
+        return DecompressStrips(state, refData, buffer, imageData, nullptr, -1);
+    }
+
+    // The single-frame format is not unfiltered by strips
+    if (state->UnpackFunction) {
+        return 0;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    const size_t byteCount = (size_t)imageData->WidthPixels * imageData->HeightPixels * pixelBytes;
+
+    // Large I-frames are decompressed and unfiltered in cache-sized chunks
+    if (imageData->IsIFrame && byteCount >= kStreamMinBytes && IsRowPacked(imageData, pixelBytes))
+    {
+        return DecompressStreaming(
+            state,
+            buffer.Data + ZPNG_HEADER_OVERHEAD_BYTES,
+            buffer.Bytes - ZPNG_HEADER_OVERHEAD_BYTES,
+            pixelBytes,
+            imageData,
+            nullptr);
+    }
+
+    // Space for packing
+    const size_t packingBytes = byteCount + GetOverflowBytes(byteCount, !imageData->IsIFrame);
+    uint8_t* packing = GetScratch(state, packingBytes);
+
+    if (!packing || !EnsureDecompressionWorkers(state, 1)) {
+        return 0;
+    }
+
+    // Stage 1: Decompress back to packing buffer
+
+    const uint8_t* src = buffer.Data + ZPNG_HEADER_OVERHEAD_BYTES;
+    const size_t srcSize = buffer.Bytes - ZPNG_HEADER_OVERHEAD_BYTES;
+    uint64_t t0 = StartStage(state->Collector);
+    const size_t result = DecompressFrame(
+        state->DCtx[0],
+        GetFrameDDict(state, src, srcSize),
+        packing,
+        packingBytes,
+        src,
+        srcSize);
+    EndStage(state->Collector, ZPNG_STAGE_ZSTD, t0);
+
+    if (ZSTD_isError(result) || result < byteCount) {
+        return 0;
+    }
+
+    // Stage 2: Unpack/Unfilter
+
+    t0 = StartStage(state->Collector);
+    int success = 1;
+    if (!imageData->IsIFrame) {
+        const size_t overflowCount = result - byteCount;
+        success = UnpackImageVideo(refData, packing, pixelBytes, overflowCount, imageData) ? 1 : 0;
+        CountOverflow(state->Collector, overflowCount);
+    } else {
+        UnpackImage(packing, pixelBytes, imageData);
+    }
+    EndStage(state->Collector, ZPNG_STAGE_FILTER, t0);
+
+    return success;
+}
+
+// Decode level `level` of a progressive image into imageData->Buffer, which
+// must hold the level with rows StrideBytes apart.  Only the parts the
+// level needs are decompressed.  Returns 1 on success, 0 on failure
+static int DecodeProgressive(
+    ZPNG_DecompressionState* state,
+    ZPNG_Buffer buffer,
+    const ZPNG_ProgressiveLayout* layout,
+    unsigned level,
+    ZPNG_ImageData* imageData
+)
+{
+    // Parts are unfiltered into cells here and then copied
+    if (state->UnpackFunction) {
+        return 0;
+    }
+
+    const size_t cellBytes = GetLargestPartBytes(layout, level);
+    uint8_t* cells = AllocateBuffer(cellBytes);
+    CountAllocation(state->Collector);
+    if (!cells) {
+        return 0;
+    }
+
+    int success = 1;
+    for (unsigned i = 0; i < layout->PartCount && success; ++i)
+    {
+        ZPNG_ProgressivePart part;
+        GetProgressivePart(layout, i, &part);
+
+        // Parts run from coarse to fine, so the rest are not needed
+        if (i != 0 && part.Level < level) {
+            break;
+        }
+        if (part.CountX == 0 || part.CountY == 0) {
+            continue;
+        }
+
+        const ZPNG_Buffer partBuffer = GetPartBuffer(buffer, i);
+        unsigned stripRows;
+        ZPNG_ImageData partImage;
+        if (!ReadHeader(partBuffer, &partImage, &stripRows)) {
+            success = 0;
+            break;
+        }
+        partImage.Buffer.Data = cells;
+        partImage.Buffer.Bytes = cellBytes;
+
+        success = DecodeImage(state, nullptr, partBuffer, &partImage, stripRows);
+        if (!success) {
+            break;
+        }
+
+        const uint64_t t0 = StartStage(state->Collector);
+        if (level <= part.Level)
+        {
+            CopyCells(
+                cells, partImage.StrideBytes, 0, 0, 1,
+                imageData->Buffer.Data, imageData->StrideBytes, part.X >> level, part.Y >> level, part.Step >> level,
+                part.CountX, part.CountY, layout->Cell, layout->PixelBytes);
+        }
+        else
+        {
+            // Levels below the coarsest stored one are subsampled from it
+            CopyCells(
+                cells, partImage.StrideBytes, 0, 0, 1u << (level - layout->Levels),
+                imageData->Buffer.Data, imageData->StrideBytes, 0, 0, 1,
+                GetLevelCells(layout->CellsX, level), GetLevelCells(layout->CellsY, level), layout->Cell, layout->PixelBytes);
+        }
+        EndStage(state->Collector, ZPNG_STAGE_FILTER, t0);
+    }
+
+    FreeBuffer(cells);
+    return success;
+}
+
+static ZPNG_ImageData DecompressWithState(
+    ZPNG_DecompressionState* state,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer
+)
+{
+    unsigned stripRows = 0;
+
+    ZPNG_ImageData imageData;
+    imageData.Buffer.Data = nullptr;
+    imageData.Buffer.Bytes = 0;
+    imageData.BytesPerChannel = 0;
+    imageData.Channels = 0;
+    imageData.HeightPixels = 0;
+    imageData.StrideBytes = 0;
+    imageData.WidthPixels = 0;
+    imageData.IsIFrame = 1;
+    imageData.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    ZPNG_ProgressiveLayout progressive;
+    const bool isProgressive = ReadProgressiveHeader(buffer, &imageData, &progressive) != 0;
+    if (!isProgressive && !ReadHeader(buffer, &imageData, &stripRows)) {
+        imageData.IsIFrame = 1;
+        return imageData;
+    }
+
+    // The header is checked against the frame content sizes and the
+    // reference before it sizes the output
+    ZPNG_ImageInfo info;
+    size_t byteCount;
+    if (!GetImageBytes(&imageData, GetPixelBytes(&imageData), &byteCount) || !ZPNG_GetInfo(buffer, &info) ||
+        (!imageData.IsIFrame && !IsReferenceUsable(refData, &imageData))) {
+        return imageData;
+    }
+
+    ZPNG_StatsCollector statsCollector;
+    state->Collector = BeginStats(&statsCollector, state->Stats);
+
+    // Space for output: Every byte is overwritten so it is not cleared
+    uint8_t* output = AllocateBuffer(byteCount);
+    CountAllocation(state->Collector);
+
+    if (output)
+    {
+        imageData.Buffer.Data = output;
+        imageData.Buffer.Bytes = byteCount;
+
+        const int success = isProgressive ?
+            DecodeProgressive(state, buffer, &progressive, 0, &imageData) :
+            DecodeImage(state, refData, buffer, &imageData, stripRows);
+        if (success) {
+            EndStats(state->Collector, buffer.Bytes, byteCount, imageData.IsIFrame);
+        }
+        else
+        {
+            FreeBuffer(output);
+            imageData.Buffer.Data = nullptr;
+            imageData.Buffer.Bytes = 0;
+        }
+    }
+
+    state->Collector = nullptr;
+    return imageData;
+}
+
+ZPNG_ImageData ZPNG_DecompressVideo(
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer
+)
+{
+    ZPNG_DecompressionState state;
+    InitDecompressionState(&state);
+
+    ZPNG_ImageData imageData = DecompressWithState(&state, refData, buffer);
+
+    FreeDecompressionState(&state);
+    return imageData;
+}
+
+ZPNG_ImageData ZPNG_DecompressWithContext(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer
+)
+{
+    ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+    if (!state) {
+        return ZPNG_DecompressVideo(refData, buffer);
+    }
+
+    return DecompressWithState(state, refData, buffer);
+}
+
+// ZPNG_DecompressToBuffer(), or ZPNG_DecompressInPlace() with the reference
+// taken from imageData if inPlace is set
+static int DecodeToBuffer(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData,
+    bool inPlace
+)
+{
+    if (!imageData || !imageData->Buffer.Data) {
+        return 0;
+    }
+
+    unsigned stripRows = 0;
+    ZPNG_ImageData header = *imageData;
+    ZPNG_ProgressiveLayout progressive;
+    const bool isProgressive = ReadProgressiveHeader(buffer, &header, &progressive) != 0;
+    if (!isProgressive && !ReadHeader(buffer, &header, &stripRows)) {
+        return 0;
+    }
+
+    // Rows are written StrideBytes apart if the caller asked for padding
+    const size_t rowBytes = header.StrideBytes;
+    const size_t stride = imageData->StrideBytes > rowBytes ? imageData->StrideBytes : rowBytes;
+    const size_t requiredBytes = (header.HeightPixels == 0) ? 0 : stride * (header.HeightPixels - 1) + rowBytes;
+    if (imageData->Buffer.Bytes < requiredBytes) {
+        return 0;
+    }
+    header.Buffer.Bytes = requiredBytes;
+    header.StrideBytes = (unsigned)stride;
+
+    // Delta frames decoded in place must have the format of the frame the
+    // buffer holds, which is then read through the same rows it is written to
+    ZPNG_ImageData inPlaceRef;
+    if (inPlace)
+    {
+        if (!header.IsIFrame && (imageData->WidthPixels != header.WidthPixels ||
+            imageData->HeightPixels != header.HeightPixels || imageData->Channels != header.Channels ||
+            imageData->BytesPerChannel != header.BytesPerChannel || imageData->PixelFormat != header.PixelFormat)) {
+            return 0;
+        }
+        inPlaceRef = header;
+        refData = &inPlaceRef;
+    }
+
+    int success;
+    if (context)
+    {
+        ZPNG_DecompressionState* state = (ZPNG_DecompressionState*)context;
+        ZPNG_StatsCollector statsCollector;
+        state->Collector = BeginStats(&statsCollector, state->Stats);
+
+        success = isProgressive ?
+            DecodeProgressive(state, buffer, &progressive, 0, &header) :
+            DecodeImage(state, refData, buffer, &header, stripRows);
+        if (success) {
+            EndStats(state->Collector, buffer.Bytes, (uint64_t)header.WidthPixels * header.HeightPixels * GetPixelBytes(&header), header.IsIFrame);
+        }
+        state->Collector = nullptr;
+    }
+    else
+    {
+        ZPNG_DecompressionState state;
+        InitDecompressionState(&state);
+        success = isProgressive ?
+            DecodeProgressive(&state, buffer, &progressive, 0, &header) :
+            DecodeImage(&state, refData, buffer, &header, stripRows);
+        FreeDecompressionState(&state);
+    }
+
+    if (success) {
+        *imageData = header;
+    }
+    return success;
+}
+
+int ZPNG_DecompressToBuffer(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData
+)
+{
+    return DecodeToBuffer(context, refData, buffer, imageData, false);
+}
+
+int ZPNG_DecompressInPlace(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* frame
+)
+{
+    return DecodeToBuffer(context, nullptr, buffer, frame, true);
+}
+
+// Decode an I-frame a band of rows at a time into the sink, keeping one
+// strip or chunk resident where the format allows it.
+// Returns 1 on success, 0 on failure or if the sink stopped
+static int DecodeRows(
+    ZPNG_DecompressionState* state,
+    ZPNG_Buffer buffer,
+    const ZPNG_RowSink* sink
+)
+{
+    unsigned stripRows = 0;
+
+    ZPNG_ImageData imageData;
+    imageData.Buffer.Data = nullptr;
+    imageData.Buffer.Bytes = 0;
+    imageData.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    ZPNG_ImageInfo info;
+    if (!ReadHeader(buffer, &imageData, &stripRows) || !imageData.IsIFrame || !ZPNG_GetInfo(buffer, &info)) {
+        return 0;
+    }
+
+    const unsigned height = imageData.HeightPixels;
+    const unsigned pixelBytes = GetPixelBytes(&imageData);
+    const size_t rowBytes = imageData.StrideBytes;
+    if (height == 0) {
+        return 1;
+    }
+
+    if (stripRows != 0)
+    {
+        // Strip format: Decode one strip at a time into a band buffer
+        ZPNG_StripDecoder dec;
+        const unsigned bandRows = stripRows < height ? stripRows : height;
+        uint8_t* band = AllocateBuffer(bandRows * rowBytes);
+        if (!band) {
+            return 0;
+        }
+
+        imageData.Buffer.Data = band;
+        imageData.Buffer.Bytes = bandRows * rowBytes;
+
+        int success = InitStripDecoder(&dec, state, nullptr, buffer, &imageData, nullptr, -1);
+        for (unsigned strip = 0; success && strip < dec.Layout.StripCount; ++strip)
+        {
+            dec.FirstRow = strip * stripRows;
+            success = RunStripDecoder(state, &dec, strip, 1);
+
+            ZPNG_ImageData bandImage = imageData;
+            bandImage.HeightPixels = GetStripRowCount(&dec.Layout, height, strip);
+            bandImage.Buffer.Bytes = bandImage.HeightPixels * rowBytes;
+            success = success && sink->Function(sink->Opaque, &bandImage, dec.FirstRow);
+        }
+
+        FreeBuffer(band);
+        return success;
+    }
+
+    if (IsRowPacked(&imageData, pixelBytes))
+    {
+        return DecompressStreaming(
+            state,
+            buffer.Data + ZPNG_HEADER_OVERHEAD_BYTES,
+            buffer.Bytes - ZPNG_HEADER_OVERHEAD_BYTES,
+            pixelBytes,
+            &imageData,
+            sink);
+    }
+
+    // The planes of the single-frame format span the whole image, so it is
+    // decoded in full and then handed out a chunk of rows at a time
+    size_t byteCount;
+    if (!GetImageBytes(&imageData, pixelBytes, &byteCount)) {
+        return 0;
+    }
+    uint8_t* output = AllocateBuffer(byteCount);
+    if (!output) {
+        return 0;
+    }
+    imageData.Buffer.Data = output;
+    imageData.Buffer.Bytes = byteCount;
+
+    int success = DecodeImage(state, nullptr, buffer, &imageData, 0);
+
+    const unsigned chunkRows = GetStreamChunkRows(rowBytes);
+    for (unsigned row = 0; success && row < height; row += chunkRows)
+    {
+        const unsigned rows = (height - row < chunkRows) ? height - row : chunkRows;
+        const ZPNG_ImageData band = GetStripImage(&imageData, pixelBytes, row, rows);
+        success = sink->Function(sink->Opaque, &band, row);
+    }
+
+    FreeBuffer(output);
+    return success;
+}
+
+int ZPNG_DecompressRows(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Buffer buffer,
+    ZPNG_RowFunction sink,
+    void* opaque
+)
+{
+    if (!sink) {
+        return 0;
+    }
+
+    ZPNG_RowSink rowSink;
+    rowSink.Function = sink;
+    rowSink.Opaque = opaque;
+
+    if (context) {
+        return DecodeRows((ZPNG_DecompressionState*)context, buffer, &rowSink);
+    }
+
+    ZPNG_DecompressionState state;
+    InitDecompressionState(&state);
+    const int success = DecodeRows(&state, buffer, &rowSink);
+    FreeDecompressionState(&state);
+    return success;
+}
+
+ZPNG_ImageData ZPNG_DecompressRegion(
+    ZPNG_Buffer buffer,
+    unsigned x,
+    unsigned y,
+    unsigned width,
+    unsigned height
+)
+{
+    unsigned stripRows = 0;
+
+    ZPNG_ImageData imageData;
+    imageData.Buffer.Data = nullptr;
+    imageData.Buffer.Bytes = 0;
+    imageData.BytesPerChannel = 0;
+    imageData.Channels = 0;
+    imageData.HeightPixels = 0;
+    imageData.StrideBytes = 0;
+    imageData.WidthPixels = 0;
+    imageData.IsIFrame = 1;
+    imageData.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    ZPNG_ImageInfo info;
+    if (!ReadHeader(buffer, &imageData, &stripRows) || !imageData.IsIFrame || !ZPNG_GetInfo(buffer, &info)) {
+        imageData.IsIFrame = 1;
+        return imageData;
+    }
+
+    const unsigned imageWidth = imageData.WidthPixels;
+    const unsigned imageHeight = imageData.HeightPixels;
+    if (width == 0 || height == 0 ||
+        x >= imageWidth || width > imageWidth - x ||
+        y >= imageHeight || height > imageHeight - y) {
+        return imageData;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(&imageData);
+    const size_t byteCount = (size_t)width * height * pixelBytes;
+
+    imageData.WidthPixels = width;
+    imageData.HeightPixels = height;
+    imageData.StrideBytes = width * pixelBytes;
+
+    if (stripRows == 0)
+    {
+        // Single-frame format: Decode everything and crop
+        ZPNG_ImageData full = ZPNG_Decompress(buffer);
+        if (!full.Buffer.Data) {
+            return imageData;
+        }
+
+        uint8_t* output = AllocateBuffer(byteCount);
+        if (output)
+        {
+            const size_t copyBytes = (size_t)width * pixelBytes;
+            for (unsigned row = 0; row < height; ++row)
+            {
+                memcpy(
+                    output + row * copyBytes,
+                    full.Buffer.Data + ((size_t)(y + row) * imageWidth + x) * pixelBytes,
+                    copyBytes);
+            }
+
+            imageData.Buffer.Data = output;
+            imageData.Buffer.Bytes = byteCount;
+        }
+
+        ZPNG_Free(&full.Buffer);
+        return imageData;
+    }
+
+    uint8_t* output = AllocateBuffer(byteCount);
+    if (!output) {
+        return imageData;
+    }
+
+    imageData.Buffer.Data = output;
+    imageData.Buffer.Bytes = byteCount;
+
+    ZPNG_Region region;
+    region.X = x;
+    region.Y = y;
+    region.Width = width;
+    region.Height = height;
+
+    ZPNG_DecompressionState state;
+    InitDecompressionState(&state);
+
+    if (!DecompressStrips(&state, nullptr, buffer, &imageData, &region, -1))
+    {
+        FreeBuffer(output);
+        imageData.Buffer.Data = nullptr;
+        imageData.Buffer.Bytes = 0;
+    }
+
+    FreeDecompressionState(&state);
+
+    return imageData;
+}
+
+ZPNG_ImageData ZPNG_DecompressChannel(
+    ZPNG_Buffer buffer,
+    unsigned channel
+)
+{
+    unsigned stripRows = 0;
+
+    ZPNG_ImageData imageData;
+    imageData.Buffer.Data = nullptr;
+    imageData.Buffer.Bytes = 0;
+    imageData.BytesPerChannel = 0;
+    imageData.Channels = 0;
+    imageData.HeightPixels = 0;
+    imageData.StrideBytes = 0;
+    imageData.WidthPixels = 0;
+    imageData.IsIFrame = 1;
+    imageData.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    ZPNG_ImageInfo info;
+    if (!ReadHeader(buffer, &imageData, &stripRows) || !imageData.IsIFrame || !ZPNG_GetInfo(buffer, &info)) {
+        imageData.IsIFrame = 1;
+        return imageData;
+    }
+
+    if (channel >= imageData.Channels) {
+        return imageData;
+    }
+    if (imageData.Channels == 1) {
+        return ZPNG_Decompress(buffer);
+    }
+
+    const unsigned width = imageData.WidthPixels;
+    const unsigned height = imageData.HeightPixels;
+    // Older Bayer images have BytesPerChannel > 8 for 8-bit channels
+    const unsigned pixelBytes = GetPixelBytes(&imageData);
+    const unsigned channelBytes = pixelBytes / imageData.Channels;
+    const size_t byteCount = (size_t)width * height * channelBytes;
+
+    uint8_t* output = AllocateBuffer(byteCount);
+    if (!output) {
+        return imageData;
+    }
+
+    if (stripRows != 0 && GetFramesPerStrip((const ZPNG_StripHeader*)buffer.Data) != 1)
+    {
+        // Plane frames: Only decompress the planes this channel depends on
+        imageData.Buffer.Data = output;
+        imageData.Buffer.Bytes = byteCount;
+
+        ZPNG_DecompressionState state;
+        InitDecompressionState(&state);
+        const int success = DecompressStrips(&state, nullptr, buffer, &imageData, nullptr, (int)channel);
+        FreeDecompressionState(&state);
+
+        if (!success)
+        {
+            FreeBuffer(output);
+            imageData.Buffer.Data = nullptr;
+            imageData.Buffer.Bytes = 0;
+        }
+    }
+    else
+    {
+        // Otherwise decode everything and pick out the channel
+        ZPNG_ImageData full = ZPNG_Decompress(buffer);
+        if (!full.Buffer.Data) {
+            FreeBuffer(output);
+            return imageData;
+        }
+
+        const uint8_t* input = full.Buffer.Data + channel * channelBytes;
+        const size_t pixelCount = (size_t)width * height;
+        for (size_t i = 0; i < pixelCount; ++i) {
+            memcpy(output + i * channelBytes, input + i * pixelBytes, channelBytes);
+        }
+
+        ZPNG_Free(&full.Buffer);
+
+        imageData.Buffer.Data = output;
+        imageData.Buffer.Bytes = byteCount;
+    }
+
+    imageData.Channels = 1;
+    imageData.StrideBytes = width * channelBytes;
+    return imageData;
+}
+
+ZPNG_ImageData ZPNG_DecompressLevel(
+    ZPNG_Buffer buffer,
+    unsigned level
+)
+{
+    ZPNG_ImageData imageData;
+    imageData.Buffer.Data = nullptr;
+    imageData.Buffer.Bytes = 0;
+    imageData.BytesPerChannel = 0;
+    imageData.Channels = 0;
+    imageData.HeightPixels = 0;
+    imageData.StrideBytes = 0;
+    imageData.WidthPixels = 0;
+    imageData.IsIFrame = 1;
+    imageData.PixelFormat = ZPNG_PIXEL_FORMAT_DEFAULT;
+
+    ZPNG_ProgressiveLayout progressive;
+    const bool isProgressive = ReadProgressiveHeader(buffer, &imageData, &progressive) != 0;
+    if (level == 0 && !isProgressive) {
+        return ZPNG_Decompress(buffer);
+    }
+    ZPNG_ImageInfo info;
+    if (level >= 32 || (isProgressive && !ZPNG_GetInfo(buffer, &info))) {
+        return imageData;
+    }
+
+    // Otherwise decode everything and subsample it
+    ZPNG_ImageData full = imageData;
+    if (!isProgressive)
+    {
+        full = ZPNG_Decompress(buffer);
+        if (!full.Buffer.Data) {
+            return imageData;
+        }
+        imageData = full;
+        imageData.Buffer.Data = nullptr;
+        imageData.Buffer.Bytes = 0;
+
+        GetProgressiveLayout(&full, 0, &progressive);
+    }
+
+    const unsigned cell = progressive.Cell;
+    const unsigned pixelBytes = progressive.PixelBytes;
+    imageData.WidthPixels = GetLevelCells(progressive.CellsX, level) * cell;
+    imageData.HeightPixels = GetLevelCells(progressive.CellsY, level) * cell;
+    imageData.StrideBytes = imageData.WidthPixels * pixelBytes;
+    const size_t byteCount = (size_t)imageData.StrideBytes * imageData.HeightPixels;
+
+    uint8_t* output = AllocateBuffer(byteCount > 0 ? byteCount : 1);
+    int success = 0;
+    if (output)
+    {
+        imageData.Buffer.Data = output;
+        imageData.Buffer.Bytes = byteCount;
+
+        if (isProgressive)
+        {
+            ZPNG_DecompressionState state;
+            InitDecompressionState(&state);
+            success = DecodeProgressive(&state, buffer, &progressive, level, &imageData);
+            FreeDecompressionState(&state);
+        }
+        else
+        {
+            CopyCells(
+                full.Buffer.Data, full.StrideBytes, 0, 0, 1u << level,
+                output, imageData.StrideBytes, 0, 0, 1,
+                GetLevelCells(progressive.CellsX, level), GetLevelCells(progressive.CellsY, level), cell, pixelBytes);
+            success = 1;
+        }
+    }
+    ZPNG_Free(&full.Buffer);
+
+    if (!success)
+    {
+        FreeBuffer(output);
+        imageData.Buffer.Data = nullptr;
+        imageData.Buffer.Bytes = 0;
+    }
+    return imageData;
+}
+
+int ZPNG_VerifyChecksum(
+    ZPNG_Buffer buffer
+)
+{
+    unsigned stripRows = 0;
+    ZPNG_ImageData imageData;
+
+    // Every part of a progressive image has its own checksum
+    ZPNG_ProgressiveLayout progressive;
+    if (ReadProgressiveHeader(buffer, &imageData, &progressive))
+    {
+        unsigned verified = 0;
+        for (unsigned i = 0; i < progressive.PartCount; ++i)
+        {
+            const ZPNG_Buffer part = GetPartBuffer(buffer, i);
+            if (part.Bytes == 0) {
+                continue;
+            }
+            if (!ZPNG_VerifyChecksum(part)) {
+                return 0;
+            }
+            ++verified;
+        }
+        return verified != 0;
+    }
+
+    if (!ReadHeader(buffer, &imageData, &stripRows) || stripRows == 0) {
+        return 0;
+    }
+
+    const ZPNG_StripHeader* header = (const ZPNG_StripHeader*)buffer.Data;
+    if ((header->Flags & ZPNG_STRIP_FLAG_CHECKSUM) == 0) {
+        return 0;
+    }
+
+    ZPNG_StripLayout layout;
+    return GetBufferStripLayout(buffer, GetPixelBytes(&imageData), &layout, nullptr) && CheckStripTable(buffer, &layout);
+}
+
+// Check the rows and format given to ZPNG_PackRows() or ZPNG_UnpackRows()
+static bool IsPackableRows(
+    const ZPNG_ImageData* imageData,
+    unsigned firstRow,
+    unsigned rows
+)
+{
+    if (!imageData || !imageData->Buffer.Data) {
+        return false;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+    if (pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(imageData) ||
+        !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return false;
+    }
+
+    // Bayer quads span two rows
+    if (GetBayerFormat(imageData) != ZPNG_PIXEL_FORMAT_DEFAULT && ((firstRow | rows) & 1) != 0) {
+        return false;
+    }
+    return firstRow <= imageData->HeightPixels && rows <= imageData->HeightPixels - firstRow;
+}
+
+int ZPNG_PackRows(
+    const ZPNG_ImageData* imageData,
+    unsigned firstRow,
+    unsigned rows,
+    void* packing
+)
+{
+    if (!packing || !IsPackableRows(imageData, firstRow, rows)) {
+        return 0;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    const ZPNG_ImageData stripImage = GetStripImage(imageData, pixelBytes, firstRow, rows);
+    if (IsWideImage(imageData)) {
+        PackImageWide(&stripImage, (uint8_t*)packing);
+    } else {
+        PackImage(&stripImage, pixelBytes, (uint8_t*)packing);
+    }
+    return 1;
+}
+
+int ZPNG_UnpackRows(
+    const void* packing,
+    unsigned firstRow,
+    unsigned rows,
+    const ZPNG_ImageData* imageData
+)
+{
+    if (!packing || !IsPackableRows(imageData, firstRow, rows)) {
+        return 0;
+    }
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    ZPNG_ImageData stripImage = GetStripImage(imageData, pixelBytes, firstRow, rows);
+    if (IsWideImage(imageData)) {
+        UnpackImageWide((const uint8_t*)packing, &stripImage);
+    } else {
+        UnpackImage((const uint8_t*)packing, pixelBytes, &stripImage);
+    }
+    return 1;
+}
+
+void ZPNG_Free(
+    ZPNG_Buffer* buffer
+)
+{
+    if (buffer && buffer->Data)
+    {
+        FreeBuffer(buffer->Data);
+        buffer->Data = nullptr;
+        buffer->Bytes = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Video Encoder
+
+struct ZPNG_VideoPipeline;
+
+// A frame moving through the encoder
+struct ZPNG_VideoSlot
+{
+    ZPNG_VideoPipeline* Encoder;
+
+    // Tightly packed copy of the pushed frame.  Once filtered it is swapped
+    // into the reference list, and the oldest reference buffer takes its place
+    uint8_t* Frame;
+
+    // Filtered frame, for the pipelined stages
+    uint8_t* Packing;
+    size_t PackedBytes;
+
+    // Compressed frame, or 0 bytes on failure
+    uint8_t* Output;
+    size_t OutputBytes;
+
+    int64_t Timestamp;
+    unsigned FrameIndex;
+    unsigned RefFrame;
+    unsigned KeyFrame;
+    bool IsKeyFrame;
+};
+
+// A recent frame that later frames can be delta encoded against
+struct ZPNG_VideoReference
+{
+    uint8_t* Frame;
+    unsigned FrameIndex;
+    unsigned KeyFrame;
+};
+
+// State behind the opaque ZPNG_VideoEncoder pointer.
+// Frames are filtered on one worker and compressed on another, so frame N+1
+// is filtered while frame N is compressed.  Each stage runs its frames in
+// order on a single-thread pool.
+struct ZPNG_VideoPipeline
+{
+    ZPNG_CompressionContext* Context;
+
+    // Context allocated for a null context, freed with the encoder
+    ZPNG_CompressionContext* TempContext;
+
+    // Frame format, tightly packed with no buffer
+    ZPNG_ImageData Format;
+    unsigned PixelBytes;
+    size_t FrameBytes;
+
+    // Kernels for the pipelined stages
+    const ZPNG_Kernels* Kernels;
+    const ZPNG_VideoKernels* VideoKernels;
+
+    // Frames that fit the single-frame format are filtered and compressed
+    // in separate stages.  Others go through ZPNG_CompressVideoToBuffer()
+    // in the filter stage, which then owns the context
+    bool Pipelined;
+    size_t OutputCapacity;
+
+    ZPNG_VideoFrameFunction Write;
+    void* Opaque;
+
+    POOL_ctx* FilterPool;
+    POOL_ctx* CompressPool;
+
+    ZPNG_VideoSlot* Slots;
+    unsigned SlotCount;
+
+    // Owned by the filter stage
+    ZPNG_VideoReference* References;
+    unsigned ReferenceCount;
+    unsigned MaxReferences;
+    unsigned NextReference;
+
+    // Protects the fields below
+    ZSTD_pthread_mutex_t Lock;
+    ZSTD_pthread_cond_t Drained;
+    unsigned InFlight;
+    unsigned FrameCount;
+    bool Failed;
+};
+
+static void FreeVideoPipeline(ZPNG_VideoPipeline* enc)
+{
+    // Freeing the pools waits for their threads
+    if (enc->FilterPool) {
+        POOL_free(enc->FilterPool);
+    }
+    if (enc->CompressPool) {
+        POOL_free(enc->CompressPool);
+    }
+    if (enc->Slots)
+    {
+        for (unsigned i = 0; i < enc->SlotCount; ++i)
+        {
+            FreeBuffer(enc->Slots[i].Frame);
+            FreeBuffer(enc->Slots[i].Packing);
+            FreeBuffer(enc->Slots[i].Output);
+        }
+        free(enc->Slots);
+    }
+    if (enc->References)
+    {
+        for (unsigned i = 0; i < enc->MaxReferences; ++i) {
+            FreeBuffer(enc->References[i].Frame);
+        }
+        free(enc->References);
+    }
+    ZSTD_pthread_cond_destroy(&enc->Drained);
+    ZSTD_pthread_mutex_destroy(&enc->Lock);
+    ZPNG_FreeCompressionContext(enc->TempContext);
+    free(enc);
+}
+
+static ZPNG_ImageData GetVideoFrameImage(const ZPNG_VideoPipeline* enc, uint8_t* frame)
+{
+    ZPNG_ImageData imageData = enc->Format;
+    imageData.Buffer.Data = frame;
+    imageData.Buffer.Bytes = enc->FrameBytes;
+    return imageData;
+}
+
+static void CompressVideoSlot(void* opaque)
+{
+    ZPNG_VideoSlot* slot = (ZPNG_VideoSlot*)opaque;
+    ZPNG_VideoPipeline* enc = slot->Encoder;
+
+    ZSTD_pthread_mutex_lock(&enc->Lock);
+    bool failed = enc->Failed;
+    ZSTD_pthread_mutex_unlock(&enc->Lock);
+
+    if (!failed && enc->Pipelined)
+    {
+        const size_t result = CompressWithContext(
+            enc->Context,
+            slot->Output + ZPNG_HEADER_OVERHEAD_BYTES,
+            enc->OutputCapacity - ZPNG_HEADER_OVERHEAD_BYTES,
+            slot->Packing,
+            slot->PackedBytes,
+            nullptr);
+
+        slot->OutputBytes = 0;
+        if (!ZSTD_isError(result))
+        {
+            WriteHeader(&enc->Format, !slot->IsKeyFrame, slot->Output);
+            slot->OutputBytes = ZPNG_HEADER_OVERHEAD_BYTES + result;
+        }
+    }
+
+    if (!failed)
+    {
+        ZPNG_VideoFrameInfo info;
+        info.Frame.Data = slot->Output;
+        info.Frame.Bytes = slot->OutputBytes;
+        info.Timestamp = slot->Timestamp;
+        info.IsKeyFrame = slot->IsKeyFrame ? 1 : 0;
+        info.RefFrame = slot->RefFrame;
+        info.KeyFrame = slot->KeyFrame;
+
+        failed = slot->OutputBytes == 0 || !enc->Write(enc->Opaque, slot->FrameIndex, &info);
+    }
+
+    ZSTD_pthread_mutex_lock(&enc->Lock);
+    if (failed) {
+        enc->Failed = true;
+    }
+    --enc->InFlight;
+    ZSTD_pthread_cond_broadcast(&enc->Drained);
+    ZSTD_pthread_mutex_unlock(&enc->Lock);
+}
+
+static void FilterVideoSlot(void* opaque)
+{
+    ZPNG_VideoSlot* slot = (ZPNG_VideoSlot*)opaque;
+    ZPNG_VideoPipeline* enc = slot->Encoder;
+
+    ZSTD_pthread_mutex_lock(&enc->Lock);
+    const bool failed = enc->Failed;
+    ZSTD_pthread_mutex_unlock(&enc->Lock);
+
+    slot->OutputBytes = 0;
+
+    if (!failed)
+    {
+        const ZPNG_ImageData imageData = GetVideoFrameImage(enc, slot->Frame);
+
+        // Pick the reference with the lowest sampled delta cost, if that
+        // beats intra coding
+        const ZPNG_VideoReference* best = nullptr;
+        uint64_t bestCost = 0, intraCost = 0;
+        for (unsigned i = 0; i < enc->ReferenceCount; ++i)
+        {
+            const ZPNG_ImageData refData = GetVideoFrameImage(enc, enc->References[i].Frame);
+            uint64_t deltaCost;
+            GetVideoCosts(&refData, &imageData, enc->PixelBytes, nullptr, &deltaCost, &intraCost);
+            if (!best || deltaCost < bestCost) {
+                best = enc->References + i;
+                bestCost = deltaCost;
+            }
+        }
+        if (best && bestCost > intraCost) {
+            best = nullptr;
+        }
+
+        const ZPNG_ImageData refData = GetVideoFrameImage(enc, best ? best->Frame : nullptr);
+        slot->IsKeyFrame = true;
+
+        if (enc->Pipelined)
+        {
+            size_t overflowCount = 0;
+            if (best) {
+                overflowCount = enc->VideoKernels->Pack(&refData, &imageData, slot->Packing);
+            } else {
+                enc->Kernels->Pack[ZPNG_FILTER_LEFT](&imageData, slot->Packing);
+            }
+            slot->PackedBytes = enc->FrameBytes + overflowCount;
+            slot->IsKeyFrame = !best;
+        }
+        else
+        {
+            ZPNG_Buffer buffer;
+            buffer.Data = slot->Output;
+            buffer.Bytes = enc->OutputCapacity;
+
+            unsigned stripRows;
+            ZPNG_ImageData header;
+            ZPNG_ProgressiveLayout progressive;
+            if (ZPNG_CompressVideoToBuffer(best ? &refData : nullptr, &imageData, &buffer, enc->Context) &&
+                (ReadHeader(buffer, &header, &stripRows) || ReadProgressiveHeader(buffer, &header, &progressive)))
+            {
+                slot->OutputBytes = buffer.Bytes;
+                slot->IsKeyFrame = header.IsIFrame != 0;
+            }
+        }
+
+        slot->RefFrame = slot->IsKeyFrame ? slot->FrameIndex : best->FrameIndex;
+        slot->KeyFrame = slot->IsKeyFrame ? slot->FrameIndex : best->KeyFrame;
+
+        // This frame replaces the oldest reference
+        ZPNG_VideoReference* newest = enc->References + enc->NextReference;
+        uint8_t* frame = newest->Frame;
+        newest->Frame = slot->Frame;
+        newest->FrameIndex = slot->FrameIndex;
+        newest->KeyFrame = slot->KeyFrame;
+        slot->Frame = frame;
+
+        enc->NextReference = (enc->NextReference + 1) % enc->MaxReferences;
+        if (enc->ReferenceCount < enc->MaxReferences) {
+            ++enc->ReferenceCount;
+        }
+    }
+
+    // The compress pool queue holds every slot, so this does not block
+    POOL_add(enc->CompressPool, CompressVideoSlot, slot);
+}
+
+ZPNG_VideoEncoder* ZPNG_CreateVideoEncoder(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context,
+    unsigned references,
+    unsigned queueFrames,
+    ZPNG_VideoFrameFunction write,
+    void* opaque
+)
+{
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+
+    const unsigned pixelBytes = GetPixelBytes(imageData);
+    size_t byteCount;
+    if (!HasThreadPool() || !write || pixelBytes == 0 || pixelBytes > 8 || !IsValidPixelFormat(imageData) ||
+        !GetImageBytes(imageData, pixelBytes, &byteCount)) {
+        return nullptr;
+    }
+
+    if (references == 0) {
+        references = kVideoReferences;
+    } else if (references > kMaxVideoReferences) {
+        references = kMaxVideoReferences;
+    }
+    if (queueFrames == 0) {
+        queueFrames = kVideoQueueFrames;
+    }
+
+    ZPNG_VideoPipeline* enc = (ZPNG_VideoPipeline*)calloc(1, sizeof(ZPNG_VideoPipeline));
+    if (!enc) {
+        return nullptr;
+    }
+    ZSTD_pthread_mutex_init(&enc->Lock, nullptr);
+    ZSTD_pthread_cond_init(&enc->Drained, nullptr);
+
+    if (!ctx)
+    {
+        enc->TempContext = (ZPNG_CompressionContext*)ZPNG_AllocateCompressionContext();
+        if (!enc->TempContext) {
+            FreeVideoPipeline(enc);
+            return nullptr;
+        }
+        ctx = enc->TempContext;
+    }
+
+    enc->Context = ctx;
+    enc->Format = *imageData;
+    enc->Format.Buffer.Data = nullptr;
+    enc->Format.Buffer.Bytes = 0;
+    enc->Format.StrideBytes = 0;
+    enc->Format.IsIFrame = 1;
+    enc->PixelBytes = pixelBytes;
+    enc->FrameBytes = byteCount;
+    enc->Kernels = GetKernels(imageData, pixelBytes, false);
+    enc->VideoKernels = GetVideoKernels(pixelBytes);
+    enc->Write = write;
+    enc->Opaque = opaque;
+
+    // The same test ZPNG_CompressVideoToBuffer() uses for I-frames, which
+    // also covers delta frames
+    const bool planeFrames = ctx->PlaneFrames && IsPlanarImage(imageData);
+    const bool entropy = ctx->Backend != ZPNG_BACKEND_ZSTD;
+    const unsigned transform = IsPlanarImage(imageData) ? ctx->ColorTransform : (unsigned)ZPNG_COLOR_GB_RG;
+    enc->Pipelined = ctx->StripRows == 0 && ctx->ProgressiveLevels == 0 &&
+        !NeedsStripHeader(&enc->Format, ctx, ctx->Filter, transform, planeFrames, false,
+            ctx->MotionSearch || ctx->SkipBlocks, entropy, ctx->Palette, ctx->ConstantPlanes);
+    enc->OutputCapacity = enc->Pipelined ?
+        ZPNG_HEADER_OVERHEAD_BYTES + ZSTD_compressBound(byteCount + GetOverflowBytes(byteCount, true)) :
+        ZPNG_MaximumBufferSize(&enc->Format);
+
+    enc->SlotCount = queueFrames;
+    enc->MaxReferences = references;
+    enc->Slots = (ZPNG_VideoSlot*)calloc(queueFrames, sizeof(ZPNG_VideoSlot));
+    enc->References = (ZPNG_VideoReference*)calloc(references, sizeof(ZPNG_VideoReference));
+    if (!enc->Slots || !enc->References) {
+        FreeVideoPipeline(enc);
+        return nullptr;
+    }
+
+    for (unsigned i = 0; i < queueFrames; ++i)
+    {
+        ZPNG_VideoSlot* slot = enc->Slots + i;
+        slot->Encoder = enc;
+        slot->Frame = AllocateBuffer(byteCount + 1);
+        slot->Output = AllocateBuffer(enc->OutputCapacity);
+        if (enc->Pipelined) {
+            slot->Packing = AllocateBuffer(byteCount + GetOverflowBytes(byteCount, true));
+        }
+        if (!slot->Frame || !slot->Output || (enc->Pipelined && !slot->Packing)) {
+            FreeVideoPipeline(enc);
+            return nullptr;
+        }
+    }
+    for (unsigned i = 0; i < references; ++i)
+    {
+        enc->References[i].Frame = AllocateBuffer(byteCount + 1);
+        if (!enc->References[i].Frame) {
+            FreeVideoPipeline(enc);
+            return nullptr;
+        }
+    }
+
+    // Each queue holds every slot, so adding to either never blocks
+    enc->FilterPool = POOL_create(1, queueFrames);
+    enc->CompressPool = POOL_create(1, queueFrames);
+    if (!enc->FilterPool || !enc->CompressPool) {
+        FreeVideoPipeline(enc);
+        return nullptr;
+    }
+
+    return (ZPNG_VideoEncoder*)enc;
+}
+
+int ZPNG_PushVideoFrame(
+    ZPNG_VideoEncoder* encoder,
+    const ZPNG_ImageData* imageData,
+    int64_t timestamp
+)
+{
+    ZPNG_VideoPipeline* enc = (ZPNG_VideoPipeline*)encoder;
+    if (!enc || !imageData || !imageData->Buffer.Data ||
+        imageData->WidthPixels != enc->Format.WidthPixels ||
+        imageData->HeightPixels != enc->Format.HeightPixels ||
+        imageData->Channels != enc->Format.Channels ||
+        imageData->BytesPerChannel != enc->Format.BytesPerChannel ||
+        imageData->PixelFormat != enc->Format.PixelFormat) {
+        return 0;
+    }
+
+    const unsigned height = enc->Format.HeightPixels;
+    const size_t rowBytes = (size_t)enc->Format.WidthPixels * enc->PixelBytes;
+    const size_t stride = GetRowStride(imageData, enc->PixelBytes);
+    if (height > 0 && imageData->Buffer.Bytes < stride * (height - 1) + rowBytes) {
+        return 0;
+    }
+
+    // Slots are compressed in order, so the next one is free unless all are
+    ZSTD_pthread_mutex_lock(&enc->Lock);
+    const bool full = enc->Failed || enc->InFlight == enc->SlotCount;
+    ZPNG_VideoSlot* slot = nullptr;
+    if (!full)
+    {
+        slot = enc->Slots + enc->FrameCount % enc->SlotCount;
+        slot->FrameIndex = enc->FrameCount++;
+        ++enc->InFlight;
+    }
+    ZSTD_pthread_mutex_unlock(&enc->Lock);
+
+    if (!slot) {
+        return 0;
+    }
+
+    for (unsigned y = 0; y < height; ++y) {
+        memcpy(slot->Frame + y * rowBytes, imageData->Buffer.Data + y * stride, rowBytes);
+    }
+    slot->Timestamp = timestamp;
+
+    POOL_add(enc->FilterPool, FilterVideoSlot, slot);
+    return 1;
+}
+
+int ZPNG_FlushVideoEncoder(
+    ZPNG_VideoEncoder* encoder
+)
+{
+    ZPNG_VideoPipeline* enc = (ZPNG_VideoPipeline*)encoder;
+    if (!enc) {
+        return 0;
+    }
+
+    ZSTD_pthread_mutex_lock(&enc->Lock);
+    while (enc->InFlight > 0) {
+        ZSTD_pthread_cond_wait(&enc->Drained, &enc->Lock);
+    }
+    const bool failed = enc->Failed;
+    ZSTD_pthread_mutex_unlock(&enc->Lock);
+
+    return failed ? 0 : 1;
+}
+
+int ZPNG_FreeVideoEncoder(
+    ZPNG_VideoEncoder* encoder
+)
+{
+    ZPNG_VideoPipeline* enc = (ZPNG_VideoPipeline*)encoder;
+    if (!enc) {
+        return 0;
+    }
+
+    const int success = ZPNG_FlushVideoEncoder(encoder);
+    FreeVideoPipeline(enc);
+    return success;
+}
+
+
+//------------------------------------------------------------------------------
+// Video Decoder
+
+// A frame of the decoder ring.  Frame f goes in slot f % SlotCount, once the
+// frame before it there has been released and is not pinned
+struct ZPNG_VideoDecodeSlot
+{
+    // Decoded frame in Buffer, which is grown to fit
+    ZPNG_ImageData Image;
+    size_t Capacity;
+
+    // Frame in the slot, or UINT32_MAX before the first
+    unsigned Frame;
+    bool Ready;
+    bool Failed;
+
+    // Set while its worker decodes the next frame against it
+    bool Pinned;
+};
+
+// State behind the opaque ZPNG_VideoDecoder pointer.
+// The frames are split into chunks at I-frames that no later frame reaches
+// back past, so each chunk decodes on its own.  Workers take the chunks in
+// order and decode their frames into the ring, which the caller takes them
+// from in order.  The earliest unfinished chunk always has a worker, and
+// only waits for the caller to release frames before it
+struct ZPNG_VideoPlayback
+{
+    const ZPNG_VideoFileReader* Reader;
+
+    // Chunk i is frames [Chunks[i], Chunks[i + 1]), ending at the last frame
+    unsigned* Chunks;
+    unsigned ChunkCount;
+
+    ZPNG_VideoDecodeSlot* Slots;
+    unsigned SlotCount;
+
+    POOL_ctx* Pool;
+    ZPNG_DecompressionContext** Contexts;
+    unsigned Threads;
+
+    // Protects the fields below and the slot states
+    ZSTD_pthread_mutex_t Lock;
+    ZSTD_pthread_cond_t Changed;
+    unsigned StartedWorkers;
+    unsigned NextChunk;
+
+    // Next frame for the caller, and the frames before Released that it is
+    // done with.  The caller holds the frame before NextFrame until its next call
+    unsigned NextFrame;
+    unsigned Released;
+
+    bool Failed;
+    bool Stopping;
+};
+
+static void FreeVideoPlayback(ZPNG_VideoPlayback* dec)
+{
+    // Freeing the pool waits for its threads
+    if (dec->Pool) {
+        POOL_free(dec->Pool);
+    }
+    if (dec->Slots)
+    {
+        for (unsigned i = 0; i < dec->SlotCount; ++i) {
+            FreeBuffer(dec->Slots[i].Image.Buffer.Data);
+        }
+        free(dec->Slots);
+    }
+    if (dec->Contexts)
+    {
+        for (unsigned i = 0; i < dec->Threads; ++i) {
+            ZPNG_FreeDecompressionContext(dec->Contexts[i]);
+        }
+        free(dec->Contexts);
+    }
+    free(dec->Chunks);
+    ZSTD_pthread_cond_destroy(&dec->Changed);
+    ZSTD_pthread_mutex_destroy(&dec->Lock);
+    free(dec);
+}
+
+// Decode a frame into its slot, against the frame in prev if that is its
+// reference.  Returns true on success
+static bool DecodeVideoSlot(
+    ZPNG_VideoPlayback* dec,
+    ZPNG_DecompressionContext* context,
+    unsigned frame,
+    const ZPNG_VideoDecodeSlot* prev,
+    ZPNG_VideoDecodeSlot* slot
+)
+{
+    const ZPNG_VideoFrameEntry* entry = dec->Reader->Entries + frame;
+    const ZPNG_Buffer buffer = { dec->Reader->File.Data + entry->Offset, (size_t)entry->Bytes };
+
+    ZPNG_ImageInfo info;
+    if (!ZPNG_GetInfo(buffer, &info)) {
+        return false;
+    }
+    if (slot->Capacity < info.ImageBytes)
+    {
+        FreeBuffer(slot->Image.Buffer.Data);
+        slot->Image.Buffer.Data = AllocateBuffer((size_t)info.ImageBytes);
+        slot->Capacity = slot->Image.Buffer.Data ? (size_t)info.ImageBytes : 0;
+        if (!slot->Image.Buffer.Data) {
+            return false;
+        }
+    }
+
+    slot->Image.Buffer.Bytes = slot->Capacity;
+    slot->Image.StrideBytes = 0;
+
+    // Frames that are not against the one before them decode their chain
+    if (info.IsIFrame) {
+        return ZPNG_DecompressToBuffer(context, nullptr, buffer, &slot->Image) != 0;
+    }
+    if (prev && entry->RefFrame == prev->Frame) {
+        return ZPNG_DecompressToBuffer(context, &prev->Image, buffer, &slot->Image) != 0;
+    }
+    return DecodeVideoChain(dec->Reader, context, frame, &slot->Image) != 0;
+}
+
+// Pool task: Decode chunks until there are none left
+static void DecodeVideoChunks(void* opaque)
+{
+    ZPNG_VideoPlayback* dec = (ZPNG_VideoPlayback*)opaque;
+
+    ZSTD_pthread_mutex_lock(&dec->Lock);
+    ZPNG_DecompressionContext* context = dec->Contexts[dec->StartedWorkers++];
+
+    while (!dec->Stopping && dec->NextChunk < dec->ChunkCount)
+    {
+        const unsigned chunk = dec->NextChunk++;
+        ZPNG_VideoDecodeSlot* prev = nullptr;
+
+        for (unsigned frame = dec->Chunks[chunk]; frame < dec->Chunks[chunk + 1]; ++frame)
+        {
+            ZPNG_VideoDecodeSlot* slot = dec->Slots + frame % dec->SlotCount;
+            while (!dec->Stopping && (frame - dec->Released >= dec->SlotCount || slot->Pinned)) {
+                ZSTD_pthread_cond_wait(&dec->Changed, &dec->Lock);
+            }
+            if (dec->Stopping) {
+                break;
+            }
+            slot->Frame = frame;
+            slot->Ready = false;
+            ZSTD_pthread_mutex_unlock(&dec->Lock);
+
+            const bool success = DecodeVideoSlot(dec, context, frame, prev, slot);
+
+            ZSTD_pthread_mutex_lock(&dec->Lock);
+            slot->Ready = true;
+            slot->Failed = !success;
+            if (prev) {
+                prev->Pinned = false;
+            }
+            prev = success ? slot : nullptr;
+            if (prev) {
+                prev->Pinned = true;
+            }
+            ZSTD_pthread_cond_broadcast(&dec->Changed);
+        }
+
+        if (prev)
+        {
+            prev->Pinned = false;
+            ZSTD_pthread_cond_broadcast(&dec->Changed);
+        }
+    }
+
+    ZSTD_pthread_mutex_unlock(&dec->Lock);
+}
+
+ZPNG_VideoDecoder* ZPNG_CreateVideoDecoder(
+    ZPNG_VideoReader* videoReader,
+    unsigned firstFrame,
+    unsigned threads,
+    unsigned ringFrames
+)
+{
+    const ZPNG_VideoFileReader* reader = (const ZPNG_VideoFileReader*)videoReader;
+    if (!HasThreadPool() || !reader || firstFrame > reader->FrameCount) {
+        return nullptr;
+    }
+
+    if (threads == 0) {
+        threads = GetHardwareThreads();
+    }
+
+    ZPNG_VideoPlayback* dec = (ZPNG_VideoPlayback*)calloc(1, sizeof(ZPNG_VideoPlayback));
+    if (!dec) {
+        return nullptr;
+    }
+    ZSTD_pthread_mutex_init(&dec->Lock, nullptr);
+    ZSTD_pthread_cond_init(&dec->Changed, nullptr);
+
+    dec->Reader = reader;
+    dec->NextFrame = firstFrame;
+    dec->Released = firstFrame;
+
+    // An I-frame starts a chunk if every frame from it on references only
+    // frames from it on.  References point back, so a running minimum from
+    // the last frame finds them
+    const unsigned frameCount = reader->FrameCount;
+    dec->Chunks = (unsigned*)malloc(((size_t)frameCount - firstFrame + 1) * sizeof(unsigned));
+    if (!dec->Chunks) {
+        FreeVideoPlayback(dec);
+        return nullptr;
+    }
+    unsigned chunkCount = 0;
+    unsigned lowestRef = frameCount;
+    for (unsigned i = frameCount; i > firstFrame + 1; --i)
+    {
+        const ZPNG_VideoFrameEntry* entry = reader->Entries + i - 1;
+        if (entry->RefFrame < lowestRef) {
+            lowestRef = entry->RefFrame;
+        }
+        if (lowestRef == i - 1) {
+            dec->Chunks[chunkCount++] = i - 1;
+        }
+    }
+    if (firstFrame < frameCount) {
+        dec->Chunks[chunkCount++] = firstFrame;
+    }
+    for (unsigned i = 0; i < chunkCount / 2; ++i)
+    {
+        const unsigned start = dec->Chunks[i];
+        dec->Chunks[i] = dec->Chunks[chunkCount - 1 - i];
+        dec->Chunks[chunkCount - 1 - i] = start;
+    }
+    dec->Chunks[chunkCount] = frameCount;
+    dec->ChunkCount = chunkCount;
+
+    // By default each thread gets an average chunk of room, up to a limit
+    if (ringFrames == 0)
+    {
+        const unsigned chunkFrames = chunkCount ? (frameCount - firstFrame + chunkCount - 1) / chunkCount : 1;
+        ringFrames = threads * (chunkFrames < kVideoDecodeFramesPerThread ? chunkFrames : kVideoDecodeFramesPerThread);
+    }
+    // The caller holds one frame while the next is decoded
+    if (ringFrames < 2) {
+        ringFrames = 2;
+    }
+
+    dec->SlotCount = ringFrames;
+    dec->Slots = (ZPNG_VideoDecodeSlot*)calloc(ringFrames, sizeof(ZPNG_VideoDecodeSlot));
+    dec->Threads = threads;
+    dec->Contexts = (ZPNG_DecompressionContext**)calloc(threads, sizeof(ZPNG_DecompressionContext*));
+    if (!dec->Slots || !dec->Contexts) {
+        FreeVideoPlayback(dec);
+        return nullptr;
+    }
+    for (unsigned i = 0; i < ringFrames; ++i) {
+        dec->Slots[i].Frame = UINT32_MAX;
+    }
+
+    // Frames are decoded a whole frame per thread, so each context keeps
+    // to one worker of its own
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        dec->Contexts[i] = ZPNG_AllocateDecompressionContext();
+        if (!dec->Contexts[i] || !ZPNG_SetDecompressionWorkers(dec->Contexts[i], 1)) {
+            FreeVideoPlayback(dec);
+            return nullptr;
+        }
+    }
+
+    // The queue holds a task per thread, so adding them never blocks
+    dec->Pool = POOL_create(threads, threads);
+    if (!dec->Pool) {
+        FreeVideoPlayback(dec);
+        return nullptr;
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        POOL_add(dec->Pool, DecodeVideoChunks, dec);
+    }
+
+    return (ZPNG_VideoDecoder*)dec;
+}
+
+int ZPNG_NextVideoFrame(
+    ZPNG_VideoDecoder* decoder,
+    ZPNG_ImageData* frame,
+    unsigned* index
+)
+{
+    ZPNG_VideoPlayback* dec = (ZPNG_VideoPlayback*)decoder;
+    if (!dec || !frame) {
+        return 0;
+    }
+
+    ZSTD_pthread_mutex_lock(&dec->Lock);
+
+    // The frame from the last call is released back to the ring
+    dec->Released = dec->NextFrame;
+    ZSTD_pthread_cond_broadcast(&dec->Changed);
+
+    int success = 0;
+    if (!dec->Failed && dec->NextFrame < dec->Reader->FrameCount)
+    {
+        const ZPNG_VideoDecodeSlot* slot = dec->Slots + dec->NextFrame % dec->SlotCount;
+        while (slot->Frame != dec->NextFrame || !slot->Ready) {
+            ZSTD_pthread_cond_wait(&dec->Changed, &dec->Lock);
+        }
+
+        if (slot->Failed) {
+            dec->Failed = true;
+        }
+        else
+        {
+            *frame = slot->Image;
+            if (index) {
+                *index = dec->NextFrame;
+            }
+            ++dec->NextFrame;
+            success = 1;
+        }
+    }
+
+    ZSTD_pthread_mutex_unlock(&dec->Lock);
+    return success;
+}
+
+void ZPNG_FreeVideoDecoder(
+    ZPNG_VideoDecoder* decoder
+)
+{
+    ZPNG_VideoPlayback* dec = (ZPNG_VideoPlayback*)decoder;
+    if (!dec) {
+        return;
+    }
+
+    ZSTD_pthread_mutex_lock(&dec->Lock);
+    dec->Stopping = true;
+    ZSTD_pthread_cond_broadcast(&dec->Changed);
+    ZSTD_pthread_mutex_unlock(&dec->Lock);
+
+    FreeVideoPlayback(dec);
+}
+
+
+//------------------------------------------------------------------------------
+// Async Queue
+
+struct ZPNG_AsyncState;
+
+// A job of the queue, from submission until its result is delivered
+struct ZPNG_AsyncJob
+{
+    ZPNG_AsyncState* Queue;
+
+    bool Compress;
+    ZPNG_ImageData Input;
+    ZPNG_Buffer Buffer;
+
+    ZPNG_AsyncFunction Done;
+    ZPNG_AsyncResult Result;
+};
+
+// State behind the opaque ZPNG_AsyncQueue pointer.
+// Jobs run on a shared pool, and each takes whichever thread contexts are
+// free.  There are as many of each as threads, so one always is
+struct ZPNG_AsyncState
+{
+    POOL_ctx* Pool;
+    unsigned Threads;
+    ZPNG_CompressionParams Params;
+    bool HasParams;
+
+    ZPNG_AsyncJob* Jobs;
+    unsigned MaxJobs;
+
+    // Protects the fields below
+    ZSTD_pthread_mutex_t Lock;
+    ZSTD_pthread_cond_t Drained;
+
+    // Jobs not in use
+    unsigned* FreeJobs;
+    unsigned FreeCount;
+
+    // Finished jobs without a callback, oldest first, in a ring
+    unsigned* Finished;
+    unsigned FinishedHead;
+    unsigned FinishedCount;
+
+    // Contexts not in use, created on first use
+    ZPNG_Context** CompressContexts;
+    unsigned CompressCount;
+    ZPNG_DecompressionContext** DecompressContexts;
+    unsigned DecompressCount;
+
+    unsigned InFlight;
+    uint64_t JobCount;
+};
+
+static void FreeAsyncState(ZPNG_AsyncState* queue)
+{
+    // Freeing the pool waits for its threads
+    if (queue->Pool) {
+        POOL_free(queue->Pool);
+    }
+    if (queue->Jobs && queue->Finished)
+    {
+        for (unsigned i = 0; i < queue->FinishedCount; ++i)
+        {
+            ZPNG_AsyncResult* result = &queue->Jobs[queue->Finished[(queue->FinishedHead + i) % queue->MaxJobs]].Result;
+            ZPNG_Free(&result->Compressed);
+            ZPNG_Free(&result->Image.Buffer);
+        }
+    }
+    if (queue->CompressContexts) {
+        for (unsigned i = 0; i < queue->Threads; ++i) {
+            ZPNG_FreeCompressionContext(queue->CompressContexts[i]);
+        }
+    }
+    if (queue->DecompressContexts) {
+        for (unsigned i = 0; i < queue->Threads; ++i) {
+            ZPNG_FreeDecompressionContext(queue->DecompressContexts[i]);
+        }
+    }
+    free(queue->CompressContexts);
+    free(queue->DecompressContexts);
+    free(queue->Jobs);
+    free(queue->FreeJobs);
+    free(queue->Finished);
+    ZSTD_pthread_cond_destroy(&queue->Drained);
+    ZSTD_pthread_mutex_destroy(&queue->Lock);
+    free(queue);
+}
+
+static void RunAsyncJob(void* opaque)
+{
+    ZPNG_AsyncJob* job = (ZPNG_AsyncJob*)opaque;
+    ZPNG_AsyncState* queue = job->Queue;
+    ZPNG_AsyncResult* result = &job->Result;
+
+    result->Success = 0;
+    result->Compressed.Data = nullptr;
+    result->Compressed.Bytes = 0;
+    memset(&result->Image, 0, sizeof(result->Image));
+
+    ZSTD_pthread_mutex_lock(&queue->Lock);
+    void* context = job->Compress ?
+        (void*)queue->CompressContexts[--queue->CompressCount] :
+        (void*)queue->DecompressContexts[--queue->DecompressCount];
+    ZSTD_pthread_mutex_unlock(&queue->Lock);
+
+    if (job->Compress)
+    {
+        if (!context)
+        {
+            context = ZPNG_AllocateCompressionContext();
+            if (context && queue->HasParams && !ZPNG_SetCompressionParams(context, &queue->Params)) {
+                ZPNG_FreeCompressionContext(context);
+                context = nullptr;
+            }
+        }
+        if (context)
+        {
+            result->Compressed = ZPNG_Compress(&job->Input, context);
+            result->Success = result->Compressed.Data ? 1 : 0;
+        }
+    }
+    else
+    {
+        // Jobs already run in parallel, so each decodes on its own thread
+        if (!context)
+        {
+            context = ZPNG_AllocateDecompressionContext();
+            if (context && !ZPNG_SetDecompressionWorkers(context, 1)) {
+                ZPNG_FreeDecompressionContext(context);
+                context = nullptr;
+            }
+        }
+        if (context)
+        {
+            result->Image = ZPNG_DecompressWithContext(context, nullptr, job->Buffer);
+            result->Success = result->Image.Buffer.Data ? 1 : 0;
+        }
+    }
+
+    ZSTD_pthread_mutex_lock(&queue->Lock);
+    if (job->Compress) {
+        queue->CompressContexts[queue->CompressCount++] = (ZPNG_Context*)context;
+    } else {
+        queue->DecompressContexts[queue->DecompressCount++] = (ZPNG_DecompressionContext*)context;
+    }
+    ZSTD_pthread_mutex_unlock(&queue->Lock);
+
+    if (job->Done) {
+        job->Done(result->Opaque, result);
+    }
+
+    const unsigned index = (unsigned)(job - queue->Jobs);
+    ZSTD_pthread_mutex_lock(&queue->Lock);
+    if (job->Done) {
+        queue->FreeJobs[queue->FreeCount++] = index;
+    } else {
+        queue->Finished[(queue->FinishedHead + queue->FinishedCount++) % queue->MaxJobs] = index;
+    }
+    --queue->InFlight;
+    ZSTD_pthread_cond_broadcast(&queue->Drained);
+    ZSTD_pthread_mutex_unlock(&queue->Lock);
+}
+
+ZPNG_AsyncQueue* ZPNG_CreateAsyncQueue(
+    unsigned threads,
+    unsigned maxJobs,
+    const ZPNG_CompressionParams* params
+)
+{
+    if (!HasThreadPool()) {
+        return nullptr;
+    }
+
+    if (threads == 0) {
+        threads = GetHardwareThreads();
+    }
+    if (maxJobs == 0) {
+        maxJobs = threads * kAsyncJobsPerThread;
+    }
+
+    ZPNG_AsyncState* queue = (ZPNG_AsyncState*)calloc(1, sizeof(ZPNG_AsyncState));
+    if (!queue) {
+        return nullptr;
+    }
+    ZSTD_pthread_mutex_init(&queue->Lock, nullptr);
+    ZSTD_pthread_cond_init(&queue->Drained, nullptr);
+
+    queue->Threads = threads;
+    queue->MaxJobs = maxJobs;
+    if (params)
+    {
+        // Check the parameters once here rather than failing every job
+        ZPNG_Context* context = ZPNG_AllocateCompressionContext();
+        const bool valid = context && ZPNG_SetCompressionParams(context, params);
+        ZPNG_FreeCompressionContext(context);
+        if (!valid) {
+            FreeAsyncState(queue);
+            return nullptr;
+        }
+        queue->Params = *params;
+        queue->HasParams = true;
+    }
+
+    queue->Jobs = (ZPNG_AsyncJob*)calloc(maxJobs, sizeof(ZPNG_AsyncJob));
+    queue->FreeJobs = (unsigned*)malloc(maxJobs * sizeof(unsigned));
+    queue->Finished = (unsigned*)malloc(maxJobs * sizeof(unsigned));
+    queue->CompressContexts = (ZPNG_Context**)calloc(threads, sizeof(ZPNG_Context*));
+    queue->DecompressContexts = (ZPNG_DecompressionContext**)calloc(threads, sizeof(ZPNG_DecompressionContext*));
+    if (!queue->Jobs || !queue->FreeJobs || !queue->Finished || !queue->CompressContexts || !queue->DecompressContexts) {
+        FreeAsyncState(queue);
+        return nullptr;
+    }
+
+    for (unsigned i = 0; i < maxJobs; ++i)
+    {
+        queue->Jobs[i].Queue = queue;
+        queue->FreeJobs[i] = maxJobs - 1 - i;
+    }
+    queue->FreeCount = maxJobs;
+    queue->CompressCount = threads;
+    queue->DecompressCount = threads;
+
+    // The pool queue holds every job, so adding to it never blocks
+    queue->Pool = POOL_create(threads, maxJobs);
+    if (!queue->Pool) {
+        FreeAsyncState(queue);
+        return nullptr;
+    }
+
+    return (ZPNG_AsyncQueue*)queue;
+}
+
+// Take a free job, or return null if the queue is full
+static ZPNG_AsyncJob* BeginAsyncJob(ZPNG_AsyncState* queue, ZPNG_AsyncFunction done, void* opaque)
+{
+    ZPNG_AsyncJob* job = nullptr;
+
+    ZSTD_pthread_mutex_lock(&queue->Lock);
+    if (queue->FreeCount > 0)
+    {
+        job = queue->Jobs + queue->FreeJobs[--queue->FreeCount];
+        job->Result.Job = ++queue->JobCount;
+        ++queue->InFlight;
+    }
+    ZSTD_pthread_mutex_unlock(&queue->Lock);
+
+    if (job)
+    {
+        job->Done = done;
+        job->Result.Opaque = opaque;
+    }
+    return job;
+}
+
+uint64_t ZPNG_CompressAsync(
+    ZPNG_AsyncQueue* queue,
+    const ZPNG_ImageData* imageData,
+    ZPNG_AsyncFunction done,
+    void* opaque
+)
+{
+    ZPNG_AsyncState* state = (ZPNG_AsyncState*)queue;
+    if (!state || !imageData) {
+        return 0;
+    }
+
+    ZPNG_AsyncJob* job = BeginAsyncJob(state, done, opaque);
+    if (!job) {
+        return 0;
+    }
+
+    job->Compress = true;
+    job->Input = *imageData;
+
+    const uint64_t number = job->Result.Job;
+    POOL_add(state->Pool, RunAsyncJob, job);
+    return number;
+}
+
+uint64_t ZPNG_DecompressAsync(
+    ZPNG_AsyncQueue* queue,
+    ZPNG_Buffer buffer,
+    ZPNG_AsyncFunction done,
+    void* opaque
+)
+{
+    ZPNG_AsyncState* state = (ZPNG_AsyncState*)queue;
+    if (!state) {
+        return 0;
+    }
+
+    ZPNG_AsyncJob* job = BeginAsyncJob(state, done, opaque);
+    if (!job) {
+        return 0;
+    }
+
+    job->Compress = false;
+    job->Buffer = buffer;
+
+    const uint64_t number = job->Result.Job;
+    POOL_add(state->Pool, RunAsyncJob, job);
+    return number;
+}
+
+int ZPNG_PollAsync(
+    ZPNG_AsyncQueue* queue,
+    ZPNG_AsyncResult* result
+)
+{
+    ZPNG_AsyncState* state = (ZPNG_AsyncState*)queue;
+    if (!state || !result) {
+        return 0;
+    }
+
+    ZSTD_pthread_mutex_lock(&state->Lock);
+    const bool ready = state->FinishedCount > 0;
+    if (ready)
+    {
+        const unsigned index = state->Finished[state->FinishedHead];
+        state->FinishedHead = (state->FinishedHead + 1) % state->MaxJobs;
+        --state->FinishedCount;
+        *result = state->Jobs[index].Result;
+        state->FreeJobs[state->FreeCount++] = index;
+    }
+    ZSTD_pthread_mutex_unlock(&state->Lock);
+
+    return ready ? 1 : 0;
+}
+
+int ZPNG_FlushAsyncQueue(
+    ZPNG_AsyncQueue* queue
+)
+{
+    ZPNG_AsyncState* state = (ZPNG_AsyncState*)queue;
+    if (!state) {
+        return 0;
+    }
 
+    ZSTD_pthread_mutex_lock(&state->Lock);
+    while (state->InFlight > 0) {
+        ZSTD_pthread_cond_wait(&state->Drained, &state->Lock);
+    }
+    ZSTD_pthread_mutex_unlock(&state->Lock);
 
+    return 1;
+}
 
-unsigned ZPNG_MaximumBufferSize(
-    const ZPNG_ImageData* imageData
+void ZPNG_FreeAsyncQueue(
+    ZPNG_AsyncQueue* queue
 )
 {
-    const unsigned pixelCount = imageData->WidthPixels * imageData->HeightPixels;
-    const unsigned pixelBytes = (imageData->BytesPerChannel > 8) ? imageData->Channels : imageData->BytesPerChannel * imageData->Channels;
-    const unsigned byteCount = pixelBytes * pixelCount + 1000;
-    const unsigned maxOutputBytes = (unsigned)ZSTD_compressBound(byteCount);
-    return ZPNG_HEADER_OVERHEAD_BYTES + maxOutputBytes;
+    ZPNG_AsyncState* state = (ZPNG_AsyncState*)queue;
+    if (state)
+    {
+        ZPNG_FlushAsyncQueue(queue);
+        FreeAsyncState(state);
+    }
 }
 
-ZPNG_Buffer ZPNG_Compress(
+//------------------------------------------------------------------------------
+// Network Stream
+
+int ZPNG_CompressStream(
+    const ZPNG_ImageData* refData,
     const ZPNG_ImageData* imageData,
+    ZPNG_WriteFunction write,
+    void* opaque,
     ZPNG_Context* context,
     ZPNG_Dictionary** dictionary
 )
 {
-    ZPNG_Buffer buffer;
-    buffer.Bytes = 0;
-    buffer.Data = nullptr;
-    ZPNG_CompressVideoToBuffer(nullptr, imageData, &buffer, context, dictionary);
+    ZPNG_CompressionContext* ctx = (ZPNG_CompressionContext*)context;
+    if (!imageData || !write || (ctx && ctx->Stream)) {
+        return 0;
+    }
 
-    return buffer;
+    // The stream is threaded through the context used for the strips
+    ZPNG_CompressionContext* tempCtx = nullptr;
+    if (!ctx)
+    {
+        tempCtx = (ZPNG_CompressionContext*)ZPNG_AllocateCompressionContext();
+        if (!tempCtx) {
+            return 0;
+        }
+        ctx = tempCtx;
+    }
+
+    ZPNG_StreamWriter stream;
+    stream.Write = write;
+    stream.Opaque = opaque;
+    stream.Offset = 0;
+    stream.Done = nullptr;
+    stream.Next = 0;
+    stream.Failed = false;
+    ZSTD_pthread_mutex_init(&stream.Lock, nullptr);
+
+    // The whole image is still built in memory, as that is where the
+    // frames are compressed before they are written out
+    ZPNG_Buffer output = { nullptr, 0 };
+    ZPNG_Dictionary* contextDict;
+    dictionary = AcquireCallDictionary(ctx, dictionary, &contextDict);
+    ctx->Stream = &stream;
+    const int success = CompressImage(refData, imageData, &output, ctx, dictionary);
+    ctx->Stream = nullptr;
+    ZPNG_FreeDictionary(contextDict);
+
+    FreeBuffer(output.Data);
+    ZSTD_pthread_mutex_destroy(&stream.Lock);
+    ZPNG_FreeCompressionContext(tempCtx);
+    return success;
 }
 
-int ZPNG_CompressToBuffer(
-    const ZPNG_ImageData* imageData,
-    ZPNG_Buffer* bufferOutput,
-    ZPNG_Context* context,
-    ZPNG_Dictionary** dictionary
-)
+// State behind the opaque ZPNG_StreamDecoder pointer
+struct ZPNG_StreamReader
 {
-    return ZPNG_CompressVideoToBuffer(0, imageData, bufferOutput, context, dictionary);
-}
+    ZPNG_DecompressionContext* Context;
 
-int ZPNG_CompressVideoToBuffer(
-    const ZPNG_ImageData* refData,
-    const ZPNG_ImageData* imageData,
-    ZPNG_Buffer* bufferOutput,
-    ZPNG_Context* context,
-    ZPNG_Dictionary** dictionary
-)
+    // Context allocated for a null context, freed with the decoder
+    ZPNG_DecompressionContext* TempContext;
+
+    const ZPNG_ImageData* RefData;
+    ZPNG_RowFunction Sink;
+    void* Opaque;
+
+    // Bytes pushed that are not yet part of a decoded strip
+    uint8_t* Input;
+    size_t InputBytes;
+    size_t InputCapacity;
+
+    // Image from the stream header, and its strips.  Format.Channels is 0
+    // until the header has arrived
+    ZPNG_ImageData Format;
+    ZPNG_StripLayout Layout;
+
+    // Single-strip image of the strip being decoded: The strip header,
+    // offset table, palette, plane map and dictionary ID in PrefixBytes,
+    // then the frames
+    uint8_t* Strip;
+    size_t PrefixBytes;
+    size_t StripCapacity;
+
+    // Decoded rows of one strip
+    uint8_t* Rows;
+
+    // Index of the next strip to decode
+    unsigned NextStrip;
+
+    bool Failed;
+};
+
+static void FreeStreamReader(ZPNG_StreamReader* reader)
 {
-    uint8_t* packing = nullptr;
-    uint8_t* output = nullptr;
+    ZPNG_FreeDecompressionContext(reader->TempContext);
+    FreeBuffer(reader->Input);
+    FreeBuffer(reader->Strip);
+    FreeBuffer(reader->Rows);
+    free(reader);
+}
 
-    const unsigned pixelCount = imageData->WidthPixels * imageData->HeightPixels;
-    const unsigned pixelBytes = (imageData->BytesPerChannel > 8) ? imageData->Channels : imageData->BytesPerChannel * imageData->Channels;
-    const unsigned byteCount = pixelBytes * pixelCount;
+static void ConsumeStreamInput(ZPNG_StreamReader* reader, size_t bytes)
+{
+    reader->InputBytes -= bytes;
+    memmove(reader->Input, reader->Input + bytes, reader->InputBytes);
+}
 
-    // FIXME: One day add support for other formats
-    if (pixelBytes > 8) {
+// Read the stream header once it has all arrived, and set up the strip
+// image.  Returns 1 if read, 0 if more input is needed, -1 if it is invalid
+static int ReadStreamHeader(ZPNG_StreamReader* reader)
+{
+    if (reader->InputBytes < sizeof(ZPNG_StripHeader)) {
         return 0;
     }
 
-    // Space for packing
-    packing = (uint8_t*)calloc(1, byteCount + 1000);
+    // Streams have no motion section
+    ZPNG_StripHeader header;
+    memcpy(&header, reader->Input, sizeof(header));
+    if (header.Magic != ZPNG_STREAM_HEADER_MAGIC || (header.Flags & ZPNG_STRIP_FLAG_CHECKSUM) ||
+        HasStripMotion(&header) || HasStripSkip(&header)) {
+        return -1;
+    }
 
-    if (!packing) {
-ReturnResult:
-        if (bufferOutput->Data != output && output) {
-            free(output);
-        }
-        free(packing);
-        return 0;
+    // Validate it the same way as the strip header it stands for
+    header.Magic = ZPNG_STRIP_HEADER_MAGIC;
+    ZPNG_ImageData format;
+    memset(&format, 0, sizeof(format));
+    unsigned stripRows;
+    const ZPNG_Buffer headerBuffer = { (uint8_t*)&header, sizeof(header) };
+    if (!ReadHeader(headerBuffer, &format, &stripRows)) {
+        return -1;
     }
 
-    const unsigned maxOutputBytes = (unsigned)ZSTD_compressBound(byteCount);
-    if (bufferOutput->Bytes == 0) {
-        output = (uint8_t*)calloc(1, ZPNG_HEADER_OVERHEAD_BYTES + maxOutputBytes);
-    } else if (bufferOutput->Bytes < ZPNG_HEADER_OVERHEAD_BYTES + maxOutputBytes) {
+    const unsigned pixelBytes = GetPixelBytes(&format);
+    GetStripLayout(format.WidthPixels, format.HeightPixels, pixelBytes, stripRows,
+        GetFramesPerStrip(&header), 0, nullptr, !format.IsIFrame, false, false, &reader->Layout);
+    if (header.StripCount != reader->Layout.StripCount) {
+        return -1;
+    }
+
+    // Delta frames need a reference image of the same format
+    if (!format.IsIFrame && !IsReferenceUsable(reader->RefData, &format)) {
+        return -1;
+    }
+
+    // The palette, plane map and dictionary ID follow the header
+    size_t extraBytes = 0;
+    if (header.Flags & ZPNG_STRIP_FLAG_PALETTE)
+    {
+        uint32_t colors;
+        if (reader->InputBytes < sizeof(header) + sizeof(colors)) {
+            return 0;
+        }
+        memcpy(&colors, reader->Input + sizeof(header), sizeof(colors));
+        if (colors == 0 || colors > kMaxPaletteColors) {
+            return -1;
+        }
+        extraBytes += sizeof(colors) + (size_t)colors * pixelBytes;
+    }
+    if (header.Flags & ZPNG_STRIP_FLAG_CONSTANT_PLANES) {
+        extraBytes += header.Channels * kPlaneMapBytesPerChannel;
+    }
+    if (header.Flags & ZPNG_STRIP_FLAG_DICTIONARY) {
+        extraBytes += sizeof(uint64_t);
+    }
+    if (reader->InputBytes < sizeof(header) + extraBytes) {
         return 0;
-    } else {
-        output = bufferOutput->Data;
     }
 
-    if (!output) {
-        goto ReturnResult;
+    // Strips are decoded as images of one strip, with the same extras
+    // The rows are allocated once the first strip has been checked
+    const size_t tableBytes = ((size_t)reader->Layout.FramesPerStrip + 1) * sizeof(uint64_t);
+    reader->PrefixBytes = sizeof(header) + tableBytes + extraBytes;
+    reader->StripCapacity = reader->PrefixBytes;
+    reader->Strip = AllocateBuffer(reader->StripCapacity);
+    if (!reader->Strip) {
+        return -1;
     }
+    header.StripCount = 1;
+    memcpy(reader->Strip, &header, sizeof(header));
+    memcpy(reader->Strip + sizeof(header) + tableBytes, reader->Input + sizeof(header), extraBytes);
 
-    int overflowCount = 0;
+    reader->Format = format;
+    ConsumeStreamInput(reader, sizeof(header) + extraBytes);
+    return 1;
+}
 
-    // Pass 1: Pack and filter data.
-    if (refData)
+// Decode the next strip once all of its frames have arrived.
+// Returns 1 if decoded, 0 if more input is needed, -1 on failure
+static int DecodeStreamStrip(ZPNG_StreamReader* reader)
+{
+    const ZPNG_StripLayout* layout = &reader->Layout;
+    const unsigned strip = reader->NextStrip;
+    const unsigned firstRow = strip * layout->StripRows;
+    const unsigned rows = GetStripRowCount(layout, reader->Format.HeightPixels, strip);
+
+    // Frames are a uint64_t size and then the frame.  No frame can be
+    // larger than the Zstd bound for a slot of packed data
+    const uint64_t maxFrameBytes = ZSTD_compressBound(layout->SlotBytes);
+    size_t offset = 0;
+    for (unsigned i = 0; i < layout->FramesPerStrip; ++i)
     {
-        switch (pixelBytes)
-        {
-        case 1: {
-            overflowCount = PackAndFilterVideo<1>(refData, imageData, packing);
-            // ZPNG_ImageData out = *refData;
-            // out.Buffer.Data = (uint8_t*)calloc(1, byteCount);
-            // UnpackAndUnfilterVideo<1>(refData, packing, &out);
-            // if (memcmp(imageData->Buffer.Data, out.Buffer.Data, out.Buffer.Bytes) != 0) {
-            //     printf("unpacking doesn't match packing\n");
-            // }
-            break; }
-        case 2:
-            overflowCount = PackAndFilterVideo<2>(refData, imageData, packing);
-            break;
-        case 3:
-            overflowCount = PackAndFilterVideo<3>(refData, imageData, packing);
-            break;
-        case 4:
-            overflowCount = PackAndFilterVideo<4>(refData, imageData, packing);
-            break;
-        case 5:
-            overflowCount = PackAndFilterVideo<5>(refData, imageData, packing);
-            break;
-        case 6:
-            overflowCount = PackAndFilterVideo<6>(refData, imageData, packing);
-            break;
-        case 7:
-            overflowCount = PackAndFilterVideo<7>(refData, imageData, packing);
-            break;
-        case 8:
-            overflowCount = PackAndFilterVideo<8>(refData, imageData, packing);
-            break;
+        uint64_t bytes;
+        if (reader->InputBytes - offset < sizeof(bytes)) {
+            return 0;
         }
-    } else {
-        if (imageData->BytesPerChannel > 8) {
-            PackAndFilterXGGY(imageData, packing);
-        } else {
-            switch (pixelBytes)
-            {
-            case 1:
-                PackAndFilter<1>(imageData, packing);
-                break;
-            case 2:
-                PackAndFilter<2>(imageData, packing);
-                break;
-            case 3:
-                PackAndFilter<3>(imageData, packing);
-                break;
-            case 4:
-                PackAndFilter<4>(imageData, packing);
-                break;
-            case 5:
-                PackAndFilter<5>(imageData, packing);
-                break;
-            case 6:
-                PackAndFilter<6>(imageData, packing);
-                break;
-            case 7:
-                PackAndFilter<7>(imageData, packing);
-                break;
-            case 8:
-                PackAndFilter<8>(imageData, packing);
-                break;
-            }
+        memcpy(&bytes, reader->Input + offset, sizeof(bytes));
+        if (bytes > maxFrameBytes) {
+            return -1;
+        }
+        offset += sizeof(bytes);
+        if (reader->InputBytes - offset < bytes) {
+            return 0;
         }
+        offset += (size_t)bytes;
     }
 
-    // Pass 2: Compress the packed/filtered data.
-    size_t result;
-    if (context)
+    const size_t stripBytes = reader->PrefixBytes + offset - layout->FramesPerStrip * sizeof(uint64_t);
+    if (stripBytes > reader->StripCapacity)
     {
-        if (*dictionary == nullptr)
-        {
-            char* dictBuf = (char*)malloc(100000);
-            size_t* sampleSizes = (size_t*)malloc(imageData->HeightPixels * 8 * sizeof(size_t));
-            for (uint i = 0; i < imageData->HeightPixels * 8; ++i)
-                sampleSizes[i] = byteCount / imageData->HeightPixels / 8;
-            ZDICT_cover_params_t params = {32, 8, 0, 1, {kCompressionLevel, 0, 0}};
-            size_t actualSize = ZDICT_trainFromBuffer_cover(dictBuf, 100000, packing, sampleSizes, imageData->HeightPixels * 8, params);
-            free(sampleSizes);
-            *dictionary = (void*)ZSTD_createCDict(dictBuf, actualSize, kCompressionLevel);
-            free(dictBuf);
+        uint8_t* grown = AllocateBuffer(stripBytes);
+        if (!grown) {
+            return -1;
         }
-        result = ZSTD_compress_usingCDict(
-            (ZSTD_CCtx*)context,
-            output + ZPNG_HEADER_OVERHEAD_BYTES,
-            maxOutputBytes,
-            packing,
-            byteCount + ((overflowCount >= 0) ? overflowCount : 0),
-            (ZSTD_CDict*)*dictionary);
-    } else
-    {
-        result = ZSTD_compress(
-            output + ZPNG_HEADER_OVERHEAD_BYTES,
-            maxOutputBytes,
-            packing,
-            byteCount + ((overflowCount >= 0) ? overflowCount : 0),
-            kCompressionLevel);
+        memcpy(grown, reader->Strip, reader->PrefixBytes);
+        FreeBuffer(reader->Strip);
+        reader->Strip = grown;
+        reader->StripCapacity = stripBytes;
     }
 
-    if (ZSTD_isError(result)) {
-        goto ReturnResult;
+    // Gather the frames after the prefix and fill in the offset table
+    ZPNG_StripHeader* header = (ZPNG_StripHeader*)reader->Strip;
+    header->Height = rows;
+    uint64_t* offsets = (uint64_t*)(reader->Strip + sizeof(ZPNG_StripHeader));
+    size_t stripOffset = reader->PrefixBytes;
+    offset = 0;
+    for (unsigned i = 0; i < layout->FramesPerStrip; ++i)
+    {
+        uint64_t bytes;
+        memcpy(&bytes, reader->Input + offset, sizeof(bytes));
+        offset += sizeof(bytes);
+        memcpy(reader->Strip + stripOffset, reader->Input + offset, (size_t)bytes);
+        offsets[i] = stripOffset;
+        offset += (size_t)bytes;
+        stripOffset += (size_t)bytes;
     }
+    offsets[layout->FramesPerStrip] = stripOffset;
+    ConsumeStreamInput(reader, offset);
 
-    // Write header
+    // The first strip is the tallest, and sizes the rows once its frames
+    // agree with the header
+    const ZPNG_Buffer buffer = { reader->Strip, stripOffset };
+    if (!reader->Rows)
+    {
+        ZPNG_ImageInfo info;
+        if (!ZPNG_GetInfo(buffer, &info)) {
+            return -1;
+        }
+        reader->Rows = AllocateBuffer((size_t)rows * reader->Format.StrideBytes + 1);
+        if (!reader->Rows) {
+            return -1;
+        }
+    }
 
-    ZPNG_Header* header = (ZPNG_Header*)output;
-    header->Magic = (refData && overflowCount >= 0) ? ZPNG_VIDEO_HEADER_MAGIC : ZPNG_HEADER_MAGIC;
-    header->Width = (uint16_t)imageData->WidthPixels;
-    header->Height = (uint16_t)imageData->HeightPixels;
-    header->Channels = (uint8_t)imageData->Channels;
-    header->BytesPerChannel = (uint8_t)imageData->BytesPerChannel;
+    ZPNG_ImageData band;
+    memset(&band, 0, sizeof(band));
+    band.Buffer.Data = reader->Rows;
+    band.Buffer.Bytes = (size_t)rows * reader->Format.StrideBytes;
 
-    bufferOutput->Data = output;
-    bufferOutput->Bytes = ZPNG_HEADER_OVERHEAD_BYTES + (unsigned)result;
+    ZPNG_ImageData refBand;
+    const ZPNG_ImageData* ref = nullptr;
+    if (!reader->Format.IsIFrame)
+    {
+        refBand = GetStripImage(reader->RefData, layout->PixelBytes, firstRow, rows);
+        ref = &refBand;
+    }
 
-    goto ReturnResult;
-}
+    if (!ZPNG_DecompressToBuffer(reader->Context, ref, buffer, &band) ||
+        !reader->Sink(reader->Opaque, &band, firstRow)) {
+        return -1;
+    }
 
-ZPNG_ImageData ZPNG_Decompress(
-    ZPNG_Buffer buffer
-)
-{
-    return ZPNG_DecompressVideo(nullptr, buffer);
+    ++reader->NextStrip;
+    return 1;
 }
 
-ZPNG_ImageData ZPNG_DecompressVideo(
+ZPNG_StreamDecoder* ZPNG_BeginDecodeStream(
     const ZPNG_ImageData* refData,
-    ZPNG_Buffer buffer
+    ZPNG_RowFunction sink,
+    void* opaque,
+    ZPNG_DecompressionContext* context
 )
 {
-    uint8_t* packing = nullptr;
-    uint8_t* output = nullptr;
+    if (!sink) {
+        return nullptr;
+    }
 
-    ZPNG_ImageData imageData;
-    imageData.Buffer.Data = nullptr;
-    imageData.Buffer.Bytes = 0;
-    imageData.BytesPerChannel = 0;
-    imageData.Channels = 0;
-    imageData.HeightPixels = 0;
-    imageData.StrideBytes = 0;
-    imageData.WidthPixels = 0;
-    imageData.IsIFrame = 1;
+    ZPNG_StreamReader* reader = (ZPNG_StreamReader*)calloc(1, sizeof(ZPNG_StreamReader));
+    if (!reader) {
+        return nullptr;
+    }
 
-    if (!buffer.Data || buffer.Bytes < ZPNG_HEADER_OVERHEAD_BYTES) {
-ReturnResult:
-        if (imageData.Buffer.Data != output) {
-            free(output);
+    // Strips are decoded one at a time, so a context keeps the packing
+    // space and Zstd state from one to the next
+    if (!context)
+    {
+        reader->TempContext = ZPNG_AllocateDecompressionContext();
+        if (!reader->TempContext) {
+            FreeStreamReader(reader);
+            return nullptr;
         }
-        free(packing);
-        return imageData;
+        context = reader->TempContext;
     }
 
-    const ZPNG_Header* header = (const ZPNG_Header*)buffer.Data;
-    if (refData == nullptr) {
-        if (header->Magic != ZPNG_HEADER_MAGIC) {
-            goto ReturnResult;
+    reader->Context = context;
+    reader->RefData = refData;
+    reader->Sink = sink;
+    reader->Opaque = opaque;
+    return (ZPNG_StreamDecoder*)reader;
+}
+
+int ZPNG_PushStreamData(
+    ZPNG_StreamDecoder* decoder,
+    const void* data,
+    size_t bytes
+)
+{
+    ZPNG_StreamReader* reader = (ZPNG_StreamReader*)decoder;
+    if (!reader || reader->Failed) {
+        return 0;
+    }
+    if (bytes > 0 && !data) {
+        reader->Failed = true;
+        return 0;
+    }
+
+    if (reader->InputCapacity - reader->InputBytes < bytes)
+    {
+        size_t capacity = reader->InputCapacity > 0 ? reader->InputCapacity * 2 : kStreamChunkBytes;
+        while (capacity - reader->InputBytes < bytes) {
+            capacity *= 2;
         }
-    } else {
-        if (header->Magic != ZPNG_HEADER_MAGIC) {
-            if (header->Magic == ZPNG_VIDEO_HEADER_MAGIC)
-                imageData.IsIFrame = 0;
-            else
-                goto ReturnResult;
+        uint8_t* grown = AllocateBuffer(capacity);
+        if (!grown) {
+            reader->Failed = true;
+            return 0;
         }
+        if (reader->InputBytes > 0) {
+            memcpy(grown, reader->Input, reader->InputBytes);
+        }
+        FreeBuffer(reader->Input);
+        reader->Input = grown;
+        reader->InputCapacity = capacity;
+    }
+    if (bytes > 0) {
+        memcpy(reader->Input + reader->InputBytes, data, bytes);
     }
+    reader->InputBytes += bytes;
 
-    imageData.WidthPixels = header->Width;
-    imageData.HeightPixels = header->Height;
-    imageData.Channels = header->Channels;
-    imageData.BytesPerChannel = header->BytesPerChannel;
-    imageData.StrideBytes = imageData.WidthPixels * imageData.Channels;
+    int result = 1;
+    if (reader->Format.Channels == 0) {
+        result = ReadStreamHeader(reader);
+    }
+    while (result > 0 && reader->NextStrip < reader->Layout.StripCount) {
+        result = DecodeStreamStrip(reader);
+    }
 
-    const unsigned pixelCount = imageData.WidthPixels * imageData.HeightPixels;
-    const unsigned pixelBytes = (imageData.BytesPerChannel > 8) ? imageData.Channels : imageData.BytesPerChannel * imageData.Channels;
-    const unsigned byteCount = pixelBytes * pixelCount;
+    // Nothing may follow the last strip
+    if (result < 0 || (reader->Format.Channels != 0 && reader->NextStrip == reader->Layout.StripCount && reader->InputBytes > 0))
+    {
+        reader->Failed = true;
+        return 0;
+    }
+    return 1;
+}
 
-    // Space for packing
-    packing = (uint8_t*)calloc(1, byteCount + 1000);
+int ZPNG_EndDecodeStream(
+    ZPNG_StreamDecoder* decoder
+)
+{
+    ZPNG_StreamReader* reader = (ZPNG_StreamReader*)decoder;
+    if (!reader) {
+        return 0;
+    }
 
-    if (!packing) {
-        goto ReturnResult;
+    const int success = !reader->Failed && reader->Format.Channels != 0 &&
+        reader->NextStrip == reader->Layout.StripCount;
+    FreeStreamReader(reader);
+    return success;
+}
+
+
+
+//------------------------------------------------------------------------------
+// Batch
+
+// Image of a batch, for sorting by size
+struct ZPNG_BatchImage
+{
+    size_t Bytes;
+    unsigned Index;
+};
+
+static int CompareBatchImages(const void* a, const void* b)
+{
+    const ZPNG_BatchImage* x = (const ZPNG_BatchImage*)a;
+    const ZPNG_BatchImage* y = (const ZPNG_BatchImage*)b;
+    if (x->Bytes != y->Bytes) {
+        return x->Bytes > y->Bytes ? -1 : 1;
     }
+    return x->Index < y->Index ? -1 : (x->Index > y->Index ? 1 : 0);
+}
 
-    // Stage 1: Decompress back to packing buffer
+struct ZPNG_BatchEncoder
+{
+    const ZPNG_ImageData* Images;
+    ZPNG_Buffer* Outputs;
 
-    const size_t result = ZSTD_decompress(
-        packing,
-        byteCount + 1000,
-        buffer.Data + ZPNG_HEADER_OVERHEAD_BYTES,
-        buffer.Bytes - ZPNG_HEADER_OVERHEAD_BYTES);
+    // Task i compresses image Order[i].Index
+    const ZPNG_BatchImage* Order;
 
-    if (ZSTD_isError(result)) {
-        goto ReturnResult;
+    // One context per worker
+    ZPNG_Context** Contexts;
+
+    // Per task: Nonzero if the image was compressed
+    uint8_t* Succeeded;
+};
+
+static void CompressBatchImage(void* opaque, unsigned task, unsigned worker)
+{
+    ZPNG_BatchEncoder* batch = (ZPNG_BatchEncoder*)opaque;
+    const unsigned index = batch->Order[task].Index;
+
+    batch->Succeeded[task] = (uint8_t)ZPNG_CompressVideoToBuffer(
+        nullptr,
+        &batch->Images[index],
+        &batch->Outputs[index],
+        batch->Contexts[worker]);
+}
+
+unsigned ZPNG_CompressBatch(
+    const ZPNG_ImageData* images,
+    unsigned count,
+    ZPNG_Buffer* outputs,
+    unsigned threads,
+    const ZPNG_CompressionParams* params
+)
+{
+    if (!images || !outputs || count == 0) {
+        return 0;
+    }
+    if (threads == 0) {
+        threads = GetHardwareThreads();
     }
 
-    // Stage 2: Unpack/Unfilter
+    // Threads beyond one per image only help split the large ones
+    const unsigned contextCount = threads < count ? threads : count;
 
-    // Space for output
-    output = (uint8_t*)calloc(1, byteCount);
+    ZPNG_BatchEncoder batch;
+    batch.Images = images;
+    batch.Outputs = outputs;
 
-    if (!output) {
-        goto ReturnResult;
+    ZPNG_BatchImage* order = (ZPNG_BatchImage*)malloc(count * sizeof(ZPNG_BatchImage));
+    uint8_t* succeeded = (uint8_t*)calloc(count, 1);
+    ZPNG_Context** contexts = (ZPNG_Context**)calloc(contextCount, sizeof(ZPNG_Context*));
+    POOL_ctx* pool = nullptr;
+    unsigned compressed = 0;
+
+    if (!order || !succeeded || !contexts) {
+        goto Done;
     }
 
-    imageData.Buffer.Data = output;
-    imageData.Buffer.Bytes = byteCount;
+    {
+        // Largest first, so the small images fill in around the big ones
+        uint64_t totalBytes = 0;
+        for (unsigned i = 0; i < count; ++i)
+        {
+            size_t bytes;
+            if (!GetImageBytes(&images[i], GetPixelBytes(&images[i]), &bytes)) {
+                bytes = 0;
+            }
+            order[i].Bytes = bytes;
+            order[i].Index = i;
+            totalBytes += bytes;
+        }
+        qsort(order, count, sizeof(ZPNG_BatchImage), CompareBatchImages);
 
-    if (refData && !imageData.IsIFrame) {
-            switch (pixelBytes)
-            {
-            case 1:
-                UnpackAndUnfilterVideo<1>(refData, packing, &imageData);
-                break;
-            case 2:
-                UnpackAndUnfilterVideo<2>(refData, packing, &imageData);
-                break;
-            case 3:
-                UnpackAndUnfilterVideo<3>(refData, packing, &imageData);
-                break;
-            case 4:
-                UnpackAndUnfilterVideo<4>(refData, packing, &imageData);
-                break;
-            case 5:
-                UnpackAndUnfilterVideo<5>(refData, packing, &imageData);
-                break;
-            case 6:
-                UnpackAndUnfilterVideo<6>(refData, packing, &imageData);
-                break;
-            case 7:
-                UnpackAndUnfilterVideo<7>(refData, packing, &imageData);
-                break;
-            case 8:
-                UnpackAndUnfilterVideo<8>(refData, packing, &imageData);
-                break;
+        batch.Order = order;
+        batch.Contexts = contexts;
+        batch.Succeeded = succeeded;
+
+        for (unsigned i = 0; i < contextCount; ++i)
+        {
+            contexts[i] = ZPNG_AllocateCompressionContext();
+            if (!contexts[i] || (params && !ZPNG_SetCompressionParams(contexts[i], params))) {
+                goto Done;
             }
-    } else {
-        if (imageData.BytesPerChannel > 8) {
-            UnpackAndUnfilterXGGY(packing, &imageData);
-        } else {
-            switch (pixelBytes)
+        }
+
+        // Images larger than a thread's share of the batch would finish long
+        // after the rest, so each is split across all threads by ZSTDMT.
+        // It is still a single Zstd frame, so the output is the same format
+        unsigned first = 0;
+        if (threads > 1)
+        {
+            const uint64_t share = totalBytes / threads;
+            bool split = false;
+            while (first < count && order[first].Bytes > share && order[first].Bytes >= kStreamMinBytes)
             {
-            case 1:
-                UnpackAndUnfilter<1>(packing, &imageData);
-                break;
-            case 2:
-                UnpackAndUnfilter<2>(packing, &imageData);
-                break;
-            case 3:
-                UnpackAndUnfilter<3>(packing, &imageData);
-                break;
-            case 4:
-                UnpackAndUnfilter<4>(packing, &imageData);
-                break;
-            case 5:
-                UnpackAndUnfilter<5>(packing, &imageData);
-                break;
-            case 6:
-                UnpackAndUnfilter<6>(packing, &imageData);
-                break;
-            case 7:
-                UnpackAndUnfilter<7>(packing, &imageData);
-                break;
-            case 8:
-                UnpackAndUnfilter<8>(packing, &imageData);
-                break;
+                if (!split)
+                {
+                    if (!ZPNG_SetCompressionWorkers(contexts[0], threads < kMaxWorkers ? threads : kMaxWorkers)) {
+                        goto Done;
+                    }
+                    split = true;
+                }
+                CompressBatchImage(&batch, first, 0);
+                ++first;
+            }
+            if (split && !ZPNG_SetCompressionWorkers(contexts[0], 1)) {
+                goto Done;
             }
         }
+
+        const unsigned remaining = count - first;
+        const unsigned workers = contextCount < remaining ? contextCount : remaining;
+        if (workers > 1)
+        {
+            pool = POOL_create(workers - 1, workers);
+            if (!pool) {
+                goto Done;
+            }
+        }
+
+        batch.Order = order + first;
+        batch.Succeeded = succeeded + first;
+        ParallelFor(pool, workers, remaining, CompressBatchImage, &batch);
     }
 
-    goto ReturnResult;
-}
+    for (unsigned i = 0; i < count; ++i) {
+        compressed += succeeded[i];
+    }
 
-void ZPNG_Free(
-    ZPNG_Buffer* buffer
-)
-{
-    if (buffer && buffer->Data)
+Done:
+    POOL_free(pool);
+    if (contexts)
     {
-        free(buffer->Data);
-        buffer->Data = nullptr;
-        buffer->Bytes = 0;
+        for (unsigned i = 0; i < contextCount; ++i) {
+            ZPNG_FreeCompressionContext(contexts[i]);
+        }
     }
+    free(contexts);
+    free(succeeded);
+    free(order);
+    return compressed;
 }
 
 
@@ -52,6 +52,7 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,7 +65,24 @@ struct ZPNG_Buffer
     unsigned char* Data;
 
     // Size of buffer in bytes
-    unsigned Bytes;
+    size_t Bytes;
+};
+
+// Layout of the pixels in ZPNG_ImageData.
+// The Bayer layouts are tagged values instead of small numbers, so that a
+// PixelFormat left uninitialized is rejected rather than read as Bayer data
+enum ZPNG_PixelFormat
+{
+    // Interleaved channels as given by Channels and BytesPerChannel
+    ZPNG_PIXEL_FORMAT_DEFAULT = 0,
+
+    // Raw Bayer sensor data, named by the colors of the top-left 2x2 block.
+    // Requires Channels = 1, BytesPerChannel = 1 or 2 (for 10 to 16-bit
+    // samples), and an even width and height.
+    ZPNG_PIXEL_FORMAT_BAYER_RGGB = 0x5A500001,
+    ZPNG_PIXEL_FORMAT_BAYER_BGGR = 0x5A500002,
+    ZPNG_PIXEL_FORMAT_BAYER_GRBG = 0x5A500003,
+    ZPNG_PIXEL_FORMAT_BAYER_GBRG = 0x5A500004
 };
 
 // Image data returned by the library
@@ -73,112 +91,1565 @@ struct ZPNG_ImageData
     // Pixel data
     ZPNG_Buffer Buffer;
 
-    // Number of bytes for each color channel (1-2)
-    unsigned BytesPerChannel;
+    // Number of bytes for each color channel (1-2).
+    // 2-byte channels are native-endian uint16_t values, and any bit depth
+    // up to 16 (such as 10 or 12-bit sensor data) compresses well.
+    unsigned BytesPerChannel;
+
+    // Number of channels for each pixel (1-4)
+    unsigned Channels;
+
+    // Width in pixels of image.
+    // Images wider or taller than 65535 pixels use the strip format header.
+    unsigned WidthPixels;
+
+    // Height in pixels of image
+    unsigned HeightPixels;
+
+    // Bytes from the start of one pixel row to the next.
+    // 0, or less than a row, means the rows are tightly packed.
+    // Larger values allow padded rows or a sub-rectangle of a larger image.
+    unsigned StrideBytes;
+
+    // whether this frame is an I-frame
+    unsigned IsIFrame;
+
+    // ZPNG_PixelFormat.  0 (ZPNG_PIXEL_FORMAT_DEFAULT) is interleaved
+    // channels, so zeroed images need not set it.  Other values that are not
+    // a ZPNG_PixelFormat make the image fail to compress.
+    // Setting BytesPerChannel > 8 still selects 8-bit RGGB/BGGR Bayer data,
+    // which also needs an even width and height.
+    unsigned PixelFormat;
+};
+
+// Spatial predictors for ZPNG_SetCompressionFilter().
+// Each sample is replaced by its difference from a prediction made from its
+// left (a), up (b) and up-left (c) neighbors, with 0 outside the image.
+enum ZPNG_Filter
+{
+    // a: The original filter, and the fastest (default)
+    ZPNG_FILTER_LEFT = 0,
+
+    // b: Good for screenshots and other images with vertical structure
+    ZPNG_FILTER_UP = 1,
+
+    // (a + b) / 2
+    ZPNG_FILTER_AVERAGE = 2,
+
+    // Whichever of a, b or c is closest to a + b - c, as in PNG
+    ZPNG_FILTER_PAETH = 3,
+
+    // a + b - c, clamped to the sample range
+    ZPNG_FILTER_GRADIENT = 4,
+
+    // Encoder only: Pick the predictor with the smallest residuals on rows
+    // sampled from each image
+    ZPNG_FILTER_ADAPTIVE = 5
+};
+
+// Reversible color transforms for ZPNG_SetCompressionColorTransform().
+// Each maps the red, green and blue residuals of a pixel to planes Y, U
+// and V with byte arithmetic, so decoding recovers them exactly.
+enum ZPNG_ColorTransform
+{
+    // Y = B, U = G - B, V = G - R: The GB-RG filter from BCIF (default)
+    ZPNG_COLOR_GB_RG = 0,
+
+    // Y = R, U = G, V = B: For channels that do not move together, such as
+    // false color or synthetic data
+    ZPNG_COLOR_NONE = 1,
+
+    // Y = G, U = R - G, V = B - G: Subtract green, as in WebP lossless
+    ZPNG_COLOR_SUBTRACT_GREEN = 2,
+
+    // Y, Co, Cg of YCoCg-R, made of lifting steps that wrap around in 8
+    // bits.  Decorrelates natural photos better than the linear transforms
+    ZPNG_COLOR_YCOCG_R = 3,
+
+    // Encoder only: Pick the transform that leaves the smallest residuals
+    // on rows sampled from each image
+    ZPNG_COLOR_AUTO = 4
+};
+
+// Coders for the filtered data, for ZPNG_SetCompressionBackend()
+enum ZPNG_Backend
+{
+    // Zstd: LZ matches and entropy coding (default)
+    ZPNG_BACKEND_ZSTD = 0,
+
+    // Huffman coding of each plane without match search.  Faster, and often
+    // smaller, for noisy photographic residuals where LZ finds few matches
+    ZPNG_BACKEND_ENTROPY = 1,
+
+    // Probe each strip or plane frame and pick Zstd for run-heavy data such
+    // as UI, masks and alpha, and the entropy coder for noisy data
+    ZPNG_BACKEND_AUTO = 2,
+
+    ZPNG_BACKEND_COUNT
+};
+
+// Zstd settings for ZPNG_SetCompressionParams().
+// Zeroed fields select the defaults, which favor speed.
+struct ZPNG_CompressionParams
+{
+    // Zstd compression level, up to 22.  Negative levels are faster still.
+    // 0 selects the default level 1
+    int Level;
+
+    // Zstd strategy (ZSTD_strategy: 1 = ZSTD_fast up to 8 = ZSTD_btultra).
+    // 0 uses the strategy of the level
+    unsigned Strategy;
+
+    // Log2 of the Zstd match window (10-31).  0 uses the window of the level,
+    // or 27 with long-distance matching
+    unsigned WindowLog;
+
+    // Nonzero enables Zstd long-distance matching, which finds repeats far
+    // back in large images
+    unsigned LongDistanceMatching;
+
+    // Target bytes per job when one frame is split across worker threads.
+    // 0 lets Zstd choose
+    unsigned TargetBlockBytes;
+};
+
+// Counters for one call, from ZPNG_SetCompressionStats() and
+// ZPNG_SetDecompressionStats().  Stage times are summed over the worker
+// threads, so with several workers they can add up to more than TotalNsec
+struct ZPNG_Stats
+{
+    // Wall-clock nanoseconds for the whole call
+    uint64_t TotalNsec;
+
+    // Choosing between a P- and I-frame and the ZPNG_FILTER_ADAPTIVE
+    // predictor from sampled rows.  Compression only
+    uint64_t DecideNsec;
+
+    // Packing and filtering, or unfiltering
+    uint64_t FilterNsec;
+
+    // Zstd compression or decompression
+    uint64_t ZstdNsec;
+
+    // Training the dictionary for the first frame.  Compression only
+    uint64_t DictionaryNsec;
+
+    // Bytes read and written: pixels in and compressed out for compression,
+    // and the reverse for decompression
+    uint64_t BytesIn;
+    uint64_t BytesOut;
+
+    // Escaped +/-128 deltas of a P-frame
+    uint64_t OverflowCount;
+
+    // Heap allocations made by Zpng, including growth of the context
+    // scratch space and worker contexts.  Allocations inside Zstd are not
+    // counted
+    unsigned Allocations;
+
+    // 1 if the frame was written or read as an I-frame, 0 for a P-frame
+    unsigned IsIFrame;
+};
+
+// Description of a compressed image from ZPNG_GetInfo()
+struct ZPNG_ImageInfo
+{
+    unsigned WidthPixels;
+    unsigned HeightPixels;
+    unsigned Channels;
+    unsigned BytesPerChannel;
+
+    // ZPNG_PixelFormat
+    unsigned PixelFormat;
+
+    // 1 for an I-frame, 0 for a delta frame that needs its reference
+    unsigned IsIFrame;
+
+    // Bytes of tightly packed pixels: The Buffer.Bytes that
+    // ZPNG_DecompressToBuffer() needs without padded rows
+    uint64_t ImageBytes;
+
+    // Bytes the Zstd frames decompress to, from their frame headers.
+    // Delta frames add one byte per escaped delta to ImageBytes and leave
+    // out skipped blocks, palette images hold an index per pixel instead of
+    // its color, and images with constant planes leave some channels out
+    uint64_t ContentBytes;
+
+    // Strips of the strip format, or 0 for the original header
+    unsigned StripCount;
+
+    // Dictionary the image needs, as from ZPNG_GetImageDictionaryID()
+    unsigned DictionaryID;
+
+    // Reduced levels for ZPNG_DecompressLevel(), or 0 if not progressive
+    unsigned Levels;
+
+    // Colors of a palette image (see ZPNG_SetCompressionPalette()), or 0
+    unsigned PaletteColors;
+
+    // Channels left out of the frames (see ZPNG_SetCompressionConstantPlanes())
+    unsigned ElidedChannels;
+
+    // ZPNG_ColorTransform of the color planes (see ZPNG_SetCompressionColorTransform())
+    unsigned ColorTransform;
+
+    // Block size of a delta frame with motion vectors, or 0 for none
+    // (see ZPNG_SetCompressionMotionSearch())
+    unsigned MotionBlockPixels;
+
+    // Blocks of a delta frame left out as the same as the reference, or 0
+    // (see ZPNG_SetCompressionSkipBlocks())
+    unsigned SkippedBlocks;
+};
+
+typedef void ZPNG_Context;
+typedef void ZPNG_DecompressionContext;
+typedef void ZPNG_Dictionary;
+typedef void ZPNG_Encoder;
+typedef void ZPNG_VideoWriter;
+typedef void ZPNG_VideoReader;
+typedef void ZPNG_VideoEncoder;
+typedef void ZPNG_VideoDecoder;
+typedef void ZPNG_AsyncQueue;
+typedef void ZPNG_StreamDecoder;
+
+// Output sink for ZPNG_BeginEncode(): Store `bytes` of data at `offset`
+// from the start of the compressed image.  Returns 1 on success, 0 on failure.
+// ZPNG_CompressStream() only ever appends, so offset is the bytes so far
+typedef int (*ZPNG_WriteFunction)(
+    void* opaque,
+    uint64_t offset,
+    const void* data,
+    size_t bytes
+);
+
+// Sink for ZPNG_DecompressRows() and ZPNG_BeginDecodeStream(): Receives the
+// next band of rows, starting at row firstRow of the image.  rows->Buffer is
+// only valid during the call.  Returns 1 to continue, 0 to stop decoding
+typedef int (*ZPNG_RowFunction)(
+    void* opaque,
+    const ZPNG_ImageData* rows,
+    unsigned firstRow
+);
+
+// Frame of a video file, from ZPNG_GetVideoFrameInfo()
+struct ZPNG_VideoFrameInfo
+{
+    // Compressed frame, pointing into the file buffer
+    ZPNG_Buffer Frame;
+
+    // Timestamp given to ZPNG_AddVideoFrame()
+    int64_t Timestamp;
+
+    // 1 if this is an I-frame
+    unsigned IsKeyFrame;
+
+    // Frame this one is delta encoded against (itself for I-frames)
+    unsigned RefFrame;
+
+    // I-frame to start decoding from to reach this frame
+    unsigned KeyFrame;
+};
+
+// Output for ZPNG_CreateVideoEncoder(): Receives each compressed frame in
+// order, with frame its index among the pushed frames.  info->Frame is only
+// valid during the call, and its fields can be passed to ZPNG_AddVideoFrame().
+// Returns 1 to continue, 0 to fail the encoder
+typedef int (*ZPNG_VideoFrameFunction)(
+    void* opaque,
+    unsigned frame,
+    const ZPNG_VideoFrameInfo* info
+);
+
+// Filter for ZPNG_SetCompressionPackFunction(): Write the bytes that
+// ZPNG_PackRows() would for `rows` rows of the image from row firstRow to
+// packing.  Called from the compression threads, for several strips at once.
+// Returns 1 on success, 0 to fail the compression
+typedef int (*ZPNG_PackFunction)(
+    void* opaque,
+    const ZPNG_ImageData* imageData,
+    unsigned firstRow,
+    unsigned rows,
+    void* packing
+);
+
+// Unfilter for ZPNG_SetDecompressionUnpackFunction(): Rebuild `rows` rows
+// of the image from row firstRow, as ZPNG_UnpackRows() would.  Called from
+// the decompression threads, for several strips at once.  packing is only
+// valid during the call.  Returns 1 on success, 0 to fail the decompression
+typedef int (*ZPNG_UnpackFunction)(
+    void* opaque,
+    const void* packing,
+    unsigned firstRow,
+    unsigned rows,
+    const ZPNG_ImageData* imageData
+);
+
+// Finished job of a ZPNG_AsyncQueue
+struct ZPNG_AsyncResult
+{
+    // Number returned when the job was submitted
+    uint64_t Job;
+
+    // Opaque pointer given with the job
+    void* Opaque;
+
+    // 1 if the job succeeded, 0 if it failed
+    int Success;
+
+    // ZPNG_CompressAsync(): The compressed image, to pass to ZPNG_Free()
+    ZPNG_Buffer Compressed;
+
+    // ZPNG_DecompressAsync(): The image, whose Buffer is passed to ZPNG_Free()
+    ZPNG_ImageData Image;
+};
+
+// Completion for ZPNG_CompressAsync() and ZPNG_DecompressAsync(): Called on
+// a queue thread when the job finishes.  The result buffers now belong to
+// the callee.  Must not flush or free the queue
+typedef void (*ZPNG_AsyncFunction)(
+    void* opaque,
+    const ZPNG_AsyncResult* result
+);
+
+// Allocator for ZPNG_SetAllocator(): Returns `bytes` of memory aligned to
+// at least 16 bytes, or null on failure
+typedef void* (*ZPNG_AllocateFunction)(
+    void* opaque,
+    size_t bytes
+);
+
+// Releases memory returned by the paired ZPNG_AllocateFunction
+typedef void (*ZPNG_FreeFunction)(
+    void* opaque,
+    void* data
+);
+
+//------------------------------------------------------------------------------
+// API
+
+/**
+    ZPNG_AllocateCompressionContext()
+
+*/
+ZPNG_Context* ZPNG_AllocateCompressionContext();
+
+void ZPNG_FreeCompressionContext(ZPNG_Context* context);
+
+/**
+    ZPNG_SetCompressionWorkers()
+
+    Set the number of worker threads Zstd uses when compressing with this
+    context.  0 or 1 compresses on the calling thread (default).
+    Larger values switch to the multi-threaded ZSTDMT engine so that one
+    large image can use all cores.  Images under 1 MB stay single-threaded.
+
+    Fails for more than 200 workers, or more than 1 if Zstd was built
+    without ZSTD_MULTITHREAD, leaving the setting unchanged.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionWorkers(
+    ZPNG_Context* context,
+    unsigned workers
+);
+
+/**
+    ZPNG_SetCompressionStripRows()
+
+    Select the strip format for images compressed with this context.
+    The image is split into horizontal strips of the given number of rows,
+    and each strip is filtered and compressed as an independent Zstd frame.
+    A table of strip offsets follows the header so that both compression
+    and decompression can process strips in parallel.
+
+    With more than one worker (see ZPNG_SetCompressionWorkers()), strips
+    are compressed in parallel instead of using ZSTDMT.
+
+    Rows are rounded up to an even number of at least 16.
+    0 selects the original single-frame format (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionStripRows(
+    ZPNG_Context* context,
+    unsigned stripRows
+);
+
+/**
+    ZPNG_SetCompressionParams()
+
+    Set the Zstd level, strategy, window, long-distance matching and job
+    size used by this context, so one build can serve both fast capture
+    (low or negative levels) and archival (such as level 19 or ZSTD_btopt).
+    Images get the same filters either way, so decompression is unchanged.
+
+    Dictionaries trained by ZPNG_Compress() use only the level.
+
+    On success returns 1.
+    On failure returns 0, and the parameters are unchanged.
+*/
+int ZPNG_SetCompressionParams(
+    ZPNG_Context* context,
+    const ZPNG_CompressionParams* params
+);
+
+/**
+    ZPNG_SetCompressionChecksum()
+
+    Append an XXH64 checksum of the compressed data to images compressed
+    with this context.  The checksum covers the header, the strip offsets
+    and every strip, so ZPNG_VerifyChecksum() can check a file at memory
+    speed without decoding it, and decompression fails if it does not match.
+    Checksummed images always use the strip format header.
+
+    0 disables the checksum (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionChecksum(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionFilter()
+
+    Select the spatial predictor (ZPNG_Filter) for images compressed with
+    this context.  ZPNG_FILTER_ADAPTIVE tries each one on a sample of rows
+    and keeps the best for the image.
+
+    Predictors other than ZPNG_FILTER_LEFT apply to I-frames with 1-4
+    channels of 8 bits in the default pixel format, and are recorded in
+    the strip format header.  Other images always use ZPNG_FILTER_LEFT.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionFilter(
+    ZPNG_Context* context,
+    unsigned filter
+);
+
+/**
+    ZPNG_SetCompressionColorTransform()
+
+    Select the reversible color transform (ZPNG_ColorTransform) for the
+    color planes of 8-bit RGB and RGBA I-frames compressed with this
+    context.  ZPNG_COLOR_AUTO applies each transform to the left filter
+    residuals of every 16th row and keeps the one that best decorrelates
+    the channels, falling back to ZPNG_COLOR_GB_RG unless another is
+    clearly smaller.
+
+    Transforms other than ZPNG_COLOR_GB_RG are recorded in the strip
+    format header, so those images always use it.  Delta frames, palette
+    images and images filtered by a ZPNG_SetCompressionPackFunction()
+    function always use ZPNG_COLOR_GB_RG.  ZPNG_BeginEncode() picks the
+    transform for ZPNG_COLOR_AUTO from the first strip.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionColorTransform(
+    ZPNG_Context* context,
+    unsigned transform
+);
+
+/**
+    ZPNG_SetCompressionPlanes()
+
+    Compress each color plane of RGB and RGBA I-frames as an independent
+    Zstd frame.  The planes are the Y, U, V residuals of the color filter
+    plus alpha, and with workers they compress and decompress in parallel.
+    ZPNG_DecompressChannel() then only decompresses the planes it needs.
+    Images with plane frames always use the strip format header.
+
+    0 keeps all planes of a strip in one frame (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionPlanes(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionPlaneLevel()
+
+    Set the Zstd level for one plane with ZPNG_SetCompressionPlanes():
+    0 = Y (blue), 1 = U, 2 = V, 3 = alpha.  Alpha is often flat enough
+    that a low level loses nothing, while Y may deserve a higher one.
+
+    0 uses the context level (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionPlaneLevel(
+    ZPNG_Context* context,
+    unsigned plane,
+    int level
+);
+
+/**
+    ZPNG_SetCompressionBackend()
+
+    Select the coder (ZPNG_Backend) for I-frames compressed with this
+    context.  ZPNG_BACKEND_ENTROPY codes each strip or plane frame with
+    Huffman tables per color plane and skips Zstd, so the Zstd level and
+    plane levels do not apply.  It is recorded in the strip format header.
+
+    ZPNG_BACKEND_AUTO chooses for each strip, or each plane with
+    ZPNG_SetCompressionPlanes(), from a histogram and the runs of a sample
+    of its filtered bytes.  Mixed content such as a screenshot with photos
+    in it keeps Zstd for the flat areas and skips it for the photos.
+
+    P-frames, images compressed with a dictionary and ZPNG_BeginEncode()
+    always use Zstd.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionBackend(
+    ZPNG_Context* context,
+    unsigned backend
+);
+
+/**
+    ZPNG_SetCompressionPalette()
+
+    Store 8-bit I-frames of 1 to 4 channels that have at most 256 colors as
+    a palette plus the index of each pixel, in 1, 2, 4 or 8 bits depending
+    on the color count, instead of filtered residuals.  Sprites, UI, masks
+    and other indexed art shrink before Zstd sees them, and decode with a
+    table lookup per pixel.  1-channel images use it at 16 colors or fewer.
+    Images with a palette always use the strip format header.
+
+    The colors are counted with a small hash table during compression, and
+    images with too many fall back to the filters.  P-frames, Bayer images
+    and images compressed with a dictionary never use a palette.
+
+    0 always filters the pixels (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionPalette(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionConstantPlanes()
+
+    Leave channels of 8-bit I-frames with 2 to 4 channels out of the Zstd
+    frames when every pixel has the same value in them, such as opaque
+    alpha, or red and blue equal to green as in grayscale stored as RGB.
+    A map in the strip format header records each left out channel, and
+    decoding fills it in without unfiltering or decompressing it.  The
+    channels are found with one pass over the pixels during compression.
+    Images with constant planes always use the strip format header, and
+    those over 2 MB are split into strips of about 1 MB.
+
+    Palette images and images with plane frames are never changed.
+
+    0 stores every channel (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionConstantPlanes(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionNonTemporal()
+
+    Write the planes of 8-bit RGB and RGBA single-frame images of 32 MB or
+    more with streaming stores that bypass the cache.  Such planes are out
+    of the last level cache by the time Zstd reads them, so this saves the
+    read for ownership of each line and keeps the pixels in cache.  Whether
+    it is faster depends on the machine: Measure with `zpng_bench --large`.
+    Strips are about 1 MB and stay in cache, so they are never changed.
+
+    Only used on x86 with SSSE3.  The output is the same either way.
+
+    0 uses ordinary stores (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionNonTemporal(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionMotionSearch()
+
+    Search for the motion of 16x16 pixel blocks between each delta frame
+    and its reference, so pans and moving objects are predicted from where
+    they were rather than the same pixels.  Each block gets an integer
+    vector of up to 16 pixels, found on a half resolution luma plane and
+    refined at full resolution.  The vectors are stored compressed after
+    the strip header, and are only kept when the sampled residuals shrink.
+
+    Applies to ZPNG_CompressVideoToBuffer() and the video encoder with
+    8-bit images of up to 4 channels and the default pixel format.
+    Streams and pack functions ignore the setting.  Frames with vectors use
+    the strip format header, and older decoders reject them.
+
+    0 disables it (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionMotionSearch(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionSkipBlocks()
+
+    Leave the 16x16 pixel blocks of each delta frame that are bit for bit
+    the same as its reference out of the strips, so static parts of the
+    scene cost nothing to compress or decompress.  A bitmap of the skipped
+    blocks is stored compressed after the strip header.  Decoders copy the
+    blocks from the reference, or leave them alone when decoding into the
+    reference buffer.  With ZPNG_SetCompressionMotionSearch() blocks are
+    compared with where their vectors move them from.
+
+    Applies to ZPNG_CompressVideoToBuffer() and the video encoder when at
+    least an eighth of the blocks can be skipped.  Streams and pack
+    functions ignore the setting.  Frames with skipped blocks use the strip
+    format header, and older decoders reject them.
+
+    0 disables it (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionSkipBlocks(
+    ZPNG_Context* context,
+    int enabled
+);
+
+/**
+    ZPNG_SetCompressionProgressive()
+
+    Store I-frames compressed with this context as a pyramid of `levels`
+    reduced levels for ZPNG_DecompressLevel(), up to 8.  The coarsest level
+    comes first and each finer level adds the pixels it lacks, each part in
+    Zstd frames of its own, so decoding a 1/8 scale preview (3 levels)
+    touches about 1/64 of the image.  Bayer images are subsampled in 2x2
+    quads to keep the mosaic.
+
+    Subsampled parts cost some compression, as neighboring pixels are
+    split between parts.  P-frames and ZPNG_BeginEncode() ignore the setting.
+    ZPNG_Decompress(), ZPNG_DecompressWithContext() and
+    ZPNG_DecompressToBuffer() decode these images at full resolution, and
+    the row, region and channel decoders reject them.
+
+    0 disables it (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionProgressive(
+    ZPNG_Context* context,
+    unsigned levels
+);
+
+/**
+    ZPNG_SetCompressionStats()
+
+    Fill in stats on each ZPNG_CompressVideoToBuffer() call with this
+    context, including through ZPNG_Compress() and ZPNG_CompressToBuffer().
+    The struct is reset at the start of each call and must outlive its use
+    by the context.  Null disables stats (default), which skips the timers.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionStats(
+    ZPNG_Context* context,
+    ZPNG_Stats* stats
+);
+
+/**
+    ZPNG_SetCompressionPackFunction()
+
+    Filter I-frames with the given function in place of the built-in left
+    filter, one strip at a time, for frames that live where the library
+    cannot read them, such as GPU memory.  The library only passes the
+    ZPNG_ImageData along and never reads its pixels.  It compresses the
+    packed bytes the function writes to host memory.
+
+    Images are written in the strip format, split like the entropy backend
+    into strips of about 1 MB unless ZPNG_SetCompressionStripRows() is set.
+    The palette, constant planes, other filters, delta frames and the
+    progressive format are turned off, since they read the pixels.
+    ZPNG_BeginEncode() does not use the function.
+
+    Null restores the built-in filter (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionPackFunction(
+    ZPNG_Context* context,
+    ZPNG_PackFunction pack,
+    void* opaque
+);
+
+/**
+    ZPNG_AllocateDecompressionContext()
+
+    Allocate a context for ZPNG_DecompressWithContext() that keeps the
+    Zstd decompression state and worker threads alive between frames.
+
+    Returns null on failure.
+*/
+ZPNG_DecompressionContext* ZPNG_AllocateDecompressionContext();
+
+void ZPNG_FreeDecompressionContext(ZPNG_DecompressionContext* context);
+
+/**
+    ZPNG_SetDecompressionWorkers()
+
+    Set the number of threads used to decompress images in the strip
+    format with this context.  Defaults to the number of hardware threads.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetDecompressionWorkers(
+    ZPNG_DecompressionContext* context,
+    unsigned workers
+);
+
+/**
+    ZPNG_SetDecompressionDictionary()
+
+    Use a dictionary (see ZPNG_TrainDictionary()) to decompress images that
+    were compressed with it.  The context keeps its own reference to the
+    dictionary, and null removes it.  Images record the ID of their
+    dictionary, and fail to decompress without the matching one.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetDecompressionDictionary(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_Dictionary* dict
+);
+
+/**
+    ZPNG_SetDecompressionStats()
+
+    Fill in stats on each ZPNG_DecompressWithContext() call with this
+    context, which is how ZPNG_DecompressVideo() reports them.  The struct
+    is reset at the start of each call and must outlive its use by the
+    context.  Null disables stats (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetDecompressionStats(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Stats* stats
+);
+
+/**
+    ZPNG_SetDecompressionUnpackFunction()
+
+    Unfilter each strip with the given function in place of the built-in
+    one, as the packed bytes come out of Zstd, so with ZPNG_DecompressToBuffer()
+    the output buffer can be GPU memory that the library never touches.
+    An unfilter that runs asynchronously must copy the packed bytes before
+    returning, and the image is ready only once its own work finishes.
+
+    This only decodes full images in the strip format that
+    ZPNG_SetCompressionPackFunction() can produce: I-frames with the left
+    filter and no palette or constant planes.  Other images fail to
+    decompress.  ZPNG_DecompressRows() does not use the function.
+
+    Null restores the built-in unfilter (default).
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetDecompressionUnpackFunction(
+    ZPNG_DecompressionContext* context,
+    ZPNG_UnpackFunction unpack,
+    void* opaque
+);
+
+/**
+    ZPNG_TrainDictionary()
+
+    Train a Zstd dictionary offline on sample images, filtered as they would
+    be when compressed with the context, which is optional and also gives
+    the compression level.  Pass it to ZPNG_Compress() for similar images
+    so that each one does not have to start from an empty window.
+    dictionaryBytes is the maximum size, or 0 for the default of 100 KB.
+
+    Images compressed with a dictionary record its ID in the strip format
+    header, and decompress with ZPNG_SetDecompressionDictionary().
+    Passing a pointer to a null dictionary to ZPNG_Compress() instead trains
+    one on the first frame inline, which adds to that frame's latency:
+    ZPNG_TrainCompressionDictionary() can train it in the background.
+
+    Returns null on failure.
+*/
+ZPNG_Dictionary* ZPNG_TrainDictionary(
+    const ZPNG_ImageData* images,
+    unsigned imageCount,
+    size_t dictionaryBytes,
+    ZPNG_Context* context
+);
+
+/**
+    ZPNG_SetCompressionDictionary()
+
+    Compress images with this context using a dictionary whenever no
+    dictionary argument is passed, as if it were passed to ZPNG_Compress().
+    The context keeps its own reference to the dictionary, and null removes
+    it.  Each image holds a reference to the dictionary it started with, so
+    the dictionary may be replaced from another thread while images are
+    being compressed, and the same dictionary may be set on many contexts.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_SetCompressionDictionary(
+    ZPNG_Context* context,
+    const ZPNG_Dictionary* dict
+);
+
+/**
+    ZPNG_TrainCompressionDictionary()
+
+    Train a dictionary for this context on sample images, as with
+    ZPNG_TrainDictionary(), and put it in place as the context's dictionary
+    (see ZPNG_SetCompressionDictionary()) once it is ready.
+
+    The images are filtered before this returns, so they need not outlive
+    the call.  With background = 1 the slower training then runs on a
+    thread of its own, and images compressed with the context in the
+    meantime go without a dictionary until it is swapped in.  With
+    background = 0 it trains before returning.
+
+    The new dictionary replaces the previous one, which is freed once
+    nothing holds it.  Freeing the context waits for training to finish.
+    This fails while the context is already training a dictionary.
+
+    On success returns 1, which for background training means it started.
+    On failure returns 0.
+*/
+int ZPNG_TrainCompressionDictionary(
+    ZPNG_Context* context,
+    const ZPNG_ImageData* images,
+    unsigned imageCount,
+    size_t dictionaryBytes,
+    int background
+);
+
+/**
+    ZPNG_WaitCompressionDictionary()
+
+    Wait for background training on the context to finish.
+
+    Returns 1 if the context now has a dictionary.
+    Returns 0 if it has none, such as when training failed.
+*/
+int ZPNG_WaitCompressionDictionary(
+    ZPNG_Context* context
+);
+
+/**
+    ZPNG_GetCompressionDictionary()
+
+    Returns a reference to the context's dictionary without waiting, to
+    serialize it or pass it to ZPNG_SetDecompressionDictionary(), or null
+    if there is none (yet).  The reference should be passed to
+    ZPNG_FreeDictionary().
+*/
+ZPNG_Dictionary* ZPNG_GetCompressionDictionary(
+    ZPNG_Context* context
+);
+
+/**
+    ZPNG_SerializeDictionary()
+
+    Copy out the Zstd dictionary data, to store next to the images.
+
+    The returned buffer should be passed to ZPNG_Free().
+    Returns a null pointer on failure.
+*/
+ZPNG_Buffer ZPNG_SerializeDictionary(
+    const ZPNG_Dictionary* dict
+);
+
+/**
+    ZPNG_LoadDictionary()
+
+    Prepare a dictionary from ZPNG_SerializeDictionary() data, or any Zstd
+    dictionary.  Both the compression (at the given level, 0 for the
+    default) and decompression tables are built once here, referencing a
+    single copy of the data.
+
+    Returns null on failure.
+*/
+ZPNG_Dictionary* ZPNG_LoadDictionary(
+    ZPNG_Buffer buffer,
+    int level
+);
+
+/**
+    ZPNG_GetDictionaryID()
+
+    Returns the Zstd dictionary ID, or 0 for a raw content dictionary.
+*/
+unsigned ZPNG_GetDictionaryID(
+    const ZPNG_Dictionary* dict
+);
+
+/**
+    ZPNG_GetImageDictionaryID()
+
+    Returns the ID of the dictionary a compressed image needs,
+    or 0 if it needs none (or a raw content dictionary).
+*/
+unsigned ZPNG_GetImageDictionaryID(
+    ZPNG_Buffer buffer
+);
+
+/**
+    ZPNG_RetainDictionary()
+
+    Take another reference to a dictionary, so that it can be shared by
+    threads that each free their own reference.  Dictionaries are
+    read-only, and can be used by any number of contexts at once.
+
+    Returns dict.
+*/
+ZPNG_Dictionary* ZPNG_RetainDictionary(
+    ZPNG_Dictionary* dict
+);
+
+/**
+    ZPNG_FreeDictionary()
+
+    Release a reference to a dictionary from ZPNG_TrainDictionary(),
+    ZPNG_LoadDictionary(), ZPNG_RetainDictionary() or
+    ZPNG_GetCompressionDictionary().  The last reference frees it.
+*/
+void ZPNG_FreeDictionary(ZPNG_Dictionary* dict);
+
+/**
+    ZPNG_MaximumBufferSize()
+
+    Get maximum buffer size for preallocating image buffer outside ZPNG
+    for use with ZPNG_CompressToBuffer() or ZPNG_CompressVideoToBuffer().
+    This covers a delta frame with an escaped byte for every byte of the
+    image, so it is about twice the image size.
+
+    Returns the buffer size that should be allocated.
+*/
+size_t ZPNG_MaximumBufferSize(
+    const ZPNG_ImageData* imageData
+);
+
+/**
+    ZPNG_Compress()
+
+    Compress image into a buffer.
+
+    context is optional
+
+    The returned buffer should be passed to ZPNG_Free().
+
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_Buffer ZPNG_Compress(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context = 0,
+    ZPNG_Dictionary** dictionary = 0
+);
+
+/**
+    ZPNG_CompressToBuffer()
+
+    Compress image into preallocated buffer.
+
+    context and dictionary are optional
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_CompressToBuffer(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* out,
+    ZPNG_Context* context = 0,
+    ZPNG_Dictionary** dictionary = 0
+);
+
+/**
+    ZPNG_CompressVideoToBuffer()
+
+    Compress image into preallocated buffer
+    using delta encoding relative to refData.
+
+    Frames that a sample of rows predicts would compress better on their
+    own, such as scene cuts, are written as I-frames.  The decoder reports
+    which it got in IsIFrame.
+
+    context and dictionary are optional
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_CompressVideoToBuffer(
+    const ZPNG_ImageData* refData,
+    const ZPNG_ImageData* imageData,
+    ZPNG_Buffer* out,
+    ZPNG_Context* context = 0,
+    ZPNG_Dictionary** dictionary = 0
+);
+
+/**
+    ZPNG_CompressBatch()
+
+    Compress count independent images on a pool of threads, such as the
+    textures of an atlas.  outputs[i] receives images[i] as from
+    ZPNG_Compress(): An output with Bytes = 0 is allocated and should be
+    passed to ZPNG_Free(), and otherwise it is a preallocated buffer as for
+    ZPNG_CompressToBuffer().
+
+    Each thread has its own compression context.  The largest images are
+    started first, and any image larger than its share of the batch is
+    split across all of the threads, so that it does not finish long after
+    the rest.
+
+    threads = 0 uses the number of hardware threads.
+    params are optional, and zeroed fields select the defaults.
+
+    Returns the number of images compressed.
+    The outputs of images that failed are left unchanged.
+*/
+unsigned ZPNG_CompressBatch(
+    const ZPNG_ImageData* images,
+    unsigned count,
+    ZPNG_Buffer* outputs,
+    unsigned threads,
+    const ZPNG_CompressionParams* params = 0
+);
+
+/**
+    ZPNG_BeginEncode()
+
+    Start compressing an image that arrives a few rows at a time, such as
+    from a line-scan camera, without holding all of it in memory.
+    imageData gives the dimensions and format; its Buffer is not used.
+
+    Rows are collected into strips (see ZPNG_SetCompressionStripRows(),
+    about 1 MB each by default) that are filtered and compressed as soon
+    as they are complete, so memory use depends on the width and not the
+    height.  Compressed data goes to the write function, which may be
+    called with any offset: strips are written in order after the offset
+    table, and each table entry and the header are filled in as they
+    become known.  The output decodes like any other strip format image.
+
+    context is optional.  Its filter and Zstd settings are used, except
+    that ZPNG_FILTER_ADAPTIVE picks the predictor from the first strip.
+    Checksums and plane frames are not written by this encoder.
+
+    Returns null on failure.
+*/
+ZPNG_Encoder* ZPNG_BeginEncode(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context,
+    ZPNG_WriteFunction write,
+    void* opaque
+);
+
+/**
+    ZPNG_PushRows()
+
+    Add the next rowCount rows of the image to the encoder.
+    Rows are strideBytes apart, or tightly packed if it is smaller than a row.
+
+    On success returns 1.
+    On failure returns 0, and ZPNG_EndEncode() will fail too.
+*/
+int ZPNG_PushRows(
+    ZPNG_Encoder* encoder,
+    const void* rows,
+    unsigned rowCount,
+    unsigned strideBytes
+);
+
+/**
+    ZPNG_EndEncode()
+
+    Write the header and free the encoder.  Fails if not every row of the
+    image was pushed, which is also how to abandon an image.
+    The header is written last, so an unfinished image never decodes.
+
+    On success returns 1 and sets *bytes (if not null) to the compressed size.
+    On failure returns 0.
+*/
+int ZPNG_EndEncode(
+    ZPNG_Encoder* encoder,
+    uint64_t* bytes
+);
+
+/**
+    ZPNG_BeginVideoFile()
+
+    Start writing a sequence of compressed frames as a .zpngv video file.
+    Frames are written in order through the write function as they are
+    added, followed by a frame table with their offsets, sizes, key frame
+    flags and timestamps.  The file header is written last, so an
+    unfinished file never opens.
+
+    Returns null on failure.
+*/
+ZPNG_VideoWriter* ZPNG_BeginVideoFile(
+    ZPNG_WriteFunction write,
+    void* opaque
+);
+
+/**
+    ZPNG_AddVideoFrame()
+
+    Append a frame from ZPNG_Compress() or ZPNG_CompressVideoToBuffer().
+    Timestamps are caller-defined and must not decrease.
+    refFrame is the index of the frame that a delta frame was encoded
+    against, usually the previous one, and is ignored for I-frames.
+
+    On success returns 1.
+    On failure returns 0, and ZPNG_EndVideoFile() will fail too.
+*/
+int ZPNG_AddVideoFrame(
+    ZPNG_VideoWriter* writer,
+    ZPNG_Buffer frame,
+    int64_t timestamp,
+    unsigned refFrame
+);
+
+/**
+    ZPNG_EndVideoFile()
+
+    Write the frame table and header, and free the writer.
+
+    On success returns 1 and sets *bytes (if not null) to the file size.
+    On failure returns 0.
+*/
+int ZPNG_EndVideoFile(
+    ZPNG_VideoWriter* writer,
+    uint64_t* bytes
+);
+
+/**
+    ZPNG_OpenVideoFile()
+
+    Open a .zpngv video file held in memory, such as a mapped file.
+    The frame table is validated here, and the buffer must stay valid
+    until ZPNG_CloseVideoFile().
+
+    Returns null if the file is not a valid video file.
+*/
+ZPNG_VideoReader* ZPNG_OpenVideoFile(
+    ZPNG_Buffer file
+);
+
+/**
+    ZPNG_GetVideoFrameCount()
+
+    Returns the number of frames in the file.
+*/
+unsigned ZPNG_GetVideoFrameCount(
+    ZPNG_VideoReader* reader
+);
+
+/**
+    ZPNG_GetVideoFrameInfo()
+
+    Look up a frame in the frame table, including the I-frame to decode
+    from to seek to it.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_GetVideoFrameInfo(
+    ZPNG_VideoReader* reader,
+    unsigned frame,
+    ZPNG_VideoFrameInfo* info
+);
+
+/**
+    ZPNG_FindVideoFrame()
 
-    // Number of channels for each pixel (1-4)
-    unsigned Channels;
+    Returns the index of the last frame with a timestamp at or before the
+    given one, or 0 if there is none.
+*/
+unsigned ZPNG_FindVideoFrame(
+    ZPNG_VideoReader* reader,
+    int64_t timestamp
+);
 
-    // Width in pixels of image
-    unsigned WidthPixels;
+/**
+    ZPNG_DecodeVideoFrame()
 
-    // Height in pixels of image
-    unsigned HeightPixels;
+    Decode any frame of the file.  Only its chain of references back to
+    the nearest I-frame is decoded, each frame over the one before it.
+    Players that decode frames in order should instead keep the previous
+    frame and decode the next one over it with ZPNG_DecompressInPlace().
 
-    // Width of pixel row in bytes
-    unsigned StrideBytes;
+    context is optional.
 
-    // whether this frame is an I-frame
-    unsigned IsIFrame;
-};
+    The returned ZPNG_Buffer should be passed to ZPNG_Free().
 
-typedef void ZPNG_Context;
-typedef void ZPNG_Dictionary;
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_ImageData ZPNG_DecodeVideoFrame(
+    ZPNG_VideoReader* reader,
+    ZPNG_DecompressionContext* context,
+    unsigned frame
+);
 
-//------------------------------------------------------------------------------
-// API
+/**
+    ZPNG_CloseVideoFile()
+
+    Free the reader.  The file buffer is not freed.
+*/
+void ZPNG_CloseVideoFile(
+    ZPNG_VideoReader* reader
+);
 
 /**
-    ZPNG_AllocateCompressionContext()
+    ZPNG_CreateVideoDecoder()
 
+    Create a decoder that plays the file from firstFrame to the end on
+    several threads, for reviewing footage faster than one core decodes.
+    The file is split at I-frames that no later frame references past, and
+    each thread decodes the next of those runs into a ring of frames ahead
+    of the caller.
+
+    threads = 0 uses the hardware threads.
+    ringFrames = 0 sizes the ring to hold a run per thread, up to 32 frames
+    each.  Decoding stalls while the ring is full, so a smaller ring uses
+    less memory but keeps fewer threads busy.  At least 2 frames are used.
+
+    The reader must stay open until ZPNG_FreeVideoDecoder().
+
+    Returns null on failure, or if Zstd was built without ZSTD_MULTITHREAD.
 */
-ZPNG_Context* ZPNG_AllocateCompressionContext();
+ZPNG_VideoDecoder* ZPNG_CreateVideoDecoder(
+    ZPNG_VideoReader* reader,
+    unsigned firstFrame,
+    unsigned threads,
+    unsigned ringFrames
+);
 
-void ZPNG_FreeCompressionContext(ZPNG_Context* context);
+/**
+    ZPNG_NextVideoFrame()
 
-void ZPNG_FreeDictionary(ZPNG_Dictionary* dict);
+    Wait for the next frame in order and set *frame to it, and *index (if
+    not null) to its number.  The frame is owned by the decoder and stays
+    valid until the next call or ZPNG_FreeVideoDecoder().
+
+    Returns 1 on success.
+    Returns 0 after the last frame, or if a frame fails to decode, after
+    which all calls return 0.
+*/
+int ZPNG_NextVideoFrame(
+    ZPNG_VideoDecoder* decoder,
+    ZPNG_ImageData* frame,
+    unsigned* index
+);
 
 /**
-    ZPNG_MaximumBufferSize()
+    ZPNG_FreeVideoDecoder()
 
-    Get maximum buffer size for preallocating image buffer outside ZPNG
-    for use with ZPNG_CompressToBuffer().
+    Stop the threads and free the decoder and its frames.
+*/
+void ZPNG_FreeVideoDecoder(
+    ZPNG_VideoDecoder* decoder
+);
 
-    Returns the buffer size that should be allocated.
+/**
+    ZPNG_CreateVideoEncoder()
+
+    Create an encoder for a sequence of frames with the format of imageData
+    (its Buffer is not used), such as from a capture thread.
+
+    The encoder keeps the last `references` frames (0 for the default of 3,
+    at most 16).  Each frame is delta encoded against whichever of them a
+    sample of rows predicts is cheapest, or as an I-frame if that is cheaper
+    still.  Frames are filtered on one worker thread and compressed on
+    another, so one frame is filtered while the previous one is compressed.
+    Up to queueFrames frames (0 for the default of 4) can be in flight.
+
+    context is optional, and must not be used elsewhere until the encoder
+    is freed.  Frames are handed to the write function in order.
+
+    Returns null on failure, or if Zstd was built without ZSTD_MULTITHREAD.
 */
-unsigned ZPNG_MaximumBufferSize(
-    const ZPNG_ImageData* imageData
+ZPNG_VideoEncoder* ZPNG_CreateVideoEncoder(
+    const ZPNG_ImageData* imageData,
+    ZPNG_Context* context,
+    unsigned references,
+    unsigned queueFrames,
+    ZPNG_VideoFrameFunction write,
+    void* opaque
 );
 
 /**
-    ZPNG_Compress()
+    ZPNG_PushVideoFrame()
 
-    Compress image into a buffer.
+    Copy a frame onto the encoder queue, and return without waiting for it
+    to be compressed.  Call from one thread at a time.
 
-    context is optional
+    On success returns 1.
+    Returns 0 without blocking if the queue is full, in which case the frame
+    can be dropped or pushed again later, or if the frame does not match
+    the encoder format or the encoder has failed.
+*/
+int ZPNG_PushVideoFrame(
+    ZPNG_VideoEncoder* encoder,
+    const ZPNG_ImageData* imageData,
+    int64_t timestamp
+);
 
-    The returned buffer should be passed to ZPNG_Free().
+/**
+    ZPNG_FlushVideoEncoder()
 
-    On success returns a valid data pointer.
-    On failure returns a null pointer.
+    Wait until every pushed frame has been written.
+
+    Returns 1 if every frame so far was compressed and written.
+    Returns 0 if any failed.
 */
-ZPNG_Buffer ZPNG_Compress(
+int ZPNG_FlushVideoEncoder(
+    ZPNG_VideoEncoder* encoder
+);
+
+/**
+    ZPNG_FreeVideoEncoder()
+
+    Flush and free the encoder.
+
+    Returns 1 if every frame was compressed and written.
+    Returns 0 if any failed.
+*/
+int ZPNG_FreeVideoEncoder(
+    ZPNG_VideoEncoder* encoder
+);
+
+/**
+    ZPNG_CreateAsyncQueue()
+
+    Create a pool of threads that compress and decompress images in the
+    background, for event loops that must not block on a frame.
+    Each thread keeps its own contexts between jobs.
+
+    threads = 0 uses the number of hardware threads.
+    Up to maxJobs jobs (0 for twice the threads) can be queued, running or
+    waiting to be polled at once.
+    params are optional, and zeroed fields select the defaults.
+
+    Returns null on failure, or if Zstd was built without ZSTD_MULTITHREAD.
+*/
+ZPNG_AsyncQueue* ZPNG_CreateAsyncQueue(
+    unsigned threads,
+    unsigned maxJobs,
+    const ZPNG_CompressionParams* params = 0
+);
+
+/**
+    ZPNG_CompressAsync()
+
+    Queue an image to compress as with ZPNG_Compress(), and return without
+    waiting.  imageData->Buffer must stay valid until the job finishes.
+    The result goes to `done`, or with a null `done` it waits for
+    ZPNG_PollAsync().  Call from any thread.
+
+    Returns the job number, counting from 1.
+    Returns 0 without blocking if the queue is full, in which case the
+    image can be dropped or submitted again once a job finishes.
+*/
+uint64_t ZPNG_CompressAsync(
+    ZPNG_AsyncQueue* queue,
     const ZPNG_ImageData* imageData,
-    ZPNG_Context* context = 0,
-    ZPNG_Dictionary** dictionary = 0
+    ZPNG_AsyncFunction done,
+    void* opaque
 );
 
 /**
-    ZPNG_CompressToBuffer()
+    ZPNG_DecompressAsync()
 
-    Compress image into preallocated buffer.
+    Queue an I-frame to decompress as with ZPNG_Decompress(), and return
+    without waiting.  buffer must stay valid until the job finishes.
+    Otherwise the same as ZPNG_CompressAsync().
 
-    context and dictionary are optional
+    Returns the job number, counting from 1.
+    Returns 0 without blocking if the queue is full.
+*/
+uint64_t ZPNG_DecompressAsync(
+    ZPNG_AsyncQueue* queue,
+    ZPNG_Buffer buffer,
+    ZPNG_AsyncFunction done,
+    void* opaque
+);
+
+/**
+    ZPNG_PollAsync()
+
+    Take the oldest finished result of the jobs submitted without a
+    callback, without waiting.  This frees its place in the queue.
+
+    Returns 1 and fills in result if one was ready.
+    Returns 0 if none was.
+*/
+int ZPNG_PollAsync(
+    ZPNG_AsyncQueue* queue,
+    ZPNG_AsyncResult* result
+);
+
+/**
+    ZPNG_FlushAsyncQueue()
+
+    Wait until every submitted job has finished and its callback returned.
+    Results waiting for ZPNG_PollAsync() are kept.
 
     On success returns 1.
     On failure returns 0.
 */
-int ZPNG_CompressToBuffer(
-    const ZPNG_ImageData* imageData,
-    ZPNG_Buffer* out,
-    ZPNG_Context* context = 0,
-    ZPNG_Dictionary** dictionary = 0
+int ZPNG_FlushAsyncQueue(
+    ZPNG_AsyncQueue* queue
 );
 
 /**
-    ZPNG_CompressVideoToBuffer()
+    ZPNG_FreeAsyncQueue()
 
-    Compress image into preallocated buffer
-    using delta encoding to .
+    Flush the queue, free the results that were never polled, and free it.
+*/
+void ZPNG_FreeAsyncQueue(
+    ZPNG_AsyncQueue* queue
+);
 
-    context and dictionary are optional
+/**
+    ZPNG_CompressStream()
+
+    Compress an image for sending over a network as it is produced, such
+    as a remote desktop frame.  The image is written in the stream format:
+    the header first, then each strip as soon as it and the strips above it
+    are compressed, so the receiver can decode the top of the image while
+    the rest is still being encoded.
+
+    Writes are made in order, each from one of the compression threads, and
+    only append.  Images are split into strips of about 1 MB unless the
+    context sets the strip height.  Checksums are not written to streams.
+    A stream is decoded with ZPNG_BeginDecodeStream(), not ZPNG_Decompress().
+
+    refData is optional, and makes delta frames as for
+    ZPNG_CompressVideoToBuffer().  context and dictionary are optional.
 
     On success returns 1.
-    On failure returns 0.
+    On failure returns 0, which may be after some of the stream was written.
 */
-int ZPNG_CompressVideoToBuffer(
+int ZPNG_CompressStream(
     const ZPNG_ImageData* refData,
     const ZPNG_ImageData* imageData,
-    ZPNG_Buffer* out,
+    ZPNG_WriteFunction write,
+    void* opaque,
     ZPNG_Context* context = 0,
     ZPNG_Dictionary** dictionary = 0
 );
 
+/**
+    ZPNG_BeginDecodeStream()
+
+    Start decoding a stream from ZPNG_CompressStream() as it arrives.
+    Each strip is decompressed as soon as all of its bytes have been pushed,
+    and passed to the sink as a band of rows, in order from the top.
+
+    refData is the image the sender used as refData, and is only needed
+    for delta frames.  It must stay valid until ZPNG_EndDecodeStream().
+    context is optional, and holds any dictionary the stream was compressed
+    with.
+
+    Returns null on failure.
+*/
+ZPNG_StreamDecoder* ZPNG_BeginDecodeStream(
+    const ZPNG_ImageData* refData,
+    ZPNG_RowFunction sink,
+    void* opaque,
+    ZPNG_DecompressionContext* context = 0
+);
+
+/**
+    ZPNG_PushStreamData()
+
+    Add the next bytes of the stream, split anywhere, such as each packet
+    as it is received.  Strips they complete are decoded into the sink
+    before this returns.  Bytes past the end of the image are an error.
+
+    On success returns 1.
+    On failure, or if the sink returns 0, returns 0, and
+    ZPNG_EndDecodeStream() will fail too.
+*/
+int ZPNG_PushStreamData(
+    ZPNG_StreamDecoder* decoder,
+    const void* data,
+    size_t bytes
+);
+
+/**
+    ZPNG_EndDecodeStream()
+
+    Free the decoder.  Fails if the stream ended before the last strip,
+    which is also how to abandon an image.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_EndDecodeStream(
+    ZPNG_StreamDecoder* decoder
+);
+
+/**
+    ZPNG_GetInfo()
+
+    Describe a compressed image from its header and the headers of its Zstd
+    frames, without decompressing anything, for example to preallocate the
+    buffer for ZPNG_DecompressToBuffer().  The checksum is not verified.
+
+    On success returns 1.
+    On failure returns 0, if the buffer is not a valid image.
+*/
+int ZPNG_GetInfo(
+    ZPNG_Buffer buffer,
+    ZPNG_ImageInfo* info
+);
+
 /*
     ZPNG_Decompress()
 
     Decompress image from a buffer.
 
+    Images in the strip format are decompressed in parallel.
+
     The returned ZPNG_Buffer should be passed to ZPNG_Free().
 
     On success returns a valid data pointer.
@@ -194,6 +1665,14 @@ ZPNG_ImageData ZPNG_Decompress(
     Decompress image from a buffer
     using delta encoding relative to refData.
 
+    Delta frames fail unless refData has the width, height and pixel bytes
+    of the frame, with every row inside refData->Buffer.  The image size in
+    the header must agree with the content sizes of its frames, and the
+    reference is checked, before the output is allocated, so untrusted
+    buffers can be decoded (see apps/zpng_fuzz.cpp).  A small valid buffer
+    can still decode to a large image, so servers should also limit the
+    ImageBytes from ZPNG_GetInfo().
+
     The returned ZPNG_Buffer should be passed to ZPNG_Free().
 
     On success returns a valid data pointer.
@@ -204,6 +1683,218 @@ ZPNG_ImageData ZPNG_DecompressVideo(
     ZPNG_Buffer buffer
 );
 
+/*
+    ZPNG_DecompressWithContext()
+
+    Decompress image from a buffer like ZPNG_DecompressVideo(),
+    reusing the state in the context instead of creating it per call.
+    See ZPNG_DecompressToBuffer() to also reuse the output buffer.
+
+    refData is optional, and only needed for delta frames.
+
+    The returned ZPNG_Buffer should be passed to ZPNG_Free().
+
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_ImageData ZPNG_DecompressWithContext(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer
+);
+
+/*
+    ZPNG_DecompressToBuffer()
+
+    Decompress image into a caller-owned buffer.
+
+    imageData->Buffer must point to at least Width * Height * pixel bytes.
+    If imageData->StrideBytes is larger than a row, rows are written that
+    far apart and the buffer must hold (Height - 1) * StrideBytes plus a row.
+    On success the other imageData fields are filled in from the header
+    and Buffer.Bytes is set to the number of bytes spanned.
+
+    context and refData are optional.  With a context the packing space
+    is kept between calls, so steady-state decoding does not allocate.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_DecompressToBuffer(
+    ZPNG_DecompressionContext* context,
+    const ZPNG_ImageData* refData,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* imageData
+);
+
+/*
+    ZPNG_DecompressInPlace()
+
+    Decompress a frame over its reference, for players that decode frames
+    in order and keep just one of them.  frame holds the reference, as
+    filled in by the previous call or ZPNG_DecompressToBuffer(), and
+    receives the decoded frame like ZPNG_DecompressToBuffer() would.
+
+    Each pixel of a delta frame only depends on the reference pixel under
+    it, so the deltas are applied to the buffer directly and nothing is
+    copied.  Delta frames with motion vectors (see
+    ZPNG_SetCompressionMotionSearch()) read the reference around each
+    block, so their reference is first copied to the context scratch space.
+    Delta frames must have the format of the reference, and I-frames just
+    need frame->Buffer to be large enough.
+
+    context is optional.
+
+    On success returns 1.
+    On failure returns 0, and the frame may be partly overwritten.
+*/
+int ZPNG_DecompressInPlace(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Buffer buffer,
+    ZPNG_ImageData* frame
+);
+
+/*
+    ZPNG_DecompressRows()
+
+    Decompress an I-frame a band of rows at a time, passing each band to
+    the sink in order from the top, for consumers such as texture uploads
+    or file writers that do not need the whole image in memory.
+
+    Images in the strip format are decoded one strip per band, and only
+    one strip of packing space is kept, so memory use depends on the strip
+    size and not the image height.  Single-frame images without color
+    planes are decoded a chunk of rows at a time in the same way.
+    Single-frame RGB and RGBA images are decoded in full first.
+
+    context is optional.
+
+    On success returns 1.
+    On failure, or if the sink returns 0, returns 0.
+*/
+int ZPNG_DecompressRows(
+    ZPNG_DecompressionContext* context,
+    ZPNG_Buffer buffer,
+    ZPNG_RowFunction sink,
+    void* opaque
+);
+
+/*
+    ZPNG_DecompressRegion()
+
+    Decompress just the rectangle of width x height pixels with its
+    top-left corner at (x, y) from an I-frame.
+
+    For the strip format (see ZPNG_SetCompressionStripRows()) only the
+    strips that overlap the rectangle are decompressed and unfiltered.
+    Other images are fully decompressed and then cropped.
+
+    The returned ZPNG_Buffer should be passed to ZPNG_Free().
+
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_ImageData ZPNG_DecompressRegion(
+    ZPNG_Buffer buffer,
+    unsigned x,
+    unsigned y,
+    unsigned width,
+    unsigned height
+);
+
+/*
+    ZPNG_DecompressChannel()
+
+    Decompress one channel of an I-frame as a 1-channel image:
+    0 = red, 1 = green, 2 = blue, 3 = alpha.
+
+    With plane frames (see ZPNG_SetCompressionPlanes()) only the planes the
+    channel depends on are decompressed: one for blue or alpha, two for
+    green, which serves as a cheap luma, and three for red.
+    Other images are fully decompressed and the channel is copied out.
+
+    The returned ZPNG_Buffer should be passed to ZPNG_Free().
+
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_ImageData ZPNG_DecompressChannel(
+    ZPNG_Buffer buffer,
+    unsigned channel
+);
+
+/*
+    ZPNG_DecompressLevel()
+
+    Decompress level `level` of an I-frame, which is 1/2^level of its width
+    and height rounded up: 0 is full resolution, and 3 is a 1/8 preview.
+    The pixel at (x, y) of the level is at (x * 2^level, y * 2^level) in
+    the image, or for Bayer images the same goes for 2x2 quads.
+
+    For progressive images (see ZPNG_SetCompressionProgressive()) only the
+    parts up to that level are decompressed, and levels past the stored
+    ones are subsampled from the coarsest.  Other images are fully
+    decompressed and then subsampled.
+
+    The returned ZPNG_Buffer should be passed to ZPNG_Free().
+
+    On success returns a valid data pointer.
+    On failure returns a null pointer.
+*/
+ZPNG_ImageData ZPNG_DecompressLevel(
+    ZPNG_Buffer buffer,
+    unsigned level
+);
+
+/*
+    ZPNG_VerifyChecksum()
+
+    Check the XXH64 checksum of a compressed image without decompressing it.
+    See ZPNG_SetCompressionChecksum().
+
+    Returns 1 if the buffer has a checksum and it matches.
+    Returns 0 if it does not match, or the buffer has no checksum.
+*/
+int ZPNG_VerifyChecksum(
+    ZPNG_Buffer buffer
+);
+
+/*
+    ZPNG_PackRows()
+
+    Filter `rows` rows of an image from row firstRow with the left filter
+    into packing, which must hold rows * Width * pixel bytes.  This is the
+    reference for a ZPNG_PackFunction.  RGB and RGBA rows become color
+    planes of rows * Width bytes, 16-bit rows high and low byte planes, and
+    Bayer rows quarter planes.  Other rows stay interleaved.  Each is
+    delta coded along the row.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_PackRows(
+    const ZPNG_ImageData* imageData,
+    unsigned firstRow,
+    unsigned rows,
+    void* packing
+);
+
+/*
+    ZPNG_UnpackRows()
+
+    Rebuild `rows` rows of an image from row firstRow out of the bytes
+    ZPNG_PackRows() wrote.  This is the reference for a ZPNG_UnpackFunction.
+
+    On success returns 1.
+    On failure returns 0.
+*/
+int ZPNG_UnpackRows(
+    const void* packing,
+    unsigned firstRow,
+    unsigned rows,
+    const ZPNG_ImageData* imageData
+);
+
 /*
     ZPNG_Free()
 
@@ -215,6 +1906,37 @@ void ZPNG_Free(
     ZPNG_Buffer* buffer
 );
 
+/**
+    ZPNG_SetAllocator()
+
+    Allocate the image-sized buffers with `allocate` and release them with
+    `release`: Images and compressed data returned to the caller, which
+    ZPNG_Free() releases, and the packing, scratch and frame buffers of
+    contexts, encoders and decoders.  Small bookkeeping and the Zstd
+    contexts still use malloc().  Buffers must be released by the allocator
+    that returned them, so this fails once the library has allocated any,
+    and should be called once before any other function, on one thread.
+    Buffers for ZPNG_CompressToBuffer() that are later given to ZPNG_Free()
+    must come from it too.
+
+    Passing null for both restores the default, which uses malloc() for
+    buffers under 2 MB, so ZPNG_Free() still takes buffers from malloc().
+    Larger buffers are mapped from the OS with transparent huge pages on
+    Linux, or large pages on Windows when the process may lock memory.  No
+    page is touched when one is allocated, so the OS places each on the
+    NUMA node of the thread that first writes it, and strips filtered by a
+    worker stay local to it.  Freeing takes no lock, and a buffer is found
+    among a few slots picked by its address.
+
+    On success returns 1.
+    On failure, or after the first buffer was allocated, returns 0.
+*/
+int ZPNG_SetAllocator(
+    ZPNG_AllocateFunction allocate,
+    ZPNG_FreeFunction release,
+    void* opaque
+);
+
 
 #ifdef __cplusplus
 }